@@ -50,7 +50,7 @@ m_vma( vma )
     wxFlexGridSizer *fSizer;
     wxStaticText *sText;
     wxString recfms[] = { wxT("Fixed"), wxT("Variable") };
-    wxString methods[] = { wxT("ASIS"), wxT("LZW"), wxT("S2") };
+    wxString methods[] = { wxT("ASIS"), wxT("LZW"), wxT("S2"), wxT("AUTO") };
 
     // Base grouping
     vSizer = new wxBoxSizer( wxVERTICAL );
@@ -191,6 +191,24 @@ m_vma( vma )
 
     fSizer->Add( m_Method, 0, wxEXPAND | wxALL, 3 );
 
+    //
+    // Why AUTO chose the method
+    //
+    sText = new wxStaticText( this,
+                             wxID_ANY,
+                             wxT( "Chosen By AUTO:" ) );
+
+    fSizer->Add( sText, 0, wxALIGN_CENTER_VERTICAL | wxALIGN_RIGHT );
+
+    m_Why = new wxTextCtrl( this,
+                           wxID_ANY,
+                           wxEmptyString,
+                           wxDefaultPosition,
+                           wxDefaultSize,
+                           wxTE_READONLY );
+
+    fSizer->Add( m_Why, 0, wxEXPAND | wxALL, 3 );
+
     //
     // Done with content
     //
@@ -345,6 +363,21 @@ bool Properties::TransferDataToWindow()
 
     m_Method->SetStringSelection( ToWX( m_Subfile->meth ) );
 
+    switch( m_Subfile->why )
+    {
+        case VMAW_SMALLEST:
+            m_Why->SetValue( wxT("Smallest result") );
+            break;
+
+        case VMAW_FASTER:
+            m_Why->SetValue( wxT("Faster and within the slack") );
+            break;
+
+        default:
+            m_Why->SetValue( wxEmptyString );
+            break;
+    }
+
     return true;
 }
 
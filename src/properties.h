@@ -50,6 +50,7 @@ private:
     wxTextCtrl *m_Lrecl;
 
     wxChoice *m_Method;
+    wxTextCtrl *m_Why;
 
     wxConfigBase *m_Config;
 
@@ -216,7 +216,7 @@ Settings::Settings( wxWindow *parent, int id, wxString title )
     //
 
     wxString recfms[] = { wxT("Fixed"), wxT("Variable") };
-    wxString methods[] = { wxT("ASIS"), wxT("LZW"), wxT("S2") };
+    wxString methods[] = { wxT("ASIS"), wxT("LZW"), wxT("S2"), wxT("AUTO") };
     wxString modes[] = { wxT("Auto"), wxT("Text"), wxT("Binary") };
 
     // Base grouping
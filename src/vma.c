@@ -9,8 +9,11 @@
 ||   -a        add files to archive
 ||   -c        convert names to lowercase
 ||   -h        display usage summary
+||   -i        use/maintain a sidecar index (archive.vmaidx)
+||   -j n      extract using n threads...0=one per processor
 ||   -l        record length...1 to 65535
 ||   -m fm     replace filemode...0=remove
+||   -p        extract files to standard output
 ||   -q        do not list files
 ||   -r        record format...f=fixed, v=variable
 ||   -s        store method...asis, lzw, s2
@@ -54,6 +57,11 @@
 
 #include <ctype.h>
 
+#if defined( _WIN32 )
+#include <io.h>
+#include <fcntl.h>
+#endif
+
 #include "version.h"
 #include "vmalib.h"
 
@@ -179,11 +187,17 @@ getopt(int argc, char **argv, char *opts)
 */
 static char f_add     = FALSE;              /* add files             */
 static char f_case    = FALSE;              /* names > lowercase     */
+static char f_index   = FALSE;              /* use sidecar index     */
 static char f_list    = TRUE;               /* list subfile info     */
 static char f_verbose = FALSE;              /* enable verbose output */
 static char f_version = FALSE;              /* display version       */
 static char f_extract = FALSE;              /* extract subfiles      */
+static char f_pipe    = FALSE;              /* extract to stdout     */
+static FILE *msgout;                        /* where messages go     */
 static int  xmode     = VMAX_BINARY;        /* extraction mode       */
+static int  i_jobs    = 0;                  /* extract/add threads   */
+static int  sfcount   = 0;                  /* subfiles seen         */
+static int  sfproc    = 0;                  /* subfiles processed    */
 static int  lrecl     = 65535;              /* record length         */
 static char recfm     = VMAR_VARIABLE;      /* record format         */
 static char *s_meth   = VMAM_LZW;           /* store method          */
@@ -197,6 +211,8 @@ static char *s_tucm   = NULL;               /* to UCM charmap        */
 static size_t i_flen;                       /* len of filter         */
 static char *s_name;                        /* output name           */
 static size_t i_nlen;                       /* len of name           */
+static char **s_inputs;                     /* files being added     */
+static int  i_input;                        /* next one to add       */
 
 #if defined( _WIN32 )
 /* --------------------------------------------------------------------
@@ -419,6 +435,15 @@ amatch( char *str, char *p )
     return !*str;
 }
 
+/*
+|| Filters without any pattern characters can be looked up directly
+*/
+static int
+literal( const char *p )
+{
+    return strpbrk( p, "*?[\\." ) == NULL;
+}
+
 static void
 make_name( SUBFILE *sf )
 {
@@ -533,6 +558,120 @@ list_file( SUBFILE *sf )
     return;
 }
 
+/*
+|| Called by vma_extract_all() for each subfile to filter it and give
+|| it an output name
+*/
+static int
+name_file( void *vma, SUBFILE *sf, char *buf, size_t len )
+{
+    /*          Fn  .   Ft  .   Fm  0 */
+    char fname[ 8 + 1 + 8 + 1 + 2 + 1 ];
+
+    /*
+    || Track total subfile count
+    */
+    sfcount++;
+
+    /*
+    || Filter it
+    */
+    sprintf( fname,
+            "%s.%s.%s",
+            sf->fn,
+            sf->ft,
+            sf->fm );
+
+    if( !amatch( fname, s_filter ) )
+    {
+        return 1;
+    }
+
+    make_name( sf );
+    if( strlen( s_name ) >= len )
+    {
+        return 1;
+    }
+    strcpy( buf, s_name );
+
+    return 0;
+}
+
+/*
+|| Called by vma_extract_all() for each extracted subfile, in order
+*/
+static int
+done_file( void *vma, SUBFILE *sf, int rc )
+{
+    if( rc == VMAE_LRECL )
+    {
+        fprintf( msgout, "Bypassing next file due "
+                 "to LRECL limitations:\n" );
+    }
+
+    /*
+    || List it ... do after extraction to get byte counts
+    */
+    if( f_list )
+    {
+        rc = vma_stat( vma, sf );
+        if( rc != VMAE_NOERR )
+        {
+            return rc;
+        }
+
+        list_file( sf );
+    }
+
+    /*
+    || Track processed subfile count
+    */
+    sfproc++;
+
+    return VMAE_NOERR;
+}
+
+/*
+|| Called by vma_add_all() for each new subfile, in the order they were
+|| made, to give it its input file
+*/
+static int
+name_input( void *vma, SUBFILE *sf, char *buf, size_t len )
+{
+    const char *name = s_inputs[ i_input++ ];
+
+    if( strlen( name ) >= len )
+    {
+        return 1;
+    }
+    strcpy( buf, name );
+
+    return 0;
+}
+
+/*
+|| Called by vma_add_all() for each added subfile, in order
+*/
+static int
+done_input( void *vma, SUBFILE *sf, int rc )
+{
+    if( f_list )
+    {
+        list_file( sf );
+
+        if( f_verbose && sf->why != VMAW_GIVEN )
+        {
+            printf( "  stored %s: %s\n",
+                   sf->meth,
+                   ( sf->why == VMAW_SMALLEST ?
+                     "smallest" :
+                     "faster and close to smallest" ) );
+        }
+    }
+
+    return VMAE_NOERR;
+}
+
 static void
 usage( void )
 {
@@ -543,11 +682,14 @@ usage( void )
     printf( "  -a        add files to archive\n" );
     printf( "  -c        convert names to lowercase\n" );
     printf( "  -h        display usage summary\n" );
+    printf( "  -i        use/maintain a sidecar index (archive.vmaidx)\n" );
+    printf( "  -j n      extract or add using n threads...0=one per processor\n" );
     printf( "  -l        record length...fixed=length, variable=max\n" );
     printf( "  -m fm     replace filemode...0=remove\n" );
+    printf( "  -p        extract files to standard output\n" );
     printf( "  -q        do not list files\n" );
     printf( "  -r        record format\n" );
-    printf( "  -s        store method...asis, lzw, s2\n" );
+    printf( "  -s        store method...asis, lzw, s2, auto\n" );
     printf( "  -t        translate files to ASCII on extraction\n" );
     printf( "            or to EBCDIC on addition\n" );
     printf( "  -u f,t    (f)rom and (t) UCM filenames\n" );
@@ -576,8 +718,7 @@ main( int argc, char *argv[] )
     void *vma = NULL;
     int rc = VMAE_NOERR;
     int cnt;
-    int sfcount = 0;
-    int sfproc = 0;
+    int f_exact;
     char *fn = NULL;
     char *ft = NULL;
     char *fm = NULL;
@@ -590,14 +731,14 @@ main( int argc, char *argv[] )
       usage();
       exit(99);
     }
-    while( ( rc = getopt( argc, argv, "achl:m:qr:s:tu:vxV" ) ) != -1 )
+    while( ( rc = getopt( argc, argv, "achij:l:m:pqr:s:tu:vxV" ) ) != -1 )
     {
         switch( rc )
         {
             case 'a':
                 if( f_extract )
                 {
-                    printf( "-a and -x are mutually exclusive\n" );
+                    printf( "-a and -x/-p are mutually exclusive\n" );
                     usage();
                 }
                 f_add = TRUE;
@@ -607,6 +748,19 @@ main( int argc, char *argv[] )
                 f_case = TRUE;
                 break;
 
+            case 'i':
+                f_index = TRUE;
+                break;
+
+            case 'j':
+                i_jobs = atoi( optarg );
+                if( i_jobs < 0 )
+                {
+                    printf( "invalid thread count %s\n", optarg );
+                    usage();
+                }
+                break;
+
             case 'l':
             {
                 char *endp;
@@ -624,6 +778,16 @@ main( int argc, char *argv[] )
                 s_mode = optarg;
                 break;
 
+            case 'p':
+                if( f_add )
+                {
+                    printf( "-a and -x/-p are mutually exclusive\n" );
+                    usage();
+                }
+                f_extract = TRUE;
+                f_pipe = TRUE;
+                break;
+
             case 'q':
                 f_list = FALSE;
                 break;
@@ -657,6 +821,10 @@ main( int argc, char *argv[] )
                 {
                     s_meth = VMAM_S2;
                 }
+                else if( strcmp( optarg, "auto" ) == 0 )
+                {
+                    s_meth = VMAM_AUTO;
+                }
                 else
                 {
                     printf( "invalid store method %s\n", optarg );
@@ -689,7 +857,7 @@ main( int argc, char *argv[] )
             case 'x':
                 if( f_add )
                 {
-                    printf( "-a and -x are mutually exclusive\n" );
+                    printf( "-a and -x/-p are mutually exclusive\n" );
                     usage();
                 }
                 f_extract = TRUE;
@@ -715,6 +883,20 @@ main( int argc, char *argv[] )
         exit( 0 );
     }
 
+    /*
+    || When the subfiles go to stdout, the listing is dropped and
+    || everything else goes to stderr so it doesn't get mixed in
+    */
+    msgout = stdout;
+    if( f_pipe )
+    {
+        f_list = FALSE;
+        msgout = stderr;
+#if defined( _WIN32 )
+        _setmode( _fileno( stdout ), _O_BINARY );
+#endif
+    }
+
     /*
     || Make sure we have the right number of arguments
     */
@@ -739,17 +921,24 @@ main( int argc, char *argv[] )
     */
     if( f_verbose )
     {
-        printf( "Processing: %s\n\n", argv[ optind ] );
+        fprintf( msgout, "Processing: %s\n\n", argv[ optind ] );
     }
 
     /*
-    || Open the VMARC file
+    || Open the VMARC file...subfiles are only sized when needed and,
+    || unless limited to one thread, large ones are extracted with the
+    || reading and writing done on threads of their own and the
+    || decoding spread across the processors
     */
-    rc = vma_open( argv[ optind ], &vma );
+    rc = vma_open_ex( argv[ optind ],
+                      VMAO_LAZY | VMAO_PARALLEL |
+                      ( f_index ? VMAO_INDEX : 0 ) |
+                      ( i_jobs != 1 ? VMAO_PIPELINE | VMAO_PARDECODE : 0 ),
+                      &vma );
     if( rc != VMAE_NOERR )
     {
-        printf( "Aborting due to error: %s\n",
-               vma_strerror( rc ) );
+        fprintf( msgout, "Aborting due to error: %s\n",
+                 vma_strerror( rc ) );
         exit( 1 );
     }
 
@@ -758,7 +947,7 @@ main( int argc, char *argv[] )
         rc = vma_setconv( vma, s_fucm, s_tucm );
         if( rc != VMAE_NOERR )
         {
-            printf( "Failed to set conversion: %d\n", rc );
+            fprintf( msgout, "Failed to set conversion: %d\n", rc );
             goto error;
         }
     }
@@ -766,7 +955,7 @@ main( int argc, char *argv[] )
     rc = vma_setmode( vma, xmode );
     if( rc != VMAE_NOERR )
     {
-        printf( "Unable to set conversion mode\n" );
+        fprintf( msgout, "Unable to set conversion mode\n" );
         goto error;
     }
 
@@ -943,16 +1132,19 @@ main( int argc, char *argv[] )
                 goto error;
             }
 
-            rc = vma_add( vma, argv[ i ] );
-            if( rc != VMAE_NOERR )
-            {
-                goto error;
-            }
+        }
 
-            if( f_list )
-            {
-                list_file( sf );
-            }
+        /*
+        || Now compress them all, several at once unless limited to one
+        || thread
+        */
+        s_inputs = &argv[ optind + 1 ];
+        i_input = 0;
+
+        rc = vma_add_all( vma, i_jobs, name_input, done_input, vma );
+        if( rc != VMAE_NOERR )
+        {
+            goto error;
         }
 
         rc = vma_commit( vma );
@@ -1018,7 +1210,7 @@ main( int argc, char *argv[] )
         */
         if( strcmp( s_filter, "*.*.*" ) != 0 )
         {
-            printf("Using filter: '%s'\n\n", s_filter );
+            fprintf( msgout, "Using filter: '%s'\n\n", s_filter );
         }
 
         /*
@@ -1034,81 +1226,148 @@ main( int argc, char *argv[] )
         s_name = malloc( i_nlen );
         if( s_name == NULL )
         {
-            printf( "no mem\n" );
+            fprintf( msgout, "no mem\n" );
             goto error;
         }
 
-        for( rc = vma_first( vma, &sf );
-            rc == VMAE_NOERR;
-            rc = vma_next( vma, &sf ) )
-        {
-            /*
-            || Track total subfile count
-            */
-            sfcount++;
-
-            /*
-            || Build a name for filtering
-            */
-            sprintf( fname,
-                    "%s.%s.%s",
-                    sf->fn,
-                    sf->ft,
-                    sf->fm );
+        /*
+        || A filter naming a single subfile is simply looked up, along with
+        || any later subfiles of the same name
+        */
+        f_exact = literal( s_fn ) && literal( s_ft ) &&
+        ( strcmp( s_fm, "*" ) == 0 || literal( s_fm ) );
 
-            /*
-            || Filter it
-            */
-            if( !amatch( fname, s_filter ) )
+        /*
+        || Extracting to files can be spread across threads.  The
+        || listing still comes out in archive order.
+        */
+        if( f_extract && !f_pipe && !f_exact )
+        {
+            rc = vma_extract_all( vma, i_jobs, name_file, done_file, vma );
+            if( rc != VMAE_NOERR )
             {
-                continue;
+                goto error;
             }
 
-            /*
-            || Extract file
-            */
-            if( f_extract )
+            rc = VMAE_NOMORE;
+        }
+        else
+        {
+            for( rc = ( f_exact ?
+                       vma_find( vma,
+                                 s_fn,
+                                 s_ft,
+                                 ( strcmp( s_fm, "*" ) == 0 ? NULL : s_fm ),
+                                 &sf ) :
+                       vma_first( vma, &sf ) );
+                rc == VMAE_NOERR;
+                rc = ( f_exact ?
+                       vma_find_next( vma,
+                                      s_fn,
+                                      s_ft,
+                                      ( strcmp( s_fm, "*" ) == 0 ? NULL : s_fm ),
+                                      &sf ) :
+                       vma_next( vma, &sf ) ) )
             {
                 /*
-                || Build the output name
+                || Track total subfile count
+                */
+                sfcount++;
+
+                /*
+                || Build a name for filtering
                 */
-                make_name( sf );
+                sprintf( fname,
+                        "%s.%s.%s",
+                        sf->fn,
+                        sf->ft,
+                        sf->fm );
+
+                /*
+                || Filter it
+                */
+                if( !amatch( fname, s_filter ) )
+                {
+                    continue;
+                }
+
+                /*
+                || Extract file
+                */
+                if( f_extract )
+                {
+                    if( f_pipe )
+                    {
+                        /*
+                        || Anything already buffered has to go out first
+                        */
+                        fflush( stdout );
+                        rc = vma_extract_fd( vma, fileno( stdout ) );
+                    }
+                    else
+                    {
+                        /*
+                        || Build the output name
+                        */
+                        make_name( sf );
+
+                        /*
+                        || And extract
+                        */
+                        rc = vma_extract( vma, s_name );
+                    }
+                    if( rc != VMAE_NOERR )
+                    {
+                        if( rc != VMAE_LRECL )
+                        {
+                            goto error;
+                        }
+
+                        fprintf( msgout, "Bypassing next file due "
+                                 "to LRECL limitations:\n" );
+                    }
+                }
 
                 /*
-                || And extract
+                || List it ... do after extraction to get byte counts
                 */
-                rc = vma_extract( vma, s_name );
-                if( rc != VMAE_NOERR )
+                if( f_list )
                 {
-                    if( rc != VMAE_LRECL )
+                    rc = vma_stat( vma, sf );
+                    if( rc != VMAE_NOERR )
                     {
                         goto error;
                     }
 
-                    printf( "Bypassing next file due "
-                           "to LRECL limitations:\n" );
+                    list_file( sf );
                 }
-            }
 
-            /*
-            || List it ... do after extraction to get byte counts
-            */
-            if( f_list )
-            {
-                list_file( sf );
+                /*
+                || Track processed subfile count
+                */
+                sfproc++;
             }
-
-            /*
-            || Track processed subfile count
-            */
-            sfproc++;
         }
 
         /*
         || This one really isn't an error
         */
-        if( rc == VMAE_NOMORE )
+        if( rc == VMAE_NOMORE || ( f_exact && rc == VMAE_NOTFOUND ) )
+        {
+            rc = VMAE_NOERR;
+        }
+
+        /*
+        || A lookup didn't visit the others, so count them for the summary
+        */
+        if( f_exact && f_verbose )
         {
+            for( sfcount = 0, rc = vma_first( vma, &sf );
+                rc == VMAE_NOERR;
+                rc = vma_next( vma, &sf ) )
+            {
+                sfcount++;
+            }
             rc = VMAE_NOERR;
         }
 
@@ -1117,16 +1376,16 @@ main( int argc, char *argv[] )
         */
         if( f_verbose )
         {
-            printf( "\n%d subfiles",
-                   sfcount );
+            fprintf( msgout, "\n%d subfiles",
+                     sfcount );
 
             if( sfcount != sfproc )
             {
-                printf( ", %d bypassed due to filtering",
-                       sfcount - sfproc );
+                fprintf( msgout, ", %d bypassed due to filtering",
+                         sfcount - sfproc );
             }
 
-            printf( "\n" );
+            fprintf( msgout, "\n" );
         }
 
     }
@@ -1158,8 +1417,8 @@ error:
 
     if( rc != VMAE_NOERR )
     {
-        printf( "Aborting due to error: %s\n",
-               vma_strerror( rc ) );
+        fprintf( msgout, "Aborting due to error: %s\n",
+                 vma_strerror( rc ) );
     }
 
     if( vma )
@@ -918,11 +918,8 @@ void MyFrame::OnExtract( wxCommandEvent& WXUNUSED( event ) )
 // ====================================================================
 void MyFrame::OnExtAll( wxCommandEvent& WXUNUSED( event ) )
 {
-    SUBFILE *sf;
-    wxFileName fn;
-    wxString dest;
-    int nItem;
-    int cnt;
+    long nItem;
+    int rc;
 
     // Can't do anything without entries
     if( m_List->GetItemCount() == 0 )
@@ -954,40 +951,95 @@ void MyFrame::OnExtAll( wxCommandEvent& WXUNUSED( event ) )
     {
         wxBusyInfo wait( wxT( "Extracting files..." ) );
 
-        // Retrieve the first selected item
-        cnt = 0;
-        nItem = -1;
-        while( TRUE )
+        // Note where each subfile is listed so the results can find
+        // their entries without a search
+        m_ExtItems.clear();
+        for( nItem = 0; nItem < m_List->GetItemCount(); nItem++ )
         {
-            nItem = m_List->GetNextItem( nItem );
-            if( nItem == -1 )
-            {
-                break;
-            }
+            m_ExtItems[ wxUIntToPtr( m_List->GetItemData( nItem ) ) ] = nItem;
+        }
 
-            // And the SUBFILE ptr
-            sf = (SUBFILE *) wxUIntToPtr( m_List->GetItemData( nItem ) );
+        // Extract them all at once, using every processor
+        m_ExtCount = 0;
+        rc = vma_extract_all( m_vma, 0, ExtAllName, ExtAllDone, this );
 
-            // Generate an output name and append to previous folder path
-            fn.Assign( m_SavePath, OutputName( sf ) );
+        m_ExtItems.clear();
+    }
 
-            // Extract it
-            if( !Extract( sf, fn.GetFullPath(), nItem ) )
-            {
-                break;
-            }
+    // Complain if there was an error
+    if( rc != VMAE_NOERR )
+    {
+        m_Msg.Printf( wxT( " Extraction failed with %d, %s" ),
+                     rc,
+                     ToWX( vma_strerror( rc ) ).c_str() );
 
-            cnt++;
-        }
+        wxMessageBox( m_Msg, wxT( "Not So Helpful Message" ) );
     }
 
     // Provide a little info
-    m_Msg.Printf( wxT( " %d subfiles extracted" ), cnt );
+    m_Msg.Printf( wxT( " %d subfiles extracted" ), m_ExtCount );
     SetStatusText( m_Msg );
 
     return;
 }
 
+// ====================================================================
+// Gives vma_extract_all() the output name for a subfile
+// ====================================================================
+int MyFrame::ExtAllName( void *ctx, SUBFILE *sf, char *buf, size_t len )
+{
+    MyFrame *frame = (MyFrame *) ctx;
+    wxFileName fn;
+
+    // Generate an output name and append to previous folder path
+    fn.Assign( frame->m_SavePath, frame->OutputName( sf ) );
+
+    wxCharBuffer name( fn.GetFullPath().mb_str() );
+    if( strlen( name.data() ) >= len )
+    {
+        return 1;
+    }
+    strcpy( buf, name.data() );
+
+    return 0;
+}
+
+// ====================================================================
+// Told by vma_extract_all() how extracting a subfile went
+// ====================================================================
+int MyFrame::ExtAllDone( void *ctx, SUBFILE *sf, int rc )
+{
+    MyFrame *frame = (MyFrame *) ctx;
+    ItemMap::iterator it;
+    long nItem;
+
+    // Subfiles the system can't hold (VMAE_LRECL) were passed over, so
+    // they stay selected and aren't counted
+    if( rc != VMAE_NOERR )
+    {
+        return VMAE_NOERR;
+    }
+
+    it = frame->m_ExtItems.find( sf );
+    if( it != frame->m_ExtItems.end() )
+    {
+        nItem = it->second;
+
+        // Refresh stats for this entry since they are now available
+        frame->m_List->SetItem( nItem, Cbytes, frame->Format( sf, Cbytes ) );
+        frame->m_List->SetItem( nItem, Ubytes, frame->Format( sf, Ubytes ) );
+        frame->m_List->SetItem( nItem, Dtype,  frame->Format( sf, Dtype  ) );
+        frame->m_List->SetItemImage( nItem, sf->dtype );
+
+        // Unselect the list item
+        frame->m_List->SetItemState( nItem, 0, wxLIST_STATE_SELECTED );
+    }
+
+    frame->m_ExtCount++;
+
+    return VMAE_NOERR;
+}
+
 // ====================================================================
 // View button clicked
 // ====================================================================
@@ -15,10 +15,12 @@
 
 #include <wx/bmpbuttn.h>
 #include <wx/dynarray.h>
+#include <wx/hashmap.h>
 #include <wx/panel.h>
 #include <wx/sizer.h>
 
 WX_DECLARE_OBJARRAY( wxBitmap, BitmapArray );
+WX_DECLARE_VOIDPTR_HASH_MAP( long, ItemMap );
 
 // ====================================================================
 // The application
@@ -70,6 +72,8 @@ private:
     void SaveSettings( void );
 
     bool Extract( SUBFILE *sf, wxString dest, int nItem );
+    static int ExtAllName( void *ctx, SUBFILE *sf, char *buf, size_t len );
+    static int ExtAllDone( void *ctx, SUBFILE *sf, int rc );
 
     bool OpenArchive();
     void CloseArchive();
@@ -128,6 +132,8 @@ private:
     };
 
     void *m_vma;
+    int m_ExtCount;
+    ItemMap m_ExtItems;
     wxConfigBase *m_Config;
 
     wxString m_Filename;
@@ -42,6 +42,51 @@
 #define fseek _fseeki64
 #endif
 
+#if !defined( _WIN32 ) && !defined( __MVS__ )
+#define HAVE_MMAP
+#include <sys/mman.h>
+#endif
+
+#if !defined( _WIN32 ) && !defined( __MVS__ )
+#define HAVE_THREADS
+#include <pthread.h>
+#endif
+
+#if !defined( _WIN32 )
+#define HAVE_PREAD
+#endif
+
+#if defined( HAVE_THREADS ) && defined( HAVE_PREAD ) && defined( __GNUC__ )
+#define HAVE_PIPELINE
+#include <sched.h>
+#endif
+
+#if !defined( _WIN32 ) && !defined( __MVS__ )
+#define HAVE_BATCH
+#endif
+
+#if defined( __linux__ )
+#define HAVE_MTIM
+#endif
+
+#if defined( __linux__ ) && defined( __GNUC__ ) && defined( __has_include )
+#if __has_include( <linux/io_uring.h> )
+#define HAVE_IO_URING
+#include <sys/syscall.h>
+#include <sys/vfs.h>
+#include <linux/io_uring.h>
+#endif
+#endif
+
+#if defined( __SSE2__ )
+#include <emmintrin.h>
+#endif
+
+#if defined( __GNUC__ ) && defined( __x86_64__ )
+#define HAVE_CPU_DISPATCH
+#include <immintrin.h>
+#endif
+
 #include "vmalib.h"
 #include "vmapriv.h"
 #include "version.h"
@@ -81,6 +126,8 @@
 static const uchar hid[ 9 ] = "\x7a\xc3\xc6\xc6\x40\x40\x40\x40";
 static const uchar aid[ 9 ] = ":CFF    ";
 
+#define HIDLEN      8                   /* length of header IDs      */
+
 /* --------------------------------------------------------------------
 || Message text
 */
@@ -124,6 +171,8 @@ etext[] =
     "subfile already retained",
     "subfile not previously retained",
     "rename failed...manual rename required",
+    "not allowed while a stream is open",
+    "not allowed with decode contexts open",
     ""
 };
 
@@ -249,6 +298,122 @@ set_active( VMA *vma, PSUBFILE *psf )
     return;
 }
 
+#if defined( HAVE_THREADS )
+/* --------------------------------------------------------------------
+|| Thread helpers
+*/
+#define MAXTHREADS  64                  /* most threads we'll start  */
+
+/*
+|| Number of threads worth starting
+*/
+static int
+cpus( void )
+{
+    long n = sysconf( _SC_NPROCESSORS_ONLN );
+    
+    if( n < 1 )
+    {
+        return 1;
+    }
+    
+    return n > MAXTHREADS ? MAXTHREADS : (int) n;
+}
+
+/*
+|| Runs fn on each of the args, one per thread.  Anything that can't
+|| get its own thread is simply run here.
+*/
+static void
+run_threads( void *( *fn )( void * ), void **args, int cnt )
+{
+    pthread_t tids[ MAXTHREADS ];
+    char started[ MAXTHREADS ];
+    int i;
+    
+    for( i = 1; i < cnt; i++ )
+    {
+        started[ i ] = ( pthread_create( &tids[ i ], NULL, fn, args[ i ] ) == 0 );
+        if( !started[ i ] )
+        {
+            fn( args[ i ] );
+        }
+    }
+    
+    if( cnt > 0 )
+    {
+        fn( args[ 0 ] );
+    }
+    
+    for( i = 1; i < cnt; i++ )
+    {
+        if( started[ i ] )
+        {
+            pthread_join( tids[ i ], NULL );
+        }
+    }
+    
+    return;
+}
+
+#endif
+
+/* --------------------------------------------------------------------
+|| Once decode contexts have been opened, what extraction learns about
+|| a subfile (sizes and data type) is written back to the archive's
+|| shared subfile list under the archive's lock.
+*/
+static void
+lock_shared( VMA *vma )
+{
+#if defined( HAVE_THREADS )
+    VMA *ar = ( vma->parent != NULL ? vma->parent : vma );
+    
+    if( ar->f_shared )
+    {
+        pthread_mutex_lock( &ar->lock );
+    }
+#endif
+    
+    return;
+}
+
+static void
+unlock_shared( VMA *vma )
+{
+#if defined( HAVE_THREADS )
+    VMA *ar = ( vma->parent != NULL ? vma->parent : vma );
+    
+    if( ar->f_shared )
+    {
+        pthread_mutex_unlock( &ar->lock );
+    }
+#endif
+    
+    return;
+}
+
+/* --------------------------------------------------------------------
+|| Contexts use the archive's subfile list as is, so neither a context
+|| nor an archive with contexts open may change it
+*/
+static int
+in_context( VMA *vma )
+{
+    int cnt;
+    
+    if( vma->parent != NULL )
+    {
+        return TRUE;
+    }
+    
+    lock_shared( vma );
+    cnt = vma->nctx;
+    unlock_shared( vma );
+    
+    return ( cnt > 0 );
+}
+
 /* --------------------------------------------------------------------
 ||
 */
@@ -579,2409 +744,8803 @@ cmp( const void *e1, const void *e2 )
 }
 
 /* --------------------------------------------------------------------
-|| General I/O stuff
+|| Maps the archive so it can be read in place.  Not being able to map
+|| it isn't an error...we just fall back to stdio.
 */
 static void
-unget( VMA *vma, uchar *buf, int len )
+map_archive( VMA *vma )
 {
-    while( --len > 0 )
+#if defined( HAVE_MMAP )
+    struct stat st;
+    void *map;
+    
+    if( ( vma->flags & VMAO_NOMAP ) || vma->vfile == NULL )
     {
-        vma->ibuf[ --vma->ibufp ] = buf[ len ];
-        vma->icnt++;
+        return;
     }
     
-    return;
-}
-
-/* --------------------------------------------------------------------
-|| Get a character from the VMARC
-*/
-static unsigned int
-get( VMA *vma )
-{
     /*
-    || Need to refill the buffer?
+    || Can't map empty (or unreasonably large) files
     */
-    if( vma->icnt == 0 )
+    if( fstat( fileno( vma->vfile ), &st ) != 0 ||
+        st.st_size <= 0 ||
+        (unsigned long long) st.st_size > (size_t) -1 )
     {
-        /*
-        || Check for EOF
-        */
-        if( feof( vma->in ) )
-        {
-            return (unsigned int) EOF;
-        }
-        
-        /*
-        || Remember file position corresponding to start of buffer
-        */
-        vma->ipos = ftell( vma->in );
-        
-        /*
-        || Read a buffers worth
-        */
-        vma->icnt = fread( &vma->ibuf[ UNREAD ], 1, BUFLEN, vma->in );
-        
-        /*
-        || Check for errors...defer EOF check for later
-        */
-        if( ferror( vma->in ) )
-        {
-            seterr( VMAE_RERR );
-            
-            return (unsigned int) EOF;
-        }
-        
-        /*
-        || Check for EOF
-        */
-        if( vma->icnt == 0 && feof( vma->in ) )
-        {
-            return (unsigned int) EOF;
-        }
-        
-        /*
-        || Reset buffer position
-        */
-        vma->ibufp = UNREAD;
+        return;
     }
     
-    /*
-    || Track # of bytes read...resets at start of subfile extraction
-    */
-    vma->bytesin++;
+    map = mmap( NULL,
+                (size_t) st.st_size,
+                PROT_READ,
+                MAP_SHARED,
+                fileno( vma->vfile ),
+                0 );
+    if( map == MAP_FAILED )
+    {
+        return;
+    }
     
     /*
-    || One less byte in the buffer
+    || Opening reads the whole thing front to back
     */
-    vma->icnt--;
+    posix_madvise( map, (size_t) st.st_size, POSIX_MADV_SEQUENTIAL );
+    
+    vma->vmap = (uchar *) map;
+    vma->vmaplen = (size_t) st.st_size;
+#endif
     
-    return (unsigned int) vma->ibuf[ vma->ibufp++ ];
+    return;
 }
 
-/* --------------------------------------------------------------------
-|| Returns current input position in the VMARC
-*/
-static size_t
-mytell( VMA *vma )
+static void
+unmap_archive( VMA *vma )
 {
-    /*
-    || Return the current input position
-    ||
-    || Accounts for any "unget()" bytes too.
-    */
-    return vma->ipos + ( vma->ibufp - UNREAD );
+#if defined( HAVE_MMAP )
+    if( vma->vmap != NULL )
+    {
+        munmap( vma->vmap, vma->vmaplen );
+        vma->vmap = NULL;
+        vma->vmaplen = 0;
+    }
+#endif
+    vma->imap = FALSE;
+    
+    return;
 }
 
 /* --------------------------------------------------------------------
-|| Writes a byte to the extract file
+|| Positions the input file.  If it's the mapped archive, the whole
+|| map simply becomes the input buffer.
 */
 static int
-put( VMA *vma, unsigned int c )
+seek_in( VMA *vma, size_t off )
 {
-    /*
-    || Track the number of bytes we've written (for display)
-    */
-    if( c != UINT_MAX )
-    {
-        vma->bytesout++;
-        
-        if( vma->bytesout <= 1024 )
-        {
-            if( c < 0x20 )
-            {
-                if( c != '\t' && c != '\r' && c != '\n' )
-                {
-                    vma->dtype = VMAD_BINARY;
-                }
-            }
-        }
-    }
-    
-    /*
-    || Nothing else to do if we're not extracting
-    */
-    if( !vma->f_extract )
+    if( vma->in == vma->vfile && vma->vmap != NULL )
     {
-        return TRUE;
-    }
-    
-    /*
-    || Flush the output buffer
-    */
-    if( c == UINT_MAX )
-    {
-        if( fwrite( vma->obuf, 1, vma->opos, vma->out ) != vma->opos )
+        if( off > vma->vmaplen )
         {
-            seterr( VMAE_WERR );
             return FALSE;
         }
         
-        vma->opos = 0;
+        vma->imap = TRUE;
+        vma->ibase = vma->vmap;
+        vma->ipos = 0;
+        vma->iptr = vma->vmap + off;
+        vma->icnt = vma->vmaplen - off;
         
         return TRUE;
     }
     
-    /*
-    || Make sure we don't overflow
-    */
-    if( vma->opos == vma->omax )
+    if( vma->f_pread )
+    {
+        vma->ioff = off;
+    }
+    else if( fseek( vma->in, off, SEEK_SET ) != 0 )
     {
-        seterr( VMAE_OOVER );
         return FALSE;
     }
     
-    /*
-    || Store the character
-    */
-    vma->obuf[ vma->opos++ ] = c;
+    vma->imap = FALSE;
+    vma->ibase = &vma->cd->ibuf[ UNREAD ];
+    vma->ipos = off;
+    vma->iptr = vma->ibase;
+    vma->icnt = 0;
     
     return TRUE;
 }
 
 /* --------------------------------------------------------------------
-|| Shared compression I/O
+|| Returns the file position of the next byte read_in() would read
 */
-static int
-putbyte( VMA *vma, unsigned short c )
+static size_t
+tell_in( VMA *vma )
 {
-    int code;
+    if( vma->f_pread )
+    {
+        return vma->ioff;
+    }
     
+    return ftell( vma->in );
+}
+
+#if defined( HAVE_PIPELINE )
+/* --------------------------------------------------------------------
+|| Pipelined extraction
+||
+|| A large subfile can be extracted by three threads:  a reader that
+|| keeps a ring of input blocks filled ahead of the decoder, the
+|| decoder itself (the caller's thread) and a writer that drains a
+|| ring of decoded output to the real writer.  Each ring has a single
+|| producer and a single consumer, so they only need the two running
+|| counts, published with release stores and read with acquire loads.
+|| A mapped archive doesn't get a reader since the system is already
+|| reading ahead of the decoder.
+*/
+#define PIPEBLKS    8                   /* input blocks in ring      */
+#define PIPEOUT     ( 1024 * 1024 )     /* output ring size          */
+#define PIPEMIN     ( 1024 * 1024 )     /* smallest subfile to pipe  */
+
+typedef struct vpipe
+{
     /*
-    || Convert back to EBCDIC character
-    */
-    code = c - kodebcd;
-    
+    || Input ring (reader -> decoder)
+    */
+    pthread_t rtid;                     /* reader thread             */
+    char f_reader;                      /* reader is running         */
+    int rfd;                            /* descriptor to read        */
+    size_t roff;                        /* file pos of next block    */
+    uchar *blk[ PIPEBLKS ];             /* input blocks              */
+    size_t blen[ PIPEBLKS ];            /* bytes in each block       */
+    size_t rhead;                       /* blocks filled             */
+    size_t rtail;                       /* blocks used up            */
+    size_t rused;                       /* bytes used of tail block  */
+    int reof;                           /* reader hit EOF or error   */
+    int rerr;                           /* reader's read failed      */
+    int rstop;                          /* reader should quit        */
+
     /*
-    || Handle special codes (only EOR)
-    */
-    if( code < 0 )
+    || Output ring (decoder -> writer)
+    */
+    pthread_t wtid;                     /* writer thread             */
+    VMA *vma;                           /* for the real writer       */
+    int ( *owrite )( VMA *, const uchar *, size_t ); /* real writer */
+    uchar *out;                         /* output ring               */
+    size_t whead;                       /* bytes put in ring         */
+    size_t wtail;                       /* bytes written out         */
+    int wdone;                          /* decoder has finished      */
+    int werr;                           /* real writer failed        */
+} VPIPE;
+
+#define pipe_get( v )       __atomic_load_n( &( v ), __ATOMIC_ACQUIRE )
+#define pipe_set( v, n )    __atomic_store_n( &( v ), ( n ), __ATOMIC_RELEASE )
+
+/*
+|| Waits a bit for the other end of a ring.  It spins (politely) for a
+|| while before sleeping so a busy pipeline doesn't pay for wakeups.
+*/
+static void
+pipe_wait( unsigned *spins )
+{
+    struct timespec ts;
+    
+    if( ++*spins < 64 )
     {
-        /*
-        || Track number of times we've seen the EOR code
-        */
-        vma->eor++;
-        
-        /*
-        || Variable records:
-        || First means end-of-record...second one means end-of-file
-        ||
-        || Fixed records:
-        || First means end-of-file
-        */
-        if( vma->eor > 1 || vma->recfm == 'F' )
+        sched_yield();
+        return;
+    }
+    
+    ts.tv_sec = 0;
+    ts.tv_nsec = 50000;
+    nanosleep( &ts, NULL );
+    
+    return;
+}
+
+/*
+|| Reader thread.  Fills blocks until EOF, an error or it's told to
+|| quit.  Only one ring's worth is ever read beyond the subfile.
+*/
+static void *
+pipe_reader( void *arg )
+{
+    VPIPE *p = (VPIPE *) arg;
+    unsigned spins;
+    size_t head;
+    size_t len;
+    ssize_t n;
+    uchar *buf;
+    
+    for( head = p->rhead; ; head++ )
+    {
+        spins = 0;
+        while( head - pipe_get( p->rtail ) >= PIPEBLKS )
         {
-            if( !put( vma, UINT_MAX ) )
+            if( pipe_get( p->rstop ) )
             {
-                return -1;
+                return NULL;
             }
-            
-            return 0;
+            pipe_wait( &spins );
         }
         
-        /*
-        || Append a line end if converting
-        */
-        if( vma->f_text )
-        {
-#if defined( _WIN32 )
-            if( !put( vma, '\r' ) )
-            {
-                return -1;
-            }
-#endif
-            if( !put( vma, '\n' ) )
-            {
-                return -1;
-            }
-        }
-        
-        if( !put( vma, UINT_MAX ) )
+        if( pipe_get( p->rstop ) )
         {
-            return -1;
+            return NULL;
         }
         
-        return 1;
-    }
-    
-    /*
-    || Reset EOR counter
-    */
-    vma->eor = 0;
-    
-    /*
-    || Bail out if we're scanning and have hit our limit
-    */
-    if( vma->f_scanning && vma->bytesin >= 1024 )
-    {
-        return 0;
-    }
-    
-    /*
-    || Fixed files need record length tracking to output newline since
-    || we don't receive an EOR code for them.
-    */
-    if( vma->recfm == 'F' )
-    {
-        if( vma->recbytes == vma->lrecl )
+        buf = p->blk[ head % PIPEBLKS ];
+        len = 0;
+        while( len < BUFLEN )
         {
-            vma->recbytes = 0;
+            n = pread( p->rfd, buf + len, BUFLEN - len, p->roff );
+            if( n < 0 && errno == EINTR )
+            {
+                continue;
+            }
             
-            if( vma->f_text )
+            if( n < 0 )
             {
-#if defined( _WIN32 )
-                if( !put( vma, '\r' ) )
-                {
-                    return -1;
-                }
-#endif
-                if( !put( vma, '\n' ) )
-                {
-                    return -1;
-                }
+                pipe_set( p->rerr, TRUE );
+                break;
             }
             
-            if( !put( vma, UINT_MAX ) )
+            if( n == 0 )
             {
-                return -1;
+                break;
             }
+            
+            len += n;
+            p->roff += n;
         }
         
-        vma->recbytes++;
-    }
-    
-    /*
-    || Translate
-    */
-    if( vma->f_text )
-    {
-        code = TO_A_USR( code );
-    }
-    
-    /*
-    || Put the byte
-    */
-    if( !put( vma, code ) )
-    {
-        return -1;
+        p->blen[ head % PIPEBLKS ] = len;
+        pipe_set( p->rhead, head + 1 );
+        
+        if( len < BUFLEN )
+        {
+            pipe_set( p->reof, TRUE );
+            return NULL;
+        }
     }
-    
-    return 1;
 }
 
-static unsigned short
-getcode( VMA *vma )
+/*
+|| read_in() for the decoder when the reader is running
+*/
+static int
+pipe_read( VMA *vma, uchar *buf, size_t len, size_t *got )
 {
-    unsigned int code;
-    
-    /*
-    || Always need to read as least one byte
-    */
-    code = get( vma );
-    if( code == EOF )
-    {
-        return USHRT_MAX;
-    }
+    VPIPE *p = vma->pipe;
+    unsigned spins = 0;
+    size_t tail = p->rtail;
+    size_t n;
+    int eof;
     
-    /*
-    || Use what's left over from previous call
-    */
-    if( vma->residual != UINT_MAX )
-    {
-        code |= ( vma->residual << 8 );
-        vma->residual = UINT_MAX;
-    }
-    else
+    while( *got < len )
     {
         /*
-        || Get the low 4 bits of the 12 bit code
+        || Wait for a block, noting EOF before looking at the count so
+        || the last block can't be missed
         */
-        vma->residual = get( vma );
-        if( vma->residual == EOF )
+        eof = pipe_get( p->reof );
+        if( tail == pipe_get( p->rhead ) )
         {
-            return USHRT_MAX;
+            if( !eof )
+            {
+                pipe_wait( &spins );
+                continue;
+            }
+            
+            if( pipe_get( p->rerr ) )
+            {
+                seterr( VMAE_RERR );
+                return FALSE;
+            }
+            
+            break;
+        }
+        spins = 0;
+        
+        n = p->blen[ tail % PIPEBLKS ] - p->rused;
+        if( n > len - *got )
+        {
+            n = len - *got;
         }
         
+        memcpy( buf + *got, p->blk[ tail % PIPEBLKS ] + p->rused, n );
+        *got += n;
+        vma->ioff += n;
+        p->rused += n;
+        
         /*
-        || And put it where it belongs
+        || Hand used up blocks back
         */
-        code = ( code << 4 ) | ( vma->residual >> 4 );
+        if( p->rused == p->blen[ tail % PIPEBLKS ] )
+        {
+            p->rused = 0;
+            pipe_set( p->rtail, ++tail );
+        }
     }
     
-    /*
-    || Always returns a 12 bit code
-    */
-    return code & 0xfff;
+    return TRUE;
 }
 
+#endif
+
 /* --------------------------------------------------------------------
-|| LZW Decompression
+|| Reads from the input file.  Decode contexts share the archive's file
+|| handles, so they read at their own offset with pread() and never
+|| move the file position.  "*got" is only short of "len" at EOF.
+|| Returns FALSE on error.
 */
 static int
-lookup( VMA *vma, LZWSTRING *lastpred, unsigned short nextchar, LZWSTRING **ent )
+read_in( VMA *vma, uchar *buf, size_t len, size_t *got )
 {
-    unsigned int offset;
-    LZWSTRING *bucket;
-    LZWSTRING *origin;
-    LZWSTRING *left;
-    LZWSTRING *right;
-    int wrapped;
-    
-    /*
-    || Hash function.
-    */
-    offset = ( ( ( (size_t) lastpred ) / sizeof(LZWHASH) ) ^ nextchar )
-    & 0xffff;
-    offset *= offset;
-    offset %= HASHSIZE;
+    *got = 0;
     
-    /*
-    || Locate start of hash chain
-    */
-    bucket = (LZWSTRING *) &vma->lzwhashtab[ offset ];
-    origin = bucket;
+#if defined( HAVE_PIPELINE )
+    if( vma->pipe != NULL && vma->pipe->f_reader )
+    {
+        return pipe_read( vma, buf, len, got );
+    }
+#endif
     
-    /*
-    || Search hash table for (predecessor,character) combination.
-    */
-    while( bucket->right != origin )
+#if defined( HAVE_PREAD )
+    if( vma->f_pread )
     {
-        bucket = bucket->right;
-        if( bucket->pred == lastpred && bucket->schar == nextchar )
+        ssize_t n;
+        
+        while( *got < len )
         {
-            /* found it*/
-            *ent = bucket;
-            return TRUE;
+            n = pread( fileno( vma->in ), buf + *got, len - *got, vma->ioff );
+            if( n < 0 && errno == EINTR )
+            {
+                continue;
+            }
+            
+            if( n < 0 )
+            {
+                seterr( VMAE_RERR );
+                return FALSE;
+            }
+            
+            if( n == 0 )
+            {
+                break;
+            }
+            
+            *got += n;
+            vma->ioff += n;
         }
+        
+        return TRUE;
     }
+#endif
     
-    /*
-    || Desired entry not found.  Add it if possible.
-    */
-    
-    /*
-    || Bump reference count of previous predecessor
-    */
-    if( lastpred != ENDCHAIN )
+    *got = fread( buf, 1, len, vma->in );
+    if( ferror( vma->in ) )
     {
-        lastpred->refcnt++;
+        seterr( VMAE_RERR );
+        return FALSE;
     }
     
+    return TRUE;
+}
+
+/* --------------------------------------------------------------------
+|| Get a character from the VMARC
+*/
+static unsigned int
+get( VMA *vma )
+{
     /*
-    || Search for free entry until end of table is reached
+    || Need to refill the buffer?
     */
-    wrapped = 0;
-    do
+    if( vma->icnt == 0 )
     {
         /*
-        || Bump to next table entry
+        || Check for EOF
+        */
+        if( vma->imap || ( !vma->f_pread && feof( vma->in ) ) )
+        {
+            return (unsigned int) EOF;
+        }
+        
+        /*
+        || Remember file position corresponding to start of buffer
         */
-        ++vma->lzwtabp;
+        vma->ipos = tell_in( vma );
         
         /*
-        || Reached the end of the table?
+        || Read a buffers worth
         */
-        if( vma->lzwtabp > vma->lzwtabl )
+        if( !read_in( vma, &vma->cd->ibuf[ UNREAD ], BUFLEN, &vma->icnt ) )
         {
-            /*
-            || Get out if we've been here before
-            */
-            if( wrapped )
-            {
-                break;
-            }
-            
-            wrapped = 1;
-            vma->lzwtabp = vma->lzwtabs;
+            return (unsigned int) EOF;
         }
-    } while( vma->lzwtabp->refcnt != 0 );
-    
-    /*
-    || If we hit the KwKwK case, then don't add this entry
-    || to the table. (big flower box in VMARC source)
-    */
-    if( vma->lzwtabp > vma->lzwtabl )
-    {
-        lastpred->refcnt--;
         
         /*
-        || Indicate it wasn't found
+        || Check for EOF
         */
-        *ent = lastpred;
-        return FALSE;
-    }
-    
-    /*
-    || Remove entry from previous location in hash and prefix chains
-    */
-    if( vma->lzwtabp->right != 0 )
-    {
-        right = vma->lzwtabp->right;
-        left = vma->lzwtabp->left;
-        right->left = left;
-        left->right = right;
-        if( vma->lzwtabp->pred != 0 )
+        if( vma->icnt == 0 )
         {
-            vma->lzwtabp->pred->refcnt--;
+            return (unsigned int) EOF;
         }
+        
+        /*
+        || Reset buffer position
+        */
+        vma->ibase = &vma->cd->ibuf[ UNREAD ];
+        vma->iptr = vma->ibase;
     }
     
     /*
-    || Add it to its new home in the prefix chain
+    || Track # of bytes read...resets at start of subfile extraction
     */
-    vma->lzwtabp->pred = lastpred;
-    vma->lzwtabp->schar = nextchar;
-    vma->lzwtabp->refcnt = 0;
+    vma->bytesin++;
     
     /*
-    || And in the hash chain
+    || One less byte in the buffer
     */
-    right = origin->right;
-    vma->lzwtabp->right = right;
-    vma->lzwtabp->left = origin;
-    origin->right = vma->lzwtabp;
-    right->left = vma->lzwtabp;
+    vma->icnt--;
     
-    /*
-    || Return entry
-    */
-    *ent = vma->lzwtabp;
-    return FALSE;
+    return (unsigned int) *vma->iptr++;
 }
 
-static void
-lzwinit( VMA *vma )
+/* --------------------------------------------------------------------
+|| Makes sure at least "need" bytes are waiting in the input buffer.
+|| Returns FALSE if EOF (or an error) means no more will be coming.
+*/
+static int
+fill( VMA *vma, size_t need )
 {
-    LZWSTRING *ent;
-    LZWHASH *hash;
-    unsigned short ndx;
+    size_t want;
+    size_t len;
     
     /*
-    || Clear the prefix table
+    || Already have enough?  (A map has everything it'll ever have.)
     */
-    memset( vma->lzwstrtab, 0, sizeof( vma->lzwstrtab ) );
+    if( vma->icnt >= need || vma->imap )
+    {
+        return ( vma->icnt >= need );
+    }
     
     /*
-    || Initialize the hash table
+    || Slide what's left down to the start of the buffer
     */
-    hash = &vma->lzwhashtab[ 0 ];
-    for( ndx = 0; ndx < HASHSIZE; ndx++ )
+    if( vma->icnt == 0 )
+    {
+        vma->ipos = tell_in( vma );
+    }
+    else
     {
-        hash->head = (LZWSTRING *) hash;
-        hash->tail = (LZWSTRING *) hash;
-        hash++;
+        vma->ipos += vma->iptr - vma->ibase;
+        memmove( &vma->cd->ibuf[ UNREAD ], vma->iptr, vma->icnt );
     }
+    vma->ibase = &vma->cd->ibuf[ UNREAD ];
+    vma->iptr = vma->ibase;
     
     /*
-    || Preload the specials plus 256 EBCDIC characters
+    || And top it up
     */
-    vma->lzwtabp = &vma->lzwstrtab[ 0 ] - 1; /* -1 for lookup preinc*/
-    vma->lzwtabl = &vma->lzwstrtab[ TABSIZE - 1 ];
-    
-    for( ndx = 0; ndx < kodmax + 1; ndx++ )
+    while( vma->icnt < need )
     {
+        want = BUFLEN - vma->icnt;
+        if( !read_in( vma, &vma->cd->ibuf[ UNREAD + vma->icnt ], want, &len ) )
+        {
+            return FALSE;
+        }
+        
+        vma->icnt += len;
+        
         /*
-        || Force addition of entry and set reference count
+        || Short means EOF
         */
-        lookup( vma, ENDCHAIN, ndx, &ent );
-        ent->refcnt = 1;
+        if( len < want )
+        {
+            return ( vma->icnt >= need );
+        }
     }
     
+    return TRUE;
+}
+
+/* --------------------------------------------------------------------
+|| Returns current input position in the VMARC
+*/
+static size_t
+mytell( VMA *vma )
+{
     /*
-    || Set wrap-around point
+    || Return the current input position
     */
-    vma->lzwtabs = ent + 1;
-    
-    return;
+    return vma->ipos + ( vma->iptr - vma->ibase );
 }
 
+/* --------------------------------------------------------------------
+|| Output writers.  Extracted data is handed to vma->owrite() a record
+|| (or for binary ASIS, a run of records) at a time.
+*/
 static int
-extract_lzw( VMA *vma )
+write_file( VMA *vma, const uchar *buf, size_t len )
 {
-    LZWSTRING *prev;
-    LZWSTRING *last;
-    LZWSTRING *ent;
-    LZWSTRING *tabptr;
-    int wrapped;
-    unsigned short code;
-    int rc;
-    
-    /*
-    || Initialize
-    */
-    lzwinit( vma );
-    tabptr = vma->lzwtabs;
-    tabptr->pred = ENDCHAIN;
+    return ( fwrite( buf, 1, len, vma->out ) == len );
+}
+
+static int
+write_all( int fd, const uchar *buf, size_t len )
+{
+    long n;
     
-    while( TRUE )
+    while( len > 0 )
     {
-        /*
-        || Get the next code
-        */
-        code = getcode( vma );
-        if( code == USHRT_MAX )
-        {
-            return seterr( VMAE_BADDATA );
-        }
-        
-        /*
-        || Protect against corrupt hives
-        */
-        ent = &vma->lzwstrtab[ code ];
-        if( ent->pred == NULL )
-        {
-            return seterr( VMAE_BADDATA );
-        }
-        
-        /*
-        || Traverse down to get to the start of the string
-        */
-        prev = ENDCHAIN;
-        do
-        {
-            last = ent->pred;
-            ent->pred = prev;
-            prev = ent;
-            ent = last;
-        } while( ent != ENDCHAIN );
-        
-        /*
-        ||
-        */
-        tabptr->schar = prev->schar;
-        
-        /*
-        || Go back up while outputing the characters in correct order
-        */
-        do
+        n = write( fd, buf, ( len > INT_MAX ? INT_MAX : len ) );
+        if( n < 0 )
         {
-            rc = putbyte( vma, prev->schar );
-            if( rc == 0 )
-            {
-                return seterr( VMAE_NOERR );
-            }
-            if( rc < 0 )
+            if( errno == EINTR )
             {
-                return seterr( VMAE_BADDATA );
+                continue;
             }
             
-            last = prev->pred;
-            prev->pred = ent;
-            ent = prev;
-            prev = last;
-        } while( prev != ENDCHAIN );
-        
-        /*
-        || Start building follow-on entry for this code.
-        */
-        ent->refcnt++;
-        
-        /*
-        || Search for free entry until end of table is reached
-        */
-        wrapped = FALSE;
-        tabptr = vma->lzwtabp;
-        do
-        {
-            /*
-            || Bump to next table entry
-            */
-            ++tabptr;
-            
-            /*
-            || Reached the end of the table?
-            */
-            if( tabptr > vma->lzwtabl )
-            {
-                /*
-                || Get out if we've been here before
-                */
-                if( wrapped )
-                {
-                    break;
-                }
-                
-                wrapped = TRUE;
-                tabptr = vma->lzwtabs;
-            }
-        } while( tabptr->refcnt );
+            return FALSE;
+        }
         
-        /*
-        || If we hit the KwKwK case, then don't add this entry
-        || to the table. (big flower box in VMARC source)
-        */
-        if( tabptr > vma->lzwtabl )
+        buf += n;
+        len -= n;
+    }
+    
+    return TRUE;
+}
+
+static int
+write_fd( VMA *vma, const uchar *buf, size_t len )
+{
+    return write_all( vma->ofd, buf, len );
+}
+
+static int
+write_cb( VMA *vma, const uchar *buf, size_t len )
+{
+    return ( vma->ocb( vma->octx, buf, len ) == 0 );
+}
+
+/*
+|| Appends to the memory buffer
+*/
+static int
+write_mem( VMA *vma, const uchar *buf, size_t len )
+{
+    uchar *nbuf;
+    size_t nmax;
+    
+    if( vma->slen + len > vma->smax )
+    {
+        nmax = vma->smax * 2;
+        if( nmax < vma->slen + len )
         {
-            ent->refcnt--;
-            continue;
+            nmax = vma->slen + len;
         }
         
-        /*
-        || Add the new entry
-        */
-        if( tabptr->pred != ENDCHAIN && tabptr->pred != NULL )
+        nbuf = (uchar *) realloc( vma->sbuf, nmax );
+        if( nbuf == NULL )
         {
-            tabptr->pred->refcnt--;
+            seterr( VMAE_MEM );
+            return FALSE;
         }
         
-        /*
-        || Remember for next round
-        */
-        tabptr->pred = ent;
-        vma->lzwtabp = tabptr;
+        vma->sbuf = nbuf;
+        vma->smax = nmax;
     }
     
-    return seterr( VMAE_NOERR );
+    memcpy( &vma->sbuf[ vma->slen ], buf, len );
+    vma->slen += len;
+    
+    return TRUE;
 }
 
-/* --------------------------------------------------------------------
-|| S2 Decompression
+/*
+|| Queues output for vma_read() and asks the decoder to stop and let
+|| the reader have it
 */
-static void
-s2addnew( VMA *vma, unsigned short slastcode, unsigned short lastcode  )
+static int
+write_stream( VMA *vma, const uchar *buf, size_t len )
 {
-    STRDSECT *left;
-    STRDSECT *right;
-    STRDSECT *probe;
-    STRDSECT *ostr;
-    STRDSECT **psib;
-    STRDSECT **opsib;
-    
-    /*
-    || Find string table entries for the left and right substrings
-    */
-    left = &vma->s2strtab[ slastcode ];
-    right = &vma->s2strtab[ lastcode ];
+    vma->f_pause = TRUE;
     
+    return write_mem( vma, buf, len );
+}
+
+/* --------------------------------------------------------------------
+|| Writes a byte to the extract file
+*/
+static int
+put( VMA *vma, unsigned int c )
+{
     /*
-    || Would string be longer with buffer?
+    || Track the number of bytes we've written (for display)
     */
-    if( ( left->strlen + right->strlen ) > ( TABSIZE - 2 ) )
+    if( c != UINT_MAX )
     {
-        return;
+        vma->bytesout++;
+        
+        if( vma->bytesout <= 1024 )
+        {
+            if( c < 0x20 )
+            {
+                if( c != '\t' && c != '\r' && c != '\n' )
+                {
+                    vma->dtype = VMAD_BINARY;
+                }
+            }
+        }
     }
     
-    left->strcount++;
-    right->strcount++;
-    
     /*
-    || Find a place for the new string
+    || Nothing else to do if we're not extracting
     */
-    probe = vma->s2tabp;
-    do
+    if( !vma->f_extract )
     {
-        probe++;
-        if( probe > vma->s2tabl )
-        {
-            probe = vma->s2tabs;
-        }
-    } while( probe->strcount != 0 );
+        return TRUE;
+    }
     
     /*
-    || Replace an old string entry with this new one
+    || Flush the output buffer
     */
-    ostr = probe->strleft;
-    if( ostr )
+    if( c == UINT_MAX )
     {
-        ostr->strcount--;
-        
-        psib = &ostr->stroffsp;
-        while( *psib != probe )
+        if( !vma->owrite( vma, vma->obuf, vma->opos ) )
         {
-            psib = &( *psib )->strsiblg;
+            seterr( VMAE_WERR );
+            return FALSE;
         }
-        *psib = probe->strsiblg;
         
-        ostr = probe->strright;
-        ostr->strcount--;
+        vma->opos = 0;
+        
+        return TRUE;
     }
     
     /*
-    || Now construct a new entry for this string
+    || Make sure we don't overflow
     */
-    if( right == vma->s2tabp )
+    if( vma->opos == vma->omax )
     {
-        if( left == right->strleft )
-        {
-            ostr = right;
-            right = left;
-            left = ostr;
-        }
+        seterr( VMAE_OOVER );
+        return FALSE;
     }
     
-    probe->strleft = left;
-    probe->strright = right;
-    probe->strlen = 2 + left->strlen + right->strlen;
-    
     /*
-    || Insert new node into offspring/sibling list of left substring
+    || Store the character
     */
-    psib = &left->stroffsp;
-    do
-    {
-        opsib = psib;
-        left = *psib;
-        psib = &left->strsiblg;
-    } while( left && ( left != vma->s2tabp ) );
+    vma->obuf[ vma->opos++ ] = c;
     
-    probe->strsiblg = left;
-    *opsib = probe;
-    vma->s2tabp = probe;
+    return TRUE;
+}
+
+/* --------------------------------------------------------------------
+|| Translates a buffer through a 256 byte table ("in" and "out" may be
+|| the same buffer).  When the CPU has AVX-512 VBMI, the table fits in
+|| four registers, and two 128 byte permutes plus a blend on the high
+|| bit translate 64 bytes at a time.
+*/
+#if defined( HAVE_CPU_DISPATCH )
+__attribute__(( target( "avx512f,avx512bw,avx512vbmi" ) ))
+static void
+xlate_vbmi( const uchar *map, uchar *out, const uchar *in, size_t len )
+{
+    __m512i t0 = _mm512_loadu_si512( map );
+    __m512i t1 = _mm512_loadu_si512( map + 64 );
+    __m512i t2 = _mm512_loadu_si512( map + 128 );
+    __m512i t3 = _mm512_loadu_si512( map + 192 );
+    __m512i v;
+    __m512i lo;
+    __m512i hi;
+    __mmask64 m;
+    
+    while( len > 0 )
+    {
+        m = ( len >= 64 ? ~(__mmask64) 0 : ( (__mmask64) 1 << len ) - 1 );
+        
+        v = _mm512_maskz_loadu_epi8( m, in );
+        lo = _mm512_permutex2var_epi8( t0, v, t1 );
+        hi = _mm512_permutex2var_epi8( t2, v, t3 );
+        _mm512_mask_storeu_epi8( out,
+                                 m,
+                                 _mm512_mask_blend_epi8( _mm512_movepi8_mask( v ),
+                                                         lo,
+                                                         hi ) );
+        
+        if( len < 64 )
+        {
+            break;
+        }
+        
+        in += 64;
+        out += 64;
+        len -= 64;
+    }
     
     return;
 }
+#endif
 
 static void
-s2init( VMA *vma )
+xlate_buf( const uchar *map, uchar *out, const uchar *in, size_t len )
 {
-    unsigned short ndx;
-    
-    memset( &vma->s2buf, 0, sizeof( vma->s2buf ) );
-    memset( &vma->s2strtab, 0, sizeof( vma->s2strtab ) );
+    size_t i;
     
-    vma->s2tabs = &vma->s2strtab[ kodmax + 1 ];
-    vma->s2tabl = &vma->s2strtab[ TABSIZE ];
-    vma->s2tabp = vma->s2tabl;
+#if defined( HAVE_CPU_DISPATCH )
+    if( len >= 16 && __builtin_cpu_supports( "avx512vbmi" ) )
+    {
+        xlate_vbmi( map, out, in, len );
+        return;
+    }
+#endif
     
-    for( ndx = 0; ndx < kodmax + 1; ndx++ )
+    for( i = 0; i < len; i++ )
     {
-        vma->s2strtab[ ndx ].strchar = ndx;
-        vma->s2strtab[ ndx ].strcount = 1;
+        out[ i ] = map[ in[ i ] ];
     }
     
     return;
 }
 
+/* --------------------------------------------------------------------
+|| Shared compression I/O
+||
+|| Decoders hand over whole strings of codes and ASIS hands over whole
+|| records, so the per-record work only happens at record boundaries
+|| and everything in between is a straight copy.
+||
+|| What's done with the output (RECFM, conversion, extracting or just
+|| sizing/scanning) is passed down as flags.  These routines are always
+|| inlined, and each decoder is built once per combination that
+|| extraction uses, so the tests fold away and the right one is picked
+|| when the subfile is started.
+*/
+#if defined( __GNUC__ )
+#define SPECIALIZE  __inline__ __attribute__(( always_inline ))
+#elif defined( _MSC_VER )
+#define SPECIALIZE  __forceinline
+#else
+#define SPECIALIZE
+#endif
+
+#define OUT_FIXED   0x01                /* RECFM is F                */
+#define OUT_TEXT    0x02                /* convert to text           */
+#define OUT_EXTRACT 0x04                /* output is being kept      */
+#define OUT_SCAN    0x08                /* scanning for data type    */
+
+/*
+|| Output flags for the current subfile
+*/
 static int
-extract_s2( VMA *vma )
+out_flavor( VMA *vma )
 {
-    STRDSECT *prev;
-    STRDSECT *curr;
-    STRDSECT *next;
-    unsigned short slastcode;
-    unsigned short lastcode;
-    int rc;
+    return ( vma->recfm == 'F' ? OUT_FIXED : 0 ) |
+           ( vma->f_text ? OUT_TEXT : 0 ) |
+           ( vma->f_extract ? OUT_EXTRACT : 0 ) |
+           ( vma->f_scanning ? OUT_SCAN : 0 );
+}
+
+/*
+|| Writes the line end (if converting) and flushes the record
+*/
+static SPECIALIZE int
+putline( VMA *vma, const int of )
+{
+    if( of & OUT_TEXT )
+    {
+#if defined( _WIN32 )
+        if( !put( vma, '\r' ) )
+        {
+            return FALSE;
+        }
+#endif
+        if( !put( vma, '\n' ) )
+        {
+            return FALSE;
+        }
+    }
     
+    return put( vma, UINT_MAX );
+}
+
+/*
+|| Handles an EOR code.  Returns 1 to keep going, 0 at end-of-file and
+|| -1 on error.
+*/
+static SPECIALIZE int
+puteor( VMA *vma, const int of )
+{
     /*
-    || Intialize tables
+    || Track number of times we've seen the EOR code
     */
-    s2init( vma );
+    vma->eor++;
     
     /*
-    || Retrieve and remember the first code
+    || Variable records:
+    || First means end-of-record...second one means end-of-file
+    ||
+    || Fixed records:
+    || First means end-of-file
     */
-    slastcode = getcode( vma );
-    if( slastcode == USHRT_MAX )
+    if( vma->eor > 1 || ( of & OUT_FIXED ) )
     {
-        return seterr( VMAE_NEEDMORE );
+        if( !put( vma, UINT_MAX ) )
+        {
+            return -1;
+        }
+        
+        return 0;
     }
     
     /*
-    || Output the first code
+    || Append a line end if converting
     */
-    rc = putbyte( vma, slastcode );
-    if( rc < 0 )
+    if( !putline( vma, of ) )
     {
-        return seterr( VMAE_BADDATA );
+        return -1;
     }
     
-    /*
-    || EOF is okay at this point
-    */
-    if( rc == 0 )
-    {
-        return seterr( VMAE_NOERR );
-        return TRUE;
-    }
+    return 1;
+}
+
+/*
+|| Converts characters to output bytes.  Exactly one of "str" (codes)
+|| or "raw" (EBCDIC bytes) is given.
+*/
+static SPECIALIZE void
+xlate( VMA *vma,
+       uchar *out,
+       const unsigned short *str,
+       const uchar *raw,
+       size_t len,
+       const int of )
+{
+    size_t i;
     
-    while( TRUE )
+    if( str != NULL )
     {
-        lastcode = getcode( vma );
-        if( slastcode == USHRT_MAX )
+        for( i = 0; i < len; i++ )
         {
-            return seterr( VMAE_BADDATA );
+            out[ i ] = (uchar) ( str[ i ] - kodebcd );
         }
         
-        curr = &vma->s2strtab[ lastcode ];
-        prev = NULL;
-        do
+        if( ( of & OUT_TEXT ) )
         {
-            /*
-            || Drop down as far as possible along the leftmost path
-            */
-            do
-            {
-                next = curr->strleft;
-                curr->strleft = prev;
-                prev = curr;
-                curr = next;
-            } while( curr );
-            
-            /*
-            || We have hit the bottom
-            */
-            curr = prev;
-            prev = curr->strleft;
-            curr->strleft = next;
-            rc = putbyte( vma, curr->strchar );
-            if( rc < 0 )
+            xlate_buf( vma->e2a_map, out, out, len );
+        }
+    }
+    else if( ( of & OUT_TEXT ) )
+    {
+        xlate_buf( vma->e2a_map, out, raw, len );
+    }
+    else
+    {
+        memcpy( out, raw, len );
+    }
+    
+    return;
+}
+
+/*
+|| Looks for anything that isn't text in the first 1024 bytes written.
+|| Must be called before "bytesout" is advanced past "buf".
+*/
+static void
+sniff( VMA *vma, const uchar *buf, size_t len )
+{
+    size_t i;
+    
+    if( vma->bytesout >= 1024 )
+    {
+        return;
+    }
+    
+    if( len > 1024 - vma->bytesout )
+    {
+        len = 1024 - vma->bytesout;
+    }
+    
+    for( i = 0; i < len; i++ )
+    {
+        if( buf[ i ] < 0x20 )
+        {
+            if( buf[ i ] != '\t' && buf[ i ] != '\r' && buf[ i ] != '\n' )
             {
-                return seterr( VMAE_BADDATA );
+                vma->dtype = VMAD_BINARY;
             }
-            
-            /*
-            || Done...
-            */
-            if( rc == 0 )
+        }
+    }
+    
+    return;
+}
+
+/*
+|| Writes a run of characters that all belong to the current record
+*/
+static SPECIALIZE int
+putchars( VMA *vma, const unsigned short *str, const uchar *raw, size_t len, const int of )
+{
+    uchar tmp[ 1024 ];
+    uchar *out;
+    size_t n;
+    
+    /*
+    || When not extracting, only the bytes that get sniffed matter
+    */
+    if( !( of & OUT_EXTRACT ) )
+    {
+        if( vma->bytesout < 1024 )
+        {
+            n = 1024 - vma->bytesout;
+            if( n > len )
             {
-                return seterr( VMAE_NOERR );
+                n = len;
             }
             
-            /*
-            || Retrace path up looking for the first unexplored right
-            || path
-            */
-            while( TRUE )
+            xlate( vma, tmp, str, raw, n, of );
+            sniff( vma, tmp, n );
+        }
+        
+        vma->bytesout += len;
+        
+        return TRUE;
+    }
+    
+    /*
+    || Make sure we don't overflow
+    */
+    if( vma->omax - vma->opos < len )
+    {
+        seterr( VMAE_OOVER );
+        return FALSE;
+    }
+    
+    /*
+    || Store the characters
+    */
+    out = &vma->obuf[ vma->opos ];
+    xlate( vma, out, str, raw, len, of );
+    sniff( vma, out, len );
+    
+    vma->bytesout += len;
+    vma->opos += len;
+    
+    return TRUE;
+}
+
+/*
+|| Writes a run of characters (no EORs), splitting it into records when
+|| the RECFM is fixed since we don't receive an EOR code for them.
+*/
+static SPECIALIZE int
+putrun( VMA *vma, const unsigned short *str, const uchar *raw, size_t len, const int of )
+{
+    size_t n;
+    
+    while( len > 0 )
+    {
+        n = len;
+        
+        if( ( of & OUT_FIXED ) )
+        {
+            if( vma->recbytes == (size_t) vma->lrecl )
             {
-                next = curr;
-                curr = prev;
-                
-                /*
-                || Reached the root
-                */
-                if( !curr )
-                {
-                    break;
-                }
+                vma->recbytes = 0;
                 
-                /*
-                || Have another right side to traverse
-                */
-                if( !curr->visited )
+                if( !putline( vma, of ) )
                 {
-                    prev = curr->strleft;
-                    curr->strleft = next;
-                    
-                    next = curr->strright;
-                    curr->strright = prev;
-                    
-                    curr->visited = TRUE;
-                    
-                    prev = curr;
-                    curr = next;
-                    break;
+                    return FALSE;
                 }
-                
-                /*
-                || Move back up a level
-                */
-                curr->visited = FALSE;
-                prev = curr->strright;
-                curr->strright = next;
             }
-        } while( curr );
+            
+            if( vma->recbytes < (size_t) vma->lrecl &&
+                n > vma->lrecl - vma->recbytes )
+            {
+                n = vma->lrecl - vma->recbytes;
+            }
+            
+            vma->recbytes += n;
+        }
         
-        /*
-        || Extend string table with new entry
-        */
-        s2addnew( vma, slastcode, lastcode );
-        slastcode = lastcode;
+        if( !putchars( vma, str, raw, n, of ) )
+        {
+            return FALSE;
+        }
+        
+        if( str != NULL )
+        {
+            str += n;
+        }
+        else
+        {
+            raw += n;
+        }
+        len -= n;
     }
     
-    return seterr( VMAE_NOERR );
+    return TRUE;
 }
 
-/* --------------------------------------------------------------------
-|| ASIS stuff
+/*
+|| Writes a decoded string.  Returns 1 to keep going, 0 when the
+|| end-of-file (or scanning limit) is reached and -1 on error.
 */
-static int
-extract_asis( VMA *vma )
+static SPECIALIZE int
+putcodes( VMA *vma, const unsigned short *str, size_t len, const int of )
 {
-    int lrecl;
-    unsigned int h;
-    unsigned int l;
+    size_t n;
+    int rc;
     
-    while( TRUE )
+    while( len > 0 )
     {
         /*
-        || Get the reccord length
+        || Handle special codes (only EOR)
         */
-        h = get( vma );
-        if( h == EOF )
-        {
-            break;
-        }
-        
-        l = get( vma );
-        if( l == EOF )
+        if( *str < kodebcd )
         {
-            return seterr( VMAE_NEEDMORE );
+            rc = puteor( vma, of );
+            if( rc <= 0 )
+            {
+                return rc;
+            }
+            
+            str++;
+            len--;
+            continue;
         }
         
         /*
-        || Reconstruct lrecl
+        || Reset EOR counter
         */
-        lrecl = ( h << 8 ) + l;
+        vma->eor = 0;
         
         /*
-        || Done when we get a zero LRECL
+        || Bail out if we're scanning and have hit our limit
         */
-        if( lrecl == 0 )
+        if( ( of & OUT_SCAN ) && vma->bytesin >= 1024 )
         {
-            break;
+            return 0;
         }
         
         /*
-        || Copy input to output
+        || Everything up to the next EOR
         */
-        while( lrecl-- )
+        for( n = 1; n < len && str[ n ] >= kodebcd; n++ )
         {
-            l = get( vma );
-            if( l == EOF )
-            {
-                return seterr( VMAE_NEEDMORE );
-            }
-            
-            if( putbyte( vma, l + kodebcd ) < 0 )
-            {
-                return seterr( VMAE_WERR );
-            }
         }
         
-        /*
-        || Force EOR for variable files only
-        */
-        if( vma->recfm == 'V' )
+        if( !putrun( vma, str, NULL, n, of ) )
         {
-            if( putbyte( vma, 0 ) < 0 )
-            {
-                return seterr( VMAE_WERR );
-            }
+            return -1;
         }
+        
+        str += n;
+        len -= n;
     }
     
+    return 1;
+}
+
+/* --------------------------------------------------------------------
+|| 12 bit code input
+||
+|| Codes are packed two to every three bytes.  Whole groups are
+|| unpacked from the input buffer ahead of time and handed out one at a
+|| time.  "bytesin" is counted per code, exactly as if the bytes were
+|| still read one at a time.  unget_codes() gives back the input for
+|| any codes that weren't used.
+*/
+#if defined( HAVE_CPU_DISPATCH )
+__attribute__(( target( "ssse3" ) ))
+static size_t
+unpack_ssse3( unsigned short *out, const uchar *in, size_t groups )
+{
+    const __m128i shuf = _mm_setr_epi8( 1, 0, 2, 1, 4, 3, 5, 4,
+                                        7, 6, 8, 7, 10, 9, 11, 10 );
+    const __m128i mask = _mm_set1_epi16( 0x0fff );
+    const __m128i even = _mm_set1_epi32( 0x0000ffff );
+    __m128i v;
+    size_t done;
+    
     /*
-    || Force EOF
+    || Four groups at a time, but 16 bytes are loaded to get their 12
     */
-    if( putbyte( vma, 0 ) < 0 )
+    for( done = 0; groups - done >= 6; done += 4 )
     {
-        return seterr( VMAE_WERR );
+        v = _mm_shuffle_epi8( _mm_loadu_si128( (const __m128i *) in ),
+                              shuf );
+        v = _mm_or_si128( _mm_and_si128( even, _mm_srli_epi16( v, 4 ) ),
+                          _mm_andnot_si128( even, _mm_and_si128( v, mask ) ) );
+        _mm_storeu_si128( (__m128i *) out, v );
+        
+        in += 12;
+        out += 8;
     }
     
-    return seterr( VMAE_NOERR );;
+    return done;
 }
+#endif
 
+/*
+|| Unpacks as many whole groups as the input buffer holds
+*/
 static int
-extract( VMA *vma )
+unpack_codes( VMA *vma )
 {
-    int rc;
+    unsigned short *out = vma->cd->codes;
+    const uchar *in;
+    size_t groups;
+    size_t g;
+    
+    vma->codepos = 0;
+    vma->codecnt = 0;
     
     /*
-    || Get properly positioned
+    || Finish off a split group (or the end of the input) the slow way
     */
-    if( fseek( vma->in, vma->active->dataoff, SEEK_SET ) != 0 )
+    if( vma->residual != UINT_MAX || !fill( vma, 3 ) )
     {
-        seterr( VMAE_SEEK );
         return FALSE;
     }
     
-    /*
-    || Cache RECFM and LRECL
-    */
-    vma->recfm = vma->active->sf.recfm;
-    vma->lrecl = vma->active->sf.lrecl;
-    
-    /*
-    || Reset various counters and I/O controls
-    */
-    vma->ibufp = 0;
-    vma->icnt = 0;
-    vma->bytesin = 0;
-    vma->bytesout = 0;
-    vma->residual = UINT_MAX;
-    vma->recbytes = 0;
-    vma->eor = 0;
-    vma->dtype = VMAD_TEXT;    /* assume text for now*/
-    
-    /*
-    || Extract based on storage type
-    */
-    if( vma->active->flags & HF_ASIS )
+    groups = vma->icnt / 3;
+    if( groups > CODEBUF / 2 )
     {
-        rc = ( extract_asis( vma ) == VMAE_NOERR );
+        groups = CODEBUF / 2;
     }
-    else if ( vma->active->flags & HF_S2 )
+    in = vma->iptr;
+    
+    g = 0;
+#if defined( HAVE_CPU_DISPATCH )
+    if( groups >= 6 && __builtin_cpu_supports( "ssse3" ) )
     {
-        rc = ( extract_s2( vma ) == VMAE_NOERR );
+        g = unpack_ssse3( out, in, groups );
     }
-    else
+#endif
+    
+    for( ; g < groups; g++ )
     {
-        rc = ( extract_lzw( vma ) == VMAE_NOERR );
+        out[ g * 2 ] = ( in[ g * 3 ] << 4 ) | ( in[ g * 3 + 1 ] >> 4 );
+        out[ g * 2 + 1 ] = ( ( in[ g * 3 + 1 ] & 0x0f ) << 8 ) |
+                           in[ g * 3 + 2 ];
     }
     
-    if( rc )
+    vma->iptr += groups * 3;
+    vma->icnt -= groups * 3;
+    vma->codecnt = groups * 2;
+    
+    return TRUE;
+}
+
+/*
+|| Puts the input for unused codes back so the input position is right
+*/
+static void
+unget_codes( VMA *vma )
+{
+    size_t left = vma->codecnt - vma->codepos;
+    size_t back;
+    
+    if( left > 0 )
     {
-        if( vma->active->sf.dtype == VMAD_UNKNOWN )
+        /*
+        || Stopping half way through a group leaves its middle byte as
+        || the residual
+        */
+        if( vma->codepos & 1 )
         {
-            vma->active->sf.dtype = vma->dtype;
+            back = 1 + ( left - 1 ) / 2 * 3;
+            vma->residual = vma->iptr[ -(long) back - 1 ];
         }
-        
-        if( !vma->f_scanning )
+        else
         {
-            vma->active->sf.compressed = vma->bytesin;
-            vma->active->sf.uncompressed = vma->bytesout;
+            back = left / 2 * 3;
         }
+        
+        vma->iptr -= back;
+        vma->icnt += back;
     }
     
-    return rc;
+    vma->codepos = 0;
+    vma->codecnt = 0;
+    
+    return;
 }
 
-/* --------------------------------------------------------------------
-|| Convert decimal byte to binary
+/*
+|| Reads a code a byte at a time
 */
-static int
-cvb( int dec )
+static unsigned short
+getcode_slow( VMA *vma )
 {
-    int bin;
+    unsigned int code;
     
     /*
-    || Mask out any unwanteds...shouldn't be any
+    || Always need to read as least one byte
     */
-    dec &= 0xff;
+    code = get( vma );
+    if( code == EOF )
+    {
+        return USHRT_MAX;
+    }
     
     /*
-    || Get the "tens" digit
+    || Use what's left over from previous call
     */
-    bin = ( dec >> 4 ) * 10;
+    if( vma->residual != UINT_MAX )
+    {
+        code |= ( vma->residual << 8 );
+        vma->residual = UINT_MAX;
+    }
+    else
+    {
+        /*
+        || Get the low 4 bits of the 12 bit code
+        */
+        vma->residual = get( vma );
+        if( vma->residual == EOF )
+        {
+            return USHRT_MAX;
+        }
+        
+        /*
+        || And put it where it belongs
+        */
+        code = ( code << 4 ) | ( vma->residual >> 4 );
+    }
     
     /*
-    || And add in the "ones" digit
+    || Always returns a 12 bit code
     */
-    bin += ( dec & 0x0f );
-    
-    return bin;
+    return code & 0xfff;
 }
 
-/* --------------------------------------------------------------------
-|| Convert binary to decimal byte
+/*
+|| Returns the next code or USHRT_MAX at the end of the input
 */
-static int
-cvd( int bin )
+static unsigned short
+getcode( VMA *vma )
 {
-    int dec;
-    
-    /*
-    || Mask out any unwanteds...shouldn't be any
-    */
-    bin &= 0xff;
-    
-    /*
-    || Set the "tens" digit
-    */
-    dec = ( bin / 10 ) << 4;
+    if( vma->codepos == vma->codecnt && !unpack_codes( vma ) )
+    {
+        return getcode_slow( vma );
+    }
     
     /*
-    || Set the "ones" digit
+    || The first code of a group uses two bytes and the second one
     */
-    dec |= bin % 10;
+    vma->bytesin += 2 - ( vma->codepos & 1 );
     
-    return dec;
+    return vma->cd->codes[ vma->codepos++ ];
 }
 
 /* --------------------------------------------------------------------
-||
+|| LZW Decompression
 */
-static FILE *
-open_exclusive( VMA *vma, const char *name, int mode )
+static unsigned int
+lzwslot( unsigned int key )
 {
-    FILE *file;
-    struct stat st;
-    int fd;
+    return ( ( key * 2654435761U ) & 0xffffffff ) >> ( 32 - LZWHBITS );
+}
+
+/*
+|| Drops a key from the hash table, moving back any later keys in its
+|| run that couldn't otherwise be found
+*/
+static void
+lzwunhash( VMA *vma, unsigned int key )
+{
+    unsigned int *keys = vma->cd->lzwhkey;
+    unsigned int i;
+    unsigned int j;
+    unsigned int h;
     
-    /*
-    || Set default mode bits
-    */
-    if( mode == 0 )
+    for( i = lzwslot( key ); keys[ i ] != key; i = ( i + 1 ) & ( LZWHSIZE - 1 ) )
     {
-        st.st_mode = PERMS;
     }
     
-    /*
-    || Open the file for exclusive use
-    */
-    fd = open( name, O_CREAT | O_EXCL | O_RDWR | O_BINARY, mode );
-    if( fd < 0 )
+    for( j = ( i + 1 ) & ( LZWHSIZE - 1 ); keys[ j ] != LZWHFREE; j = ( j + 1 ) & ( LZWHSIZE - 1 ) )
     {
-        return NULL;
+        /*
+        || Leave it if it lives between the hole and where it is
+        */
+        h = lzwslot( keys[ j ] );
+        if( i < j ? ( h > i && h <= j ) : ( h > i || h <= j ) )
+        {
+            continue;
+        }
+        
+        keys[ i ] = keys[ j ];
+        vma->cd->lzwhent[ i ] = vma->cd->lzwhent[ j ];
+        i = j;
     }
     
-    /*
-    || Associate with a stream
-    */
-    file = fdopen( fd, "r+b" );
-    if( file == NULL )
-    {
-        close( fd );
-        return NULL;
-    }
+    keys[ i ] = LZWHFREE;
     
-    return file;
+    return;
 }
 
-/* --------------------------------------------------------------------
-||
-*/
 static int
-open_temp( VMA *vma )
+lookup( VMA *vma, unsigned short lastpred, unsigned short nextchar, unsigned short *ent )
 {
-    char sfx[] = ".XXXXXX" ;
-    struct stat st;
-   
+    LZWSTRING *tab = vma->cd->lzwstrtab;
+    unsigned short *refs = vma->cd->lzwrefcnt;
+    unsigned int *keys = vma->cd->lzwhkey;
+    unsigned int key;
+    unsigned int h;
+    unsigned short i;
+    int wrapped;
+    
     /*
-    || Nothing to do if it's already open
+    || Single characters are always there
     */
-    if( vma->tfile != NULL )
+    if( lastpred == LZWNONE )
     {
-        return seterr( VMAE_NOERR );
+        *ent = nextchar;
+        return TRUE;
     }
     
     /*
-    || Allocate memory for the name
+    || Search hash table for (predecessor,character) combination.
     */
-    vma->tname = malloc( strlen( vma->vname ) + sizeof( sfx ) );
-    if( vma->tname == NULL )
+    key = ( (unsigned int) lastpred << 9 ) | nextchar;
+    for( h = lzwslot( key ); keys[ h ] != LZWHFREE; h = ( h + 1 ) & ( LZWHSIZE - 1 ) )
     {
-        return seterr( VMAE_MEM );
+        if( keys[ h ] == key )
+        {
+            /* found it*/
+            *ent = vma->cd->lzwhent[ h ];
+            return TRUE;
+        }
     }
     
     /*
-    || Build the name
+    || Desired entry not found.  Add it if possible.
     */
-    strcpy( vma->tname, vma->vname );
-    strcat( vma->tname, sfx );
-    if( mktemp( vma->tname ) == NULL )
+    
+    /*
+    || Bump reference count of previous predecessor
+    */
+    refs[ lastpred ]++;
+    
+    /*
+    || Search for free entry until end of table is reached
+    */
+    wrapped = 0;
+    i = vma->lzwtabp;
+    do
     {
-        return seterr( VMAE_MEM );
-    }
+        /*
+        || Bump to next table entry
+        */
+        ++i;
+        
+        /*
+        || Reached the end of the table?
+        */
+        if( i > vma->lzwtabl )
+        {
+            /*
+            || Get out if we've been here before
+            */
+            if( wrapped )
+            {
+                break;
+            }
+            
+            wrapped = 1;
+            i = vma->lzwtabs;
+        }
+    } while( refs[ i ] != 0 );
+    vma->lzwtabp = i;
     
     /*
-    || Build the name
+    || If we hit the KwKwK case, then don't add this entry
+    || to the table. (big flower box in VMARC source)
     */
-    if( !vma->vfile || fstat( fileno( vma->vfile ), &st ) != 0 )
+    if( i > vma->lzwtabl )
     {
-        st.st_mode = PERMS;
+        refs[ lastpred ]--;
+        
+        /*
+        || Indicate it wasn't found
+        */
+        *ent = lastpred;
+        return FALSE;
     }
     
     /*
-    || And open the file for exclusive use
+    || Remove entry from the hash table and its prefix's count
     */
-    vma->tfile = open_exclusive( vma, vma->tname, st.st_mode );
-    if( vma->tfile == NULL )
+    if( tab[ i ].pred != LZWNONE )
     {
-        return seterr( VMAE_TOPEN );
+        lzwunhash( vma, ( (unsigned int) tab[ i ].pred << 9 ) | tab[ i ].schar );
+        refs[ tab[ i ].pred ]--;
+        
+        /*
+        || Anything moved may have taken the free slot
+        */
+        for( h = lzwslot( key ); keys[ h ] != LZWHFREE; h = ( h + 1 ) & ( LZWHSIZE - 1 ) )
+        {
+        }
     }
     
-    return seterr( VMAE_NOERR );
+    /*
+    || Add it to its new home in the prefix chain
+    */
+    tab[ i ].pred = lastpred;
+    tab[ i ].schar = nextchar;
+    refs[ i ] = 0;
+    
+    /*
+    || And in the hash table
+    */
+    keys[ h ] = key;
+    vma->cd->lzwhent[ h ] = i;
+    
+    /*
+    || Return entry
+    */
+    *ent = i;
+    return FALSE;
 }
 
-/* --------------------------------------------------------------------
-||
-*/
-static int
-write_trailer( VMA *vma, FILE *f )
+static void
+lzwinit( VMA *vma )
 {
-    long pos;
+    unsigned short ndx;
     
     /*
-    || Get the current position
+    || Clear the prefix table (an unused entry has no prefix)
     */
-    pos = ftell( f );
-    if( pos == -1 )
+    memset( vma->cd->lzwrefcnt, 0, sizeof( vma->cd->lzwrefcnt ) );
+    for( ndx = 0; ndx <= TABSIZE; ndx++ )
     {
-        return seterr( VMAE_WERR );
+        vma->cd->lzwstrtab[ ndx ].pred = LZWNONE;
+        vma->cd->lzwstrtab[ ndx ].schar = 0;
     }
     
     /*
-    || And pad to a multiple of 80, but don't fall into the classic
-    || trap of writing 80 nulls when we have a complete card.
+    || Initialize the hash table
     */
-    pos %= 80;
-    for( pos = (pos ? 80 - pos : 0 ) ; pos > 0; pos-- )
+    memset( vma->cd->lzwhkey, 0xff, sizeof( vma->cd->lzwhkey ) );
+    
+    /*
+    || Preload the specials plus 256 EBCDIC characters, which lookup()
+    || finds without the hash table
+    */
+    for( ndx = 0; ndx < kodmax + 1; ndx++ )
     {
-        if( fputc( 0, f ) == EOF )
-        {
-            return seterr( VMAE_WERR );
-        }
+        vma->cd->lzwstrtab[ ndx ].schar = ndx;
+        vma->cd->lzwrefcnt[ ndx ] = 1;
     }
     
-    return seterr( VMAE_NOERR );
+    /*
+    || Set wrap-around point
+    */
+    vma->lzwtabs = kodmax + 1;
+    vma->lzwtabl = TABSIZE - 1;
+    vma->lzwtabp = kodmax;
+    
+    return;
 }
 
 /* --------------------------------------------------------------------
+|| Decodes an LZW subfile
 ||
+|| Decoded strings are laid end to end in vma->cd->hist.  A new entry is
+|| always the previous string plus the first character of the next, so
+|| it starts where the previous string does and can simply be copied
+|| from there.  Strings that have been pushed out of the history are
+|| rebuilt back to front from the flat code table.  Entry reuse and the
+|| KwKwK case follow the original pointer based decoder exactly.
 */
-static int
-write_header( VMA *vma, FILE *f, PSUBFILE *psf )
+static void
+start_lzw( VMA *vma )
 {
-    char *p;
-    int i;
+    LZWCODE *tab = vma->cd->lzwcodes;
+    unsigned short *refs = vma->cd->lzwrefs;
+    unsigned short i;
     
     /*
-    || Build the subfile header
+    || Preload the specials plus 256 EBCDIC characters
     */
-    vma->head[ H_VER ] = psf->sf.ver;
-    vma->head[ H_REL ] = psf->sf.rel;
-    
-    for( p = psf->sf.fn, i = 0; i < 8; i++ )
-    {
-        vma->head[ H_FN + i ] = *p ? TO_E_SYS( *p++ ) : TO_E_SYS( ' ' );
-    }
-    
-    for( p = psf->sf.ft, i = 0; i < 8; i++ )
+    for( i = 0; i <= kodmax; i++ )
     {
-        vma->head[ H_FT + i ] = *p ? TO_E_SYS( *p++ ) : TO_E_SYS( ' ' );
+        tab[ i ].pred = LZWROOT;
+        tab[ i ].schar = i;
+        tab[ i ].first = i;
+        tab[ i ].len = 1;
+        refs[ i ] = 1;
+        tab[ i ].pos = NOPOS;
     }
     
-    for( p = psf->sf.fm, i = 0; i < 2; i++ )
+    for( ; i <= TABSIZE; i++ )
     {
-        vma->head[ H_FM + i ] = *p ? TO_E_SYS( *p++ ) : TO_E_SYS( ' ' );
+        tab[ i ].pred = LZWUNDEF;
+        tab[ i ].schar = 0;
+        tab[ i ].first = 0;
+        tab[ i ].len = 0;
+        refs[ i ] = 0;
+        tab[ i ].pos = NOPOS;
     }
     
-    vma->head[ H_FLAGS ] = psf->flags;
+    /*
+    || The first entry is pending before any codes have been read
+    */
+    vma->pend = kodmax + 1;
+    tab[ vma->pend ].pred = LZWROOT;
+    tab[ vma->pend ].len = 1;
+    vma->last = kodmax;
+    vma->hpos = 0;
     
-    vma->head[ H_LRECL ] = ( psf->sf.lrecl >> 8 ) & 0xff;
-    vma->head[ H_LRECL + 1 ] = psf->sf.lrecl & 0xff;
+    return;
+}
+
+/*
+|| Decodes until the end of the subfile or until the output asks for a
+|| pause, in which case the state is saved and PAUSED returned.
+*/
+static SPECIALIZE int
+decode_lzw( VMA *vma, const int of )
+{
+    LZWCODE *tab = vma->cd->lzwcodes;
+    unsigned short *refs = vma->cd->lzwrefs;
+    unsigned short *str;
+    unsigned int hpos = vma->hpos;
+    unsigned short code;
+    unsigned short pend = vma->pend;
+    unsigned short last = vma->last;
+    unsigned short len;
+    unsigned short i;
+    int wrapped;
+    int rc;
     
-    i = psf->sf.year - 1900;
-    if( i >= 100 )
+    while( TRUE )
     {
-        vma->head[ H_FLAGS ] |= HF_Y2K;
-        i -= 100;
-    }
-    vma->head[ H_YEAR ] = cvd( i );
-    
-    vma->head[ H_MONTH ] = cvd( psf->sf.month );
-    vma->head[ H_DAY ] = cvd( psf->sf.day );
-    vma->head[ H_HOUR ] = cvd( psf->sf.hour );
-    vma->head[ H_MINUTE ] = cvd( psf->sf.minute );
-    vma->head[ H_SECOND ] = cvd( psf->sf.second );
-    vma->head[ H_RECFM ] = TO_E_SYS( psf->sf.recfm );
+        if( vma->f_pause )
+        {
+            vma->hpos = hpos;
+            vma->pend = pend;
+            vma->last = last;
+            
+            return PAUSED;
+        }
+        
+        /*
+        || Get the next code
+        */
+        code = getcode( vma );
+        if( code == USHRT_MAX )
+        {
+            return seterr( VMAE_BADDATA );
+        }
+        
+        /*
+        || Protect against corrupt hives
+        */
+        if( tab[ code ].pred == LZWUNDEF )
+        {
+            return seterr( VMAE_BADDATA );
+        }
+        
+        /*
+        || The pending entry ends with the first character of this
+        || string.  Must be set first in case this is that entry.
+        */
+        tab[ pend ].schar = tab[ code ].first;
+        
+        /*
+        || Start over at the front of the history when it fills up,
+        || forgetting where the older strings were
+        */
+        len = tab[ code ].len;
+        if( hpos + len > HISTLEN )
+        {
+            for( i = 0; i <= TABSIZE; i++ )
+            {
+                tab[ i ].pos = NOPOS;
+            }
+            hpos = 0;
+        }
+        str = &vma->cd->hist[ hpos ];
+        
+        /*
+        || Copy the string from its last appearance.  The pending entry's
+        || last character hasn't been output yet (KwKwK).
+        */
+        if( tab[ code ].pos != NOPOS )
+        {
+            if( code == pend )
+            {
+                memcpy( str,
+                        &vma->cd->hist[ tab[ code ].pos ],
+                        ( len - 1 ) * sizeof( *str ) );
+                str[ len - 1 ] = tab[ code ].schar;
+            }
+            else
+            {
+                memcpy( str,
+                        &vma->cd->hist[ tab[ code ].pos ],
+                        len * sizeof( *str ) );
+            }
+        }
+        
+        /*
+        || Otherwise fill it in from the end
+        */
+        else
+        {
+            for( i = code; i != LZWROOT; i = tab[ i ].pred )
+            {
+                str[ tab[ i ].len - 1 ] = tab[ i ].schar;
+            }
+        }
+        tab[ code ].pos = hpos;
+        hpos += len;
+        
+        /*
+        || Output the characters
+        */
+        rc = putcodes( vma, str, len, of );
+        if( rc == 0 )
+        {
+            return seterr( VMAE_NOERR );
+        }
+        if( rc < 0 )
+        {
+            return vma->lasterr;        /* write error or overflow */
+        }
+        
+        /*
+        || Start building follow-on entry for this code.
+        */
+        refs[ code ]++;
+        
+        /*
+        || Search for free entry until end of table is reached
+        */
+        wrapped = FALSE;
+        i = last;
+        do
+        {
+            /*
+            || Bump to next table entry
+            */
+            ++i;
+            
+            /*
+            || Reached the end of the table?
+            */
+            if( i > TABSIZE - 1 )
+            {
+                /*
+                || Get out if we've been here before
+                */
+                if( wrapped )
+                {
+                    break;
+                }
+                
+                wrapped = TRUE;
+                i = kodmax + 1;
+            }
+        } while( refs[ i ] );
+        
+        /*
+        || If we hit the KwKwK case, then don't add this entry
+        || to the table. (big flower box in VMARC source)
+        */
+        if( i > TABSIZE - 1 )
+        {
+            refs[ code ]--;
+            pend = TABSIZE;
+            continue;
+        }
+        
+        /*
+        || Add the new entry
+        */
+        if( tab[ i ].pred != LZWROOT && tab[ i ].pred != LZWUNDEF )
+        {
+            refs[ tab[ i ].pred ]--;
+        }
+        
+        tab[ i ].pred = code;
+        tab[ i ].first = tab[ code ].first;
+        tab[ i ].len = tab[ code ].len + 1;
+        tab[ i ].pos = tab[ code ].pos;
+        
+        /*
+        || Remember for next round
+        */
+        last = i;
+        pend = i;
+    }
+    
+    return seterr( VMAE_NOERR );
+}
+
+/* --------------------------------------------------------------------
+|| S2 Decompression
+||
+|| Each table entry is either a single character or a pair of entries
+|| whose strings are concatenated.  Strings are expanded into the shared
+|| history buffer, and an entry remembers where its string last appeared
+|| so it can be copied from there the next time.  A new entry is usually
+|| the last two strings, which are already next to each other.  Entries
+|| forget their position when s2addnew() reuses them.
+||
+|| s2addnew() returns the entry it built, or S2NONE if the string would
+|| have been too long.
+*/
+static unsigned short
+s2addnew( VMA *vma, unsigned short slastcode, unsigned short lastcode  )
+{
+    STRDSECT *tab = vma->cd->s2strtab;
+    STRLINKS *links = vma->cd->s2links;
+    unsigned short left;
+    unsigned short right;
+    unsigned short probe;
+    unsigned short ostr;
+    unsigned short *psib;
     
     /*
-    || Write the header ID
+    || Find string table entries for the left and right substrings
     */
-    if( fwrite( hid, 1, 8, f ) != 8 || ferror( f ) )
+    left = slastcode;
+    right = lastcode;
+    
+    /*
+    || Would string be longer with buffer?
+    */
+    if( ( tab[ left ].strlen + tab[ right ].strlen ) > ( TABSIZE - 2 ) )
     {
-        return seterr( VMAE_WERR );
+        return S2NONE;
+    }
+    
+    links[ left ].strcount++;
+    links[ right ].strcount++;
+    
+    /*
+    || Find a place for the new string
+    */
+    probe = vma->s2tabp;
+    do
+    {
+        probe++;
+        if( probe > vma->s2tabl )
+        {
+            probe = vma->s2tabs;
+        }
+    } while( links[ probe ].strcount != 0 );
+    
+    /*
+    || Replace an old string entry with this new one
+    */
+    ostr = tab[ probe ].strleft;
+    if( ostr != S2NONE )
+    {
+        links[ ostr ].strcount--;
+        
+        psib = &links[ ostr ].stroffsp;
+        while( *psib != probe )
+        {
+            psib = &links[ *psib ].strsiblg;
+        }
+        *psib = links[ probe ].strsiblg;
+        
+        ostr = tab[ probe ].strright;
+        links[ ostr ].strcount--;
     }
     
     /*
-    || Write the header
+    || Now construct a new entry for this string
     */
-    if( fwrite( vma->head, 1, H_DLEN, f ) != H_DLEN || ferror( f ) )
+    if( right == vma->s2tabp )
     {
-        return seterr( VMAE_WERR );
+        if( left == tab[ right ].strleft )
+        {
+            ostr = right;
+            right = left;
+            left = ostr;
+        }
     }
     
+    tab[ probe ].strleft = left;
+    tab[ probe ].strright = right;
+    tab[ probe ].strlen = 2 + tab[ left ].strlen + tab[ right ].strlen;
+    tab[ probe ].strnchar = tab[ left ].strnchar + tab[ right ].strnchar;
+    
     /*
-    || Remember the data offset
+    || The string is already in the history if the halves are adjacent
     */
-    psf->dataofftmp = ftell( f );
-    if( psf->dataofftmp < 0 )
+    if( tab[ left ].strpos != NOPOS &&
+        tab[ right ].strpos == tab[ left ].strpos + tab[ left ].strnchar )
     {
-        return seterr( VMAE_WERR );
+        tab[ probe ].strpos = tab[ left ].strpos;
+    }
+    else
+    {
+        tab[ probe ].strpos = NOPOS;
+    }
+    
+    /*
+    || Insert new node into offspring/sibling list of left substring,
+    || ahead of the previous new node or else at the end
+    */
+    psib = &links[ left ].stroffsp;
+    while( *psib != S2NONE && *psib != vma->s2tabp )
+    {
+        psib = &links[ *psib ].strsiblg;
+    }
+    
+    links[ probe ].strsiblg = *psib;
+    *psib = probe;
+    vma->s2tabp = probe;
+    
+    return probe;
+}
+
+static void
+s2init( VMA *vma )
+{
+    unsigned short ndx;
+    
+    memset( &vma->cd->s2buf, 0, sizeof( vma->cd->s2buf ) );
+    
+    vma->s2tabs = kodmax + 1;
+    vma->s2tabl = TABSIZE;
+    vma->s2tabp = vma->s2tabl;
+    
+    for( ndx = 0; ndx <= TABSIZE; ndx++ )
+    {
+        vma->cd->s2strtab[ ndx ].strleft = S2NONE;
+        vma->cd->s2strtab[ ndx ].strright = S2NONE;
+        vma->cd->s2strtab[ ndx ].strnchar = 1;
+        vma->cd->s2strtab[ ndx ].strlen = 0;
+        vma->cd->s2strtab[ ndx ].strpos = NOPOS;
+        vma->cd->s2links[ ndx ].strsiblg = S2NONE;
+        vma->cd->s2links[ ndx ].stroffsp = S2NONE;
+        vma->cd->s2links[ ndx ].strcount = ( ndx <= kodmax ? 1 : 0 );
     }
+    
+    return;
+}
 
+static void
+start_s2( VMA *vma )
+{
     /*
-    || Prevent modification of certain header fields
+    || Intialize tables
     */
-    psf->locked = TRUE;
+    s2init( vma );
+    vma->hpos = 0;
+    vma->started = FALSE;
     
-    return seterr( VMAE_NOERR );
+    return;
 }
 
-/* --------------------------------------------------------------------
-||
+/*
+|| Decodes until the end of the subfile or until the output asks for a
+|| pause, in which case the state is saved and PAUSED returned.
 */
-static int
-add_asis( VMA *vma, FILE *f, int mode )
+static SPECIALIZE int
+decode_s2( VMA *vma, const int of )
 {
-    unsigned char *buf = vma->ibuf;
-    size_t len;
-    size_t i;
+    STRDSECT *tab = vma->cd->s2strtab;
+    STRDSECT *curr;
+    STRDSECT *ent;
+    unsigned short stack[ TABSIZE ];
+    unsigned short c;
+    unsigned short *str;
+    unsigned short *out;
+    unsigned int hpos = vma->hpos;
+    unsigned short slastcode = vma->last;
+    unsigned short lastcode;
+    unsigned short len;
+    unsigned short i;
+    int depth;
+    int rc;
     
-    if( vma->recfm == VMAR_FIXED )
+    if( !vma->started )
     {
-        len = vma->lrecl;
+        vma->started = TRUE;
         
-        while( !feof( f ) && !ferror( f ) )
+        /*
+        || Retrieve and remember the first code
+        */
+        slastcode = getcode( vma );
+        if( slastcode == USHRT_MAX )
         {
-            i = fread( buf, 1, len, f );
-            if( i == 0 )
+            return seterr( VMAE_NEEDMORE );
+        }
+        
+        /*
+        || Output the first code
+        */
+        rc = putcodes( vma, &slastcode, 1, of );
+        if( rc < 0 )
+        {
+            return vma->lasterr;        /* write error or overflow */
+        }
+        
+        /*
+        || EOF is okay at this point
+        */
+        if( rc == 0 )
+        {
+            return seterr( VMAE_NOERR );
+        }
+    }
+    
+    while( TRUE )
+    {
+        if( vma->f_pause )
+        {
+            vma->hpos = hpos;
+            vma->last = slastcode;
+            
+            return PAUSED;
+        }
+        
+        lastcode = getcode( vma );
+        if( lastcode == USHRT_MAX )
+        {
+            return seterr( VMAE_BADDATA );
+        }
+        
+        ent = &tab[ lastcode ];
+        len = ent->strnchar;
+        
+        /*
+        || Start over at the front of the history when it fills up,
+        || forgetting where the older strings were
+        */
+        if( hpos + len > HISTLEN )
+        {
+            for( i = 0; i <= TABSIZE; i++ )
             {
-                break;
+                tab[ i ].strpos = NOPOS;
             }
+            hpos = 0;
+        }
+        str = &vma->cd->hist[ hpos ];
+        
+        /*
+        || Expand the string left to right, copying any substring that
+        || can still be found in the history
+        */
+        out = str;
+        stack[ 0 ] = lastcode;
+        depth = 1;
+        while( depth > 0 )
+        {
+            c = stack[ --depth ];
+            curr = &tab[ c ];
             
-            vma->bytesin += i;
-            
-            if( fputc( ( i >> 8 ) & 0xff, vma->tfile ) == EOF )
+            if( curr->strleft == S2NONE )
             {
-                seterr( VMAE_WERR );
-                goto error;
-            }
-            
-            vma->bytesout++;
-            
-            if( fputc( i & 0xff, vma->tfile ) == EOF )
-            {
-                seterr( VMAE_WERR );
-                goto error;
-            }
-            
-            vma->bytesout++;
-            
-            if( mode == VMAX_BINARY )
-            {
-                if( fwrite( buf, 1, i, vma->tfile ) != i )
-                {
-                    seterr( VMAE_WERR );
-                    goto error;
-                }
-            }
-            else
-            {
-                size_t j;
-                for( j = 0; j < i; j++ )
-                {
-                    if( fputc( TO_E_USR( buf[ j ] ), vma->tfile ) == EOF )
-                    {
-                        seterr( VMAE_WERR );
-                        goto error;
-                    }
-                }
-            }
-            
-            vma->bytesout += i;
-        }
-    }
-    else
-    {
-        len = ( mode == VMAX_BINARY ? vma->lrecl : 0 );
-        i = 0;
-        while( !feof( f ) && !ferror( f ) )
-        {
-            int c = fgetc( f );
-            
-            if( c == EOF )
-            {
-                break;
+                *out++ = ( c <= kodmax ? c : kodendr ); /* unused entry */
             }
-            
-            vma->bytesin++;
-            
-            if( mode == VMAX_BINARY )
+            else if( curr->strpos != NOPOS )
             {
-                if( i == len )
-                {
-                    if( fputc( ( i >> 8 ) & 0xff, vma->tfile ) == EOF )
-                    {
-                        seterr( VMAE_WERR );
-                        goto error;
-                    }
-                    
-                    vma->bytesout++;
-                    
-                    if( fputc( i & 0xff, vma->tfile ) == EOF )
-                    {
-                        seterr( VMAE_WERR );
-                        goto error;
-                    }
-                    
-                    vma->bytesout++;
-                    
-                    if( fwrite( buf, 1, i, vma->tfile ) != i )
-                    {
-                        seterr( VMAE_WERR );
-                        goto error;
-                    }
-                    
-                    vma->bytesout += i;
-                    
-                    i = 0;
-                }
-                
-                buf[ i++ ] = c;
+                memcpy( out,
+                        &vma->cd->hist[ curr->strpos ],
+                        curr->strnchar * sizeof( *out ) );
+                out += curr->strnchar;
             }
             else
             {
-                switch( c )
-                {
-                    case '\r':
-                        break;
-                        
-                    case '\n':
-                        /*
-                        || CMS doesn't like zero length records, so insert
-                        || a blank
-                        */
-                        if( i == 0 )
-                        {
-                            buf[ i++ ] = TO_E_USR( ' ' );
-                        }
-                        
-                        if( fputc( ( i >> 8 ) & 0xff, vma->tfile ) == EOF )
-                        {
-                            seterr( VMAE_WERR );
-                            goto error;
-                        }
-                        
-                        vma->bytesout++;
-                        
-                        if( fputc( i & 0xff, vma->tfile ) == EOF )
-                        {
-                            seterr( VMAE_WERR );
-                            goto error;
-                        }
-                        
-                        vma->bytesout++;
-                        
-                        if( fwrite( buf, 1, i, vma->tfile ) != i )
-                        {
-                            seterr( VMAE_WERR );
-                            goto error;
-                        }
-                        
-                        vma->bytesout += i;
-                        
-                        if( i > len )
-                        {
-                            len = i;
-                        }
-                        
-                        i = 0;
-                        break;
-                        
-                    default:
-                        if( i > (size_t) vma->lrecl )
-                        {
-                            seterr( VMAE_LRECL );
-                            goto error;
-                        }
-                        
-                        buf[ i++ ] = TO_E_USR( c );
-                        break;
-                }
+                stack[ depth++ ] = curr->strright;
+                stack[ depth++ ] = curr->strleft;
             }
         }
+        ent->strpos = hpos;
+        hpos += len;
         
-        if( i > 0 )
+        /*
+        || Output the characters
+        */
+        rc = putcodes( vma, str, len, of );
+        if( rc < 0 )
         {
-            if( fputc( ( i >> 8 ) & 0xff, vma->tfile ) == EOF )
-            {
-                seterr( VMAE_WERR );
-                goto error;
-            }
-            
-            vma->bytesout++;
-            
-            if( fputc( i & 0xff, vma->tfile ) == EOF )
-            {
-                seterr( VMAE_WERR );
-                goto error;
-            }
-            
-            vma->bytesout++;
-            
-            if( fwrite( buf, 1, i, vma->tfile ) != i )
-            {
-                seterr( VMAE_WERR );
-                goto error;
-            }
-            
-            vma->bytesout += i;
+            return vma->lasterr;        /* write error or overflow */
         }
         
-        if( i > len )
+        /*
+        || Done...
+        */
+        if( rc == 0 )
         {
-            len = i;
+            return seterr( VMAE_NOERR );
         }
+        
+        /*
+        || Extend string table with new entry
+        */
+        s2addnew( vma, slastcode, lastcode );
+        slastcode = lastcode;
     }
     
-    if( ferror( f ) )
+    return seterr( VMAE_NOERR );
+}
+
+/* --------------------------------------------------------------------
+|| ASIS stuff
+*/
+#if defined( HAVE_MMAP )
+/*
+|| Binary ASIS output is just the records laid end to end, so when the
+|| archive is mapped they're written straight from the map.  The
+|| record lengths are all checked first and anything out of the
+|| ordinary (truncated data or a variable record longer than the output
+|| buffer) is left to the regular path so it fails the same way.
+|| Returns FALSE if the regular path should be used.
+*/
+static int
+copy_asis( VMA *vma )
+{
+    const uchar *p = vma->iptr;
+    const uchar *end = vma->iptr + vma->icnt;
+    size_t lrecl;
+    size_t n;
+    
+    if( !vma->imap || vma->f_text || vma->f_scanning || vma->f_stream )
     {
-        seterr( VMAE_RERR );
-        goto error;
+        return FALSE;
+    }
+    
+    if( vma->recfm != 'V' && ( vma->recfm != 'F' || vma->lrecl <= 0 ) )
+    {
+        return FALSE;
     }
     
     /*
-    || Write end of file...0 record length
+    || Check all of the record lengths
     */
-    if( fputc( 0, vma->tfile ) == EOF )
+    while( p < end )
     {
-        seterr( VMAE_WERR );
-        goto error;
+        if( end - p < 2 )
+        {
+            return FALSE;
+        }
+        
+        lrecl = ( p[ 0 ] << 8 ) + p[ 1 ];
+        p += 2;
+        
+        if( lrecl == 0 )
+        {
+            break;
+        }
+        
+        if( (size_t) ( end - p ) < lrecl ||
+            ( vma->recfm == 'V' && lrecl > vma->omax ) )
+        {
+            return FALSE;
+        }
+        p += lrecl;
     }
+    end = p;
     
-    vma->bytesout++;
-    
-    if( fputc( 0, vma->tfile ) == EOF )
+    /*
+    || And copy them
+    */
+    for( p = vma->iptr; p < end; p += lrecl )
     {
-        seterr( VMAE_WERR );
-        goto error;
+        lrecl = ( p[ 0 ] << 8 ) + p[ 1 ];
+        p += 2;
+        
+        if( vma->bytesout < 1024 )
+        {
+            sniff( vma, p, lrecl );
+        }
+        
+        if( vma->f_extract && lrecl > 0 )
+        {
+            if( !vma->owrite( vma, p, lrecl ) )
+            {
+                seterr( VMAE_WERR );
+                return TRUE;
+            }
+        }
+        
+        vma->bytesout += lrecl;
     }
     
-    vma->bytesout++;
-    
-    vma->omax = len;
+    n = end - vma->iptr;
+    vma->bytesin += n;
+    vma->iptr += n;
+    vma->icnt -= n;
     
     seterr( VMAE_NOERR );
     
-error:
-    
-    return vma->lasterr;
+    return TRUE;
 }
+#endif
 
-/* --------------------------------------------------------------------
-||
-*/
-static int
-getbyte( VMA *vma, FILE *f, int *pc )
+static SPECIALIZE int
+decode_asis( VMA *vma, const int of )
 {
-    int c;
+    int lrecl;
+    unsigned int h;
+    unsigned int l;
+    size_t n;
+    size_t cnt;
     
-    if( vma->eor )
+#if defined( HAVE_MMAP )
+    if( copy_asis( vma ) )
     {
-        vma->eor = 0;
-        vma->recbytes = 0;
-        
-        *pc = kodendr;
-        
-        return seterr( VMAE_NOERR );
+        return vma->lasterr;
     }
+#endif
     
     while( TRUE )
     {
+        if( vma->f_pause )
+        {
+            return PAUSED;
+        }
+        
         /*
-        || Need to refill the buffer?
+        || Get the reccord length
         */
-        if( vma->icnt == 0 )
+        h = get( vma );
+        if( h == EOF )
         {
-            /*
-            || Check for EOF
-            */
-            if( feof( f ) )
-            {
-                *pc = EOF;
-                
-                return seterr( VMAE_NOERR );
-            }
-            
-            /*
-            || Remember file position corresponding to start of buffer
-            */
-            vma->ipos = ftell( f );
-            
-            /*
-            || Read a buffers worth
-            */
-            vma->icnt = fread( &vma->ibuf[ UNREAD ], 1, BUFLEN, f );
-            
-            /*
-            || Check for errors...defer EOF check for later
-            */
-            if( ferror( f ) )
-            {
-                *pc = EOF;
-                return seterr( VMAE_RERR );
-            }
-            
-            /*
-            || Reset buffer position
-            */
-            vma->ibufp = UNREAD;
+            break;
         }
         
-        /*
-        || Get next character
-        */
-        c = vma->ibuf[ vma->ibufp++ ];
+        l = get( vma );
+        if( l == EOF )
+        {
+            return seterr( VMAE_NEEDMORE );
+        }
         
         /*
-        || Track # of bytes read...resets at start of subfile extraction
+        || Reconstruct lrecl
         */
-        vma->bytesin++;
+        lrecl = ( h << 8 ) + l;
         
         /*
-        || One less byte in the buffer
+        || Done when we get a zero LRECL
         */
-        vma->icnt--;
+        if( lrecl == 0 )
+        {
+            break;
+        }
         
         /*
-        || Handle text conversion
+        || Copy input to output, as much as is buffered at a time
         */
-        if( vma->f_text )
+        while( lrecl > 0 )
         {
-            /*
-            || Ignore
-            */
-            if( c == '\r' )
+            if( !fill( vma, 1 ) )
             {
-                continue;
+                return seterr( VMAE_NEEDMORE );
             }
             
-            if( c == '\n' )
+            n = vma->icnt;
+            if( n > (size_t) lrecl )
             {
-                /*
-                || CMS doesn't like zero length records, so insert
-                || a blank and trick the next getbyte() call into
-                || returning an end of record code.
-                */
-                if( vma->recbytes == 0 )
-                {
-                    c = ' ';
-                    vma->eor = 1;
-                }
-                else
+                n = lrecl;
+            }
+            
+            /*
+            || When scanning, only what was read before the limit counts
+            */
+            cnt = n;
+            if( ( of & OUT_SCAN ) )
+            {
+                cnt = ( vma->bytesin < 1023 ? 1023 - vma->bytesin : 0 );
+                if( cnt > n )
                 {
-                    vma->recbytes = 0;
-                    
-                    *pc = kodendr;
-                    
-                    return seterr( VMAE_NOERR );
+                    cnt = n;
                 }
             }
             
-            c = TO_E_USR( c );
+            vma->bytesin += n;
+            vma->eor = 0;
+            
+            if( !putrun( vma, NULL, vma->iptr, cnt, of ) )
+            {
+                return seterr( VMAE_WERR );
+            }
+            
+            vma->iptr += n;
+            vma->icnt -= n;
+            lrecl -= n;
         }
         
         /*
-        || Always exit loop
+        || Force EOR for variable files only
         */
-        break;
+        if( vma->recfm == 'V' )
+        {
+            if( puteor( vma, of ) < 0 )
+            {
+                return seterr( VMAE_WERR );
+            }
+        }
     }
     
     /*
-    || Track # of bytes in the record
-    */
-    vma->recbytes++;
-    
-    /*
-    || And maximum record length
+    || Force EOF
     */
-    if( vma->recbytes > vma->omax )
+    if( puteor( vma, of ) < 0 )
     {
-        vma->omax = vma->recbytes;
+        return seterr( VMAE_WERR );
     }
     
-    /*
-    || Convert to coded EBCDIC
-    */
-    *pc = c + kodebcd;
-    
-    return seterr( VMAE_NOERR );
+    return seterr( VMAE_NOERR );;
 }
 
 /* --------------------------------------------------------------------
+|| Decoder instances.  Extraction gets one per RECFM and conversion,
+|| and anything else (sizing, scanning) uses one that checks the flags
+|| as it goes.  Indexed by the output flags without OUT_SCAN.
+*/
+#define DECODERS( name, decode )                                        \
+static int name##_any( VMA *vma ) { return decode( vma, out_flavor( vma ) ); } \
+static int name##_vb( VMA *vma ) { return decode( vma, OUT_EXTRACT ); } \
+static int name##_fb( VMA *vma ) { return decode( vma, OUT_EXTRACT | OUT_FIXED ); } \
+static int name##_vt( VMA *vma ) { return decode( vma, OUT_EXTRACT | OUT_TEXT ); } \
+static int name##_ft( VMA *vma ) { return decode( vma, OUT_EXTRACT | OUT_FIXED | OUT_TEXT ); } \
+static int ( *const name[ 8 ] )( VMA * ) =                              \
+{                                                                       \
+    name##_any, name##_any, name##_any, name##_any,                     \
+    name##_vb, name##_fb, name##_vt, name##_ft                          \
+};
+
+DECODERS( lzw_decoders, decode_lzw )
+DECODERS( s2_decoders, decode_s2 )
+DECODERS( asis_decoders, decode_asis )
+
+#if defined( HAVE_THREADS )
+/* --------------------------------------------------------------------
+|| Parallel LZW
 ||
+|| Only building the string table is really sequential.  A big subfile
+|| is decoded a window of codes at a time in three passes.  First the
+|| table is run forward just as decode_lzw() does, but instead of
+|| building strings it notes which version of an entry each code names.
+|| A version never changes once its last character is known, so after
+|| that any thread can read them.  A running total of the lengths then
+|| gives every code's place in the output, and finally the strings are
+|| expanded by a thread per processor, each copying from where a string
+|| already appeared in its own share or else rebuilding it from its
+|| prefixes.  The window then goes through the usual output path.
+*/
+#define PARMIN      ( 16 * 1024 * 1024 ) /* smallest subfile to split */
+#define PARCODES    ( 1024 * 1024 )     /* most codes in a window    */
+#define PAROUT      ( 8 * 1024 * 1024 ) /* most output in a window   */
+#define NONODE      UINT_MAX            /* no prefix version         */
+
+#define NODE_EOR    0x01                /* string has an EOR         */
+#define NODE_EOF    0x02                /* and two in a row          */
+
+typedef struct lzwnode
+{
+    unsigned int pred;                  /* prefix version or NONODE  */
+    unsigned int pos;                   /* offset in window or NOPOS */
+    unsigned short len;                 /* length of string          */
+    unsigned short first;               /* first character           */
+    unsigned short schar;               /* last character            */
+    unsigned short eor;                 /* NODE_EOR and NODE_EOF     */
+} LZWNODE;
+
+typedef struct lzwpar
+{
+    LZWNODE *nodes;                     /* versions named in window  */
+    LZWNODE *base;                      /* versions at window start  */
+    unsigned int cur[ TABSIZE + 1 ];    /* current version of entry  */
+    unsigned int *occ;                  /* version each code names   */
+    unsigned int *offs;                 /* where each code's string goes */
+    unsigned short *out;                /* expanded window           */
+} LZWPAR;
+
+typedef struct lzwpart
+{
+    LZWPAR *par;                        /* window being expanded     */
+    size_t k0;                          /* first code of this share  */
+    size_t k1;                          /* and just past the last    */
+} LZWPART;
+
+/*
+|| Whether the active subfile is worth splitting.  One that hasn't been
+|| sized is judged by where the next one starts.
 */
 static int
-putcode( VMA *vma, unsigned short code )
+use_parlzw( VMA *vma )
 {
-    if( code == USHRT_MAX )
+    PSUBFILE *psf = vma->active;
+    PSUBFILE *next;
+    size_t len = 0;
+    int sized;
+    
+    if( !( vma->flags & VMAO_PARDECODE ) || !vma->f_extract || vma->f_stream ||
+        ( psf->flags & ( HF_ASIS | HF_S2 ) ) )
     {
-        if( vma->residual != UINT_MAX )
-        {
-            if( fputc( vma->residual, vma->tfile ) == EOF )
-            {
-                return seterr( VMAE_WERR );
-            }
-            
-            vma->bytesout++;
-        }
-        
-        return seterr( VMAE_NOERR );
+        return FALSE;
     }
     
-    code &= 0xfff;
+    lock_shared( vma );
+    sized = psf->sized;
+    if( sized )
+    {
+        len = psf->sf.compressed;
+    }
+    unlock_shared( vma );
     
-    if( vma->residual == UINT_MAX )
+    if( !sized && !psf->temp )
     {
-        vma->residual = ( code & 0x0f ) << 12;
-        if( fputc( code >> 4, vma->tfile ) == EOF )
+        for( next = psf->next; next != NULL && next->temp; next = next->next )
         {
-            return seterr( VMAE_WERR );
         }
         
-        vma->bytesout++;
-    }
-    else
-    {
-        code |= vma->residual;
-        vma->residual = UINT_MAX;
-        
-        if( fputc( code >> 8, vma->tfile ) == EOF )
+        if( next != NULL && next->dataoff > psf->dataoff )
         {
-            return seterr( VMAE_WERR );
+            len = next->dataoff - psf->dataoff;
         }
-        
-        vma->bytesout++;
-        
-        if( fputc( code & 0xff, vma->tfile ) == EOF )
+        else if( next == NULL && vma->vmaplen > psf->dataoff )
         {
-            return seterr( VMAE_WERR );
+            len = vma->vmaplen - psf->dataoff;
         }
-        
-        vma->bytesout++;
     }
     
-    return seterr( VMAE_NOERR );
+    return ( len >= PARMIN && cpus() > 1 );
 }
 
-/* --------------------------------------------------------------------
-||
+/*
+|| Fills in a version's last character, which isn't known until the
+|| next code is read
 */
-static int
-add_lzw( VMA *vma, FILE *f, int mode )
+static void
+node_done( LZWNODE *nodes, unsigned int n, unsigned short c )
 {
-    LZWSTRING *lastpred;
-    LZWSTRING *ent;
-    unsigned short code;
-    int c;
+    LZWNODE *nd = &nodes[ n ];
     
-    /*
-    || Initialize
-    */
-    lzwinit( vma );
+    nd->schar = c;
+    nd->eor = 0;
     
-    lastpred = ENDCHAIN;
-    if( getbyte( vma, f, &c ) != VMAE_NOERR )
+    if( nd->pred != NONODE )
     {
-        return vma->lasterr;
+        nd->eor = nodes[ nd->pred ].eor;
     }
     
-    while( c != EOF )
+    if( c == kodendr )
     {
-        if( lookup( vma, lastpred, c, &ent ) )
+        nd->eor |= NODE_EOR;
+        
+        if( nd->pred != NONODE && nodes[ nd->pred ].schar == kodendr )
         {
-            lastpred = ent;
-            if( getbyte( vma, f, &c ) != VMAE_NOERR )
+            nd->eor |= NODE_EOF;
+        }
+    }
+    
+    return;
+}
+
+/*
+|| Expands one thread's share of the window
+*/
+static void *
+lzw_expand( void *arg )
+{
+    LZWPART *pt = (LZWPART *) arg;
+    LZWPAR *par = pt->par;
+    const LZWNODE *nodes = par->nodes;
+    const LZWNODE *nd;
+    unsigned short *dst;
+    unsigned short *src;
+    unsigned int lo = par->offs[ pt->k0 ];
+    unsigned int n;
+    unsigned int i;
+    size_t k;
+    
+    for( k = pt->k0; k < pt->k1; k++ )
+    {
+        nd = &nodes[ par->occ[ k ] ];
+        dst = &par->out[ par->offs[ k ] ];
+        
+        /*
+        || Copy it if this share already has it (KwKwK overlaps itself)
+        */
+        if( nd->pos != NOPOS && nd->pos >= lo )
+        {
+            src = &par->out[ nd->pos ];
+            
+            if( nd->pos + nd->len <= par->offs[ k ] )
             {
-                return vma->lasterr;
+                memcpy( dst, src, nd->len * sizeof( *dst ) );
+            }
+            else
+            {
+                for( i = 0; i < nd->len; i++ )
+                {
+                    dst[ i ] = src[ i ];
+                }
             }
-            continue;
         }
         
-        code = (unsigned short) ( lastpred - vma->lzwstrtab );
-        if( putcode( vma, code ) != VMAE_NOERR )
+        /*
+        || Otherwise fill it in from the end
+        */
+        else
         {
-            return vma->lasterr;
+            for( n = par->occ[ k ]; n != NONODE; n = nodes[ n ].pred )
+            {
+                dst[ nodes[ n ].len - 1 ] = nodes[ n ].schar;
+            }
         }
-        lastpred = ENDCHAIN;
     }
     
-    if( ferror( f ) )
-    {
-        return seterr( VMAE_RERR );
-    }
+    return NULL;
+}
+
+/*
+|| Decodes the whole subfile a window at a time.  Falls back to the
+|| regular decoder if the memory can't be had.
+*/
+static int
+lzw_parallel( VMA *vma )
+{
+    LZWCODE *tab = vma->cd->lzwcodes;
+    unsigned short *refs = vma->cd->lzwrefs;
+    LZWPAR *par;
+    LZWNODE *nd;
+    LZWPART parts[ MAXTHREADS ];
+    void *args[ MAXTHREADS ];
+    unsigned int total;
+    unsigned int nnodes;
+    unsigned int n;
+    unsigned short code;
+    unsigned short pend = vma->pend;
+    unsigned short last = vma->last;
+    unsigned short prev = kodebcd;
+    unsigned short i;
+    size_t k;
+    size_t lo;
+    size_t hi;
+    int of = out_flavor( vma );
+    int nthr = cpus();
+    int wrapped;
+    int eof;
+    int rc;
+    int t;
     
-    code = (unsigned short) ( lastpred - vma->lzwstrtab );
-    if( putcode( vma, code ) != VMAE_NOERR )
+    par = (LZWPAR *) calloc( 1, sizeof( LZWPAR ) );
+    if( par != NULL )
     {
-        return vma->lasterr;
+        par->nodes = (LZWNODE *) malloc( ( TABSIZE + 1 + PARCODES ) * sizeof( LZWNODE ) );
+        par->base = (LZWNODE *) malloc( ( TABSIZE + 1 ) * sizeof( LZWNODE ) );
+        par->occ = (unsigned int *) malloc( PARCODES * sizeof( unsigned int ) );
+        par->offs = (unsigned int *) malloc( ( PARCODES + 1 ) * sizeof( unsigned int ) );
+        par->out = (unsigned short *) malloc( ( PAROUT + TABSIZE ) * sizeof( unsigned short ) );
     }
     
-    if( putcode( vma, kodendr ) != VMAE_NOERR )
+    if( par == NULL || par->nodes == NULL || par->base == NULL ||
+        par->occ == NULL || par->offs == NULL || par->out == NULL )
     {
-        return vma->lasterr;
+        if( par != NULL )
+        {
+            free( par->nodes );
+            free( par->base );
+            free( par->occ );
+            free( par->offs );
+            free( par->out );
+            free( par );
+        }
+        
+        return lzw_decoders[ of & ~OUT_SCAN ]( vma );
     }
     
-    if( putcode( vma, USHRT_MAX ) != VMAE_NOERR )
+    /*
+    || The first window starts from the freshly loaded table
+    */
+    for( n = 0; n <= TABSIZE; n++ )
     {
-        return vma->lasterr;
+        nd = &par->nodes[ n ];
+        nd->pred = ( tab[ n ].pred <= TABSIZE ? tab[ n ].pred : NONODE );
+        nd->pos = NOPOS;
+        nd->len = tab[ n ].len;
+        nd->first = tab[ n ].first;
+        nd->schar = tab[ n ].schar;
+        nd->eor = ( n <= kodmax && tab[ n ].schar == kodendr ? NODE_EOR : 0 );
+        par->cur[ n ] = n;
     }
     
-    return seterr( VMAE_NOERR );
-}
-
-
-/* --------------------------------------------------------------------
-|| Searches for the next header (There HAS to be a better way!)
-||
-|| If you can think of way to do this better, PLEASE let me know.
-*/
-static int
-locate_file( VMA *vma )
-{
-    unsigned int byte;
-    int cnt;
-    int ndx;
-    int isascii = FALSE;
-    
-    while( TRUE )
+    eof = FALSE;
+    rc = VMAE_NOERR;
+    while( rc == VMAE_NOERR && !eof )
     {
-        ndx = 0;
-        while( ndx < sizeof( hid ) - 1 )
+        /*
+        || Pass 1:  run the table forward
+        */
+        nnodes = TABSIZE + 1;
+        total = 0;
+        for( k = 0; k < PARCODES && total < PAROUT; k++ )
         {
-            byte = get( vma );
-            if( byte == EOF )
+            code = getcode( vma );
+            if( code == USHRT_MAX || tab[ code ].pred == LZWUNDEF )
             {
-                return FALSE;
+                rc = VMAE_BADDATA;
+                break;
             }
             
-            if( byte == hid[ ndx ] )
-            {
-                ndx++;
-            }
-            else if( byte == aid[ ndx ] )
-            {
-                ndx++;
-                isascii = TRUE;
-            }
-            else if( byte == hid[ 0 ] )
-            {
-                ndx = 1;
-            }
-            else if( byte == aid[ 0 ] )
-            {
-                ndx = 1;
-                isascii = TRUE;
-            }
-            else
-            {
-                isascii = FALSE;
-                ndx = 0;
-            }
-        }
-        
-        if( isascii )
-        {
-            seterr( VMAE_ASCII );
-            return FALSE;
-        }
-        
-        cnt = 0;
-        do
-        {
             /*
-            || Retrieve the creation version
+            || The pending entry ends with the first character of this
+            || string.  Must be set first in case this is that entry.
             */
-            byte = get( vma );
-            if( byte == EOF )
-            {
-                return FALSE;
-            }
-            vma->head[ cnt++ ] = byte;
-            
-            /*
-            || Verify
-            */
-            if( byte != 1 )
-            {
-                break;
-            }
+            tab[ pend ].schar = tab[ code ].first;
+            node_done( par->nodes, par->cur[ pend ], tab[ code ].first );
             
-            /*
-            || Retrieve the creation release
-            */
-            byte = get( vma );
-            if( byte == EOF )
-            {
-                return 0;
-            }
-            vma->head[ cnt++ ] = byte;
+            n = par->cur[ code ];
+            nd = &par->nodes[ n ];
+            par->occ[ k ] = n;
+            par->offs[ k ] = total;
+            total += nd->len;
             
             /*
-            || Verify
+            || Stop right where the output will end
             */
-            if( byte > 2 )
+            if( ( of & OUT_FIXED ) ?
+                ( nd->eor & NODE_EOR ) :
+                ( ( nd->eor & NODE_EOF ) || ( prev == kodendr && nd->first == kodendr ) ) )
             {
+                eof = TRUE;
+                k++;
                 break;
             }
+            prev = nd->schar;
             
             /*
-            || Retrieve the file name
-            */
-            for( ndx = 0; ndx < 8; ndx++ )
-            {
-                byte = get( vma );
-                if( byte == EOF )
-                {
-                    return FALSE;
-                }
-                
-                vma->head[ cnt ] = TO_A_SYS( byte );
-                if( !isprint( vma->head[ cnt++ ] ) )
-                {
-                    break;
-                }
-            }
-            
-            /*
-            || Verify
+            || Start building follow-on entry for this code, exactly as
+            || decode_lzw() does
             */
-            if( ndx != 8 )
-            {
-                break;
-            }
+            refs[ code ]++;
             
-            /*
-            || Retrieve the file type
-            */
-            for( ndx = 0; ndx < 8; ndx++ )
+            wrapped = FALSE;
+            i = last;
+            do
             {
-                byte = get( vma );
-                if( byte == EOF )
-                {
-                    return FALSE;
-                }
+                ++i;
                 
-                vma->head[ cnt ] = TO_A_SYS( byte );
-                if( !isprint( vma->head[ cnt++ ] ) )
+                if( i > TABSIZE - 1 )
                 {
-                    break;
+                    if( wrapped )
+                    {
+                        break;
+                    }
+                    
+                    wrapped = TRUE;
+                    i = kodmax + 1;
                 }
-            }
-            
-            /*
-            || Verify
-            */
-            if( ndx != 8 )
-            {
-                break;
-            }
-            
-            /*
-            || Retrieve the file mode
-            */
-            byte = get( vma );
-            if( byte == EOF )
-            {
-                return FALSE;
-            }
-            byte = TO_A_SYS( byte );
-            vma->head[ cnt++ ] = byte;
-            
-            /*
-            || Verify
-            */
-            if( !isalpha( byte ) )
-            {
-                break;
-            }
-            
-            /*
-            || Retrieve the file mode number
-            */
-            byte = get( vma );
-            if( byte == EOF )
-            {
-                return FALSE;
-            }
-            byte = TO_A_SYS( byte );
-            vma->head[ cnt++ ] = byte;
-            
-            /*
-            || Verify
-            */
-            if( byte < '0' || byte > '9' )
-            {
-                break;
-            }
-            
-            /*
-            || Retrieve the record length
-            */
-            byte = get( vma );
-            if( byte == EOF )
-            {
-                return FALSE;
-            }
-            vma->head[ cnt++ ] = byte;
-            
-            byte = get( vma );
-            if( byte == EOF )
-            {
-                return FALSE;
-            }
-            vma->head[ cnt++ ] = byte;
+            } while( refs[ i ] );
             
-            /*
-            || Retrieve the year
-            */
-            byte = get( vma );
-            if( byte == EOF )
-            {
-                return FALSE;
-            }
-            vma->head[ cnt++ ] = cvb( byte );
-            
-            /*
-            || Retrieve the month
-            */
-            byte = get( vma );
-            if( byte == EOF )
+            if( i > TABSIZE - 1 )
             {
-                return FALSE;
+                refs[ code ]--;
+                pend = TABSIZE;
+                continue;
             }
-            byte = cvb( byte );
-            vma->head[ cnt++ ] = byte;
             
-            /*
-            || Verify
-            */
-            if( byte < 1 || byte > 12 )
+            if( tab[ i ].pred != LZWROOT && tab[ i ].pred != LZWUNDEF )
             {
-                break;
+                refs[ tab[ i ].pred ]--;
             }
             
-            /*
-            || Retrieve the day
-            */
-            byte = get( vma );
-            if( byte == EOF )
-            {
-                return FALSE;
-            }
-            byte = cvb( byte );
-            vma->head[ cnt++ ] = byte;
+            tab[ i ].pred = code;
+            tab[ i ].first = tab[ code ].first;
+            tab[ i ].len = tab[ code ].len + 1;
             
             /*
-            || Verify
+            || The new version's string starts where this one does
             */
-            if( byte < 1 || byte > 31 )
-            {
-                break;
-            }
+            par->cur[ i ] = nnodes;
+            nd = &par->nodes[ nnodes++ ];
+            nd->pred = n;
+            nd->pos = par->offs[ k ];
+            nd->len = par->nodes[ n ].len + 1;
+            nd->first = par->nodes[ n ].first;
+            nd->schar = 0;
+            nd->eor = 0;
             
-            /*
-            || Retrieve the hour
-            */
-            byte = get( vma );
-            if( byte == EOF )
+            last = i;
+            pend = i;
+        }
+        par->offs[ k ] = total;
+        
+        /*
+        || Pass 2:  expand the strings, split by output size
+        */
+        if( nthr > 1 && k >= (size_t) nthr * 1024 )
+        {
+            for( t = 0, lo = 0; t < nthr; t++ )
             {
-                return FALSE;
+                hi = k;
+                if( t < nthr - 1 )
+                {
+                    size_t want = (size_t) total * ( t + 1 ) / nthr;
+                    size_t l = lo;
+                    
+                    while( l < hi )
+                    {
+                        size_t m = l + ( hi - l ) / 2;
+                        
+                        if( par->offs[ m ] < want )
+                        {
+                            l = m + 1;
+                        }
+                        else
+                        {
+                            hi = m;
+                        }
+                    }
+                    hi = l;
+                }
+                
+                parts[ t ].par = par;
+                parts[ t ].k0 = lo;
+                parts[ t ].k1 = hi;
+                args[ t ] = &parts[ t ];
+                lo = hi;
             }
-            byte = cvb( byte );
-            vma->head[ cnt++ ] = byte;
             
-            /*
-            || Verify
-            */
-            if( byte > 23 )
+            run_threads( lzw_expand, args, nthr );
+        }
+        else
+        {
+            parts[ 0 ].par = par;
+            parts[ 0 ].k0 = 0;
+            parts[ 0 ].k1 = k;
+            lzw_expand( &parts[ 0 ] );
+        }
+        
+        /*
+        || Pass 3:  output
+        */
+        if( total > 0 )
+        {
+            n = putcodes( vma, par->out, total, of );
+            if( n == 0 )
             {
                 break;
             }
             
-            /*
-            || Retrieve the minute
-            */
-            byte = get( vma );
-            if( byte == EOF )
-            {
-                return FALSE;
-            }
-            byte = cvb( byte );
-            vma->head[ cnt++ ] = byte;
-            
-            /*
-            || Verify
-            */
-            if( byte > 59 )
+            if( (int) n < 0 )
             {
+                rc = vma->lasterr;        /* write error or overflow */
                 break;
             }
+        }
+        
+        /*
+        || Carry the table's versions over to the next window
+        */
+        for( n = 0; n <= TABSIZE; n++ )
+        {
+            par->base[ n ] = par->nodes[ par->cur[ n ] ];
+            par->base[ n ].pred = ( tab[ n ].pred <= TABSIZE ? tab[ n ].pred : NONODE );
+            par->base[ n ].pos = NOPOS;
+            par->cur[ n ] = n;
+        }
+        memcpy( par->nodes, par->base, ( TABSIZE + 1 ) * sizeof( LZWNODE ) );
+    }
+    
+    free( par->nodes );
+    free( par->base );
+    free( par->occ );
+    free( par->offs );
+    free( par->out );
+    free( par );
+    
+    return seterr( rc );
+}
+#endif
 
-            /*
-            || Retrieve the second
-            */
-            byte = get( vma );
-            if( byte == EOF )
-            {
-                return FALSE;
-            }
-            byte = cvb( byte );
-            vma->head[ cnt++ ] = byte;
-            
-            /*
-            || Verify
-            */
-            if( byte > 59 )
-            {
-                break;
-            }
-            
-            /*
-            || Retrieve the record format
-            */
-            byte = get( vma );
-            if( byte == EOF )
-            {
-                return FALSE;
-            }
-            byte = TO_A_SYS( byte );
-            vma->head[ cnt++ ] = byte;
-            
-            /*
-            || Verify
-            */
-            if( byte != 'F' && byte != 'V' )
-            {
-                break;
-            }
-            
-            /*
-            || Retrieve the flags
-            */
-            byte = get( vma );
-            if( byte == EOF )
-            {
-                return FALSE;
-            }
-            vma->head[ cnt++ ] = byte;
-            
-            /*
-            || Verify
-            */
-            if( byte & ~( HF_S2 | HF_ASIS | HF_Y2K | HF_EXTH ) )
-            {
-                break;
+/* --------------------------------------------------------------------
+|| Extraction is split into three steps so a stream can run the
+|| decoder a piece at a time.  start_extract() positions the input and
+|| readies the decoder for the active subfile, run_extract() decodes
+|| until done (or paused) and end_extract() records what was learned.
+*/
+static int
+start_extract( VMA *vma )
+{
+    /*
+    || Get properly positioned
+    */
+    if( !seek_in( vma, vma->active->dataoff ) )
+    {
+        seterr( VMAE_SEEK );
+        return FALSE;
+    }
+    
+    /*
+    || Let the system know what we'll be reading next
+    */
+#if defined( HAVE_MMAP )
+    if( vma->imap )
+    {
+        size_t off = vma->active->dataoff & ~( (size_t) 4095 );
+        size_t len = 0;
+        
+        lock_shared( vma );
+        if( vma->active->sized )
+        {
+            len = vma->active->dataoff + vma->active->sf.compressed - off;
+        }
+        unlock_shared( vma );
+        
+        if( len != 0 )
+        {
+            posix_madvise( vma->vmap + off, len, POSIX_MADV_WILLNEED );
+        }
+    }
+#endif
+    
+    /*
+    || Cache RECFM and LRECL
+    */
+    vma->recfm = vma->active->sf.recfm;
+    vma->lrecl = vma->active->sf.lrecl;
+    
+    /*
+    || Reset various counters
+    */
+    vma->bytesin = 0;
+    vma->bytesout = 0;
+    vma->residual = UINT_MAX;
+    vma->codepos = 0;
+    vma->codecnt = 0;
+    vma->recbytes = 0;
+    vma->eor = 0;
+    vma->f_pause = FALSE;
+    vma->dtype = VMAD_TEXT;    /* assume text for now*/
+    
+    /*
+    || Ready the decoder
+    */
+    if( vma->active->flags & HF_ASIS )
+    {
+        vma->decode = asis_decoders[ out_flavor( vma ) & ~OUT_SCAN ];
+    }
+    else if ( vma->active->flags & HF_S2 )
+    {
+        start_s2( vma );
+        vma->decode = s2_decoders[ out_flavor( vma ) & ~OUT_SCAN ];
+    }
+    else
+    {
+        start_lzw( vma );
+        vma->decode = lzw_decoders[ out_flavor( vma ) & ~OUT_SCAN ];
+#if defined( HAVE_THREADS )
+        if( use_parlzw( vma ) )
+        {
+            vma->decode = lzw_parallel;
+        }
+#endif
+    }
+    
+    return TRUE;
+}
+
+static int
+run_extract( VMA *vma )
+{
+    /*
+    || Extract with the decoder picked for the subfile
+    */
+    return vma->decode( vma );
+}
+
+static int
+end_extract( VMA *vma, int rc )
+{
+    /*
+    || Leave the input just past the last code used
+    */
+    unget_codes( vma );
+    
+    if( rc )
+    {
+        lock_shared( vma );
+        
+        if( vma->active->sf.dtype == VMAD_UNKNOWN )
+        {
+            vma->active->sf.dtype = vma->dtype;
+        }
+        
+        /*
+        || Text counts include the line ends, so they're shown but never
+        || kept in the index
+        */
+        if( !vma->f_scanning )
+        {
+            vma->active->sf.compressed = vma->bytesin;
+            vma->active->sf.uncompressed = vma->bytesout;
+            vma->active->sized = TRUE;
+            vma->active->exact = !vma->f_text;
+        }
+        
+        unlock_shared( vma );
+    }
+    
+    return rc;
+}
+
+static int
+extract( VMA *vma )
+{
+    /*
+    || The decoder belongs to the stream while one is open
+    */
+    if( vma->f_stream )
+    {
+        seterr( VMAE_STREAM );
+        return FALSE;
+    }
+    
+    if( !start_extract( vma ) )
+    {
+        return FALSE;
+    }
+    
+    return end_extract( vma, run_extract( vma ) == VMAE_NOERR );
+}
+
+/* --------------------------------------------------------------------
+|| Retrieves the sizes and data type of a subfile that was skipped by
+|| a lazy open.  Doesn't disturb the active or retained subfile.
+*/
+static int
+size_subfile( VMA *vma, PSUBFILE *psf )
+{
+    PSUBFILE *active;
+    FILE *in;
+    char f_extract;
+    char f_text;
+    int sized;
+    int rc;
+    
+    /*
+    || Nothing to do if we already know
+    */
+    lock_shared( vma );
+    sized = psf->sized;
+    unlock_shared( vma );
+    
+    if( sized )
+    {
+        return seterr( VMAE_NOERR );
+    }
+    
+    /*
+    || Save the state we're about to change
+    */
+    active = vma->active;
+    in = vma->in;
+    f_extract = vma->f_extract;
+    f_text = vma->f_text;
+    
+    /*
+    || Perform a simulated extraction just like vma_open() does
+    */
+    vma->active = psf;
+    vma->in = ( psf->temp ? vma->tfile : vma->vfile );
+    vma->f_extract = FALSE;
+    vma->f_text = FALSE;
+    
+    seterr( VMAE_NOERR );
+    rc = extract( vma );
+    
+    /*
+    || Put everything back
+    */
+    vma->active = active;
+    vma->in = in;
+    vma->f_extract = f_extract;
+    vma->f_text = f_text;
+    
+    if( !rc )
+    {
+        return vma->lasterr;
+    }
+    
+    return seterr( VMAE_NOERR );
+}
+
+/* --------------------------------------------------------------------
+|| Convert decimal byte to binary
+*/
+static int
+cvb( int dec )
+{
+    int bin;
+    
+    /*
+    || Mask out any unwanteds...shouldn't be any
+    */
+    dec &= 0xff;
+    
+    /*
+    || Get the "tens" digit
+    */
+    bin = ( dec >> 4 ) * 10;
+    
+    /*
+    || And add in the "ones" digit
+    */
+    bin += ( dec & 0x0f );
+    
+    return bin;
+}
+
+/* --------------------------------------------------------------------
+|| Convert binary to decimal byte
+*/
+static int
+cvd( int bin )
+{
+    int dec;
+    
+    /*
+    || Mask out any unwanteds...shouldn't be any
+    */
+    bin &= 0xff;
+    
+    /*
+    || Set the "tens" digit
+    */
+    dec = ( bin / 10 ) << 4;
+    
+    /*
+    || Set the "ones" digit
+    */
+    dec |= bin % 10;
+    
+    return dec;
+}
+
+/* --------------------------------------------------------------------
+||
+*/
+static FILE *
+open_exclusive( VMA *vma, const char *name, int mode )
+{
+    FILE *file;
+    struct stat st;
+    int fd;
+    
+    /*
+    || Set default mode bits
+    */
+    if( mode == 0 )
+    {
+        st.st_mode = PERMS;
+    }
+    
+    /*
+    || Open the file for exclusive use
+    */
+    fd = open( name, O_CREAT | O_EXCL | O_RDWR | O_BINARY, mode );
+    if( fd < 0 )
+    {
+        return NULL;
+    }
+    
+    /*
+    || Associate with a stream
+    */
+    file = fdopen( fd, "r+b" );
+    if( file == NULL )
+    {
+        close( fd );
+        return NULL;
+    }
+    
+    return file;
+}
+
+/* --------------------------------------------------------------------
+||
+*/
+static int
+open_temp( VMA *vma )
+{
+    char sfx[] = ".XXXXXX" ;
+    struct stat st;
+   
+    /*
+    || Nothing to do if it's already open
+    */
+    if( vma->tfile != NULL )
+    {
+        return seterr( VMAE_NOERR );
+    }
+    
+    /*
+    || Allocate memory for the name
+    */
+    vma->tname = malloc( strlen( vma->vname ) + sizeof( sfx ) );
+    if( vma->tname == NULL )
+    {
+        return seterr( VMAE_MEM );
+    }
+    
+    /*
+    || Build the name
+    */
+    strcpy( vma->tname, vma->vname );
+    strcat( vma->tname, sfx );
+    if( mktemp( vma->tname ) == NULL )
+    {
+        return seterr( VMAE_MEM );
+    }
+    
+    /*
+    || Build the name
+    */
+    if( !vma->vfile || fstat( fileno( vma->vfile ), &st ) != 0 )
+    {
+        st.st_mode = PERMS;
+    }
+    
+    /*
+    || And open the file for exclusive use
+    */
+    vma->tfile = open_exclusive( vma, vma->tname, st.st_mode );
+    if( vma->tfile == NULL )
+    {
+        return seterr( VMAE_TOPEN );
+    }
+    
+    return seterr( VMAE_NOERR );
+}
+
+/* --------------------------------------------------------------------
+||
+*/
+static int
+write_trailer( VMA *vma, FILE *f )
+{
+    long pos;
+    
+    /*
+    || Get the current position
+    */
+    pos = ftell( f );
+    if( pos == -1 )
+    {
+        return seterr( VMAE_WERR );
+    }
+    
+    /*
+    || And pad to a multiple of 80, but don't fall into the classic
+    || trap of writing 80 nulls when we have a complete card.
+    */
+    pos %= 80;
+    for( pos = (pos ? 80 - pos : 0 ) ; pos > 0; pos-- )
+    {
+        if( fputc( 0, f ) == EOF )
+        {
+            return seterr( VMAE_WERR );
+        }
+    }
+    
+    return seterr( VMAE_NOERR );
+}
+
+/* --------------------------------------------------------------------
+||
+*/
+static int
+write_header( VMA *vma, FILE *f, PSUBFILE *psf )
+{
+    char *p;
+    int i;
+    
+    /*
+    || Build the subfile header
+    */
+    vma->head[ H_VER ] = psf->sf.ver;
+    vma->head[ H_REL ] = psf->sf.rel;
+    
+    for( p = psf->sf.fn, i = 0; i < 8; i++ )
+    {
+        vma->head[ H_FN + i ] = *p ? TO_E_SYS( *p++ ) : TO_E_SYS( ' ' );
+    }
+    
+    for( p = psf->sf.ft, i = 0; i < 8; i++ )
+    {
+        vma->head[ H_FT + i ] = *p ? TO_E_SYS( *p++ ) : TO_E_SYS( ' ' );
+    }
+    
+    for( p = psf->sf.fm, i = 0; i < 2; i++ )
+    {
+        vma->head[ H_FM + i ] = *p ? TO_E_SYS( *p++ ) : TO_E_SYS( ' ' );
+    }
+    
+    vma->head[ H_FLAGS ] = psf->flags;
+    
+    vma->head[ H_LRECL ] = ( psf->sf.lrecl >> 8 ) & 0xff;
+    vma->head[ H_LRECL + 1 ] = psf->sf.lrecl & 0xff;
+    
+    i = psf->sf.year - 1900;
+    if( i >= 100 )
+    {
+        vma->head[ H_FLAGS ] |= HF_Y2K;
+        i -= 100;
+    }
+    vma->head[ H_YEAR ] = cvd( i );
+    
+    vma->head[ H_MONTH ] = cvd( psf->sf.month );
+    vma->head[ H_DAY ] = cvd( psf->sf.day );
+    vma->head[ H_HOUR ] = cvd( psf->sf.hour );
+    vma->head[ H_MINUTE ] = cvd( psf->sf.minute );
+    vma->head[ H_SECOND ] = cvd( psf->sf.second );
+    vma->head[ H_RECFM ] = TO_E_SYS( psf->sf.recfm );
+    
+    /*
+    || Write the header ID
+    */
+    if( fwrite( hid, 1, 8, f ) != 8 || ferror( f ) )
+    {
+        return seterr( VMAE_WERR );
+    }
+    
+    /*
+    || Write the header
+    */
+    if( fwrite( vma->head, 1, H_DLEN, f ) != H_DLEN || ferror( f ) )
+    {
+        return seterr( VMAE_WERR );
+    }
+    
+    /*
+    || Remember the data offset
+    */
+    psf->dataofftmp = ftell( f );
+    if( psf->dataofftmp < 0 )
+    {
+        return seterr( VMAE_WERR );
+    }
+
+    /*
+    || Prevent modification of certain header fields
+    */
+    psf->locked = TRUE;
+    
+    return seterr( VMAE_NOERR );
+}
+
+/* --------------------------------------------------------------------
+||
+*/
+static int
+add_asis( VMA *vma, FILE *f, int mode )
+{
+    unsigned char *buf = vma->cd->ibuf;
+    size_t len;
+    size_t i;
+    
+    if( vma->recfm == VMAR_FIXED )
+    {
+        len = vma->lrecl;
+        
+        while( !feof( f ) && !ferror( f ) )
+        {
+            i = fread( buf, 1, len, f );
+            if( i == 0 )
+            {
+                break;
+            }
+            
+            vma->bytesin += i;
+            
+            if( fputc( ( i >> 8 ) & 0xff, vma->tfile ) == EOF )
+            {
+                seterr( VMAE_WERR );
+                goto error;
+            }
+            
+            vma->bytesout++;
+            
+            if( fputc( i & 0xff, vma->tfile ) == EOF )
+            {
+                seterr( VMAE_WERR );
+                goto error;
+            }
+            
+            vma->bytesout++;
+            
+            if( mode == VMAX_BINARY )
+            {
+                if( fwrite( buf, 1, i, vma->tfile ) != i )
+                {
+                    seterr( VMAE_WERR );
+                    goto error;
+                }
+            }
+            else
+            {
+                xlate_buf( vma->a2e_map, buf, buf, i );
+                
+                if( fwrite( buf, 1, i, vma->tfile ) != i )
+                {
+                    seterr( VMAE_WERR );
+                    goto error;
+                }
+            }
+            
+            vma->bytesout += i;
+        }
+    }
+    else
+    {
+        len = ( mode == VMAX_BINARY ? vma->lrecl : 0 );
+        i = 0;
+        while( !feof( f ) && !ferror( f ) )
+        {
+            int c = fgetc( f );
+            
+            if( c == EOF )
+            {
+                break;
+            }
+            
+            vma->bytesin++;
+            
+            if( mode == VMAX_BINARY )
+            {
+                if( i == len )
+                {
+                    if( fputc( ( i >> 8 ) & 0xff, vma->tfile ) == EOF )
+                    {
+                        seterr( VMAE_WERR );
+                        goto error;
+                    }
+                    
+                    vma->bytesout++;
+                    
+                    if( fputc( i & 0xff, vma->tfile ) == EOF )
+                    {
+                        seterr( VMAE_WERR );
+                        goto error;
+                    }
+                    
+                    vma->bytesout++;
+                    
+                    if( fwrite( buf, 1, i, vma->tfile ) != i )
+                    {
+                        seterr( VMAE_WERR );
+                        goto error;
+                    }
+                    
+                    vma->bytesout += i;
+                    
+                    i = 0;
+                }
+                
+                buf[ i++ ] = c;
+            }
+            else
+            {
+                switch( c )
+                {
+                    case '\r':
+                        break;
+                        
+                    case '\n':
+                        /*
+                        || CMS doesn't like zero length records, so insert
+                        || a blank
+                        */
+                        if( i == 0 )
+                        {
+                            buf[ i++ ] = TO_E_USR( ' ' );
+                        }
+                        
+                        if( fputc( ( i >> 8 ) & 0xff, vma->tfile ) == EOF )
+                        {
+                            seterr( VMAE_WERR );
+                            goto error;
+                        }
+                        
+                        vma->bytesout++;
+                        
+                        if( fputc( i & 0xff, vma->tfile ) == EOF )
+                        {
+                            seterr( VMAE_WERR );
+                            goto error;
+                        }
+                        
+                        vma->bytesout++;
+                        
+                        if( fwrite( buf, 1, i, vma->tfile ) != i )
+                        {
+                            seterr( VMAE_WERR );
+                            goto error;
+                        }
+                        
+                        vma->bytesout += i;
+                        
+                        if( i > len )
+                        {
+                            len = i;
+                        }
+                        
+                        i = 0;
+                        break;
+                        
+                    default:
+                        if( i > (size_t) vma->lrecl )
+                        {
+                            seterr( VMAE_LRECL );
+                            goto error;
+                        }
+                        
+                        buf[ i++ ] = TO_E_USR( c );
+                        break;
+                }
+            }
+        }
+        
+        if( i > 0 )
+        {
+            if( fputc( ( i >> 8 ) & 0xff, vma->tfile ) == EOF )
+            {
+                seterr( VMAE_WERR );
+                goto error;
+            }
+            
+            vma->bytesout++;
+            
+            if( fputc( i & 0xff, vma->tfile ) == EOF )
+            {
+                seterr( VMAE_WERR );
+                goto error;
+            }
+            
+            vma->bytesout++;
+            
+            if( fwrite( buf, 1, i, vma->tfile ) != i )
+            {
+                seterr( VMAE_WERR );
+                goto error;
+            }
+            
+            vma->bytesout += i;
+        }
+        
+        if( i > len )
+        {
+            len = i;
+        }
+    }
+    
+    if( ferror( f ) )
+    {
+        seterr( VMAE_RERR );
+        goto error;
+    }
+    
+    /*
+    || Write end of file...0 record length
+    */
+    if( fputc( 0, vma->tfile ) == EOF )
+    {
+        seterr( VMAE_WERR );
+        goto error;
+    }
+    
+    vma->bytesout++;
+    
+    if( fputc( 0, vma->tfile ) == EOF )
+    {
+        seterr( VMAE_WERR );
+        goto error;
+    }
+    
+    vma->bytesout++;
+    
+    vma->omax = len;
+    
+    seterr( VMAE_NOERR );
+    
+error:
+    
+    return vma->lasterr;
+}
+
+/* --------------------------------------------------------------------
+||
+*/
+static int
+getbyte( VMA *vma, FILE *f, int *pc )
+{
+    int c;
+    
+    if( vma->eor )
+    {
+        vma->eor = 0;
+        vma->recbytes = 0;
+        
+        *pc = kodendr;
+        
+        return seterr( VMAE_NOERR );
+    }
+    
+    while( TRUE )
+    {
+        /*
+        || Need to refill the buffer?
+        */
+        if( vma->icnt == 0 )
+        {
+            /*
+            || Check for EOF
+            */
+            if( feof( f ) )
+            {
+                *pc = EOF;
+                
+                return seterr( VMAE_NOERR );
+            }
+            
+            /*
+            || Remember file position corresponding to start of buffer
+            */
+            vma->ipos = ftell( f );
+            
+            /*
+            || Read a buffers worth
+            */
+            vma->icnt = fread( &vma->cd->ibuf[ UNREAD ], 1, BUFLEN, f );
+            
+            /*
+            || Check for errors...defer EOF check for later
+            */
+            if( ferror( f ) )
+            {
+                *pc = EOF;
+                return seterr( VMAE_RERR );
+            }
+            
+            /*
+            || Reset buffer position
+            */
+            vma->ibase = &vma->cd->ibuf[ UNREAD ];
+            vma->iptr = vma->ibase;
+            
+            /*
+            || Nothing read means EOF was just reached
+            */
+            if( vma->icnt == 0 )
+            {
+                continue;
+            }
+        }
+        
+        /*
+        || Get next character
+        */
+        c = *vma->iptr++;
+        
+        /*
+        || Track # of bytes read...resets at start of subfile extraction
+        */
+        vma->bytesin++;
+        
+        /*
+        || One less byte in the buffer
+        */
+        vma->icnt--;
+        
+        /*
+        || Handle text conversion
+        */
+        if( vma->f_text )
+        {
+            /*
+            || Ignore
+            */
+            if( c == '\r' )
+            {
+                continue;
+            }
+            
+            if( c == '\n' )
+            {
+                /*
+                || CMS doesn't like zero length records, so insert
+                || a blank and trick the next getbyte() call into
+                || returning an end of record code.
+                */
+                if( vma->recbytes == 0 )
+                {
+                    c = ' ';
+                    vma->eor = 1;
+                }
+                else
+                {
+                    vma->recbytes = 0;
+                    
+                    *pc = kodendr;
+                    
+                    return seterr( VMAE_NOERR );
+                }
+            }
+            
+            c = TO_E_USR( c );
+        }
+        
+        /*
+        || Always exit loop
+        */
+        break;
+    }
+    
+    /*
+    || Track # of bytes in the record
+    */
+    vma->recbytes++;
+    
+    /*
+    || And maximum record length
+    */
+    if( vma->recbytes > vma->omax )
+    {
+        vma->omax = vma->recbytes;
+    }
+    
+    /*
+    || Convert to coded EBCDIC
+    */
+    *pc = c + kodebcd;
+    
+    return seterr( VMAE_NOERR );
+}
+
+/* --------------------------------------------------------------------
+||
+*/
+static int
+putcode( VMA *vma, unsigned short code )
+{
+    if( code == USHRT_MAX )
+    {
+        if( vma->residual != UINT_MAX )
+        {
+            if( fputc( vma->residual, vma->tfile ) == EOF )
+            {
+                return seterr( VMAE_WERR );
+            }
+            
+            vma->bytesout++;
+        }
+        
+        return seterr( VMAE_NOERR );
+    }
+    
+    code &= 0xfff;
+    
+    if( vma->residual == UINT_MAX )
+    {
+        vma->residual = ( code & 0x0f ) << 12;
+        if( fputc( code >> 4, vma->tfile ) == EOF )
+        {
+            return seterr( VMAE_WERR );
+        }
+        
+        vma->bytesout++;
+    }
+    else
+    {
+        code |= vma->residual;
+        vma->residual = UINT_MAX;
+        
+        if( fputc( code >> 8, vma->tfile ) == EOF )
+        {
+            return seterr( VMAE_WERR );
+        }
+        
+        vma->bytesout++;
+        
+        if( fputc( code & 0xff, vma->tfile ) == EOF )
+        {
+            return seterr( VMAE_WERR );
+        }
+        
+        vma->bytesout++;
+    }
+    
+    return seterr( VMAE_NOERR );
+}
+
+/* --------------------------------------------------------------------
+||
+*/
+static int
+add_lzw( VMA *vma, FILE *f, int mode )
+{
+    unsigned short lastpred;
+    unsigned short ent;
+    int c;
+    
+    /*
+    || Initialize
+    */
+    lzwinit( vma );
+    
+    lastpred = LZWNONE;
+    if( getbyte( vma, f, &c ) != VMAE_NOERR )
+    {
+        return vma->lasterr;
+    }
+    
+    while( c != EOF )
+    {
+        if( lookup( vma, lastpred, c, &ent ) )
+        {
+            lastpred = ent;
+            if( getbyte( vma, f, &c ) != VMAE_NOERR )
+            {
+                return vma->lasterr;
+            }
+            continue;
+        }
+        
+        if( putcode( vma, lastpred ) != VMAE_NOERR )
+        {
+            return vma->lasterr;
+        }
+        lastpred = LZWNONE;
+    }
+    
+    if( ferror( f ) )
+    {
+        return seterr( VMAE_RERR );
+    }
+    
+    if( putcode( vma, lastpred ) != VMAE_NOERR )
+    {
+        return vma->lasterr;
+    }
+    
+    if( putcode( vma, kodendr ) != VMAE_NOERR )
+    {
+        return vma->lasterr;
+    }
+    
+    if( putcode( vma, USHRT_MAX ) != VMAE_NOERR )
+    {
+        return vma->lasterr;
+    }
+    
+    return seterr( VMAE_NOERR );
+}
+
+
+/* --------------------------------------------------------------------
+|| S2 Compression
+||
+|| The encoder builds the same table as the decoder by calling
+|| s2addnew() with each pair of codes it writes, so it only has to find
+|| the longest table string at the front of the input.  Every entry that
+|| could extend a match has that match as its left half, so the search
+|| starts at the single character and follows entries found by hashing
+|| the left half with the next input character, which must start the
+|| right half.  The input is read ahead into vma->cd->hist and entries
+|| remember where their strings were, the same as when decoding, so a
+|| right half can usually be checked with one memcmp().
+*/
+#define S2MAXSTR    ( TABSIZE / 2 + 1 )     /* longest table string */
+
+static unsigned int
+s2hash( unsigned short left, unsigned short c )
+{
+    return ( ( (unsigned int) left << 9 ) | c ) % HASHSIZE;
+}
+
+/*
+|| Builds the next table entry and files it under its left half and the
+|| right half's first character
+*/
+static void
+s2addenc( VMA *vma, unsigned short slastcode, unsigned short lastcode )
+{
+    STRDSECT *tab = vma->cd->s2strtab;
+    unsigned short *pnext;
+    unsigned short ent;
+    unsigned int h;
+    
+    ent = s2addnew( vma, slastcode, lastcode );
+    if( ent == S2NONE )
+    {
+        return;
+    }
+    
+    /*
+    || Unhook it from where it was filed before being reused
+    */
+    if( vma->cd->s2hbkt[ ent ] != S2NONE )
+    {
+        pnext = &vma->cd->s2hashtab[ vma->cd->s2hbkt[ ent ] ];
+        while( *pnext != ent )
+        {
+            pnext = &vma->cd->s2hnext[ *pnext ];
+        }
+        *pnext = vma->cd->s2hnext[ ent ];
+    }
+    
+    vma->cd->s2first[ ent ] = vma->cd->s2first[ tab[ ent ].strleft ];
+    
+    h = s2hash( tab[ ent ].strleft, vma->cd->s2first[ tab[ ent ].strright ] );
+    vma->cd->s2hbkt[ ent ] = (unsigned short) h;
+    vma->cd->s2hnext[ ent ] = vma->cd->s2hashtab[ h ];
+    vma->cd->s2hashtab[ h ] = ent;
+    
+    return;
+}
+
+/*
+|| Whether an entry's string is in the input at vma->cd->hist[ pos ]
+*/
+static int
+s2same( VMA *vma, unsigned short ent, unsigned int pos )
+{
+    STRDSECT *tab = vma->cd->s2strtab;
+    STRDSECT *curr;
+    unsigned short stack[ TABSIZE ];
+    unsigned short *in = &vma->cd->hist[ pos ];
+    unsigned short c;
+    int depth;
+    
+    stack[ 0 ] = ent;
+    depth = 1;
+    while( depth > 0 )
+    {
+        c = stack[ --depth ];
+        curr = &tab[ c ];
+        
+        if( curr->strleft == S2NONE )
+        {
+            if( *in++ != c )
+            {
+                return FALSE;
+            }
+        }
+        else if( curr->strpos != NOPOS )
+        {
+            if( memcmp( in,
+                        &vma->cd->hist[ curr->strpos ],
+                        curr->strnchar * sizeof( *in ) ) != 0 )
+            {
+                return FALSE;
+            }
+            in += curr->strnchar;
+        }
+        else
+        {
+            stack[ depth++ ] = curr->strright;
+            stack[ depth++ ] = curr->strleft;
+        }
+    }
+    
+    return TRUE;
+}
+
+/*
+|| Returns the longest table entry matching the input at vma->cd->hist[ pos ]
+|| up to vma->cd->hist[ end ]
+*/
+static unsigned short
+s2match( VMA *vma, unsigned int pos, unsigned int end )
+{
+    STRDSECT *tab = vma->cd->s2strtab;
+    unsigned short stack[ TABSIZE + 1 ];
+    unsigned short best = vma->cd->hist[ pos ];
+    unsigned short m;
+    unsigned short o;
+    unsigned short c;
+    unsigned short r;
+    unsigned int q;
+    int depth;
+    
+    stack[ 0 ] = best;
+    depth = 1;
+    while( depth > 0 )
+    {
+        m = stack[ --depth ];
+        q = pos + tab[ m ].strnchar;
+        if( q >= end )
+        {
+            continue;
+        }
+        c = vma->cd->hist[ q ];
+        
+        /*
+        || Every entry extending m has m on the left and a right half
+        || starting with the next character
+        */
+        for( o = vma->cd->s2hashtab[ s2hash( m, c ) ]; o != S2NONE; o = vma->cd->s2hnext[ o ] )
+        {
+            r = tab[ o ].strright;
+            if( tab[ o ].strleft != m || vma->cd->s2first[ r ] != c ||
+                q + tab[ r ].strnchar > end || !s2same( vma, r, q ) )
+            {
+                continue;
+            }
+            
+            /*
+            || The table's last slot can't be written in 12 bits, but
+            || entries built on it can
+            */
+            if( o < TABSIZE && tab[ o ].strnchar > tab[ best ].strnchar )
+            {
+                best = o;
+            }
+            stack[ depth++ ] = o;
+        }
+    }
+    
+    return best;
+}
+
+/* --------------------------------------------------------------------
+||
+*/
+static int
+add_s2( VMA *vma, FILE *f, int mode )
+{
+    STRDSECT *tab = vma->cd->s2strtab;
+    unsigned short *hist = vma->cd->hist;
+    unsigned short slastcode = S2NONE;
+    unsigned short lastcode;
+    unsigned int hpos = 0;
+    unsigned int hend = 0;
+    unsigned int i;
+    int eof = FALSE;
+    int c;
+    
+    /*
+    || Initialize
+    */
+    s2init( vma );
+    memset( vma->cd->s2hashtab, 0xff, sizeof( vma->cd->s2hashtab ) );
+    memset( vma->cd->s2hbkt, 0xff, sizeof( vma->cd->s2hbkt ) );
+    for( i = 0; i <= kodmax; i++ )
+    {
+        vma->cd->s2first[ i ] = i;
+    }
+    
+    while( TRUE )
+    {
+        /*
+        || Start over at the front of the history when the longest
+        || string might not fit, forgetting where the older strings were
+        */
+        if( hpos + S2MAXSTR > HISTLEN )
+        {
+            memmove( hist, &hist[ hpos ], ( hend - hpos ) * sizeof( *hist ) );
+            hend -= hpos;
+            hpos = 0;
+            
+            for( i = 0; i <= TABSIZE; i++ )
+            {
+                tab[ i ].strpos = NOPOS;
+            }
+        }
+        
+        /*
+        || Keep enough input to match the longest string
+        */
+        while( !eof && hend < hpos + S2MAXSTR )
+        {
+            if( getbyte( vma, f, &c ) != VMAE_NOERR )
+            {
+                return vma->lasterr;
+            }
+            
+            if( c == EOF )
+            {
+                eof = TRUE;
+                break;
+            }
+            hist[ hend++ ] = (unsigned short) c;
+        }
+        
+        if( hpos == hend )
+        {
+            break;
+        }
+        
+        /*
+        || The first code is always a single character
+        */
+        if( slastcode == S2NONE )
+        {
+            lastcode = hist[ hpos ];
+        }
+        else
+        {
+            lastcode = s2match( vma, hpos, hend );
+        }
+        
+        if( putcode( vma, lastcode ) != VMAE_NOERR )
+        {
+            return vma->lasterr;
+        }
+        
+        tab[ lastcode ].strpos = hpos;
+        hpos += tab[ lastcode ].strnchar;
+        
+        /*
+        || Extend string table with new entry, just as the decoder will
+        */
+        if( slastcode != S2NONE )
+        {
+            s2addenc( vma, slastcode, lastcode );
+        }
+        slastcode = lastcode;
+    }
+    
+    if( ferror( f ) )
+    {
+        return seterr( VMAE_RERR );
+    }
+    
+    if( putcode( vma, kodendr ) != VMAE_NOERR )
+    {
+        return vma->lasterr;
+    }
+    
+    if( putcode( vma, USHRT_MAX ) != VMAE_NOERR )
+    {
+        return vma->lasterr;
+    }
+    
+    return seterr( VMAE_NOERR );
+}
+
+/* --------------------------------------------------------------------
+|| Header validation table
+||
+|| Each entry describes a run of header bytes following the header ID,
+|| how it's converted into vma->head, and which values are acceptable.
+*/
+enum
+{
+    HV_RAW,                                 /* anything goes         */
+    HV_RANGE,                               /* raw lo <= byte <= hi  */
+    HV_PRINT,                               /* printable character   */
+    HV_ALPHA,                               /* alphabetic character  */
+    HV_CHAR,                                /* char lo <= c <= hi    */
+    HV_BCD,                                 /* decimal lo <= n <= hi */
+    HV_RECFM,                               /* F or V                */
+    HV_FLAGS                                /* known flags only      */
+};
+
+typedef struct hdrval
+{
+    uchar off;                              /* offset into header    */
+    uchar len;                              /* number of bytes       */
+    uchar kind;                             /* HV_* validation       */
+    uchar lo;                               /* lowest valid value    */
+    uchar hi;                               /* highest valid value   */
+} HDRVAL;
+
+static const HDRVAL
+hdrval[] =
+{
+    { H_VER,        1,  HV_RANGE,   1,      1   },
+    { H_REL,        1,  HV_RANGE,   0,      2   },
+    { H_FN,         8,  HV_PRINT,   0,      0   },
+    { H_FT,         8,  HV_PRINT,   0,      0   },
+    { H_FM,         1,  HV_ALPHA,   0,      0   },
+    { H_FM + 1,     1,  HV_CHAR,    '0',    '9' },
+    { H_LRECL,      2,  HV_RAW,     0,      0   },
+    { H_YEAR,       1,  HV_BCD,     0,      255 },
+    { H_MONTH,      1,  HV_BCD,     1,      12  },
+    { H_DAY,        1,  HV_BCD,     1,      31  },
+    { H_HOUR,       1,  HV_BCD,     0,      23  },
+    { H_MINUTE,     1,  HV_BCD,     0,      59  },
+    { H_SECOND,     1,  HV_BCD,     0,      59  },
+    { H_RECFM,      1,  HV_RECFM,   0,      0   },
+    { H_FLAGS,      1,  HV_FLAGS,   0,      0   },
+    { H_XRECL,      12, HV_RAW,     0,      0   }   /* extended only */
+};
+
+#define HV_BASIC ( sizeof( hdrval ) / sizeof( hdrval[ 0 ] ) - 1 )
+
+/* --------------------------------------------------------------------
+|| Returns the offset of the first byte that could start an EBCDIC or
+|| ASCII header ID, or len if there aren't any.
+*/
+static size_t
+scan_id( const uchar *buf, size_t len )
+{
+    size_t i = 0;
+    
+#if defined( __SSE2__ )
+    /*
+    || Check 16 bytes at a time for either first byte
+    */
+    const __m128i e = _mm_set1_epi8( (char) hid[ 0 ] );
+    const __m128i a = _mm_set1_epi8( (char) aid[ 0 ] );
+    
+    for( ; i + 16 <= len; i += 16 )
+    {
+        __m128i v = _mm_loadu_si128( (const __m128i *) &buf[ i ] );
+        int m = _mm_movemask_epi8( _mm_or_si128( _mm_cmpeq_epi8( v, e ),
+                                                 _mm_cmpeq_epi8( v, a ) ) );
+        if( m != 0 )
+        {
+            return i + __builtin_ctz( m );
+        }
+    }
+#endif
+    
+    /*
+    || Whatever is left (or everything on other platforms)
+    */
+    for( ; i < len; i++ )
+    {
+        if( buf[ i ] == hid[ 0 ] || buf[ i ] == aid[ 0 ] )
+        {
+            break;
+        }
+    }
+    
+    return i;
+}
+
+/* --------------------------------------------------------------------
+|| Validates the header data following a header ID and converts it into
+|| head.  Returns the header length or 0 if it isn't a header.
+*/
+static size_t
+check_header( uchar *head, const uchar *buf, size_t len )
+{
+    const HDRVAL *hv;
+    size_t ndx;
+    size_t cnt;
+    unsigned int byte;
+    
+    for( ndx = 0; ndx < sizeof( hdrval ) / sizeof( hdrval[ 0 ] ); ndx++ )
+    {
+        hv = &hdrval[ ndx ];
+        
+        /*
+        || The extended fields are only present when flagged
+        */
+        if( ndx == HV_BASIC && !( head[ H_FLAGS ] & HF_EXTH ) )
+        {
+            break;
+        }
+        
+        /*
+        || Ran out of data (only happens at EOF)
+        */
+        if( (size_t) hv->off + hv->len > len )
+        {
+            return 0;
+        }
+        
+        for( cnt = 0; cnt < hv->len; cnt++ )
+        {
+            byte = buf[ hv->off + cnt ];
+            
+            switch( hv->kind )
+            {
+                case HV_RANGE:
+                    if( byte < hv->lo || byte > hv->hi )
+                    {
+                        return 0;
+                    }
+                    break;
+                    
+                case HV_PRINT:
+                    byte = TO_A_SYS( byte );
+                    if( !isprint( byte ) )
+                    {
+                        return 0;
+                    }
+                    break;
+                    
+                case HV_ALPHA:
+                    byte = TO_A_SYS( byte );
+                    if( !isalpha( byte ) )
+                    {
+                        return 0;
+                    }
+                    break;
+                    
+                case HV_CHAR:
+                    byte = TO_A_SYS( byte );
+                    if( byte < hv->lo || byte > hv->hi )
+                    {
+                        return 0;
+                    }
+                    break;
+                    
+                case HV_BCD:
+                    byte = cvb( byte );
+                    if( byte < hv->lo || byte > hv->hi )
+                    {
+                        return 0;
+                    }
+                    break;
+                    
+                case HV_RECFM:
+                    byte = TO_A_SYS( byte );
+                    if( byte != 'F' && byte != 'V' )
+                    {
+                        return 0;
+                    }
+                    break;
+                    
+                case HV_FLAGS:
+                    if( byte & ~( HF_S2 | HF_ASIS | HF_Y2K | HF_EXTH ) )
+                    {
+                        return 0;
+                    }
+                    break;
+            }
+            
+            head[ hv->off + cnt ] = byte;
+        }
+    }
+    
+    return ( head[ H_FLAGS ] & HF_EXTH ) ? H_XDLEN : H_DLEN;
+}
+
+/* --------------------------------------------------------------------
+|| Searches for the next header
+||
+|| Works on whole buffers at a time:  candidate ID bytes are located by
+|| scan_id() and only then compared and validated.
+*/
+static int
+locate_file( VMA *vma )
+{
+    const uchar *buf;
+    size_t avail;
+    size_t limit;
+    size_t ndx;
+    size_t len;
+    int more;
+    
+    while( TRUE )
+    {
+        /*
+        || Make sure a complete header could be in the buffer
+        */
+        more = fill( vma, HIDLEN + H_XDLEN );
+        if( vma->lasterr != VMAE_NOERR )
+        {
+            return FALSE;
+        }
+        
+        avail = vma->icnt;
+        if( avail < HIDLEN + H_DLEN )
+        {
+            return FALSE;
+        }
+        
+        /*
+        || Only look where a complete header would fit unless there's
+        || nothing more to come.
+        */
+        buf = vma->iptr;
+        limit = avail - ( more ? HIDLEN + H_XDLEN : HIDLEN + H_DLEN ) + 1;
+        
+        for( ndx = 0; ndx < limit; ndx++ )
+        {
+            ndx += scan_id( &buf[ ndx ], limit - ndx );
+            if( ndx >= limit )
+            {
+                break;
+            }
+            
+            /*
+            || VMARC that's been converted to ASCII?
+            */
+            if( memcmp( &buf[ ndx ], aid, HIDLEN ) == 0 )
+            {
+                seterr( VMAE_ASCII );
+                return FALSE;
+            }
+            
+            /*
+            || A real header?
+            */
+            if( memcmp( &buf[ ndx ], hid, HIDLEN ) == 0 )
+            {
+                len = check_header( vma->head,
+                                    &buf[ ndx + HIDLEN ],
+                                    avail - ndx - HIDLEN );
+                if( len != 0 )
+                {
+                    /*
+                    || Position past the header
+                    */
+                    vma->iptr += ndx + HIDLEN + len;
+                    vma->icnt -= ndx + HIDLEN + len;
+                    
+                    return TRUE;
+                }
+            }
+        }
+        
+        /*
+        || Nothing in this buffer, so drop what we've searched
+        */
+        vma->iptr += limit;
+        vma->icnt -= limit;
+    }
+    
+    return FALSE;
+}
+
+/* --------------------------------------------------------------------
+|| Determines if we're running under z/VM or z/OS
+*/
+static void
+systype( VMA *vma )
+{
+#if defined( __MVS__ )
+    /*
+    || The utsname structures on z/OS and z/VM differ in size, so to
+    || be able to run a z/OS compiled module under z/VM, we add some
+    || padding.
+    */
+    union
+    {
+        struct utsname un;
+        char dummy[ 256 ];
+    } u;
+ 
+    memset( &u.un, 0, sizeof( u ) );
+ 
+    uname( &u.un );
+ 
+    if( strcmp( u.un.sysname, "OS/390" ) == 0 )
+    {
+        vma->f_zos = TRUE;
+    }
+    else if( strcmp( u.un.sysname, "z/VM" ) == 0 )
+    {
+        vma->f_zvm = TRUE;
+    }
+ 
+#endif
+    return;
+}
+ 
+/* --------------------------------------------------------------------
+|| Subfile name hash
+||
+|| Subfiles are hashed on their file name and type so vma_find() doesn't
+|| have to walk the list.  The mode is left out since it's optional when
+|| searching.  Each subfile carries a sequence number so that the first
+|| one in the list wins when a name appears more than once.
+*/
+#define NAMEHASH    256                 /* initial slots (power of 2) */
+
+static size_t
+name_hash( const char *fn, const char *ft, size_t size )
+{
+    size_t h = 0;
+    
+    while( *fn )
+    {
+        h = h * 31 + (uchar) *fn++;
+    }
+    
+    h = h * 31 + '.';
+    
+    while( *ft )
+    {
+        h = h * 31 + (uchar) *ft++;
+    }
+    
+    return h & ( size - 1 );
+}
+
+static void
+name_link( VMA *vma, PSUBFILE *psf )
+{
+    PSUBFILE **names;
+    PSUBFILE *next;
+    size_t size;
+    size_t i;
+    size_t h;
+    
+    if( vma->names == NULL )
+    {
+        return;
+    }
+    
+    /*
+    || Keep the chains short...if the table can't grow, it still works
+    */
+    if( vma->namecnt >= vma->namesize )
+    {
+        size = vma->namesize * 2;
+        names = (PSUBFILE **) calloc( size, sizeof( PSUBFILE * ) );
+        if( names != NULL )
+        {
+            for( i = 0; i < vma->namesize; i++ )
+            {
+                for( ; vma->names[ i ] != NULL; vma->names[ i ] = next )
+                {
+                    next = vma->names[ i ]->hnext;
+                    
+                    h = name_hash( vma->names[ i ]->sf.fn,
+                                   vma->names[ i ]->sf.ft,
+                                   size );
+                    vma->names[ i ]->hnext = names[ h ];
+                    names[ h ] = vma->names[ i ];
+                }
+            }
+            
+            free( vma->names );
+            vma->names = names;
+            vma->namesize = size;
+        }
+    }
+    
+    h = name_hash( psf->sf.fn, psf->sf.ft, vma->namesize );
+    psf->hnext = vma->names[ h ];
+    vma->names[ h ] = psf;
+    vma->namecnt++;
+    
+    return;
+}
+
+static void
+name_unlink( VMA *vma, PSUBFILE *psf )
+{
+    PSUBFILE **pp;
+    
+    if( vma->names == NULL )
+    {
+        return;
+    }
+    
+    pp = &vma->names[ name_hash( psf->sf.fn, psf->sf.ft, vma->namesize ) ];
+    for( ; *pp != NULL; pp = &( *pp )->hnext )
+    {
+        if( *pp == psf )
+        {
+            *pp = psf->hnext;
+            psf->hnext = NULL;
+            vma->namecnt--;
+            break;
+        }
+    }
+    
+    return;
+}
+
+static void
+name_reset( VMA *vma )
+{
+    if( vma->names != NULL )
+    {
+        memset( vma->names, 0, vma->namesize * sizeof( PSUBFILE * ) );
+    }
+    vma->namecnt = 0;
+    
+    return;
+}
+ 
+/* --------------------------------------------------------------------
+|| Sidecar index stuff
+||
+|| The index lives next to the archive as "<archive>.vmaidx".  It's a
+|| plain text file with a key line followed by one line per subfile and
+|| is only trusted if the archive size, mtime (to the nanosecond where
+|| available), a hash of its first and last buffers and a hash of every
+|| subfile header it lists all still match.  It's purely an
+|| optimization, so any problem with it simply means we scan the
+|| archive as usual.  Only sizes from binary decodes are kept.
+*/
+#define IDXSFX      ".vmaidx"
+#define IDXVER      2
+
+static char *
+index_name( VMA *vma )
+{
+    char *iname;
+    
+    iname = malloc( strlen( vma->vname ) + sizeof( IDXSFX ) );
+    if( iname != NULL )
+    {
+        strcpy( iname, vma->vname );
+        strcat( iname, IDXSFX );
+    }
+    
+    return iname;
+}
+
+static unsigned long
+index_hash( unsigned long hash, const uchar *buf, size_t len )
+{
+    /*
+    || FNV-1a...fast and good enough to catch a rewritten archive
+    */
+    while( len-- )
+    {
+        hash ^= *buf++;
+        hash = ( hash * 16777619UL ) & 0xffffffffUL;
+    }
+    
+    return hash;
+}
+
+static int
+index_key( VMA *vma, unsigned long *size, long *mtime, long *mtimens, unsigned long *hash )
+{
+    struct stat st;
+    size_t len;
+    
+    if( fstat( fileno( vma->vfile ), &st ) != 0 )
+    {
+        return FALSE;
+    }
+    
+    *size = (unsigned long) st.st_size;
+    *mtime = (long) st.st_mtime;
+#if defined( HAVE_MTIM )
+    *mtimens = (long) st.st_mtim.tv_nsec;
+#else
+    *mtimens = 0;
+#endif
+    *hash = 2166136261UL;
+    
+    /*
+    || Hash the first buffer
+    */
+    if( fseek( vma->vfile, 0, SEEK_SET ) != 0 )
+    {
+        return FALSE;
+    }
+    
+    len = fread( &vma->cd->ibuf[ UNREAD ], 1, BUFLEN, vma->vfile );
+    *hash = index_hash( *hash, &vma->cd->ibuf[ UNREAD ], len );
+    
+    /*
+    || And the last one if the archive is bigger than that
+    */
+    if( *size > BUFLEN )
+    {
+        if( fseek( vma->vfile, (long) ( *size - BUFLEN ), SEEK_SET ) != 0 )
+        {
+            return FALSE;
+        }
+        
+        len = fread( &vma->cd->ibuf[ UNREAD ], 1, BUFLEN, vma->vfile );
+        *hash = index_hash( *hash, &vma->cd->ibuf[ UNREAD ], len );
+    }
+    
+    /*
+    || Leave the archive positioned at the start
+    */
+    if( ferror( vma->vfile ) || fseek( vma->vfile, 0, SEEK_SET ) != 0 )
+    {
+        return FALSE;
+    }
+    
+    return TRUE;
+}
+
+/*
+|| Hashes what leads up to each subfile's data, which takes in all of
+|| its header
+*/
+static int
+index_heads( VMA *vma, unsigned long *hash )
+{
+    uchar buf[ HIDLEN + H_XDLEN ];
+    PSUBFILE *psf;
+    size_t len;
+    
+    *hash = 2166136261UL;
+    for( psf = vma->subfiles; psf != NULL; psf = psf->next )
+    {
+        len = ( psf->dataoff < sizeof( buf ) ? psf->dataoff : sizeof( buf ) );
+        if( fseek( vma->vfile, (long) ( psf->dataoff - len ), SEEK_SET ) != 0 ||
+            fread( buf, 1, len, vma->vfile ) != len )
+        {
+            return FALSE;
+        }
+        
+        *hash = index_hash( *hash, buf, len );
+    }
+    
+    return ( fseek( vma->vfile, 0, SEEK_SET ) == 0 );
+}
+
+/*
+|| Only sizes from binary decodes go in the index
+*/
+static int
+index_sized( PSUBFILE *psf )
+{
+    return ( psf->sized && psf->exact );
+}
+
+/* --------------------------------------------------------------------
+|| Builds the subfile list from the index if it matches the archive
+*/
+static int
+load_index( VMA *vma )
+{
+    FILE *f;
+    char *iname;
+    char line[ 256 ];
+    unsigned long size;
+    unsigned long isize;
+    long mtime;
+    long imtime;
+    long mtimens;
+    long imtimens;
+    unsigned long hash;
+    unsigned long ihash;
+    unsigned long heads;
+    unsigned long iheads;
+    unsigned long count;
+    int ver;
+    PSUBFILE *psf;
+    
+    if( !index_key( vma, &size, &mtime, &mtimens, &hash ) )
+    {
+        return FALSE;
+    }
+    
+    iname = index_name( vma );
+    if( iname == NULL )
+    {
+        return FALSE;
+    }
+    
+    f = fopen( iname, "r" );
+    free( iname );
+    if( f == NULL )
+    {
+        return FALSE;
+    }
+    
+    /*
+    || Verify the key
+    */
+    if( fgets( line, sizeof( line ), f ) == NULL ||
+        sscanf( line, "VMAIDX %d %lu %ld %ld %lu %lu %lu",
+                &ver, &isize, &imtime, &imtimens, &ihash, &iheads, &count ) != 7 ||
+        ver != IDXVER || isize != size || imtime != mtime ||
+        imtimens != mtimens || ihash != hash )
+    {
+        fclose( f );
+        return FALSE;
+    }
+    
+    /*
+    || Rebuild the subfiles
+    */
+    while( count-- )
+    {
+        unsigned long dataoff;
+        unsigned long compressed;
+        unsigned long uncompressed;
+        int sized, dtype, flags, sver, rel, lrecl, year;
+        int month, day, hour, minute, second, recfm;
+        char names[ 18 * 2 + 1 ];
+        char *p;
+        int i;
+        
+        if( fgets( line, sizeof( line ), f ) == NULL ||
+            sscanf( line,
+                    "%lu %d %lu %lu %d %d %d %d %d %d %d %d %d %d %d %d %36s",
+                    &dataoff, &sized, &compressed, &uncompressed, &dtype,
+                    &flags, &sver, &rel, &lrecl, &year, &month, &day,
+                    &hour, &minute, &second, &recfm, names ) != 17 ||
+            strlen( names ) != 18 * 2 )
+        {
+            break;
+        }
+        
+        if( vma_new( vma, NULL ) != VMAE_NOERR )
+        {
+            break;
+        }
+        psf = vma->active;
+        name_unlink( vma, psf );
+        
+        /*
+        || Names are stored in hex, blank padded to 8, 8 and 2 chars
+        */
+        for( p = names, i = 0; i < 18; i++, p += 2 )
+        {
+            unsigned int c;
+            
+            sscanf( p, "%2x", &c );
+            
+            if( i < 8 )
+            {
+                psf->sf.fn[ i ] = ( c == ' ' ? '\0' : c );
+            }
+            else if( i < 16 )
+            {
+                psf->sf.ft[ i - 8 ] = ( c == ' ' ? '\0' : c );
+            }
+            else
+            {
+                psf->sf.fm[ i - 16 ] = ( c == ' ' ? '\0' : c );
+            }
+        }
+        name_link( vma, psf );
+        
+        psf->sf.ver = sver;
+        psf->sf.rel = rel;
+        sprintf( (char *) psf->sf.meth,
+                "%s",
+                ( flags & HF_ASIS ? "ASIS" :
+                 ( flags & HF_S2 ? "S2" :
+                  "LZW" ) ) );
+        psf->sf.lrecl = lrecl;
+        psf->sf.year = year;
+        psf->sf.month = month;
+        psf->sf.day = day;
+        psf->sf.hour = hour;
+        psf->sf.minute = minute;
+        psf->sf.second = second;
+        psf->sf.recfm = recfm;
+        psf->sf.compressed = compressed;
+        psf->sf.uncompressed = uncompressed;
+        psf->sf.dtype = dtype;
+        psf->flags = flags;
+        psf->dataoff = dataoff;
+        psf->sized = ( sized != 0 );
+        psf->exact = psf->sized;
+        psf->locked = TRUE;
+    }
+    
+    fclose( f );
+    set_active( vma, NULL );
+    
+    /*
+    || Throw away a partial list or one whose headers have changed
+    */
+    if( count != (unsigned long) -1 ||
+        !index_heads( vma, &heads ) ||
+        heads != iheads )
+    {
+        while( vma->subfiles != NULL )
+        {
+            psf = vma->subfiles;
+            vma->subfiles = psf->next;
+            
+            free( psf );
+        }
+        vma->sflast = NULL;
+        name_reset( vma );
+        
+        return FALSE;
+    }
+    
+    return TRUE;
+}
+
+/* --------------------------------------------------------------------
+|| (Re)Writes the index for the archive as it exists on disk
+*/
+static void
+write_index( VMA *vma )
+{
+    FILE *f;
+    char *iname;
+    unsigned long size;
+    long mtime;
+    long mtimens;
+    unsigned long hash;
+    unsigned long heads;
+    unsigned long count;
+    PSUBFILE *psf;
+    int ok;
+    
+    /*
+    || Only when asked for and the subfile list matches the archive
+    */
+    if( !( vma->flags & VMAO_INDEX ) || vma->vfile == NULL || vma->f_dirty )
+    {
+        return;
+    }
+    
+    if( !index_key( vma, &size, &mtime, &mtimens, &hash ) ||
+        !index_heads( vma, &heads ) )
+    {
+        return;
+    }
+    
+    iname = index_name( vma );
+    if( iname == NULL )
+    {
+        return;
+    }
+    
+    f = fopen( iname, "w" );
+    if( f == NULL )
+    {
+        free( iname );
+        return;
+    }
+    
+    count = 0;
+    for( psf = vma->subfiles; psf != NULL; psf = psf->next )
+    {
+        count++;
+    }
+    
+    fprintf( f, "VMAIDX %d %lu %ld %ld %lu %lu %lu\n",
+             IDXVER, size, mtime, mtimens, hash, heads, count );
+    
+    vma->idxsized = 0;
+    for( psf = vma->subfiles; psf != NULL; psf = psf->next )
+    {
+        int i;
+        
+        fprintf( f,
+                 "%lu %d %lu %lu %d %d %d %d %d %d %d %d %d %d %d %d ",
+                 (unsigned long) psf->dataoff,
+                 index_sized( psf ),
+                 (unsigned long) psf->sf.compressed,
+                 (unsigned long) psf->sf.uncompressed,
+                 psf->sf.dtype,
+                 psf->flags,
+                 psf->sf.ver,
+                 psf->sf.rel,
+                 psf->sf.lrecl,
+                 psf->sf.year,
+                 psf->sf.month,
+                 psf->sf.day,
+                 psf->sf.hour,
+                 psf->sf.minute,
+                 psf->sf.second,
+                 psf->sf.recfm );
+        
+        for( i = 0; i < 8; i++ )
+        {
+            fprintf( f, "%02x", i < (int) strlen( psf->sf.fn ) ?
+                     (uchar) psf->sf.fn[ i ] : ' ' );
+        }
+        
+        for( i = 0; i < 8; i++ )
+        {
+            fprintf( f, "%02x", i < (int) strlen( psf->sf.ft ) ?
+                     (uchar) psf->sf.ft[ i ] : ' ' );
+        }
+        
+        for( i = 0; i < 2; i++ )
+        {
+            fprintf( f, "%02x", i < (int) strlen( psf->sf.fm ) ?
+                     (uchar) psf->sf.fm[ i ] : ' ' );
+        }
+        
+        fprintf( f, "\n" );
+        
+        if( index_sized( psf ) )
+        {
+            vma->idxsized++;
+        }
+    }
+    
+    ok = !ferror( f );
+    
+    /*
+    || Don't leave a broken index lying around
+    */
+    if( fclose( f ) != 0 || !ok )
+    {
+        unlink( iname );
+    }
+    
+    free( iname );
+    
+    return;
+}
+
+/* --------------------------------------------------------------------
+|| Creates a subfile from the header in vma->head and makes it active
+*/
+static int
+add_found( VMA *vma, size_t dataoff )
+{
+    PSUBFILE *psf;
+    int i;
+    
+    /*
+    || Allocate a new subfile
+    */
+    if( vma_new( vma, NULL ) != VMAE_NOERR )
+    {
+        return seterr( VMAE_MEM );
+    }
+    
+    /*
+    || Get the newly allocated subfile
+    */
+    psf = vma->active;
+    name_unlink( vma, psf );
+    
+    /*
+    || Copy header to subfile
+    */
+    psf->sf.ver     = vma->head[ H_VER ];
+    psf->sf.rel     = vma->head[ H_REL ];
+    
+    sprintf( (char *) psf->sf.meth,
+            "%s",
+            ( vma->head[ H_FLAGS ] & HF_ASIS ? "ASIS" :
+             ( vma->head[ H_FLAGS ] & HF_S2 ? "S2" :
+              "LZW" ) ) );
+    for( i = 0; i < 8 && vma->head[ H_FN + i ] != ' '; i++ )
+    {
+        psf->sf.fn[ i ] = vma->head[ H_FN + i ];
+    }
+    psf->sf.fn[ i ] = '\0';
+    
+    for( i = 0; i < 8 && vma->head[ H_FT + i ] != ' '; i++ )
+    {
+        psf->sf.ft[ i ] = vma->head[ H_FT + i ];
+    }
+    psf->sf.ft[ i ] = '\0';
+    
+    for( i = 0; i < 2 && vma->head[ H_FM + i ] != ' '; i++ )
+    {
+        psf->sf.fm[ i ] = vma->head[ H_FM + i ];
+    }
+    psf->sf.fm[ i ] = '\0';
+    name_link( vma, psf );
+    
+    psf->sf.year = vma->head[ H_YEAR ] + 1900 +
+    ( ( vma->head[ H_FLAGS ] & HF_Y2K ) ? 100 : 0 );
+    psf->sf.month   = vma->head[ H_MONTH ];
+    psf->sf.day     = vma->head[ H_DAY ];
+    psf->sf.hour    = vma->head[ H_HOUR ];
+    psf->sf.minute  = vma->head[ H_MINUTE ];
+    psf->sf.second  = vma->head[ H_SECOND ];
+    psf->sf.recfm   = vma->head[ H_RECFM ];
+    psf->flags      = vma->head[ H_FLAGS ] & ( HF_S2 | HF_ASIS );
+    
+    /*
+    || Hack for non-Y2K compliant files.  Yes, they ARE still being
+    || created!  Come on folks, upgrade your VMARC to at least
+    || V1R2P021.  :-)
+    */
+    if( psf->sf.year < 1960 )
+    {
+        psf->sf.year += 100;
+    }
+    
+    /*
+    || Construct the LRECL
+    */
+    if( vma->head[ H_FLAGS ] & HF_EXTH )
+    {
+        psf->sf.lrecl = ( vma->head[ H_XRECL + 0 ] << 24 ) |
+        ( vma->head[ H_XRECL + 1 ] << 16 ) |
+        ( vma->head[ H_XRECL + 2 ] << 8  ) |
+        ( vma->head[ H_XRECL + 3 ]       );
+    }
+    else
+    {
+        psf->sf.lrecl = ( vma->head[ H_LRECL + 0 ] << 8  ) |
+        ( vma->head[ H_LRECL + 1 ]       );
+    }
+    
+    /*
+    || Remember where the data starts
+    */
+    psf->dataoff = dataoff;
+    
+    return seterr( VMAE_NOERR );
+}
+
+/* --------------------------------------------------------------------
+|| Steps over the records of an ASIS subfile without looking at them,
+|| leaving the input just past its end.  Returns FALSE on error.
+*/
+static int
+skip_asis( VMA *vma )
+{
+    unsigned int h;
+    unsigned int l;
+    size_t lrecl;
+    
+    while( TRUE )
+    {
+        /*
+        || Get the record length...zero (or EOF) ends the subfile
+        */
+        h = get( vma );
+        if( h == EOF )
+        {
+            break;
+        }
+        
+        l = get( vma );
+        if( l == EOF )
+        {
+            seterr( VMAE_NEEDMORE );
+            return FALSE;
+        }
+        
+        lrecl = ( h << 8 ) + l;
+        if( lrecl == 0 )
+        {
+            break;
+        }
+        
+        /*
+        || Step over what's buffered and seek past the rest
+        */
+        if( lrecl <= vma->icnt )
+        {
+            vma->iptr += lrecl;
+            vma->icnt -= lrecl;
+        }
+        else if( !seek_in( vma, mytell( vma ) + lrecl ) )
+        {
+            seterr( VMAE_NEEDMORE );
+            return FALSE;
+        }
+    }
+    
+    return TRUE;
+}
+
+/* --------------------------------------------------------------------
+|| Finding the end of compressed data
+||
+|| LZW and S2 data ends at the second EOR in a row (or the first for
+|| RECFM=F), which can be anywhere in a string.  Rather than expanding
+|| the strings, each table entry keeps how many EORs its string starts
+|| and ends with (up to two) and whether it holds any EOR, two in a row
+|| or nothing else, which is all that's needed to spot the end.  An
+|| entry's runs follow from those of its halves, so only the table is
+|| kept up to date and nothing is output.
+*/
+#define ER_LEAD     0x03                /* leading EORs (0-2)        */
+#define ER_TRAIL    0x0c                /* trailing EORs (0-2)       */
+#define ER_TSHIFT   2                   /* shift for ER_TRAIL        */
+#define ER_ANY      0x10                /* holds an EOR              */
+#define ER_PAIR     0x20                /* holds two EORs in a row   */
+#define ER_ALL      0x40                /* holds nothing but EORs    */
+#define ER_EOR      ( 1 | ( 1 << ER_TSHIFT ) | ER_ANY | ER_ALL )
+
+/*
+|| Runs of string "a" followed by string "b"
+*/
+static uchar
+eor_join( uchar a, uchar b )
+{
+    unsigned int lead = a & ER_LEAD;
+    unsigned int trail = ( b & ER_TRAIL ) >> ER_TSHIFT;
+    uchar r;
+    
+    if( a & ER_ALL )
+    {
+        lead += b & ER_LEAD;
+        if( lead > 2 )
+        {
+            lead = 2;
+        }
+    }
+    
+    if( b & ER_ALL )
+    {
+        trail += ( a & ER_TRAIL ) >> ER_TSHIFT;
+        if( trail > 2 )
+        {
+            trail = 2;
+        }
+    }
+    
+    r = lead | ( trail << ER_TSHIFT ) | ( ( a | b ) & ( ER_ANY | ER_PAIR ) ) | ( a & b & ER_ALL );
+    if( ( a & ER_TRAIL ) && ( b & ER_LEAD ) )
+    {
+        r |= ER_PAIR;
+    }
+    
+    return r;
+}
+
+/*
+|| Returns TRUE if a string with runs "s" ends the data when "run" EORs
+|| came right before it
+*/
+static int
+eor_ends( uchar s, uchar run, int fixed )
+{
+    if( fixed )
+    {
+        return ( s & ER_ANY ) != 0;
+    }
+    
+    return ( s & ER_PAIR ) || ( run && ( s & ER_LEAD ) );
+}
+
+/*
+|| Steps over LZW data.  Entry reuse and the KwKwK case are exactly as
+|| in decode_lzw().
+*/
+static int
+skip_lzw( VMA *vma, int fixed )
+{
+    LZWCODE *tab = vma->cd->lzwcodes;
+    unsigned short *refs = vma->cd->lzwrefs;
+    uchar *eors = vma->cd->eors;
+    unsigned short code;
+    unsigned short pend;
+    unsigned short last;
+    unsigned short i;
+    uchar run = 0;
+    int wrapped;
+    
+    start_lzw( vma );
+    pend = vma->pend;
+    last = vma->last;
+    
+    memset( eors, 0, kodmax + 1 );
+    eors[ kodendr ] = ER_EOR;
+    
+    while( TRUE )
+    {
+        code = getcode( vma );
+        if( code == USHRT_MAX || tab[ code ].pred == LZWUNDEF )
+        {
+            return seterr( VMAE_BADDATA );
+        }
+        
+        /*
+        || The pending entry is now complete
+        */
+        tab[ pend ].schar = tab[ code ].first;
+        if( pend != TABSIZE )
+        {
+            eors[ pend ] = ( tab[ pend ].pred == LZWROOT ?
+                             eors[ tab[ code ].first ] :
+                             eor_join( eors[ tab[ pend ].pred ], eors[ tab[ code ].first ] ) );
+        }
+        
+        if( eor_ends( eors[ code ], run, fixed ) )
+        {
+            return seterr( VMAE_NOERR );
+        }
+        run = eors[ code ] & ER_TRAIL;
+        
+        /*
+        || Start building follow-on entry for this code
+        */
+        refs[ code ]++;
+        
+        wrapped = FALSE;
+        i = last;
+        do
+        {
+            ++i;
+            if( i > TABSIZE - 1 )
+            {
+                if( wrapped )
+                {
+                    break;
+                }
+                
+                wrapped = TRUE;
+                i = kodmax + 1;
+            }
+        } while( refs[ i ] );
+        
+        if( i > TABSIZE - 1 )
+        {
+            refs[ code ]--;
+            pend = TABSIZE;
+            continue;
+        }
+        
+        if( tab[ i ].pred != LZWROOT && tab[ i ].pred != LZWUNDEF )
+        {
+            refs[ tab[ i ].pred ]--;
+        }
+        
+        tab[ i ].pred = code;
+        tab[ i ].first = tab[ code ].first;
+        
+        last = i;
+        pend = i;
+    }
+    
+    return seterr( VMAE_NOERR );
+}
+
+/*
+|| Steps over S2 data.  The first code is output as it is, as in
+|| decode_s2(); after that unused entries stand for EOR.
+*/
+static int
+skip_s2( VMA *vma, int fixed )
+{
+    STRDSECT *tab = vma->cd->s2strtab;
+    uchar *eors = vma->cd->eors;
+    unsigned short slastcode;
+    unsigned short lastcode;
+    unsigned short probe;
+    unsigned int i;
+    uchar run;
+    
+    start_s2( vma );
+    
+    for( i = 0; i <= TABSIZE; i++ )
+    {
+        eors[ i ] = ( i == kodendr || i > kodmax ? ER_EOR : 0 );
+    }
+    
+    slastcode = getcode( vma );
+    if( slastcode == USHRT_MAX )
+    {
+        return seterr( VMAE_NEEDMORE );
+    }
+    
+    run = ( slastcode == kodendr ? ER_EOR : 0 );
+    if( eor_ends( run, 0, fixed ) )
+    {
+        return seterr( VMAE_NOERR );
+    }
+    run &= ER_TRAIL;
+    
+    while( TRUE )
+    {
+        lastcode = getcode( vma );
+        if( lastcode == USHRT_MAX )
+        {
+            return seterr( VMAE_BADDATA );
+        }
+        
+        if( eor_ends( eors[ lastcode ], run, fixed ) )
+        {
+            return seterr( VMAE_NOERR );
+        }
+        run = eors[ lastcode ] & ER_TRAIL;
+        
+        /*
+        || The new entry may have its halves swapped, so go by the table
+        */
+        probe = s2addnew( vma, slastcode, lastcode );
+        if( probe != S2NONE )
+        {
+            eors[ probe ] = eor_join( eors[ tab[ probe ].strleft ],
+                                      eors[ tab[ probe ].strright ] );
+        }
+        slastcode = lastcode;
+    }
+    
+    return seterr( VMAE_NOERR );
+}
+
+/*
+|| Steps over a subfile's data without decoding it, leaving the input
+|| just past its end.  Returns FALSE on error.
+*/
+static int
+skip_subfile( VMA *vma, PSUBFILE *psf )
+{
+    int fixed = ( psf->sf.recfm == 'F' );
+    int rc;
+    
+    if( psf->flags & HF_ASIS )
+    {
+        return skip_asis( vma );
+    }
+    
+    vma->bytesin = 0;
+    vma->residual = UINT_MAX;
+    vma->codepos = 0;
+    vma->codecnt = 0;
+    
+    if( psf->flags & HF_S2 )
+    {
+        rc = skip_s2( vma, fixed );
+    }
+    else
+    {
+        rc = skip_lzw( vma, fixed );
+    }
+    
+    /*
+    || Leave the input just past the last code used
+    */
+    unget_codes( vma );
+    
+    return ( rc == VMAE_NOERR );
+}
+
+/* --------------------------------------------------------------------
+|| Builds the subfile list by reading the archive front to back
+*/
+static void
+scan_archive( VMA *vma )
+{
+    PSUBFILE *psf;
+    
+    /*
+    || Set active input file
+    */
+    vma->in = vma->vfile;
+    if( !seek_in( vma, 0 ) )
+    {
+        seterr( VMAE_SEEK );
+        return;
+    }
+    
+    /*
+    || Turn off extraction
+    */
+    vma->f_extract = FALSE;
+    
+    /*
+    || Build list of subfiles
+    */
+    while( locate_file( vma ) )
+    {
+        if( add_found( vma, mytell( vma ) ) != VMAE_NOERR )
+        {
+            return;
+        }
+        psf = vma->active;
+        
+        /*
+        || Retrieve the sizes unless they've been deferred.  Either way
+        || the search resumes past the subfile's data, which a lazy open
+        || finds without decoding it.
+        */
+        if( vma->flags & VMAO_LAZY )
+        {
+            psf->sized = FALSE;
+            if( !skip_subfile( vma, psf ) )
+            {
+                return;
+            }
+        }
+        else
+        {
+            if( !extract( vma ) )
+            {
+                return;
+            }
+        }
+        set_active( vma, NULL );
+        
+        /*
+        || Prevent modification of certain header fields
+        */
+        psf->locked = TRUE;
+    }
+    
+    /*
+    || Locate file doesn't check for errors, just EOF
+    */
+    if( ferror( vma->vfile ) )
+    {
+        seterr( VMAE_RERR );
+    }
+    
+    return;
+}
+
+#if defined( HAVE_MMAP ) && defined( HAVE_THREADS )
+/* --------------------------------------------------------------------
+|| Parallel open
+||
+|| The mapped archive is split into chunks that are searched for
+|| headers concurrently.  Starting with the first, each subfile's data
+|| is then stepped over to find the next real header, the same way a
+|| lazy scan_archive() would, so candidates that are really inside
+|| subfile data are never decoded.  If the open isn't lazy, the sizing
+|| decodes of the real subfiles are spread across a pool of threads.
+*/
+#define MINCHUNK    ( 1024 * 1024 )     /* least to give a thread    */
+
+typedef struct cand
+{
+    size_t off;                         /* offset of header ID       */
+    size_t len;                         /* header length, 0 if ASCII */
+    PSUBFILE *psf;                      /* subfile, if one was made  */
+    int ec;                             /* result of sizing decode   */
+} CAND;
+
+typedef struct scanner
+{
+    const uchar *map;                   /* mapped archive            */
+    size_t maplen;                      /* length of mapping         */
+    size_t lo;                          /* first offset to check     */
+    size_t hi;                          /* last offset + 1           */
+    CAND *cands;                        /* candidates found          */
+    size_t ncand;                       /* number found              */
+    size_t maxcand;                     /* number allocated          */
+    int ec;                             /* error code                */
+} SCANNER;
+
+typedef struct sizer
+{
+    VMA *vma;                           /* the real handle           */
+    CAND *cands;                        /* subfiles to size          */
+    size_t ncand;                       /* number of subfiles        */
+    size_t next;                        /* next one to size          */
+    pthread_mutex_t lock;               /* protects next             */
+} SIZER;
+
+/* --------------------------------------------------------------------
+|| Finds every header (or ASCII header ID) starting within a chunk
+*/
+static void *
+scan_chunk( void *arg )
+{
+    SCANNER *sc = (SCANNER *) arg;
+    uchar head[ H_XDLEN ];
+    size_t ndx;
+    size_t len;
+    CAND *cand;
+    
+    for( ndx = sc->lo; ndx < sc->hi; ndx++ )
+    {
+        ndx += scan_id( &sc->map[ ndx ], sc->hi - ndx );
+        if( ndx >= sc->hi )
+        {
+            break;
+        }
+        
+        if( memcmp( &sc->map[ ndx ], aid, HIDLEN ) == 0 )
+        {
+            len = 0;
+        }
+        else if( memcmp( &sc->map[ ndx ], hid, HIDLEN ) == 0 )
+        {
+            len = check_header( head,
+                                &sc->map[ ndx + HIDLEN ],
+                                sc->maplen - ndx - HIDLEN );
+            if( len == 0 )
+            {
+                continue;
+            }
+        }
+        else
+        {
+            continue;
+        }
+        
+        /*
+        || Make room and remember it
+        */
+        if( sc->ncand == sc->maxcand )
+        {
+            sc->maxcand = sc->maxcand ? sc->maxcand * 2 : 64;
+            cand = (CAND *) realloc( sc->cands, sc->maxcand * sizeof( CAND ) );
+            if( cand == NULL )
+            {
+                sc->ec = VMAE_MEM;
+                break;
+            }
+            sc->cands = cand;
+        }
+        
+        cand = &sc->cands[ sc->ncand++ ];
+        cand->off = ndx;
+        cand->len = len;
+        cand->psf = NULL;
+        cand->ec = VMAE_NOERR;
+    }
+    
+    return NULL;
+}
+
+/* --------------------------------------------------------------------
+|| Sizes subfiles until there aren't any left.  Each thread decodes
+|| with its own copy of the handle and coder, made once.
+*/
+static void *
+size_cands( void *arg )
+{
+    SIZER *sz = (SIZER *) arg;
+    VMA *vma;
+    CODER *cd;
+    CAND *cand;
+    size_t i;
+    
+    vma = (VMA *) malloc( sizeof( VMA ) );
+    cd = (CODER *) malloc( sizeof( CODER ) );
+    
+    if( vma != NULL && cd != NULL )
+    {
+        memcpy( vma, sz->vma, sizeof( VMA ) );
+        vma->cd = cd;
+        vma->in = vma->vfile;
+        vma->f_extract = FALSE;
+        vma->f_text = FALSE;
+    }
+    
+    while( TRUE )
+    {
+        pthread_mutex_lock( &sz->lock );
+        i = sz->next++;
+        pthread_mutex_unlock( &sz->lock );
+        
+        if( i >= sz->ncand )
+        {
+            break;
+        }
+        
+        cand = &sz->cands[ i ];
+        if( vma == NULL || cd == NULL )
+        {
+            cand->ec = VMAE_MEM;
+            continue;
+        }
+        
+        vma->active = cand->psf;
+        seterr( VMAE_NOERR );
+        
+        if( !extract( vma ) )
+        {
+            cand->ec = vma->lasterr;
+        }
+    }
+    
+    if( vma != NULL )
+    {
+        free( vma );
+    }
+    
+    if( cd != NULL )
+    {
+        free( cd );
+    }
+    
+    return NULL;
+}
+
+/* --------------------------------------------------------------------
+|| Finds all header candidates in the mapped archive, in file order
+*/
+static CAND *
+find_cands( VMA *vma, size_t *ncand )
+{
+    SCANNER sc[ MAXTHREADS ];
+    void *args[ MAXTHREADS ];
+    CAND *cands;
+    size_t last;
+    size_t chunk;
+    size_t cnt;
+    int nthr;
+    int i;
+    
+    /*
+    || Only offsets that could hold a complete header are considered
+    */
+    last = vma->vmaplen - ( HIDLEN + H_DLEN ) + 1;
+    
+    nthr = cpus();
+    chunk = ( last + nthr - 1 ) / nthr;
+    if( chunk < MINCHUNK )
+    {
+        chunk = MINCHUNK;
+    }
+    
+    for( i = 0; i < nthr && (size_t) i * chunk < last; i++ )
+    {
+        sc[ i ].map = vma->vmap;
+        sc[ i ].maplen = vma->vmaplen;
+        sc[ i ].lo = i * chunk;
+        sc[ i ].hi = ( last - sc[ i ].lo > chunk ? sc[ i ].lo + chunk : last );
+        sc[ i ].cands = NULL;
+        sc[ i ].ncand = 0;
+        sc[ i ].maxcand = 0;
+        sc[ i ].ec = VMAE_NOERR;
+        args[ i ] = &sc[ i ];
+    }
+    nthr = i;
+    
+    run_threads( scan_chunk, args, nthr );
+    
+    /*
+    || Stitch the chunks back together
+    */
+    cnt = 0;
+    for( i = 0; i < nthr; i++ )
+    {
+        if( sc[ i ].ec != VMAE_NOERR )
+        {
+            seterr( sc[ i ].ec );
+        }
+        cnt += sc[ i ].ncand;
+    }
+    
+    cands = NULL;
+    if( vma->lasterr == VMAE_NOERR )
+    {
+        cands = (CAND *) malloc( ( cnt ? cnt : 1 ) * sizeof( CAND ) );
+        if( cands == NULL )
+        {
+            seterr( VMAE_MEM );
+        }
+    }
+    
+    *ncand = 0;
+    for( i = 0; i < nthr; i++ )
+    {
+        if( cands != NULL && sc[ i ].ncand != 0 )
+        {
+            memcpy( &cands[ *ncand ],
+                    sc[ i ].cands,
+                    sc[ i ].ncand * sizeof( CAND ) );
+            *ncand += sc[ i ].ncand;
+        }
+        
+        if( sc[ i ].cands != NULL )
+        {
+            free( sc[ i ].cands );
+        }
+    }
+    
+    return cands;
+}
+
+/* --------------------------------------------------------------------
+|| Builds the subfile list using multiple threads.  Returns FALSE if
+|| scan_archive() should be used instead.
+*/
+static int
+scan_parallel( VMA *vma )
+{
+    SIZER sz;
+    void *args[ MAXTHREADS ];
+    CAND *cands;
+    CAND *cand;
+    size_t ncand;
+    size_t nreal;
+    size_t pos;
+    size_t i;
+    PSUBFILE *psf;
+    int nthr;
+    int n;
+    
+    if( !( vma->flags & VMAO_PARALLEL ) ||
+        vma->vmap == NULL ||
+        vma->vmaplen < HIDLEN + H_DLEN ||
+        cpus() < 2 )
+    {
+        return FALSE;
+    }
+    
+    vma->in = vma->vfile;
+    vma->f_extract = FALSE;
+    
+    /*
+    || Step 1:  find everything that looks like a header
+    */
+    cands = find_cands( vma, &ncand );
+    if( cands == NULL )
+    {
+        return TRUE;
+    }
+    
+    /*
+    || Step 2:  follow the chain of subfiles from the first header.  The
+    || next real header is the first candidate past the end of the data
+    || before it and anything in between is just data that looked like
+    || one.  Only the real ones are kept.
+    */
+    pos = 0;
+    nreal = 0;
+    for( i = 0; i < ncand; i++ )
+    {
+        cand = &cands[ i ];
+        if( cand->off < pos )
+        {
+            continue;
+        }
+        
+        /*
+        || VMARC that's been converted to ASCII?
+        */
+        if( cand->len == 0 )
+        {
+            seterr( VMAE_ASCII );
+            break;
+        }
+        
+        check_header( vma->head,
+                      &vma->vmap[ cand->off + HIDLEN ],
+                      vma->vmaplen - cand->off - HIDLEN );
+        
+        if( add_found( vma, cand->off + HIDLEN + cand->len ) != VMAE_NOERR )
+        {
+            break;
+        }
+        psf = vma->active;
+        
+        if( !seek_in( vma, psf->dataoff ) )
+        {
+            seterr( VMAE_SEEK );
+            break;
+        }
+        
+        if( !skip_subfile( vma, psf ) )
+        {
+            break;
+        }
+        pos = mytell( vma );
+        set_active( vma, NULL );
+        
+        psf->sized = FALSE;
+        psf->locked = TRUE;
+        
+        cand->psf = psf;
+        cands[ nreal++ ] = *cand;
+    }
+    
+    /*
+    || Step 3:  size the real ones on a pool of threads, unless that's
+    || been deferred
+    */
+    if( vma->lasterr == VMAE_NOERR && !( vma->flags & VMAO_LAZY ) )
+    {
+        sz.vma = vma;
+        sz.cands = cands;
+        sz.ncand = nreal;
+        sz.next = 0;
+        pthread_mutex_init( &sz.lock, NULL );
+        
+        nthr = cpus();
+        for( n = 0; n < nthr; n++ )
+        {
+            args[ n ] = &sz;
+        }
+        run_threads( size_cands, args, nthr );
+        
+        pthread_mutex_destroy( &sz.lock );
+        
+        /*
+        || scan_archive() would have stopped at the first one that failed,
+        || so drop the ones after it
+        */
+        for( i = 0; i < nreal; i++ )
+        {
+            if( cands[ i ].ec != VMAE_NOERR )
+            {
+                seterr( cands[ i ].ec );
+                cands[ i ].psf->next = NULL;
+                vma->sflast = cands[ i ].psf;
+                
+                while( ++i < nreal )
+                {
+                    name_unlink( vma, cands[ i ].psf );
+                    free( cands[ i ].psf );
+                }
+            }
+        }
+    }
+    
+    free( cands );
+    
+    return TRUE;
+}
+#else
+#define scan_parallel( vma ) FALSE
+#endif
+
+/* ********************************************************************
+|| Public functions
+******************************************************************** */
+
+/* ====================================================================
+|| Returns ptr to error text
+*/
+const char *
+vma_strerror( int ec )
+{
+    if( ec < 0 || ec > VMAE_NUMERRORS )
+    {
+        return "Invalid error code passed to vma_strerror()";
+    }
+    
+    return etext[ ec ];
+}
+
+/* ====================================================================
+|| Builds conversion table based on UCMs
+*/
+int
+vma_setconv( void *vvma, const char *fucm, const char *tucm )
+{
+    VMA *vma = (VMA *)vvma;
+    int i;
+    int subchar;
+    ENT tmap[ 256 ];
+    ENT fmap[ 256 ];
+    
+    /*
+    || Verify VMA
+    */
+    if( vma == NULL )
+    {
+        return VMAE_BADARG;
+    }
+    
+    /*
+    || Verify "from" UCM
+    */
+    if( fucm == NULL && tucm != NULL )
+    {
+        return seterr( VMAE_BADARG );
+    }
+    
+    /*
+    || Verify "to" UCM
+    */
+    if( tucm == NULL && fucm != NULL )
+    {
+        return seterr( VMAE_BADARG );
+    }
+    
+    /*
+    || If both are null, then reset to default tables
+    */
+    if( tucm == NULL && fucm == NULL )
+    {
+#if defined(__MVS__)
+        memcpy( vma->e2a_map, e2e_tab, 256 );
+        memcpy( vma->a2e_map, a2e_tab, 256 );
+#else
+        memcpy( vma->e2a_map, e2a_tab, 256 );
+        memcpy( vma->a2e_map, a2e_tab, 256 );
+#endif
+        
+        return VMAE_NOERR;
+    }
+    
+    /*
+    || Load "from" UCM
+    */
+    if( !loaducm( vma, fucm, fmap, &subchar ) )
+    {
+        return vma->lasterr;
+    }
+    
+    /*
+    || Load "to" UCM
+    */
+    if( !loaducm( vma, tucm, tmap, &subchar ) )
+    {
+        return vma->lasterr;
+    }
+    
+    /*
+    || Make sure the maps are sorted
+    */
+    qsort( &fmap, 256, sizeof( ENT ), cmp );
+    qsort( &tmap, 256, sizeof( ENT ), cmp );
+    
+    /*
+    || Transfer to caller's mapping
+    */
+    for( i = 0; i < 256; i++ )
+    {
+        ENT *ent;
+        
+        ent = (ENT *) bsearch( &fmap[ i ],
+                              tmap,
+                              256,
+                              sizeof( ENT ),
+                              cmp );
+        if( ent == NULL )
+        {
+            vma->e2a_map[ i ] = subchar;
+        }
+        else
+        {
+            vma->e2a_map[ i ] = ent->b;
+        }
+    }
+    
+    /*
+    || Transfer to caller's reverse mapping
+    */
+    for( i = 0; i < 256; i++ )
+    {
+        ENT *ent;
+        
+        ent = (ENT *) bsearch( &tmap[ i ],
+                              fmap,
+                              256,
+                              sizeof( ENT ),
+                              cmp );
+        if( ent == NULL )
+        {
+            vma->a2e_map[ i ] = subchar;
+        }
+        else
+        {
+            vma->a2e_map[ i ] = ent->b;
+        }
+    }
+    
+    return VMAE_NOERR;
+}
+
+static const int days[] =
+{
+    0, 31, 59, 90, 120, 151, 181, 212, 243, 273, 304, 334
+};
+
+/* --------------------------------------------------------------------
+|| Readies the active subfile for extraction in the current mode:
+|| determines the data type if need be and sizes the output buffer.
+*/
+static int
+setup_extract( VMA *vma )
+{
+    PSUBFILE *psf = vma->active;
+    int rc;
+    int mode = vma->mode;
+    int dtype;
+    
+    /*
+    || Determine which file the subfile resides in.
+    */
+    vma->in = ( psf->temp ? vma->tfile : vma->vfile );
+    
+    /*
+    || If user requested AUTO and we haven't previously scanned the
+    || subfile, then we must do so now.
+    */
+    if( mode == VMAX_AUTO )
+    {
+        lock_shared( vma );
+        dtype = psf->sf.dtype;
+        unlock_shared( vma );
+        
+        if( dtype == VMAD_UNKNOWN )
+        {
+            /*
+            || Don't know what type it is yet.
+            */
+            vma->f_text = FALSE;
+            
+            /*
+            || Turn extraction off
+            */
+            vma->f_extract = FALSE;
+            
+            /*
+            || And indicate we only want to scan first 1024 bytes
+            */
+            vma->f_scanning = TRUE;
+            
+            /*
+            || Perform a simulated extraction
+            */
+            rc = extract( vma );
+            
+            /*
+            || Disable scanning mode
+            */
+            vma->f_scanning = FALSE;
+            
+            /*
+            || Bail if the extraction wasn't successful
+            */
+            if( !rc )
+            {
+                return vma->lasterr;
+            }
+            
+            /*
+            || Remember it
+            */
+            dtype = vma->dtype;
+            
+            lock_shared( vma );
+            psf->sf.dtype = dtype;
+            unlock_shared( vma );
+        }
+        
+        /*
+        || Set the extraction type
+        */
+        mode = dtype;
+    }
+    
+    /*
+    || Turn extraction on
+    */
+    vma->f_extract = TRUE;
+    
+    /*
+    || Convert to ASCII?
+    */
+    vma->f_text = FALSE;
+    if( mode == VMAX_TEXT )
+    {
+        vma->f_text = TRUE;
+    }
+    
+    /*
+    || Cache RECFM and LRECL
+    */
+    vma->recfm = psf->sf.recfm;
+    vma->lrecl = psf->sf.lrecl;
+    
+    /*
+    || Calculate the maximum size of the output buffer
+    */
+    vma->omax = ( vma->recfm == 'F' ? vma->lrecl : vma->lrecl + 4 ) +
+#if defined( _WIN32 )
+    ( vma->f_text ? 2 : 0 );
+#else
+    ( vma->f_text ? 1 : 0 );
+#endif
+    
+#if defined(__MVS__)
+    /*
+    || Ensure LRECL is in range
+    */
+    if( vma->f_zos )
+    {
+        if( vma->recfm == 'V' && vma->omax + 4 > 32760 )
+        {
+            return seterr( VMAE_LRECL );
+        }
+    }
+    else if( vma->f_zvm )
+    {
+        if( vma->omax > 65535 )
+        {
+            return seterr( VMAE_LRECL );
+        }
+    }
+#endif
+    
+    return seterr( VMAE_NOERR );
+}
+
+#if defined( HAVE_PIPELINE )
+/* --------------------------------------------------------------------
+|| The decoder's side of the output ring.  Records are copied in as
+|| room is made, so they may wrap around the end of the ring.
+*/
+static int
+write_pipe( VMA *vma, const uchar *buf, size_t len )
+{
+    VPIPE *p = vma->pipe;
+    unsigned spins = 0;
+    size_t head = p->whead;
+    size_t room;
+    size_t n;
+    
+    while( len > 0 )
+    {
+        room = PIPEOUT - ( head - pipe_get( p->wtail ) );
+        if( room == 0 )
+        {
+            if( pipe_get( p->werr ) )
+            {
+                return FALSE;
+            }
+            pipe_wait( &spins );
+            continue;
+        }
+        spins = 0;
+        
+        n = PIPEOUT - ( head % PIPEOUT );
+        if( n > room )
+        {
+            n = room;
+        }
+        if( n > len )
+        {
+            n = len;
+        }
+        
+        memcpy( p->out + ( head % PIPEOUT ), buf, n );
+        head += n;
+        buf += n;
+        len -= n;
+        pipe_set( p->whead, head );
+    }
+    
+    return !pipe_get( p->werr );
+}
+
+/*
+|| Writer thread.  Hands whatever is in the ring to the real writer
+|| until the decoder is done and the ring is empty, or a write fails.
+*/
+static void *
+pipe_writer( void *arg )
+{
+    VPIPE *p = (VPIPE *) arg;
+    unsigned spins = 0;
+    size_t tail = 0;
+    size_t head;
+    size_t n;
+    int done;
+    
+    while( TRUE )
+    {
+        done = pipe_get( p->wdone );
+        head = pipe_get( p->whead );
+        if( head == tail )
+        {
+            if( done )
+            {
+                break;
+            }
+            pipe_wait( &spins );
+            continue;
+        }
+        spins = 0;
+        
+        n = PIPEOUT - ( tail % PIPEOUT );
+        if( n > head - tail )
+        {
+            n = head - tail;
+        }
+        
+        if( !p->owrite( p->vma, p->out + ( tail % PIPEOUT ), n ) )
+        {
+            pipe_set( p->werr, TRUE );
+            break;
+        }
+        
+        tail += n;
+        pipe_set( p->wtail, tail );
+    }
+    
+    return NULL;
+}
+
+/*
+|| Whether the active subfile is worth pipelining.  Unsized subfiles
+|| are assumed to be.  Ones still in the temp file aren't since the
+|| reader can't see what stdio hasn't written yet.
+*/
+static int
+use_pipe( VMA *vma, int ( *owrite )( VMA *, const uchar *, size_t ) )
+{
+    size_t len = PIPEMIN;
+    
+    if( !( vma->flags & VMAO_PIPELINE ) || !vma->f_extract ||
+        vma->active->temp ||
+        ( owrite != write_file && owrite != write_fd ) )
+    {
+        return FALSE;
+    }
+    
+    lock_shared( vma );
+    if( vma->active->sized )
+    {
+        len = vma->active->sf.compressed;
+    }
+    unlock_shared( vma );
+    
+    return ( len >= PIPEMIN && cpus() > 1 );
+}
+
+/*
+|| extract() with the reader and writer on their own threads.  The
+|| input is read with pread() here too, so it's left positioned (and
+|| tell_in() answers) just as it would be otherwise.  If the threads
+|| can't be had, it's simply extracted without them.
+*/
+static int
+extract_piped( VMA *vma )
+{
+    VPIPE *p;
+    char f_pread = vma->f_pread;
+    int started;
+    int rc;
+    int i;
+    
+    if( vma->f_stream )
+    {
+        seterr( VMAE_STREAM );
+        return FALSE;
+    }
+    
+    p = (VPIPE *) calloc( 1, sizeof( VPIPE ) );
+    if( p == NULL )
+    {
+        return extract( vma );
+    }
+    
+    p->out = (uchar *) malloc( PIPEOUT );
+    p->vma = vma;
+    p->owrite = vma->owrite;
+    vma->pipe = p;
+    
+    if( p->out == NULL || pthread_create( &p->wtid, NULL, pipe_writer, p ) != 0 )
+    {
+        vma->pipe = NULL;
+        free( p->out );
+        free( p );
+        return extract( vma );
+    }
+    vma->owrite = write_pipe;
+    
+    /*
+    || Get positioned and start reading ahead
+    */
+    vma->f_pread = TRUE;
+    
+    started = start_extract( vma );
+    if( started && !vma->imap )
+    {
+        p->rfd = fileno( vma->in );
+        p->roff = vma->ioff;
+        
+        for( i = 0; i < PIPEBLKS; i++ )
+        {
+            p->blk[ i ] = (uchar *) malloc( BUFLEN );
+            if( p->blk[ i ] == NULL )
+            {
+                break;
+            }
+        }
+        
+        p->f_reader = ( i == PIPEBLKS &&
+                        pthread_create( &p->rtid, NULL, pipe_reader, p ) == 0 );
+    }
+    
+    /*
+    || Decode
+    */
+    rc = ( started && run_extract( vma ) == VMAE_NOERR );
+    
+    /*
+    || Stop the reader and let the writer finish up
+    */
+    if( p->f_reader )
+    {
+        pipe_set( p->rstop, TRUE );
+        pthread_join( p->rtid, NULL );
+        p->f_reader = FALSE;
+    }
+    
+    pipe_set( p->wdone, TRUE );
+    pthread_join( p->wtid, NULL );
+    
+    if( rc && p->werr )
+    {
+        seterr( VMAE_WERR );
+        rc = FALSE;
+    }
+    
+    vma->owrite = p->owrite;
+    vma->pipe = NULL;
+    
+    if( started )
+    {
+        rc = end_extract( vma, rc );
+    }
+    
+    /*
+    || Leave stdio where the buffered input ends
+    */
+    vma->f_pread = f_pread;
+    if( !f_pread && !vma->imap && fseek( vma->in, vma->ioff, SEEK_SET ) != 0 && rc )
+    {
+        seterr( VMAE_SEEK );
+        rc = FALSE;
+    }
+    
+    for( i = 0; i < PIPEBLKS; i++ )
+    {
+        free( p->blk[ i ] );
+    }
+    free( p->out );
+    free( p );
+    
+    return rc;
+}
+
+#endif
+
+/* --------------------------------------------------------------------
+|| Extracts the active subfile (once setup_extract() has been called)
+|| through the given writer
+*/
+static int
+extract_to( VMA *vma, int ( *owrite )( VMA *, const uchar *, size_t ) )
+{
+    int rc;
+    
+    /*
+    || (Re)Alocate output buffer
+    */
+    vma->obuf = (uchar *) malloc( vma->omax + 1 );
+    if( vma->obuf == NULL )
+    {
+        seterr( VMAE_MEM );
+        return FALSE;
+    }
+    vma->opos = 0;
+    vma->owrite = owrite;
+    
+    /*
+    || Extract the file
+    */
+#if defined( HAVE_PIPELINE )
+    if( use_pipe( vma, owrite ) )
+    {
+        rc = extract_piped( vma );
+    }
+    else
+#endif
+    rc = extract( vma );
+    
+    /*
+    || Get rid of the buffer
+    */
+    free( vma->obuf );
+    vma->obuf = NULL;
+    
+    return rc;
+}
+
+/* --------------------------------------------------------------------
+|| Returns the time an extracted file gets from its subfile's date
+*/
+static time_t
+file_time( SUBFILE *sf )
+{
+    struct tm bt;
+    
+    memset( &bt, 0, sizeof( bt ) );
+    bt.tm_sec = sf->second;
+    bt.tm_min = sf->minute;
+    bt.tm_hour = sf->hour;
+    bt.tm_mday = sf->day;
+    bt.tm_mon = sf->month - 1;
+    bt.tm_year = sf->year - 1900;
+    bt.tm_wday = 0;
+    bt.tm_yday = 0;
+    bt.tm_isdst = -1;
+    
+    return mktime( &bt );
+}
+
+/* ====================================================================
+|| Extract currently active subfile
+*/
+int
+vma_extract( void *vvma, const char *name )
+{
+    VMA *vma = (VMA *)vvma;
+    PSUBFILE *psf;
+    char openflags[ 64 ];
+    struct utimbuf ut;
+    time_t ct;
+    int rc;
+#if defined( __MVS__ )
+    fldata_t fd;
+#endif
+    
+    /*
+    || Verify VMA
+    */
+    if( vma == NULL )
+    {
+        return VMAE_BADARG;
+    }
+    
+    /*
+    || Verify name
+    */
+    if( name == NULL )
+    {
+        return seterr( VMAE_BADARG );
+    }
+    
+    /*
+    || Ensure an active subfile
+    */
+    psf = vma->active;
+    if( psf == NULL )
+    {
+        return seterr( VMAE_INACT );
+    }
+    
+    /*
+    || Reset error
+    */
+    seterr( VMAE_NOERR );
+    
+    /*
+    || The decoder belongs to the stream while one is open
+    */
+    if( vma->f_stream )
+    {
+        return seterr( VMAE_STREAM );
+    }
+    
+    /*
+    || Work out how it's to be extracted
+    */
+    if( setup_extract( vma ) != VMAE_NOERR )
+    {
+        return vma->lasterr;
+    }
+    
+    /*
+    || Build the open flags
+    */
+    sprintf( openflags,
+             "wb"
+#if defined( __MVS__ )
+             ",type=record,noseek,recfm=%c,lrecl=%d,blksize=0",
+             vma->recfm,
+             vma->omax
+#endif
+           );
+ 
+    
+    /*
+    || And open the output file
+    */
+    vma->out = fopen( name, openflags );
+    if( vma->out == NULL )
+    {
+        return seterr( VMAE_OOPEN );
+    }
+    
+    /*
+    || Extract the file
+    */
+    rc = extract_to( vma, write_file );
+    
+#if defined( __MVS__ )
+    /*
+    || Retrieve the real filename before closing the file
+    */
+    if( rc && vma->f_zvm )
+    {
+        fldata( vma->out, NULL, &fd );
+    }
+#endif
+ 
+    /*
+    || Close the file
+    */
+    fclose( vma->out );
+    vma->out = NULL;
+    
+    /*
+    || Attempt to set the file times
+    */
+    if( rc )
+    {
+#if defined( __MVS__ )
+        if( vma->f_zos )
+        {
+            /* not much we can do here */
+        }
+        else if( vma->f_zvm )
+        {
+            char cmd[ 256 ];
+ 
+            sprintf( cmd,
+                     "DMSPLU "
+                     "%s "
+                     "%02d/%02d/%04d "
+                     "%02d:%02d:%02d",
+                     fd.__dsname,
+                     vma->active->sf.month,
+                     vma->active->sf.day,
+                     vma->active->sf.year,
+                     vma->active->sf.hour,
+                     vma->active->sf.minute,
+                     vma->active->sf.second );
+            system( cmd );
+        }
+        else
+#endif
+        {
+        /*
+        || Set the last access and modification times
+        */
+        ct = file_time( &psf->sf );
+        if( ct != (time_t) -1 )
+        {
+            ut.actime = ct;
+            ut.modtime = ct;
+            
+            utime( name, &ut );
+        }
+    }
+    }
+    
+    return vma->lasterr;
+}
+
+/* ====================================================================
+|| Extract currently active subfile to an open file descriptor.  The
+|| descriptor is left open and the file times aren't touched.
+*/
+int
+vma_extract_fd( void *vvma, int fd )
+{
+    VMA *vma = (VMA *) vvma;
+    
+    /*
+    || Verify VMA
+    */
+    if( vma == NULL )
+    {
+        return VMAE_BADARG;
+    }
+    
+    /*
+    || Verify descriptor
+    */
+    if( fd < 0 )
+    {
+        return seterr( VMAE_BADARG );
+    }
+    
+    /*
+    || Ensure an active subfile
+    */
+    if( vma->active == NULL )
+    {
+        return seterr( VMAE_INACT );
+    }
+    
+    /*
+    || Reset error
+    */
+    seterr( VMAE_NOERR );
+    
+    /*
+    || The decoder belongs to the stream while one is open
+    */
+    if( vma->f_stream )
+    {
+        return seterr( VMAE_STREAM );
+    }
+    
+    /*
+    || Work out how it's to be extracted
+    */
+    if( setup_extract( vma ) != VMAE_NOERR )
+    {
+        return vma->lasterr;
+    }
+    
+    vma->ofd = fd;
+    extract_to( vma, write_fd );
+    
+    return vma->lasterr;
+}
+
+/* --------------------------------------------------------------------
+|| Extracts the active subfile (once setup_extract() has been called)
+|| into vma->sbuf.  Whatever was decoded is left there even if it
+|| fails, unless the buffer couldn't be had at all.
+*/
+static int
+extract_mem( VMA *vma )
+{
+    /*
+    || Start out big enough for the whole thing if the size is known
+    || (text mode adds line ends, so it may still have to grow)
+    */
+    vma->slen = 0;
+    
+    lock_shared( vma );
+    vma->smax = ( vma->active->sized ? vma->active->sf.uncompressed : 0 );
+    unlock_shared( vma );
+    
+    if( vma->smax < BUFLEN )
+    {
+        vma->smax = BUFLEN;
+    }
+    
+    vma->sbuf = (uchar *) malloc( vma->smax );
+    if( vma->sbuf == NULL )
+    {
+        vma->smax = 0;
+        seterr( VMAE_MEM );
+        return FALSE;
+    }
+    
+    return extract_to( vma, write_mem );
+}
+
+/* ====================================================================
+|| Extract currently active subfile to memory.  "*buf" receives a
+|| malloc()ed buffer holding "*len" bytes that the caller must free().
+*/
+int
+vma_extract_mem( void *vvma, void **buf, size_t *len )
+{
+    VMA *vma = (VMA *) vvma;
+    
+    /*
+    || Verify VMA
+    */
+    if( vma == NULL )
+    {
+        return VMAE_BADARG;
+    }
+    
+    /*
+    || Verify args
+    */
+    if( buf == NULL || len == NULL )
+    {
+        return seterr( VMAE_BADARG );
+    }
+    *buf = NULL;
+    *len = 0;
+    
+    /*
+    || Ensure an active subfile
+    */
+    if( vma->active == NULL )
+    {
+        return seterr( VMAE_INACT );
+    }
+    
+    /*
+    || Reset error
+    */
+    seterr( VMAE_NOERR );
+    
+    /*
+    || The decoder belongs to the stream while one is open
+    */
+    if( vma->f_stream )
+    {
+        return seterr( VMAE_STREAM );
+    }
+    
+    /*
+    || Work out how it's to be extracted
+    */
+    if( setup_extract( vma ) != VMAE_NOERR )
+    {
+        return vma->lasterr;
+    }
+    
+    /*
+    || Hand the buffer over if it worked
+    */
+    if( extract_mem( vma ) )
+    {
+        *buf = vma->sbuf;
+        *len = vma->slen;
+    }
+    else
+    {
+        free( vma->sbuf );
+    }
+    
+    vma->sbuf = NULL;
+    vma->smax = 0;
+    vma->slen = 0;
+    
+    return vma->lasterr;
+}
+
+/* ====================================================================
+|| Extract currently active subfile through a callback.  The callback
+|| returns 0 to keep going, anything else stops with VMAE_WERR.
+*/
+int
+vma_extract_cb( void *vvma,
+                int ( *cb )( void *ctx, const void *buf, size_t len ),
+                void *ctx )
+{
+    VMA *vma = (VMA *) vvma;
+    
+    /*
+    || Verify VMA
+    */
+    if( vma == NULL )
+    {
+        return VMAE_BADARG;
+    }
+    
+    /*
+    || Verify callback
+    */
+    if( cb == NULL )
+    {
+        return seterr( VMAE_BADARG );
+    }
+    
+    /*
+    || Ensure an active subfile
+    */
+    if( vma->active == NULL )
+    {
+        return seterr( VMAE_INACT );
+    }
+    
+    /*
+    || Reset error
+    */
+    seterr( VMAE_NOERR );
+    
+    /*
+    || The decoder belongs to the stream while one is open
+    */
+    if( vma->f_stream )
+    {
+        return seterr( VMAE_STREAM );
+    }
+    
+    /*
+    || Work out how it's to be extracted
+    */
+    if( setup_extract( vma ) != VMAE_NOERR )
+    {
+        return vma->lasterr;
+    }
+    
+    vma->ocb = cb;
+    vma->octx = ctx;
+    extract_to( vma, write_cb );
+    
+    return vma->lasterr;
+}
+
+/* --------------------------------------------------------------------
+|| Extract all
+||
+|| Each subfile to extract becomes a job.  The jobs are handed out
+|| biggest first, so the long ones start early and the short ones fill
+|| in around them, to a pool of threads each decoding with its own
+|| context.  vma_add_all() runs its jobs the same way.
+||
+|| Jobs that write the same file are chained together in archive order
+|| and the chain is handed out as one job, so they run one after the
+|| other on the same thread and the last one still wins.
+*/
+typedef struct xjob
+{
+    PSUBFILE *psf;                      /* subfile to extract        */
+    char *name;                         /* output (input) file name  */
+    size_t weight;                      /* (estimated) compressed    */
+    size_t ndx;                         /* position in archive       */
+    int rc;                             /* result of extraction      */
+    char run;                           /* extraction was attempted  */
+    char dup;                           /* name is used again        */
+    char chained;                       /* run after an earlier job  */
+    struct xjob *same;                  /* next job with the name    */
+    FILE *seg;                          /* added data's segment file */
+    long segoff;                        /* where it starts in there  */
+} XJOB;
+
+typedef struct xbatch XBATCH;
+
+/*
+|| Orders jobs biggest first, then as they are in the archive
+*/
+static int
+cmp_jobs( const void *e1, const void *e2 )
+{
+    const XJOB *j1 = *(const XJOB **) e1;
+    const XJOB *j2 = *(const XJOB **) e2;
+    
+    if( j1->weight != j2->weight )
+    {
+        return ( j1->weight > j2->weight ? -1 : 1 );
+    }
+    
+    return ( j1->ndx < j2->ndx ? -1 : ( j1->ndx > j2->ndx ) );
+}
+
+/*
+|| Orders jobs by name, then as they are in the archive
+*/
+static int
+cmp_names( const void *e1, const void *e2 )
+{
+    const XJOB *j1 = *(const XJOB **) e1;
+    const XJOB *j2 = *(const XJOB **) e2;
+    int rc;
+    
+    rc = strcmp( j1->name, j2->name );
+    if( rc != 0 )
+    {
+        return rc;
+    }
+    
+    return ( j1->ndx < j2->ndx ? -1 : ( j1->ndx > j2->ndx ) );
+}
+
+/*
+|| Chains together the jobs that write the same file.  Returns FALSE
+|| (with the error set) if there isn't the memory.
+*/
+static int
+chain_names( VMA *vma, XJOB *jobs, size_t njob )
+{
+    XJOB **order;
+    XJOB *head;
+    size_t i;
+    
+    if( njob < 2 )
+    {
+        return TRUE;
+    }
+    
+    order = (XJOB **) malloc( njob * sizeof( XJOB * ) );
+    if( order == NULL )
+    {
+        seterr( VMAE_MEM );
+        return FALSE;
+    }
+    
+    for( i = 0; i < njob; i++ )
+    {
+        order[ i ] = &jobs[ i ];
+    }
+    qsort( order, njob, sizeof( XJOB * ), cmp_names );
+    
+    head = order[ 0 ];
+    for( i = 1; i < njob; i++ )
+    {
+        if( strcmp( order[ i ]->name, head->name ) != 0 )
+        {
+            head = order[ i ];
+            continue;
+        }
+        
+        /*
+        || The head's weight covers the whole chain
+        */
+        order[ i - 1 ]->same = order[ i ];
+        order[ i ]->chained = TRUE;
+        order[ i ]->dup = TRUE;
+        head->dup = TRUE;
+        head->weight += order[ i ]->weight;
+    }
+    
+    free( order );
+    
+    return TRUE;
+}
+
+/*
+|| Estimates the compressed size of a subfile that hasn't been sized
+|| from where the next one starts
+*/
+static size_t
+job_weight( VMA *vma, PSUBFILE *psf, size_t flen )
+{
+    PSUBFILE *next;
+    size_t weight = 0;
+    
+    lock_shared( vma );
+    if( psf->sized )
+    {
+        weight = psf->sf.compressed;
+    }
+    unlock_shared( vma );
+    
+    if( weight != 0 || psf->temp )
+    {
+        return weight;
+    }
+    
+    for( next = psf->next; next != NULL && next->temp; next = next->next )
+    {
+    }
+    
+    if( next != NULL )
+    {
+        return ( next->dataoff > psf->dataoff ? next->dataoff - psf->dataoff : 0 );
+    }
+    
+    return ( flen > psf->dataoff ? flen - psf->dataoff : 0 );
+}
+
+#if defined( HAVE_BATCH )
+/* --------------------------------------------------------------------
+|| Batched output
+||
+|| Small subfiles are decoded into memory and their files are written
+|| a batch at a time, so the opens, writes and closes of a whole batch
+|| can be handed to the system at once (through io_uring on Linux) and
+|| overlap instead of each waiting its turn.  That's most of the time
+|| spent extracting lots of little files, more so on network file
+|| systems.  The files end up just as vma_extract() leaves them.
+*/
+#define BATCHFILES  64                  /* most files in a batch     */
+#define BATCHBYTES  ( 8 * 1024 * 1024 ) /* most data in a batch      */
+#define BATCHSMALL  65536               /* largest subfile to batch  */
+
+typedef struct xfile
+{
+    XJOB *job;                          /* job the data belongs to   */
+    uchar *buf;                         /* extracted data            */
+    size_t len;                         /* bytes in buf              */
+    int rc;                             /* how extracting it went    */
+    int err;                            /* how making the file went  */
+    int fd;                             /* output descriptor         */
+    int res;                            /* result of last operation  */
+} XFILE;
+
+#if defined( HAVE_IO_URING )
+typedef struct uring
+{
+    int fd;                             /* ring descriptor           */
+    unsigned *sqhead;                   /* submission queue          */
+    unsigned *sqtail;
+    unsigned *sqmask;
+    unsigned *sqarray;
+    struct io_uring_sqe *sqes;
+    unsigned *cqhead;                   /* completion queue          */
+    unsigned *cqtail;
+    unsigned *cqmask;
+    struct io_uring_cqe *cqes;
+    void *sqmap;                        /* mappings                  */
+    size_t sqlen;
+    void *cqmap;
+    size_t cqlen;
+    size_t sqeslen;
+} URING;
+#endif
+
+struct xbatch
+{
+    XFILE files[ BATCHFILES ];          /* files waiting to be made  */
+    int cnt;                            /* number of files           */
+    size_t bytes;                       /* data waiting              */
+#if defined( HAVE_IO_URING )
+    URING ring;                         /* ring for this batch       */
+    char f_ring;                        /* ring is usable            */
+    char f_tried;                       /* ring setup was attempted  */
+#endif
+};
+
+/*
+|| Sets the file's times once its data is all there and notes how
+|| making it went
+*/
+static void
+finish_file( XFILE *xf )
+{
+    struct timespec ts[ 2 ];
+    time_t ct;
+    
+    if( xf->res < 0 || (size_t) xf->res != xf->len )
+    {
+        xf->err = VMAE_WERR;
+        return;
+    }
+    
+    if( xf->rc == VMAE_NOERR )
+    {
+        ct = file_time( &xf->job->psf->sf );
+        if( ct != (time_t) -1 )
+        {
+            ts[ 0 ].tv_sec = ct;
+            ts[ 0 ].tv_nsec = 0;
+            ts[ 1 ] = ts[ 0 ];
+            
+            futimens( xf->fd, ts );
+        }
+    }
+    
+    return;
+}
+
+#if defined( HAVE_IO_URING )
+/*
+|| Whether a file would go on a network file system, where overlapping
+|| the requests really pays.  Locally they hardly wait on anything, so
+|| handing them to the kernel's workers only costs more.
+*/
+static int
+uring_remote( const char *name )
+{
+    static const unsigned int remote[] =
+    {
+        0x00006969,                     /* NFS                       */
+        0x0000517b,                     /* SMB                       */
+        0xff534d42,                     /* CIFS                      */
+        0xfe534d42,                     /* SMB2                      */
+        0x65735546,                     /* FUSE                      */
+        0x00c36400,                     /* Ceph                      */
+        0x01021997,                     /* 9P                        */
+        0x5346414f,                     /* AFS                       */
+    };
+    char dir[ FILENAME_MAX ];
+    const char *slash = strrchr( name, '/' );
+    struct statfs fs;
+    size_t len;
+    size_t i;
+    
+    if( slash == NULL )
+    {
+        strcpy( dir, "." );
+    }
+    else
+    {
+        len = ( slash == name ? 1 : slash - name );
+        if( len >= sizeof( dir ) )
+        {
+            return FALSE;
+        }
+        memcpy( dir, name, len );
+        dir[ len ] = '\0';
+    }
+    
+    if( statfs( dir, &fs ) != 0 )
+    {
+        return FALSE;
+    }
+    
+    for( i = 0; i < sizeof( remote ) / sizeof( remote[ 0 ] ); i++ )
+    {
+        if( (unsigned int) fs.f_type == remote[ i ] )
+        {
+            return TRUE;
+        }
+    }
+    
+    return FALSE;
+}
+
+/*
+|| Sets up a ring, if the system has one with everything we need
+*/
+static int
+uring_open( URING *r )
+{
+    static const int ops[] = { IORING_OP_OPENAT, IORING_OP_WRITE, IORING_OP_CLOSE };
+    struct io_uring_params p;
+    struct io_uring_probe *probe;
+    uchar *sq;
+    uchar *cq;
+    size_t i;
+    int ok;
+    
+    memset( &p, 0, sizeof( p ) );
+    r->fd = (int) syscall( __NR_io_uring_setup, BATCHFILES, &p );
+    if( r->fd < 0 )
+    {
+        return FALSE;
+    }
+    
+    /*
+    || Make sure the operations are there (older kernels lack them)
+    */
+    probe = (struct io_uring_probe *) calloc( 1, sizeof( *probe ) +
+                                              256 * sizeof( struct io_uring_probe_op ) );
+    ok = ( probe != NULL &&
+           syscall( __NR_io_uring_register, r->fd, IORING_REGISTER_PROBE, probe, 256 ) == 0 );
+    for( i = 0; ok && i < sizeof( ops ) / sizeof( ops[ 0 ] ); i++ )
+    {
+        ok = ( ops[ i ] <= probe->last_op &&
+               ( probe->ops[ ops[ i ] ].flags & IO_URING_OP_SUPPORTED ) );
+    }
+    free( probe );
+    
+    /*
+    || Map the queues
+    */
+    r->sqlen = p.sq_off.array + p.sq_entries * sizeof( unsigned );
+    r->cqlen = p.cq_off.cqes + p.cq_entries * sizeof( struct io_uring_cqe );
+    r->sqeslen = p.sq_entries * sizeof( struct io_uring_sqe );
+    if( p.features & IORING_FEAT_SINGLE_MMAP )
+    {
+        r->sqlen = r->cqlen = ( r->sqlen > r->cqlen ? r->sqlen : r->cqlen );
+    }
+    
+    r->sqmap = r->cqmap = r->sqes = MAP_FAILED;
+    if( ok )
+    {
+        r->sqmap = mmap( NULL, r->sqlen, PROT_READ | PROT_WRITE,
+                         MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING );
+        r->cqmap = r->sqmap;
+        if( !( p.features & IORING_FEAT_SINGLE_MMAP ) )
+        {
+            r->cqmap = mmap( NULL, r->cqlen, PROT_READ | PROT_WRITE,
+                             MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_CQ_RING );
+        }
+        r->sqes = mmap( NULL, r->sqeslen, PROT_READ | PROT_WRITE,
+                        MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQES );
+    }
+    
+    if( r->sqmap == MAP_FAILED || r->cqmap == MAP_FAILED || r->sqes == MAP_FAILED )
+    {
+        if( r->sqes != MAP_FAILED )
+        {
+            munmap( r->sqes, r->sqeslen );
+        }
+        if( r->cqmap != MAP_FAILED && r->cqmap != r->sqmap )
+        {
+            munmap( r->cqmap, r->cqlen );
+        }
+        if( r->sqmap != MAP_FAILED )
+        {
+            munmap( r->sqmap, r->sqlen );
+        }
+        close( r->fd );
+        return FALSE;
+    }
+    
+    sq = (uchar *) r->sqmap;
+    cq = (uchar *) r->cqmap;
+    r->sqhead = (unsigned *) ( sq + p.sq_off.head );
+    r->sqtail = (unsigned *) ( sq + p.sq_off.tail );
+    r->sqmask = (unsigned *) ( sq + p.sq_off.ring_mask );
+    r->sqarray = (unsigned *) ( sq + p.sq_off.array );
+    r->cqhead = (unsigned *) ( cq + p.cq_off.head );
+    r->cqtail = (unsigned *) ( cq + p.cq_off.tail );
+    r->cqmask = (unsigned *) ( cq + p.cq_off.ring_mask );
+    r->cqes = (struct io_uring_cqe *) ( cq + p.cq_off.cqes );
+    
+    return TRUE;
+}
+
+static void
+uring_close( URING *r )
+{
+    munmap( r->sqes, r->sqeslen );
+    if( r->cqmap != r->sqmap )
+    {
+        munmap( r->cqmap, r->cqlen );
+    }
+    munmap( r->sqmap, r->sqlen );
+    close( r->fd );
+    
+    return;
+}
+
+/*
+|| Returns the next free submission entry, cleared and tagged
+*/
+static struct io_uring_sqe *
+uring_sqe( URING *r, unsigned n, int op, int fd, size_t tag )
+{
+    unsigned tail = *r->sqtail + n;
+    unsigned ndx = tail & *r->sqmask;
+    struct io_uring_sqe *sqe = &r->sqes[ ndx ];
+    
+    memset( sqe, 0, sizeof( *sqe ) );
+    sqe->opcode = (uchar) op;
+    sqe->fd = fd;
+    sqe->user_data = tag;
+    r->sqarray[ ndx ] = ndx;
+    
+    return sqe;
+}
+
+/*
+|| Submits the "n" entries filled in by uring_sqe() and waits for all
+|| of them, putting each result in the file it's tagged with
+*/
+static int
+uring_run( URING *r, unsigned n, XFILE *files )
+{
+    struct io_uring_cqe *cqe;
+    unsigned head;
+    unsigned done = 0;
+    unsigned left = n;
+    long rc;
+    
+    __atomic_store_n( r->sqtail, *r->sqtail + n, __ATOMIC_RELEASE );
+    
+    while( done < n )
+    {
+        rc = syscall( __NR_io_uring_enter, r->fd, left, n - done,
+                      IORING_ENTER_GETEVENTS, NULL, 0 );
+        if( rc < 0 )
+        {
+            if( errno == EINTR )
+            {
+                continue;
+            }
+            return FALSE;
+        }
+        left -= ( (unsigned) rc < left ? (unsigned) rc : left );
+        
+        head = *r->cqhead;
+        while( head != __atomic_load_n( r->cqtail, __ATOMIC_ACQUIRE ) )
+        {
+            cqe = &r->cqes[ head & *r->cqmask ];
+            files[ cqe->user_data ].res = cqe->res;
+            head++;
+            done++;
+        }
+        __atomic_store_n( r->cqhead, head, __ATOMIC_RELEASE );
+    }
+    
+    return TRUE;
+}
+
+/*
+|| Opens, writes and closes the batch's files, each step for all of
+|| them at once.  The times are set in between since there's no ring
+|| operation for that.
+*/
+static int
+uring_batch( XBATCH *b )
+{
+    URING *r = &b->ring;
+    XFILE *xf;
+    unsigned n;
+    int i;
+    
+    /*
+    || Open them
+    */
+    for( i = 0, n = 0; i < b->cnt; i++ )
+    {
+        struct io_uring_sqe *sqe = uring_sqe( r, n++, IORING_OP_OPENAT, AT_FDCWD, i );
+        
+        sqe->addr = (unsigned long) b->files[ i ].job->name;
+        sqe->len = 0666;
+        sqe->open_flags = O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC;
+    }
+    
+    if( !uring_run( r, n, b->files ) )
+    {
+        return FALSE;
+    }
+    
+    /*
+    || Write them
+    */
+    for( i = 0, n = 0; i < b->cnt; i++ )
+    {
+        xf = &b->files[ i ];
+        xf->fd = xf->res;
+        xf->err = VMAE_NOERR;
+        if( xf->fd < 0 )
+        {
+            xf->err = VMAE_OOPEN;
+        }
+        else if( xf->len > 0 )
+        {
+            struct io_uring_sqe *sqe = uring_sqe( r, n++, IORING_OP_WRITE, xf->fd, i );
+            
+            sqe->addr = (unsigned long) xf->buf;
+            sqe->len = (unsigned) xf->len;
+            sqe->off = 0;
+        }
+        else
+        {
+            xf->res = 0;
+        }
+    }
+    
+    if( n > 0 && !uring_run( r, n, b->files ) )
+    {
+        for( i = 0; i < b->cnt; i++ )
+        {
+            if( b->files[ i ].fd >= 0 )
+            {
+                close( b->files[ i ].fd );
+            }
+        }
+        return FALSE;
+    }
+    
+    /*
+    || Anything short is finished the ordinary way, then the times
+    || are set and they're all closed
+    */
+    for( i = 0, n = 0; i < b->cnt; i++ )
+    {
+        xf = &b->files[ i ];
+        if( xf->fd < 0 )
+        {
+            continue;
+        }
+        
+        if( xf->res >= 0 && (size_t) xf->res < xf->len )
+        {
+            xf->res = ( write_all( xf->fd, xf->buf + xf->res, xf->len - xf->res ) ? (int) xf->len : -1 );
+        }
+        
+        finish_file( xf );
+        
+        uring_sqe( r, n++, IORING_OP_CLOSE, xf->fd, i );
+    }
+    
+    if( n > 0 && !uring_run( r, n, b->files ) )
+    {
+        return FALSE;
+    }
+    
+    return TRUE;
+}
+#endif
+
+/*
+|| Makes the batch's files one after the other
+*/
+static void
+plain_batch( XBATCH *b )
+{
+    XFILE *xf;
+    int i;
+    
+    for( i = 0; i < b->cnt; i++ )
+    {
+        xf = &b->files[ i ];
+        xf->err = VMAE_NOERR;
+        xf->fd = open( xf->job->name, O_WRONLY | O_CREAT | O_TRUNC, 0666 );
+        if( xf->fd < 0 )
+        {
+            xf->err = VMAE_OOPEN;
+            continue;
+        }
+        
+        xf->res = ( write_all( xf->fd, xf->buf, xf->len ) ? (int) xf->len : -1 );
+        finish_file( xf );
+        
+        close( xf->fd );
+    }
+    
+    return;
+}
+
+/*
+|| Makes the files waiting in the batch and finishes their jobs.
+|| Returns FALSE if any of them failed.
+*/
+static int
+flush_batch( XBATCH *b )
+{
+    XFILE *xf;
+    int ok = TRUE;
+    int i;
+    
+#if defined( HAVE_IO_URING )
+    if( uring_remote( b->files[ 0 ].job->name ) )
+    {
+        if( !b->f_tried )
+        {
+            b->f_tried = TRUE;
+            b->f_ring = uring_open( &b->ring );
+        }
+        
+        if( b->f_ring && !uring_batch( b ) )
+        {
+            uring_close( &b->ring );
+            b->f_ring = FALSE;
+            plain_batch( b );
+        }
+        else if( !b->f_ring )
+        {
+            plain_batch( b );
+        }
+    }
+    else
+#endif
+    plain_batch( b );
+    
+    for( i = 0; i < b->cnt; i++ )
+    {
+        xf = &b->files[ i ];
+        xf->job->rc = ( xf->err != VMAE_NOERR ? xf->err : xf->rc );
+        xf->job->run = TRUE;
+        ok = ok && ( xf->job->rc == VMAE_NOERR || xf->job->rc == VMAE_LRECL );
+        
+        free( xf->buf );
+    }
+    b->cnt = 0;
+    b->bytes = 0;
+    
+    return ok;
+}
+
+/*
+|| Gets a batch for a thread to use.  NULL just means no batching.
+*/
+static XBATCH *
+new_batch( void )
+{
+    return (XBATCH *) calloc( 1, sizeof( XBATCH ) );
+}
+
+/*
+|| Makes whatever's left and gets rid of the batch
+*/
+static int
+end_batch( XBATCH *b )
+{
+    int ok = TRUE;
+    
+    if( b == NULL )
+    {
+        return TRUE;
+    }
+    
+    if( b->cnt > 0 )
+    {
+        ok = flush_batch( b );
+    }
+    
+#if defined( HAVE_IO_URING )
+    if( b->f_ring )
+    {
+        uring_close( &b->ring );
+    }
+#endif
+    
+    free( b );
+    
+    return ok;
+}
+
+/*
+|| Decodes a small subfile into memory and adds it to the batch
+*/
+static int
+batch_job( VMA *vma, XBATCH *b, XJOB *job )
+{
+    XFILE *xf;
+    int ok = TRUE;
+    
+    set_active( vma, job->psf );
+    seterr( VMAE_NOERR );
+    
+    /*
+    || Nothing gets made if it can't be extracted at all
+    */
+    if( setup_extract( vma ) != VMAE_NOERR || !( extract_mem( vma ) || vma->sbuf != NULL ) )
+    {
+        job->rc = vma->lasterr;
+        job->run = TRUE;
+        return ok && job->rc == VMAE_LRECL;
+    }
+    
+    xf = &b->files[ b->cnt++ ];
+    xf->job = job;
+    xf->buf = vma->sbuf;
+    xf->len = vma->slen;
+    xf->rc = vma->lasterr;
+    b->bytes += xf->len;
+    
+    vma->sbuf = NULL;
+    vma->smax = 0;
+    vma->slen = 0;
+    
+    if( b->cnt == BATCHFILES || b->bytes >= BATCHBYTES )
+    {
+        ok = flush_batch( b ) && ok;
+    }
+    
+    return ok;
+}
+
+#else
+#define new_batch()     NULL
+#define end_batch( b )  TRUE
+#endif
+
+static int
+run_job( VMA *vma, XBATCH *batch, XJOB *job )
+{
+#if defined( HAVE_BATCH )
+    /*
+    || A batched file is only made when the batch is, so one whose name
+    || is used again would land out of order
+    */
+    if( batch != NULL && !job->dup && job->weight != 0 && job->weight <= BATCHSMALL )
+    {
+        return batch_job( vma, batch, job );
+    }
+#endif
+    
+    set_active( vma, job->psf );
+    job->rc = vma_extract( vma, job->name );
+    job->run = TRUE;
+    
+    /*
+    || Serial extraction skips files z/OS or z/VM can't hold and stops
+    || on anything else
+    */
+    return ( job->rc == VMAE_NOERR || job->rc == VMAE_LRECL );
+}
+
+#if defined( HAVE_THREADS )
+typedef struct xpool
+{
+    XJOB **order;                       /* jobs, biggest first       */
+    size_t njob;                        /* number of jobs            */
+    size_t next;                        /* next one to hand out      */
+    char stop;                          /* a job failed              */
+    pthread_mutex_t lock;               /* protects next and stop    */
+} XPOOL;
+
+typedef struct xworker
+{
+    XPOOL *pool;                        /* shared job list           */
+    VMA *ctx;                           /* this thread's context     */
+} XWORKER;
+
+/*
+|| Puts the jobs in the order they're handed out.  Returns FALSE (with
+|| the error set) if there isn't the memory.
+*/
+static int
+init_pool( VMA *vma, XPOOL *pool, XJOB *jobs, size_t njob )
+{
+    size_t cnt;
+    size_t i;
+    
+    pool->order = (XJOB **) malloc( ( njob ? njob : 1 ) * sizeof( XJOB * ) );
+    if( pool->order == NULL )
+    {
+        seterr( VMAE_MEM );
+        return FALSE;
+    }
+    
+    /*
+    || The rest of a chain comes along with its head
+    */
+    cnt = 0;
+    for( i = 0; i < njob; i++ )
+    {
+        if( !jobs[ i ].chained )
+        {
+            pool->order[ cnt++ ] = &jobs[ i ];
+        }
+    }
+    qsort( pool->order, cnt, sizeof( XJOB * ), cmp_jobs );
+    
+    pool->njob = cnt;
+    pool->next = 0;
+    pool->stop = FALSE;
+    pthread_mutex_init( &pool->lock, NULL );
+    
+    return TRUE;
+}
+
+/*
+|| Hands out the next job, or NULL once they're gone or one has failed
+*/
+static XJOB *
+next_job( XPOOL *pool )
+{
+    XJOB *job;
+    
+    pthread_mutex_lock( &pool->lock );
+    job = ( pool->stop || pool->next >= pool->njob ?
+            NULL :
+            pool->order[ pool->next++ ] );
+    pthread_mutex_unlock( &pool->lock );
+    
+    return job;
+}
+
+/*
+|| Stops the handing out of jobs
+*/
+static void
+stop_pool( XPOOL *pool )
+{
+    pthread_mutex_lock( &pool->lock );
+    pool->stop = TRUE;
+    pthread_mutex_unlock( &pool->lock );
+}
+
+/*
+|| Runs jobs until there aren't any left or one of them fails
+*/
+static void *
+extract_jobs( void *arg )
+{
+    XWORKER *w = (XWORKER *) arg;
+    XPOOL *pool = w->pool;
+    XBATCH *batch = new_batch();
+    XJOB *job;
+    
+    while( ( job = next_job( pool ) ) != NULL )
+    {
+        for( ; job != NULL; job = job->same )
+        {
+            if( !run_job( w->ctx, batch, job ) )
+            {
+                stop_pool( pool );
+                break;
+            }
+        }
+    }
+    
+    end_batch( batch );
+    
+    return NULL;
+}
+
+/*
+|| Runs the jobs on up to "nthr" contexts.  Returns FALSE (with the
+|| error set) if not even one context could be opened.
+*/
+static int
+extract_parallel( VMA *vma, XJOB *jobs, size_t njob, int nthr )
+{
+    XWORKER work[ MAXTHREADS ];
+    void *args[ MAXTHREADS ];
+    XPOOL pool;
+    int opened;
+    int cnt;
+    int ec;
+    
+    if( !init_pool( vma, &pool, jobs, njob ) )
+    {
+        return FALSE;
+    }
+    
+    /*
+    || Contexts have to come from this thread
+    */
+    ec = VMAE_NOERR;
+    for( cnt = 0; cnt < nthr; cnt++ )
+    {
+        ec = vma_open_context( vma, (void **) &work[ cnt ].ctx );
+        if( ec != VMAE_NOERR )
+        {
+            break;
+        }
+        work[ cnt ].ctx->flags &= ~( VMAO_PIPELINE | VMAO_PARDECODE ); /* pool has the CPUs */
+        work[ cnt ].pool = &pool;
+        args[ cnt ] = &work[ cnt ];
+    }
+    
+    opened = cnt;
+    if( opened > 0 )
+    {
+        run_threads( extract_jobs, args, opened );
+    }
+    
+    while( cnt > 0 )
+    {
+        vma_close( work[ --cnt ].ctx );
+    }
+    
+    pthread_mutex_destroy( &pool.lock );
+    free( pool.order );
+    
+    if( opened == 0 )
+    {
+        seterr( ec );
+        return FALSE;
+    }
+    
+    return TRUE;
+}
+#endif
+
+/* ====================================================================
+|| Extracts every subfile "name" gives a file name to, using up to
+|| "threads" threads (0 means one per processor).  Then "done" (if
+|| given) is told how each one went, in archive order.
+*/
+int
+vma_extract_all( void *vvma,
+                 int threads,
+                 int ( *name )( void *ctx, SUBFILE *sf, char *buf, size_t len ),
+                 int ( *done )( void *ctx, SUBFILE *sf, int rc ),
+                 void *ctx )
+{
+    VMA *vma = (VMA *) vvma;
+    PSUBFILE *active;
+    PSUBFILE *psf;
+    XBATCH *batch;
+    XJOB *jobs;
+    XJOB *job;
+    char fname[ FILENAME_MAX ];
+    struct stat st;
+    size_t flen;
+    size_t njob;
+    size_t cnt;
+    size_t i;
+    int rc;
+    
+    /*
+    || Verify VMA
+    */
+    if( vma == NULL )
+    {
+        return VMAE_BADARG;
+    }
+    
+    /*
+    || Verify args
+    */
+    if( name == NULL || threads < 0 )
+    {
+        return seterr( VMAE_BADARG );
+    }
+    
+    /*
+    || Reset error
+    */
+    seterr( VMAE_NOERR );
+    
+    /*
+    || The decoder belongs to the stream while one is open
+    */
+    if( vma->f_stream )
+    {
+        return seterr( VMAE_STREAM );
+    }
+    
+    /*
+    || Contexts can't make more contexts
+    */
+    if( vma->parent != NULL )
+    {
+        return seterr( VMAE_CONTEXT );
+    }
+    
+    /*
+    || Used to estimate the size of the last subfile
+    */
+    flen = 0;
+    if( vma->vfile != NULL && fstat( fileno( vma->vfile ), &st ) == 0 )
+    {
+        flen = (size_t) st.st_size;
+    }
+    
+    /*
+    || Collect the names, in archive order, right here
+    */
+    cnt = 0;
+    for( psf = vma->subfiles; psf != NULL; psf = psf->next )
+    {
+        cnt++;
+    }
+    
+    jobs = (XJOB *) calloc( cnt ? cnt : 1, sizeof( XJOB ) );
+    if( jobs == NULL )
+    {
+        return seterr( VMAE_MEM );
+    }
+    
+    njob = 0;
+    for( psf = vma->subfiles, i = 0; psf != NULL; psf = psf->next, i++ )
+    {
+        fname[ 0 ] = '\0';
+        if( name( ctx, &psf->sf, fname, sizeof( fname ) ) != 0 )
+        {
+            continue;
+        }
+        fname[ sizeof( fname ) - 1 ] = '\0';
+        
+        job = &jobs[ njob ];
+        job->name = strdup( fname );
+        if( job->name == NULL )
+        {
+            seterr( VMAE_MEM );
+            break;
+        }
+        job->psf = psf;
+        job->ndx = i;
+        job->weight = job_weight( vma, psf, flen );
+        job->rc = VMAE_NOERR;
+        job->run = FALSE;
+        njob++;
+    }
+    
+    /*
+    || Find the subfiles that go to the same file
+    */
+    if( vma->lasterr == VMAE_NOERR )
+    {
+        chain_names( vma, jobs, njob );
+    }
+    
+    /*
+    || Extract them
+    */
+    active = vma->active;
+    
+    rc = vma->lasterr;
+    if( rc == VMAE_NOERR )
+    {
+#if defined( HAVE_THREADS )
+        if( threads == 0 )
+        {
+            threads = cpus();
+        }
+        
+        if( threads > MAXTHREADS )
+        {
+            threads = MAXTHREADS;
+        }
+        
+        if( (size_t) threads > njob )
+        {
+            threads = (int) njob;
+        }
+        
+        if( threads > 1 )
+        {
+            if( !extract_parallel( vma, jobs, njob, threads ) )
+            {
+                rc = vma->lasterr;
+            }
+        }
+        else
+#endif
+        {
+            batch = new_batch();
+            for( i = 0; i < njob; i++ )
+            {
+                if( !run_job( vma, batch, &jobs[ i ] ) )
+                {
+                    break;
+                }
+            }
+            end_batch( batch );
+        }
+    }
+    
+    set_active( vma, active );
+    
+    /*
+    || Report in archive order up to the first failure, just as far as
+    || extracting them one at a time would have gotten
+    */
+    for( i = 0; i < njob && rc == VMAE_NOERR; i++ )
+    {
+        job = &jobs[ i ];
+        if( !job->run )
+        {
+            break;
+        }
+        
+        if( job->rc != VMAE_NOERR && job->rc != VMAE_LRECL )
+        {
+            rc = job->rc;
+        }
+        else if( done != NULL )
+        {
+            rc = done( ctx, &job->psf->sf, job->rc );
+        }
+    }
+    
+    for( i = 0; i < njob; i++ )
+    {
+        free( jobs[ i ].name );
+    }
+    free( jobs );
+    
+    return seterr( rc );
+}
+
+/* ====================================================================
+|| Opens a stream on the active subfile.  The subfile is decoded a
+|| piece at a time as vma_read() asks for it, in the current mode.
+*/
+int
+vma_open_stream( void *vvma )
+{
+    VMA *vma = (VMA *) vvma;
+    
+    /*
+    || Verify VMA
+    */
+    if( vma == NULL )
+    {
+        return VMAE_BADARG;
+    }
+    
+    /*
+    || Ensure an active subfile
+    */
+    if( vma->active == NULL )
+    {
+        return seterr( VMAE_INACT );
+    }
+    
+    /*
+    || Only one at a time
+    */
+    if( vma->f_stream )
+    {
+        return seterr( VMAE_STREAM );
+    }
+    
+    /*
+    || Reset error
+    */
+    seterr( VMAE_NOERR );
+    
+    /*
+    || Work out how it's to be extracted
+    */
+    if( setup_extract( vma ) != VMAE_NOERR )
+    {
+        return vma->lasterr;
+    }
+    
+    /*
+    || Allocate output buffer
+    */
+    vma->obuf = (uchar *) malloc( vma->omax + 1 );
+    if( vma->obuf == NULL )
+    {
+        return seterr( VMAE_MEM );
+    }
+    vma->opos = 0;
+    vma->owrite = write_stream;
+    
+    /*
+    || Get the decoder ready
+    */
+    if( !start_extract( vma ) )
+    {
+        free( vma->obuf );
+        vma->obuf = NULL;
+        
+        return vma->lasterr;
+    }
+    
+    vma->spsf = vma->active;
+    vma->slen = 0;
+    vma->spos = 0;
+    vma->serr = VMAE_NOERR;
+    vma->sdone = FALSE;
+    vma->f_stream = TRUE;
+    
+    return seterr( VMAE_NOERR );
+}
+
+/* ====================================================================
+|| Reads up to "len" bytes from the stream.  "*nread" is set to the
+|| number of bytes read, which is only 0 at the end of the subfile or
+|| on error.
+*/
+int
+vma_read( void *vvma, void *buf, size_t len, size_t *nread )
+{
+    VMA *vma = (VMA *) vvma;
+    PSUBFILE *active;
+    FILE *in;
+    size_t got;
+    size_t n;
+    int rc;
+    
+    /*
+    || Verify VMA
+    */
+    if( vma == NULL )
+    {
+        return VMAE_BADARG;
+    }
+    
+    /*
+    || Verify args
+    */
+    if( ( buf == NULL && len > 0 ) || nread == NULL || !vma->f_stream )
+    {
+        return seterr( VMAE_BADARG );
+    }
+    
+    got = 0;
+    while( got < len )
+    {
+        /*
+        || Hand over whatever has been decoded
+        */
+        if( vma->spos < vma->slen )
+        {
+            n = vma->slen - vma->spos;
+            if( n > len - got )
+            {
+                n = len - got;
+            }
+            
+            memcpy( (uchar *) buf + got, &vma->sbuf[ vma->spos ], n );
+            vma->spos += n;
+            got += n;
+            
+            continue;
+        }
+        
+        if( vma->sdone )
+        {
+            break;
+        }
+        
+        /*
+        || Decode some more.  The stream's subfile doesn't need to be
+        || the active one anymore.
+        */
+        vma->slen = 0;
+        vma->spos = 0;
+        
+        active = vma->active;
+        in = vma->in;
+        
+        vma->active = vma->spsf;
+        vma->in = ( vma->spsf->temp ? vma->tfile : vma->vfile );
+        vma->f_pause = FALSE;
+        
+        rc = run_extract( vma );
+        if( rc != PAUSED )
+        {
+            end_extract( vma, rc == VMAE_NOERR );
+            vma->serr = rc;
+            vma->sdone = TRUE;
+        }
+        
+        vma->active = active;
+        vma->in = in;
+    }
+    
+    *nread = got;
+    
+    /*
+    || Errors are reported once everything before them has been read
+    */
+    if( got == 0 && vma->sdone )
+    {
+        return seterr( vma->serr );
+    }
+    
+    return seterr( VMAE_NOERR );
+}
+
+/* ====================================================================
+|| Closes the stream, whether or not it was read to the end
+*/
+int
+vma_close_stream( void *vvma )
+{
+    VMA *vma = (VMA *) vvma;
+    
+    /*
+    || Verify VMA
+    */
+    if( vma == NULL )
+    {
+        return VMAE_BADARG;
+    }
+    
+    if( !vma->f_stream )
+    {
+        return seterr( VMAE_BADARG );
+    }
+    
+    free( vma->obuf );
+    vma->obuf = NULL;
+    
+    free( vma->sbuf );
+    vma->sbuf = NULL;
+    vma->smax = 0;
+    vma->slen = 0;
+    vma->spos = 0;
+    
+    vma->spsf = NULL;
+    vma->f_stream = FALSE;
+    
+    return seterr( VMAE_NOERR );
+}
+
+/* ====================================================================
+||
+*/
+int
+vma_getactive( void *vvma, SUBFILE **sfp )
+{
+    VMA *vma = (VMA *) vvma;
+    
+    /*
+    || Verify VMA
+    */
+    if( vma == NULL )
+    {
+        return VMAE_BADARG;
+    }
+    
+    /*
+    || Verify subfile
+    */
+    if( sfp == NULL )
+    {
+        return seterr( VMAE_BADARG );
+    }
+    
+    /*
+    || Get the active subfile
+    */
+    *sfp = &vma->active->sf;
+    
+    /*
+    || Fill in the sizes if the open skipped them
+    */
+    if( vma->active != NULL )
+    {
+        return size_subfile( vma, vma->active );
+    }
+    
+    /*
+    || Success
+    */
+    return seterr( VMAE_NOERR );
+}
+
+/* ====================================================================
+|| Fills in the sizes and data type of a subfile (the active subfile
+|| if sf is NULL).  Only does any work for lazily opened archives.
+*/
+int
+vma_stat( void *vvma, SUBFILE *sf )
+{
+    VMA *vma = (VMA *) vvma;
+    PSUBFILE *psf;
+    
+    /*
+    || Verify VMA
+    */
+    if( vma == NULL )
+    {
+        return VMAE_BADARG;
+    }
+    
+    /*
+    || Default to the active subfile
+    */
+    if( sf == NULL )
+    {
+        if( vma->active == NULL )
+        {
+            return seterr( VMAE_INACT );
+        }
+        
+        return size_subfile( vma, vma->active );
+    }
+    
+    /*
+    || Find the subfile
+    */
+    for( psf = vma->subfiles; psf != NULL; psf = psf->next )
+    {
+        if( &psf->sf == sf )
+        {
+            break;
+        }
+    }
+    
+    /*
+    || Was the subfile in the list?
+    */
+    if( psf == NULL )
+    {
+        return seterr( VMAE_NOTFOUND );
+    }
+    
+    return size_subfile( vma, psf );
+}
+
+/* ====================================================================
+||
+*/
+int
+vma_setactive( void *vvma, SUBFILE *sf )
+{
+    VMA *vma = (VMA *) vvma;
+    PSUBFILE *psf;
+    
+    /*
+    || Verify VMA
+    */
+    if( vma == NULL )
+    {
+        return VMAE_BADARG;
+    }
+    
+    /*
+    || Verify subfile
+    */
+    if( sf == NULL )
+    {
+        return seterr( VMAE_BADARG );
+    }
+    
+    /*
+    || Make this subfile the active one
+    */
+    for( psf = vma->subfiles; psf != NULL; psf = psf->next )
+    {
+        if( &psf->sf == sf )
+        {
+            break;
+        }
+    }
+    
+    /*
+    || Was the subfile in the list?
+    */
+    if( psf == NULL )
+    {
+        return seterr( VMAE_NOTFOUND );
+    }
+    
+    /*
+    || Set the active subfile
+    */
+    set_active( vma, psf );
+    
+    /*
+    || Success
+    */
+    return seterr( VMAE_NOERR );
+}
+
+/* --------------------------------------------------------------------
+|| Returns the earliest subfile with the given name that comes after
+|| "after" in the archive, or NULL.  "after" may be NULL to start at
+|| the front.
+*/
+static PSUBFILE *
+find_name( VMA *vma,
+           const char *fn,
+           const char *ft,
+           const char *fm,
+           PSUBFILE *after )
+{
+    PSUBFILE *psf;
+    PSUBFILE *found;
+    
+    found = NULL;
+    for( psf = vma->names[ name_hash( fn, ft, vma->namesize ) ];
+         psf != NULL;
+         psf = psf->hnext )
+    {
+        if( strcmp( psf->sf.fn, fn ) != 0 ||
+            strcmp( psf->sf.ft, ft ) != 0 ||
+            ( fm != NULL && strcmp( psf->sf.fm, fm ) != 0 ) )
+        {
+            continue;
+        }
+        
+        if( after != NULL && psf->seq <= after->seq )
+        {
+            continue;
+        }
+        
+        if( found == NULL || psf->seq < found->seq )
+        {
+            found = psf;
+        }
+    }
+    
+    return found;
+}
+
+/* ====================================================================
+|| Makes the named subfile the active one.  The file mode may be NULL
+|| to match any mode.  If the name occurs more than once, the first
+|| one in the archive is used; vma_find_next() moves on to the others.
+*/
+int
+vma_find( void *vvma,
+          const char *fn,
+          const char *ft,
+          const char *fm,
+          SUBFILE **sfp )
+{
+    VMA *vma = (VMA *) vvma;
+    PSUBFILE *found;
+    
+    /*
+    || Verify VMA
+    */
+    if( vma == NULL )
+    {
+        return VMAE_BADARG;
+    }
+    
+    /*
+    || Verify args
+    */
+    if( fn == NULL || ft == NULL || sfp == NULL || vma->names == NULL )
+    {
+        return seterr( VMAE_BADARG );
+    }
+    
+    /*
+    || Look through the chain for the earliest match
+    */
+    found = find_name( vma, fn, ft, fm, NULL );
+    if( found == NULL )
+    {
+        return seterr( VMAE_NOTFOUND );
+    }
+    
+    /*
+    || Set the active subfile
+    */
+    set_active( vma, found );
+    
+    /*
+    || Store subfile ptr
+    */
+    *sfp = &found->sf;
+    
+    /*
+    || Success
+    */
+    return seterr( VMAE_NOERR );
+}
+
+/* ====================================================================
+|| Makes the next subfile with the same name as the last vma_find()
+|| the active one.  Matches come back in archive order and
+|| VMAE_NOMORE follows the last of them.
+*/
+int
+vma_find_next( void *vvma,
+               const char *fn,
+               const char *ft,
+               const char *fm,
+               SUBFILE **sfp )
+{
+    VMA *vma = (VMA *) vvma;
+    PSUBFILE *found;
+    
+    /*
+    || Verify VMA
+    */
+    if( vma == NULL )
+    {
+        return VMAE_BADARG;
+    }
+    
+    /*
+    || Verify args
+    */
+    if( fn == NULL || ft == NULL || sfp == NULL || vma->names == NULL )
+    {
+        return seterr( VMAE_BADARG );
+    }
+    
+    /*
+    || Need somewhere to start from
+    */
+    if( vma->active == NULL )
+    {
+        return seterr( VMAE_INACT );
+    }
+    
+    /*
+    || Look through the chain for the next match
+    */
+    found = find_name( vma, fn, ft, fm, vma->active );
+    if( found == NULL )
+    {
+        return seterr( VMAE_NOMORE );
+    }
+    
+    /*
+    || Set the active subfile
+    */
+    set_active( vma, found );
+    
+    /*
+    || Store subfile ptr
+    */
+    *sfp = &found->sf;
+    
+    /*
+    || Success
+    */
+    return seterr( VMAE_NOERR );
+}
+
+/* ====================================================================
+||
+*/
+int
+vma_first( void *vvma, SUBFILE **sfp )
+{
+    VMA *vma = (VMA *) vvma;
+    
+    /*
+    || Verify VMA
+    */
+    if( vma == NULL )
+    {
+        return VMAE_BADARG;
+    }
+    
+    /*
+    || Verify subfile
+    */
+    if( sfp == NULL )
+    {
+        return seterr( VMAE_BADARG );
+    }
+    
+    /*
+    || Make this subfile the active one
+    */
+    set_active( vma, vma->subfiles );
+    
+    /*
+    || Processed all subfiles
+    */
+    if( vma->active == NULL )
+    {
+        return seterr( VMAE_NOMORE );
+    }
+    
+    /*
+    || Store subfile ptr (possibly NULL)
+    */
+    *sfp = &vma->active->sf;
+    
+    /*
+    || Success
+    */
+    return seterr( VMAE_NOERR );
+}
+
+/* ====================================================================
+||
+*/
+int
+vma_next( void *vvma, SUBFILE **sfp )
+{
+    VMA *vma = (VMA *) vvma;
+    
+    /*
+    || Verify VMA
+    */
+    if( vma == NULL )
+    {
+        return VMAE_BADARG;
+    }
+    
+    /*
+    || Verify subfile
+    */
+    if( sfp == NULL )
+    {
+        return seterr( VMAE_BADARG );
+    }
+    
+    /*
+    || Reset error
+    */
+    seterr( VMAE_NOERR );
+    
+    if( vma->active == NULL )
+    {
+        return seterr( VMAE_INACT );
+    }
+    
+    /*
+    || Set the next active file
+    */
+    set_active( vma, vma->active->next );
+    
+    /*
+    || Processed all subfiles
+    */
+    if( vma->active == NULL )
+    {
+        return seterr( VMAE_NOMORE );
+    }
+    
+    /*
+    || Store subfile ptr (possibly NULL)
+    */
+    *sfp = &vma->active->sf;
+    
+    /*
+    || Success
+    */
+    return seterr( VMAE_NOERR );
+}
+
+/* ====================================================================
+||
+*/
+int
+vma_isdirty( void *vvma, int *dirty )
+{
+    VMA *vma = (VMA *) vvma;
+    
+    /*
+    || Bail if we weren't passed a VMA
+    */
+    if( vma == NULL )
+    {
+        return seterr( VMAE_BADARG );
+    }
+    
+    /*
+    || Don't do any good if we don't have a "dirty" arg
+    */
+    if( dirty == NULL )
+    {
+        return seterr( VMAE_BADARG );
+    }
+    
+    /*
+    || Return the current cleaniness of the archive
+    */
+    *dirty = vma->f_dirty;
+    
+    return seterr( VMAE_NOERR );
+}
+
+/* ====================================================================
+||
+*/
+int
+vma_commit( void *vvma )
+{
+    VMA *vma = (VMA *) vvma;
+    PSUBFILE *psf;
+    char *mname = NULL;
+    FILE *mfile = NULL;
+    char sfx[] = ".merged.XXXXXX";
+    struct stat st;
+
+    /*
+    || Bail if we weren't passed a VMA
+    */
+    if( vma == NULL )
+    {
+        return seterr( VMAE_BADARG );
+    }
+    
+    /*
+    || Decode contexts rely on the archive staying as it is
+    */
+    if( in_context( vma ) )
+    {
+        return seterr( VMAE_CONTEXT );
+    }
+    
+    /*
+    || The archive can't be rewritten under an open stream
+    */
+    if( vma->f_stream )
+    {
+        return seterr( VMAE_STREAM );
+    }
+    
+    /*
+    || Nothing to do if not dirty
+    */
+    if( !vma->f_dirty )
+    {
+        return seterr( VMAE_NOERR );
+    }
+    
+    /*
+    || Subfiles skipped by a lazy open need their compressed size
+    */
+    for( psf = vma->subfiles; psf != NULL; psf = psf->next )
+    {
+        if( size_subfile( vma, psf ) != VMAE_NOERR )
+        {
+            return vma->lasterr;
+        }
+    }
+    
+    /*
+    || Allocate memory for new name
+    */
+    mname = malloc( strlen( vma->vname ) + sizeof( sfx ) );
+    if( mname == NULL )
+    {
+        seterr( VMAE_MEM );
+        goto error;
+    }
+        
+    /*
+    || Build new name
+    */
+    strcpy( mname, vma->vname );
+    strcat( mname, sfx );
+    if( mktemp( mname ) == NULL )
+    {
+        seterr( VMAE_WERR );
+        goto error;
+    }
+        
+    /*
+    || Get the current file permissions
+    */
+    if( vma->vfile == NULL || fstat( fileno( vma->vfile ), &st ) != 0 )
+    {
+        st.st_mode = PERMS;
+    }
+    
+    /*
+    || Open with exclusive access
+    */
+    mfile = open_exclusive( vma, mname, st.st_mode );
+    if( mfile == NULL )
+    {
+        seterr( VMAE_TOPEN );
+        goto error;
+    }
+
+    /*
+    || Copy subfiles from original and temp archives
+    */
+    for( psf = vma->subfiles; psf != NULL; psf = psf->next )
+    {
+        FILE *from;
+        size_t bytes;
+        size_t len;
+
+        /*
+        || Determine where the subfile currently lives
+        */
+        if( psf->temp )
+        {
+            from = vma->tfile;
+        }
+        else
+        {
+            from = vma->vfile;
+        }
+
+        /*
+        || Position to start of subfile data
+        */
+        if( from != vma->vfile || vma->vmap == NULL )
+        {
+            if( fseek( from, psf->dataoff, SEEK_SET ) != 0 )
+            {
+                seterr( VMAE_RERR );
+                goto error;
+            }
+        }
+        else if( psf->dataoff + psf->sf.compressed > vma->vmaplen )
+        {
+            seterr( VMAE_RERR );
+            goto error;
+        }
+        
+        /*
+        || Write the subfile header
+        */
+        if( write_header( vma, mfile, psf ) != VMAE_NOERR )
+        {
+            goto error;
+        }
+
+        /*
+        || Mapped subfiles can go straight out of the map
+        */
+        if( from == vma->vfile && vma->vmap != NULL )
+        {
+            bytes = psf->sf.compressed;
+            if( bytes != 0 &&
+                fwrite( vma->vmap + psf->dataoff, 1, bytes, mfile ) != bytes )
+            {
+                seterr( VMAE_WERR );
+                goto error;
+            }
+            bytes = 0;
+        }
+        else
+        {
+            bytes = psf->sf.compressed;
+        }
+
+        /*
+        || Copy the subfile data to the merged archive
+        */
+        for( ; bytes > 0; bytes -= len )
+        {
+            len = bytes < BUFLEN ? bytes : BUFLEN;
+            len = fread( vma->cd->ibuf, 1, len, from );
+            if( ferror( from ) || feof( from ) )
+            {
+                seterr( VMAE_RERR );
+                goto error;
             }
             
-            /*
-            || Get the extended header
-            */
-            if( byte & HF_EXTH )
+            if( len != 0 )
             {
-                for( ndx = 0; ndx < 4; ndx++ )
-                {
-                    byte = get( vma );
-                    if( byte == EOF )
-                    {
-                        return FALSE;
-                    }
-                    vma->head[ cnt++ ] = byte;
-                }
-                
-                for( ndx = 0; ndx < 8; ndx++ )
+                if( fwrite( vma->cd->ibuf, 1, len, mfile ) != len )
                 {
-                    byte = get( vma );
-                    if( byte == EOF )
-                    {
-                        return FALSE;
-                    }
-                    vma->head[ cnt++ ] = byte;
+                    seterr( VMAE_WERR );
+                    goto error;
                 }
             }
-            
-            /*
-            || Looks like we've found a new header
-            */
-            return TRUE;
-            
-        } while( FALSE );
+        }
         
-        unget( vma, vma->head, cnt );
+        /*
+        || Write the trailer
+        */
+        if( write_trailer( vma, mfile ) != VMAE_NOERR )
+        {
+            goto error;
+        }
     }
-    
-    return FALSE;
-}
 
-/* --------------------------------------------------------------------
-|| Determines if we're running under z/VM or z/OS
-*/
-static void
-systype( VMA *vma )
-{
-#if defined( __MVS__ )
-    /*
-    || The utsname structures on z/OS and z/VM differ in size, so to
-    || be able to run a z/OS compiled module under z/VM, we add some
-    || padding.
-    */
-    union
-    {
-        struct utsname un;
-        char dummy[ 256 ];
-    } u;
- 
-    memset( &u.un, 0, sizeof( u ) );
- 
-    uname( &u.un );
- 
-    if( strcmp( u.un.sysname, "OS/390" ) == 0 )
-    {
-        vma->f_zos = TRUE;
-    }
-    else if( strcmp( u.un.sysname, "z/VM" ) == 0 )
+    if( fclose( mfile ) != 0 )
     {
-        vma->f_zvm = TRUE;
+        mfile = NULL;
+        seterr( VMAE_WERR );
+        goto error;
     }
- 
-#endif
-    return;
-}
- 
-/* ********************************************************************
-|| Public functions
-******************************************************************** */
+    mfile = NULL;
 
-/* ====================================================================
-|| Returns ptr to error text
-*/
-const char *
-vma_strerror( int ec )
-{
-    if( ec < 0 || ec > VMAE_NUMERRORS )
-    {
-        return "Invalid error code passed to vma_strerror()";
-    }
-    
-    return etext[ ec ];
-}
+    /*
+    || All changes have been successfully written to the final archive.
+    || Any errors from this point on are non-fatal, but the user may
+    || have to manually rename the "<archive name>.merged.XXXXXX" to
+    || the desired name.
+    */
+    vma->f_dirty = FALSE;
 
-/* ====================================================================
-|| Builds conversion table based on UCMs
-*/
-int
-vma_setconv( void *vvma, const char *fucm, const char *tucm )
-{
-    VMA *vma = (VMA *)vvma;
-    int i;
-    int subchar;
-    ENT tmap[ 256 ];
-    ENT fmap[ 256 ];
-    
     /*
-    || Verify VMA
+    || Clean up the subfile entries
     */
-    if( vma == NULL )
+    for( psf = vma->subfiles; psf != NULL; psf = psf->next )
     {
-        return VMAE_BADARG;
+        psf->dataoff = psf->dataofftmp;
+        psf->temp = FALSE;
+        psf->dirty = FALSE;
     }
-    
+
     /*
-    || Verify "from" UCM
+    || Temp archive is no longer needed
     */
-    if( fucm == NULL && tucm != NULL )
+    if( vma->tfile )
     {
-        return seterr( VMAE_BADARG );
+        fclose( vma->tfile );
+        vma->tfile = NULL;
+
+        unlink( vma->tname );
+
+        free( vma->tname );
+        vma->tname = NULL;
     }
-    
+
     /*
-    || Verify "to" UCM
+    || Original archive is no longer needed
     */
-    if( tucm == NULL && fucm != NULL )
+    if( vma->vfile )
     {
-        return seterr( VMAE_BADARG );
+        unmap_archive( vma );
+        fclose( vma->vfile );
+        vma->vfile = NULL;
+
+        unlink( vma->vname );
     }
-    
+
     /*
-    || If both are null, then reset to default tables
+    || If the rename fails, we still want to have a valid open file
+    || handle, so forget about the original archive name and start
+    || using the new (merged) archive name.
     */
-    if( tucm == NULL && fucm == NULL )
+    if( rename( mname, vma->vname ) != 0 )
     {
-#if defined(__MVS__)
-        memcpy( vma->e2a_map, e2e_tab, 256 );
-        memcpy( vma->a2e_map, a2e_tab, 256 );
-#else
-        memcpy( vma->e2a_map, e2a_tab, 256 );
-        memcpy( vma->a2e_map, a2e_tab, 256 );
-#endif
-        
-        return VMAE_NOERR;
+        free( vma->vname );
+        vma->vname = mname;
+        mname = NULL;
+
+        seterr( VMAE_RENAME );
     }
-    
+    else
+    {
+        free( mname );
+    }
+    mname = NULL;
+
     /*
-    || Load "from" UCM
+    || Open the new VMARC file
     */
-    if( !loaducm( vma, fucm, fmap, &subchar ) )
+    vma->vfile = fopen( vma->vname, "rb" );
+    if( vma->vfile == NULL )
     {
-        return vma->lasterr;
+        return seterr( VMAE_IOPEN );
     }
+    map_archive( vma );
     
     /*
-    || Load "to" UCM
+    || The old index no longer matches
     */
-    if( !loaducm( vma, tucm, tmap, &subchar ) )
+    write_index( vma );
+    
+    return seterr( VMAE_NOERR );
+
+error:
+
+    if( mfile )
     {
-        return vma->lasterr;
+        fclose( mfile );
+    }
+
+    if( mname )
+    {
+        unlink( mname );
+        free( mname );
     }
+
+    return vma->lasterr;
+}
+
+/* ====================================================================
+||
+*/
+int
+vma_setmode( void *vvma, int mode )
+{
+    VMA *vma = (VMA *) vvma;
     
     /*
-    || Make sure the maps are sorted
+    || Verify VMA
     */
-    qsort( &fmap, 256, sizeof( ENT ), cmp );
-    qsort( &tmap, 256, sizeof( ENT ), cmp );
+    if( vma == NULL )
+    {
+        return VMAE_BADARG;
+    }
     
     /*
-    || Transfer to caller's mapping
+    || Verify mode
     */
-    for( i = 0; i < 256; i++ )
+    switch( mode )
     {
-        ENT *ent;
-        
-        ent = (ENT *) bsearch( &fmap[ i ],
-                              tmap,
-                              256,
-                              sizeof( ENT ),
-                              cmp );
-        if( ent == NULL )
-        {
-            vma->e2a_map[ i ] = subchar;
-        }
-        else
-        {
-            vma->e2a_map[ i ] = ent->b;
-        }
+        case VMAX_AUTO:
+        case VMAX_TEXT:
+        case VMAX_TRANS:
+        case VMAX_BINARY:
+            break;
+            
+        default:
+            return seterr( VMAE_BADARG );
     }
     
     /*
-    || Transfer to caller's reverse mapping
+    || Set the mode
     */
-    for( i = 0; i < 256; i++ )
-    {
-        ENT *ent;
-        
-        ent = (ENT *) bsearch( &tmap[ i ],
-                              fmap,
-                              256,
-                              sizeof( ENT ),
-                              cmp );
-        if( ent == NULL )
-        {
-            vma->a2e_map[ i ] = subchar;
-        }
-        else
-        {
-            vma->a2e_map[ i ] = ent->b;
-        }
-    }
+    vma->mode = mode;
     
-    return VMAE_NOERR;
+    /*
+    || Success
+    */
+    return seterr( VMAE_NOERR );
 }
 
-static const int days[] =
-{
-    0, 31, 59, 90, 120, 151, 181, 212, 243, 273, 304, 334
-};
-
 /* ====================================================================
-|| Extract currently active subfile
+|| Sets how much bigger (in percent) than the smallest a faster method's
+|| result may be and still be picked by VMAM_AUTO
 */
 int
-vma_extract( void *vvma, const char *name )
+vma_setslack( void *vvma, int percent )
 {
-    VMA *vma = (VMA *)vvma;
-    PSUBFILE *psf;
-    char openflags[ 64 ];
-    struct tm bt;
-    struct utimbuf ut;
-    time_t ct;
-    int rc;
-    int mode = vma->mode;
-#if defined( __MVS__ )
-    fldata_t fd;
-#endif
+    VMA *vma = (VMA *) vvma;
     
     /*
     || Verify VMA
@@ -2992,353 +9551,393 @@ vma_extract( void *vvma, const char *name )
     }
     
     /*
-    || Verify name
+    || Verify percentage
     */
-    if( name == NULL )
+    if( percent < 0 || percent > 1000 )
     {
         return seterr( VMAE_BADARG );
     }
     
+    vma->slack = percent;
+    
+    return seterr( VMAE_NOERR );
+}
+
+/* ====================================================================
+||
+*/
+void
+vma_close( void *vvma )
+{
+    VMA *vma = (VMA *) vvma;
+    PSUBFILE *psf;
+    
     /*
-    || Ensure an active subfile
+    || Bail if we weren't passed a VMA
     */
-    psf = vma->active;
-    if( psf == NULL )
+    if( vma == NULL )
     {
-        return seterr( VMAE_INACT );
+        return;
     }
     
     /*
-    || Reset error
-    */
-    seterr( VMAE_NOERR );
-    
-    /*
-    || Determine which file the subfile resides in.
+    || A context only owns its decoder state (and its own file handles
+    || where there's no pread())
     */
-    vma->in = ( psf->temp ? vma->tfile : vma->vfile );
+    if( vma->parent != NULL )
+    {
+        if( vma->f_stream )
+        {
+            vma_close_stream( vma );
+        }
+        
+        if( vma->out != NULL )
+        {
+            fclose( vma->out );
+        }
+        
+        if( vma->obuf != NULL )
+        {
+            free( vma->obuf );
+        }
+        
+#if !defined( HAVE_PREAD )
+        if( vma->vfile != NULL )
+        {
+            fclose( vma->vfile );
+        }
+        
+        if( vma->tfile != NULL )
+        {
+            fclose( vma->tfile );
+        }
+#endif
+        
+        lock_shared( vma );
+        vma->parent->nctx--;
+        unlock_shared( vma );
+        
+        free( vma->cd );
+        free( vma );
+        
+        return;
+    }
     
     /*
-    || If user requested AUTO and we haven't previously scanned the
-    || subfile, then we must do so now.
+    || Update the index if we've sized more subfiles since writing it
     */
-    if( mode == VMAX_AUTO )
+    if( vma->flags & VMAO_INDEX )
     {
-        if( psf->sf.dtype == VMAD_UNKNOWN )
+        unsigned long sized = 0;
+        
+        for( psf = vma->subfiles; psf != NULL; psf = psf->next )
         {
-            /*
-            || Don't know what type it is yet.
-            */
-            vma->f_text = FALSE;
-            
-            /*
-            || Turn extraction off
-            */
-            vma->f_extract = FALSE;
-            
-            /*
-            || And indicate we only want to scan first 1024 bytes
-            */
-            vma->f_scanning = TRUE;
-            
-            /*
-            || Perform a simulated extraction
-            */
-            rc = extract( vma );
-            
-            /*
-            || Disable scanning mode
-            */
-            vma->f_scanning = FALSE;
-            
-            /*
-            || Bail if the extraction wasn't successful
-            */
-            if( !rc )
+            if( index_sized( psf ) )
             {
-                return vma->lasterr;
+                sized++;
             }
-            
-            /*
-            || Remember it
-            */
-            psf->sf.dtype = vma->dtype;
         }
         
-        /*
-        || Set the extraction type
-        */
-        mode = psf->sf.dtype;
+        if( sized > vma->idxsized )
+        {
+            write_index( vma );
+        }
     }
     
     /*
-    || Turn extraction on
-    */
-    vma->f_extract = TRUE;
-    
-    /*
-    || Convert to ASCII?
+    || Clean up the temp file
     */
-    vma->f_text = FALSE;
-    if( mode == VMAX_TEXT )
+    if( vma->tfile != NULL )
     {
-        vma->f_text = TRUE;
+        fclose( vma->tfile );
+        unlink( vma->tname );
     }
     
     /*
-    || Cache RECFM and LRECL
-    */
-    vma->recfm = psf->sf.recfm;
-    vma->lrecl = psf->sf.lrecl;
-    
-    /*
-    || Calculate the maximum size of the output buffer
-    */
-    vma->omax = ( vma->recfm == 'F' ? vma->lrecl : vma->lrecl + 4 ) +
-#if defined( _WIN32 )
-    ( vma->f_text ? 2 : 0 );
-#else
-    ( vma->f_text ? 1 : 0 );
-#endif
-    
-#if defined(__MVS__)
-    /*
-    || Ensure LRECL is in range
+    || Free the temp file name
     */
-    if( vma->f_zos )
-    {
-        if( vma->recfm == 'V' && vma->omax + 4 > 32760 )
-        {
-            return seterr( VMAE_LRECL );
-        }
-    }
-    else if( vma->f_zvm )
+    if( vma->tname != NULL )
     {
-        if( vma->omax > 65535 )
-        {
-            return seterr( VMAE_LRECL );
-        }
+        free( vma->tname );
     }
-#endif
-    
-    /*
-    || Build the open flags
-    */
-    sprintf( openflags,
-             "wb"
-#if defined( __MVS__ )
-             ",type=record,noseek,recfm=%c,lrecl=%d,blksize=0",
-             vma->recfm,
-             vma->omax
-#endif
-           );
- 
     
     /*
-    || And open the output file
+    || Close the input file
     */
-    vma->out = fopen( name, openflags );
-    if( vma->out == NULL )
+    if( vma->vfile != NULL )
     {
-        return seterr( VMAE_OOPEN );
+        unmap_archive( vma );
+        fclose( vma->vfile );
     }
     
     /*
-    || (Re)Alocate output buffer
+    || Close the output file
     */
-    vma->obuf = (uchar *) malloc( vma->omax + 1 );
-    if( vma->obuf == NULL )
+    if( vma->out != NULL )
     {
         fclose( vma->out );
-        vma->out = NULL;
-        
-        return seterr( VMAE_MEM );
     }
-    vma->opos = 0;
     
     /*
-    || Extract the file
+    || And any stream that was left open
     */
-    rc = extract( vma );
+    if( vma->f_stream )
+    {
+        vma_close_stream( vma );
+    }
     
     /*
-    || Get rid of the buffer
+    || Free all of the SUBFILEs
     */
-    free( vma->obuf );
-    vma->obuf = NULL;
+    while( vma->subfiles != NULL )
+    {
+        psf = vma->subfiles;
+        vma->subfiles = psf->next;
+        
+        free( psf );
+    }
     
-#if defined( __MVS__ )
     /*
-    || Retrieve the real filename before closing the file
+    || Free the name hash
     */
-    if( rc && vma->f_zvm )
+    if( vma->names != NULL )
     {
-        fldata( vma->out, NULL, &fd );
+        free( vma->names );
     }
-#endif
- 
-    /*
-    || Close the file
-    */
-    fclose( vma->out );
-    vma->out = NULL;
     
     /*
-    || Attempt to set the file times
+    || Free the output buffer
     */
-    if( rc )
+    if( vma->obuf != NULL )
     {
-#if defined( __MVS__ )
-        if( vma->f_zos )
-        {
-            /* not much we can do here */
-        }
-        else if( vma->f_zvm )
-        {
-            char cmd[ 256 ];
- 
-            sprintf( cmd,
-                     "DMSPLU "
-                     "%s "
-                     "%02d/%02d/%04d "
-                     "%02d:%02d:%02d",
-                     fd.__dsname,
-                     vma->active->sf.month,
-                     vma->active->sf.day,
-                     vma->active->sf.year,
-                     vma->active->sf.hour,
-                     vma->active->sf.minute,
-                     vma->active->sf.second );
-            system( cmd );
-        }
-        else
-#endif
-        {
-        /*
-        || Set the last access and modification times
-        */
-        memset( &bt, 0, sizeof( bt ) );
-        bt.tm_sec = psf->sf.second;
-        bt.tm_min = psf->sf.minute;
-        bt.tm_hour = psf->sf.hour;
-        bt.tm_mday = psf->sf.day;
-        bt.tm_mon = psf->sf.month - 1;
-        bt.tm_year = psf->sf.year - 1900;
-        bt.tm_wday = 0;
-        bt.tm_yday = 0;
-        bt.tm_isdst = -1;
-        
-        ct = mktime( &bt );
-        if( ct != (time_t) -1 )
-        {
-            ut.actime = ct;
-            ut.modtime = ct;
-            
-            utime( name, &ut );
-        }
+        free( vma->obuf );
+    }
+    
+    /*
+    || Free the file name
+    */
+    if( vma->vname != NULL )
+    {
+        free( vma->vname );
     }
+    
+    /*
+    || Free the buffers and tables
+    */
+    if( vma->cd != NULL )
+    {
+        free( vma->cd );
     }
     
-    return vma->lasterr;
+#if defined( HAVE_THREADS )
+    /*
+    || Get rid of the lock if contexts were ever opened
+    */
+    if( vma->f_shared )
+    {
+        pthread_mutex_destroy( &vma->lock );
+    }
+#endif
+    
+    /*
+    || And, finally, free the VMA itself
+    */
+    free( vma );
+    
+    return;
 }
 
 /* ====================================================================
 ||
 */
 int
-vma_getactive( void *vvma, SUBFILE **sfp )
+vma_open( const char *name, void **vvma )
 {
-    VMA *vma = (VMA *) vvma;
+    return vma_open_ex( name, 0, vvma );
+}
+
+/* ====================================================================
+|| Opens an archive with VMAO_* flags
+*/
+int
+vma_open_ex( const char *name, int flags, void **vvma )
+{
+    VMA *vma = NULL;
+    PSUBFILE *psf;
+    int ec = VMAE_NOERR;
     
     /*
-    || Verify VMA
+    || Verify args
+    */
+    if( name == NULL || vvma == NULL )
+    {
+        ec = VMAE_BADARG;
+        goto error;
+    }
+    
+    /*
+    || Initialize vvma
+    */
+    *vvma = NULL;
+    
+    /*
+    || Allocate our handle
     */
+    vma = (VMA *) calloc( 1, sizeof( VMA ) );
     if( vma == NULL )
     {
-        return VMAE_BADARG;
+        ec = VMAE_MEM;
+        goto error;
     }
     
     /*
-    || Verify subfile
+    || And its buffers and tables
     */
-    if( sfp == NULL )
+    vma->cd = (CODER *) calloc( 1, sizeof( CODER ) );
+    if( vma->cd == NULL )
     {
-        return seterr( VMAE_BADARG );
+        ec = VMAE_MEM;
+        goto error;
     }
     
     /*
-    || Get the active subfile
+    || Remember the open flags
     */
-    *sfp = &vma->active->sf;
+    vma->flags = flags;
+    vma->slack = AUTOSLACK;
     
     /*
-    || Success
+    || Allocate the name hash
     */
-    return seterr( VMAE_NOERR );
-}
-
-/* ====================================================================
-||
-*/
-int
-vma_setactive( void *vvma, SUBFILE *sf )
-{
-    VMA *vma = (VMA *) vvma;
-    PSUBFILE *psf;
+    vma->names = (PSUBFILE **) calloc( NAMEHASH, sizeof( PSUBFILE * ) );
+    if( vma->names == NULL )
+    {
+        ec = VMAE_MEM;
+        goto error;
+    }
+    vma->namesize = NAMEHASH;
     
     /*
-    || Verify VMA
+    || Remember the file name
     */
-    if( vma == NULL )
+    vma->vname = strdup( name );
+    if( vma->vname == NULL )
     {
-        return VMAE_BADARG;
+        ec = VMAE_MEM;
+        goto error;
     }
     
     /*
-    || Verify subfile
+    || Set default conversion table
     */
-    if( sf == NULL )
+    vma_setconv( vma, NULL, NULL );
+    
+    /*
+    || Get the system type
+    */
+    systype( vma );
+
+    /*
+    || Open the VMARC file
+    */
+    vma->vfile = fopen( name, "rb" );
+    if( vma->vfile == NULL )
     {
-        return seterr( VMAE_BADARG );
+        /*
+        || Just assume they're going to create a new file
+        */
+        *( (VMA **) vvma ) = vma;
+        
+        return seterr( VMAE_NOERR );
     }
+    map_archive( vma );
     
     /*
-    || Make this subfile the active one
+    || Use the index instead of scanning if it's still good
     */
-    for( psf = vma->subfiles; psf != NULL; psf = psf->next )
+    if( ( vma->flags & VMAO_INDEX ) && load_index( vma ) )
     {
-        if( &psf->sf == sf )
+        for( psf = vma->subfiles; psf != NULL; psf = psf->next )
         {
-            break;
+            if( psf->sized )
+            {
+                vma->idxsized++;
+            }
+            
+            /*
+            || The index may have been written by a lazy open
+            */
+            else if( !( vma->flags & VMAO_LAZY ) )
+            {
+                if( size_subfile( vma, psf ) != VMAE_NOERR )
+                {
+                    ec = vma->lasterr;
+                    goto error;
+                }
+            }
         }
+        
+        *( (VMA **) vvma ) = vma;
+        
+        return seterr( VMAE_NOERR );
     }
     
     /*
-    || Was the subfile in the list?
+    || Build list of subfiles
     */
-    if( psf == NULL )
+    if( !scan_parallel( vma ) )
     {
-        return seterr( VMAE_NOTFOUND );
+        scan_archive( vma );
     }
     
     /*
-    || Set the active subfile
+    || See if any errors are outstanding
     */
-    set_active( vma, psf );
+    if( vma->lasterr )
+    {
+        ec = vma->lasterr;
+        goto error;
+    }
+    
+    /*
+    || Save what we've learned for next time
+    */
+    write_index( vma );
+    
+    /*
+    || Store the VMA ptr
+    */
+    *( (VMA **) vvma ) = vma;
     
     /*
     || Success
     */
     return seterr( VMAE_NOERR );
+    
+error:
+    
+    /*
+    || Use vma_close() to cleanup, but don't let it write an index for
+    || a partial subfile list
+    */
+    if( vma != NULL )
+    {
+        vma->flags &= ~VMAO_INDEX;
+    }
+    vma_close( vma );
+    
+    return ec;
 }
 
 /* ====================================================================
-||
+|| Opens a decode context on an archive.  The context starts out with
+|| the archive's mode and conversion tables and no active subfile.
 */
 int
-vma_first( void *vvma, SUBFILE **sfp )
+vma_open_context( void *vvma, void **vctx )
 {
     VMA *vma = (VMA *) vvma;
+    VMA *ctx;
     
     /*
     || Verify VMA
@@ -3349,34 +9948,121 @@ vma_first( void *vvma, SUBFILE **sfp )
     }
     
     /*
-    || Verify subfile
+    || Verify args
     */
-    if( sfp == NULL )
+    if( vctx == NULL )
     {
         return seterr( VMAE_BADARG );
     }
+    *vctx = NULL;
     
     /*
-    || Make this subfile the active one
+    || Contexts come from the archive itself
     */
-    set_active( vma, vma->subfiles );
+    if( vma->parent != NULL )
+    {
+        return seterr( VMAE_CONTEXT );
+    }
     
     /*
-    || Processed all subfiles
+    || Start sharing the subfile info.  Only the archive's own thread
+    || gets here, so no context can be looking at the flag yet.
     */
-    if( vma->active == NULL )
+#if defined( HAVE_THREADS )
+    if( !vma->f_shared )
     {
-        return seterr( VMAE_NOMORE );
+        if( pthread_mutex_init( &vma->lock, NULL ) != 0 )
+        {
+            return seterr( VMAE_MEM );
+        }
+        vma->f_shared = TRUE;
     }
+#endif
     
     /*
-    || Store subfile ptr (possibly NULL)
+    || Anything added but not committed is read from the temp file
     */
-    *sfp = &vma->active->sf;
+    if( vma->tfile != NULL && fflush( vma->tfile ) != 0 )
+    {
+        return seterr( VMAE_WERR );
+    }
+    
+    ctx = (VMA *) malloc( sizeof( VMA ) );
+    if( ctx == NULL )
+    {
+        return seterr( VMAE_MEM );
+    }
     
     /*
-    || Success
+    || Start from the real handle and drop what belongs to it alone
     */
+    memcpy( ctx, vma, sizeof( VMA ) );
+    ctx->cd = (CODER *) malloc( sizeof( CODER ) );
+    if( ctx->cd == NULL )
+    {
+        free( ctx );
+        return seterr( VMAE_MEM );
+    }
+    ctx->parent = vma;
+    ctx->nctx = 0;
+    ctx->f_shared = FALSE;
+    ctx->lasterr = VMAE_NOERR;
+    ctx->active = NULL;
+    ctx->sfretained = NULL;
+    ctx->in = NULL;
+    ctx->icnt = 0;
+    ctx->imap = FALSE;
+    ctx->out = NULL;
+    ctx->obuf = NULL;
+    ctx->f_stream = FALSE;
+    ctx->spsf = NULL;
+    ctx->sbuf = NULL;
+    ctx->slen = 0;
+    ctx->spos = 0;
+    ctx->smax = 0;
+    
+#if defined( HAVE_PREAD )
+    ctx->f_pread = TRUE;
+#else
+    /*
+    || No positional reads, so the context gets its own file handles
+    */
+    ctx->vfile = NULL;
+    ctx->tfile = NULL;
+    
+    if( vma->vfile != NULL )
+    {
+        ctx->vfile = fopen( vma->vname, "rb" );
+        if( ctx->vfile == NULL )
+        {
+            free( ctx->cd );
+            free( ctx );
+            return seterr( VMAE_IOPEN );
+        }
+    }
+    
+    if( vma->tfile != NULL )
+    {
+        ctx->tfile = fopen( vma->tname, "rb" );
+        if( ctx->tfile == NULL )
+        {
+            if( ctx->vfile != NULL )
+            {
+                fclose( ctx->vfile );
+            }
+            free( ctx->cd );
+            free( ctx );
+            return seterr( VMAE_TOPEN );
+        }
+    }
+#endif
+    
+    lock_shared( vma );
+    vma->nctx++;
+    unlock_shared( vma );
+    
+    *vctx = ctx;
+    
     return seterr( VMAE_NOERR );
 }
 
@@ -3384,9 +10070,10 @@ vma_first( void *vvma, SUBFILE **sfp )
 ||
 */
 int
-vma_next( void *vvma, SUBFILE **sfp )
+vma_new( void *vvma, SUBFILE **sfp )
 {
     VMA *vma = (VMA *) vvma;
+    PSUBFILE *psf;
     
     /*
     || Verify VMA
@@ -3397,76 +10084,79 @@ vma_next( void *vvma, SUBFILE **sfp )
     }
     
     /*
-    || Verify subfile
+    || Decode contexts rely on the archive staying as it is
     */
-    if( sfp == NULL )
+    if( in_context( vma ) )
     {
-        return seterr( VMAE_BADARG );
+        return seterr( VMAE_CONTEXT );
     }
     
     /*
-    || Reset error
+    || Allocate a new subfile
     */
-    seterr( VMAE_NOERR );
-    
-    if( vma->active == NULL )
+    psf = (PSUBFILE *) calloc( 1, sizeof( PSUBFILE ) );
+    if( psf == NULL )
     {
-        return seterr( VMAE_INACT );
+        return seterr( VMAE_MEM );
     }
     
     /*
-    || Set the next active file
-    */
-    set_active( vma, vma->active->next );
-    
-    /*
-    || Processed all subfiles
+    || Link it in
     */
-    if( vma->active == NULL )
+    if( vma->sflast == NULL )
     {
-        return seterr( VMAE_NOMORE );
+        vma->subfiles = psf;
+    }
+    else
+    {
+        vma->sflast->next = psf;
     }
+    vma->sflast = psf;
     
     /*
-    || Store subfile ptr (possibly NULL)
+    || Make this subfile the active one
     */
-    *sfp = &vma->active->sf;
+    set_active( vma, psf );
     
-    /*
-    || Success
-    */
-    return seterr( VMAE_NOERR );
-}
-
-/* ====================================================================
-||
-*/
-int
-vma_isdirty( void *vvma, int *dirty )
-{
-    VMA *vma = (VMA *) vvma;
+    /*
+    || Set defaults
+    */
+    psf->sf.ver = 1;
+    psf->sf.rel = 0;
+    strcpy( (char *) psf->sf.meth, VMAM_ASIS );
+    strcpy( (char *) psf->sf.fn, "TEMPNAME" );
+    strcpy( (char *) psf->sf.ft, "$DEFAULT" );
+    strcpy( (char *) psf->sf.fm, "A1" );
+    psf->sf.lrecl = 65535;
+    psf->sf.year = 1900;
+    psf->sf.month = 1;
+    psf->sf.day = 1;
+    psf->sf.hour = 0;
+    psf->sf.minute = 0;
+    psf->sf.second = 0;
+    psf->sf.recfm = VMAR_VARIABLE;
+    psf->sf.compressed = 0;
+    psf->sf.uncompressed = 0;
+    psf->sf.dtype = VMAD_UNKNOWN;
+    psf->sized = TRUE;
     
     /*
-    || Bail if we weren't passed a VMA
+    || Make it findable
     */
-    if( vma == NULL )
-    {
-        return seterr( VMAE_BADARG );
-    }
+    psf->seq = vma->seq++;
+    name_link( vma, psf );
     
     /*
-    || Don't do any good if we don't have a "dirty" arg
+    || Store subfile ptr
     */
-    if( dirty == NULL )
+    if( sfp != NULL )
     {
-        return seterr( VMAE_BADARG );
+        *sfp = &vma->active->sf;
     }
     
     /*
-    || Return the current cleaniness of the archive
+    || Success
     */
-    *dirty = vma->f_dirty;
-    
     return seterr( VMAE_NOERR );
 }
 
@@ -3474,245 +10164,128 @@ vma_isdirty( void *vvma, int *dirty )
 ||
 */
 int
-vma_commit( void *vvma )
+vma_setname( void *vvma, const char *fn, const char *ft, const char *fm )
 {
     VMA *vma = (VMA *) vvma;
     PSUBFILE *psf;
-    char *mname = NULL;
-    FILE *mfile = NULL;
-    char sfx[] = ".merged.XXXXXX";
-    struct stat st;
-
+    
     /*
-    || Bail if we weren't passed a VMA
+    || Verify VMA
     */
     if( vma == NULL )
     {
-        return seterr( VMAE_BADARG );
+        return VMAE_BADARG;
     }
     
     /*
-    || Nothing to do if not dirty
+    || Decode contexts rely on the archive staying as it is
     */
-    if( !vma->f_dirty )
+    if( in_context( vma ) )
     {
-        return seterr( VMAE_NOERR );
+        return seterr( VMAE_CONTEXT );
     }
     
     /*
-    || Allocate memory for new name
-    */
-    mname = malloc( strlen( vma->vname ) + sizeof( sfx ) );
-    if( mname == NULL )
-    {
-        seterr( VMAE_MEM );
-        goto error;
-    }
-        
-    /*
-    || Build new name
+    || Ensure an active subfile
     */
-    strcpy( mname, vma->vname );
-    strcat( mname, sfx );
-    if( mktemp( mname ) == NULL )
+    psf = vma->active;
+    if( psf == NULL )
     {
-        seterr( VMAE_WERR );
-        goto error;
+        return seterr( VMAE_INACT );
     }
-        
+    
     /*
-    || Get the current file permissions
+    || Verify the file name
     */
-    if( vma->vfile == NULL || fstat( fileno( vma->vfile ), &st ) != 0 )
+    if( fn != NULL && !validate_name( fn ) )
     {
-        st.st_mode = PERMS;
+        return seterr( VMAE_BADNAME );
     }
     
     /*
-    || Open with exclusive access
+    || Verify the file type
     */
-    mfile = open_exclusive( vma, mname, st.st_mode );
-    if( mfile == NULL )
+    if( ft != NULL && !validate_name( ft ) )
     {
-        seterr( VMAE_TOPEN );
-        goto error;
+        return seterr( VMAE_BADTYPE );
     }
-
+    
     /*
-    || Copy subfiles from original and temp archives
+    || Verify the file mode
     */
-    for( psf = vma->subfiles; psf != NULL; psf = psf->next )
+    if( fm != NULL )
     {
-        FILE *from;
-        size_t bytes;
-        size_t len;
-
-        /*
-        || Determine where the subfile currently lives
-        */
-        if( psf->temp )
-        {
-            from = vma->tfile;
-        }
-        else
-        {
-            from = vma->vfile;
-        }
-
-        /*
-        || Position to start of subfile data
-        */
-        if( fseek( from, psf->dataoff, SEEK_SET ) != 0 )
-        {
-            seterr( VMAE_RERR );
-            goto error;
-        }
+        size_t len = strlen( fm );
         
-        /*
-        || Write the subfile header
-        */
-        if( write_header( vma, mfile, psf ) != VMAE_NOERR )
+        if( len != 2 )
         {
-            goto error;
+            return seterr( VMAE_BADMODE );
         }
-
-        /*
-        || Copy the subfile data to the merged archive
-        */
-        bytes = psf->sf.compressed;
-        for( bytes = psf->sf.compressed; bytes > 0; bytes -= len )
+        
+        switch( fm[ 0 ] )
         {
-            len = bytes < BUFLEN ? bytes : BUFLEN;
-            len = fread( vma->ibuf, 1, len, from );
-            if( ferror( from ) || feof( from ) )
-            {
-                seterr( VMAE_RERR );
-                goto error;
-            }
-            
-            if( len != 0 )
-            {
-                if( fwrite( vma->ibuf, 1, len, mfile ) != len )
+            case 'A': case 'B': case 'C': case 'D': case 'E': case 'F':
+            case 'G': case 'H': case 'I': case 'J': case 'K': case 'L':
+            case 'M': case 'N': case 'O': case 'P': case 'Q': case 'R':
+            case 'S': case 'T': case 'U': case 'V': case 'W': case 'Y':
+            case 'Z':
+                if( isdigit( fm[ 1 ] ) )
                 {
-                    seterr( VMAE_WERR );
-                    goto error;
+                    break;
                 }
-            }
-        }
-        
-        /*
-        || Write the trailer
-        */
-        if( write_trailer( vma, mfile ) != VMAE_NOERR )
-        {
-            goto error;
+                /* fall through*/
+                
+            default:
+                return seterr( VMAE_BADMODE );
+                break;
         }
     }
-
-    if( fclose( mfile ) != 0 )
-    {
-        mfile = NULL;
-        seterr( VMAE_WERR );
-        goto error;
-    }
-    mfile = NULL;
-
-    /*
-    || All changes have been successfully written to the final archive.
-    || Any errors from this point on are non-fatal, but the user may
-    || have to manually rename the "<archive name>.merged.XXXXXX" to
-    || the desired name.
-    */
-    vma->f_dirty = FALSE;
-
-    /*
-    || Clean up the subfile entries
-    */
-    for( psf = vma->subfiles; psf != NULL; psf = psf->next )
-    {
-        psf->dataoff = psf->dataofftmp;
-        psf->temp = FALSE;
-        psf->dirty = FALSE;
-    }
-
+    
     /*
-    || Temp archive is no longer needed
+    || Rehash under the new name
     */
-    if( vma->tfile )
-    {
-        fclose( vma->tfile );
-        vma->tfile = NULL;
-
-        unlink( vma->tname );
-
-        free( vma->tname );
-        vma->tname = NULL;
-    }
-
+    name_unlink( vma, psf );
+    
     /*
-    || Original archive is no longer needed
+    || Set the file name
     */
-    if( vma->vfile )
+    if( fn != NULL )
     {
-        fclose( vma->vfile );
-        vma->vfile = NULL;
-
-        unlink( vma->vname );
+        strcpy( (char *) psf->sf.fn, fn );
+        mark_dirty( vma, psf );
     }
-
+    
     /*
-    || If the rename fails, we still want to have a valid open file
-    || handle, so forget about the original archive name and start
-    || using the new (merged) archive name.
+    || Set the file type
     */
-    if( rename( mname, vma->vname ) != 0 )
-    {
-        free( vma->vname );
-        vma->vname = mname;
-        mname = NULL;
-
-        seterr( VMAE_RENAME );
-    }
-    else
+    if( ft != NULL )
     {
-        free( mname );
+        strcpy( (char *) psf->sf.ft, ft );
+        mark_dirty( vma, psf );
     }
-    mname = NULL;
-
+    
     /*
-    || Open the new VMARC file
+    || Set the file mode
     */
-    vma->vfile = fopen( vma->vname, "rb" );
-    if( vma->vfile == NULL )
-    {
-        return seterr( VMAE_IOPEN );
-    }
-    
-    return seterr( VMAE_NOERR );
-
-error:
-
-    if( mfile )
-    {
-        fclose( mfile );
-    }
-
-    if( mname )
+    if( fm != NULL )
     {
-        unlink( mname );
-        free( mname );
+        strcpy( (char *) psf->sf.fm, fm );
+        mark_dirty( vma, psf );
     }
-
-    return vma->lasterr;
+    
+    name_link( vma, psf );
+    
+    return seterr( VMAE_NOERR );
 }
 
 /* ====================================================================
 ||
 */
 int
-vma_setmode( void *vvma, int mode )
+vma_setdate( void *vvma, int year, int month, int day )
 {
     VMA *vma = (VMA *) vvma;
+    PSUBFILE *psf;
     
     /*
     || Verify VMA
@@ -3723,346 +10296,269 @@ vma_setmode( void *vvma, int mode )
     }
     
     /*
-    || Verify mode
+    || Decode contexts rely on the archive staying as it is
     */
-    switch( mode )
+    if( in_context( vma ) )
     {
-        case VMAX_AUTO:
-        case VMAX_TEXT:
-        case VMAX_TRANS:
-        case VMAX_BINARY:
-            break;
-            
-        default:
-            return seterr( VMAE_BADARG );
+        return seterr( VMAE_CONTEXT );
     }
     
     /*
-    || Set the mode
+    || Ensure an active subfile
     */
-    vma->mode = mode;
+    psf = vma->active;
+    if( psf == NULL )
+    {
+        return seterr( VMAE_INACT );
+    }
     
     /*
-    || Success
+    || Verify the year
+    */
+    if( year < 1900 )
+    {
+        return seterr( VMAE_BADYEAR );
+    }
+    
+    /*
+    || Verify the month
+    */
+    if( month < 1 || month > 12 )
+    {
+        return seterr( VMAE_BADMONTH );
+    }
+    
+    /*
+    || Verify the day (I know, I know...lazy)
     */
+    if( day < 1 || day > 31 )
+    {
+        return seterr( VMAE_BADDAY );
+    }
+    
+    psf->sf.year = year;
+    psf->sf.month = month;
+    psf->sf.day = day;
+    
+    mark_dirty( vma, psf );
+    
     return seterr( VMAE_NOERR );
 }
 
 /* ====================================================================
 ||
 */
-void
-vma_close( void *vvma )
+int
+vma_settime( void *vvma, int hour, int minute, int second )
 {
     VMA *vma = (VMA *) vvma;
     PSUBFILE *psf;
     
     /*
-    || Bail if we weren't passed a VMA
+    || Verify VMA
     */
     if( vma == NULL )
     {
-        return;
-    }
-    
-    /*
-    || Clean up the temp file
-    */
-    if( vma->tfile != NULL )
-    {
-        fclose( vma->tfile );
-        unlink( vma->tname );
+        return VMAE_BADARG;
     }
     
     /*
-    || Free the temp file name
+    || Decode contexts rely on the archive staying as it is
     */
-    if( vma->tname != NULL )
+    if( in_context( vma ) )
     {
-        free( vma->tname );
+        return seterr( VMAE_CONTEXT );
     }
     
     /*
-    || Close the input file
+    || Ensure an active subfile
     */
-    if( vma->vfile != NULL )
+    psf = vma->active;
+    if( psf == NULL )
     {
-        fclose( vma->vfile );
+        return seterr( VMAE_INACT );
     }
     
     /*
-    || Close the output file
+    || Verify the hour
     */
-    if( vma->out != NULL )
+    if( hour < 0 || hour > 23 )
     {
-        fclose( vma->out );
+        return seterr( VMAE_BADHOUR );
     }
     
     /*
-    || Free all of the SUBFILEs
+    || Verify the minute
     */
-    while( vma->subfiles != NULL )
+    if( minute < 0 || minute > 59 )
     {
-        psf = vma->subfiles;
-        vma->subfiles = psf->next;
-        
-        free( psf );
+        return seterr( VMAE_BADMINS );
     }
     
     /*
-    || Free the output buffer
+    || Verify the second
     */
-    if( vma->obuf != NULL )
+    if( second < 0 || second > 59 )
     {
-        free( vma->obuf );
+        return seterr( VMAE_BADSECS );
     }
     
-    /*
-    || Free the file name
-    */
-    if( vma->vname != NULL )
-    {
-        free( vma->vname );
-    }
+    psf->sf.hour = hour;
+    psf->sf.minute = minute;
+    psf->sf.second = second;
     
-    /*
-    || And, finally, free the VMA itself
-    */
-    free( vma );
+    mark_dirty( vma, psf );
     
-    return;
+    return seterr( VMAE_NOERR );
 }
 
 /* ====================================================================
 ||
 */
 int
-vma_open( const char *name, void **vvma )
+vma_setrecfm( void *vvma, char recfm )
 {
-    VMA *vma = NULL;
+    VMA *vma = (VMA *) vvma;
     PSUBFILE *psf;
-    PSUBFILE *lpsf;
-    int i;
-    int ec = VMAE_NOERR;
     
     /*
-    || Verify args
+    || Verify VMA
     */
-    if( name == NULL || vvma == NULL )
+    if( vma == NULL )
     {
-        ec = VMAE_BADARG;
-        goto error;
+        return VMAE_BADARG;
     }
     
     /*
-    || Initialize vvma
-    */
-    *vvma = NULL;
-    
-    /*
-    || Allocate our handle
+    || Decode contexts rely on the archive staying as it is
     */
-    vma = (VMA *) calloc( 1, sizeof( VMA ) );
-    if( vma == NULL )
+    if( in_context( vma ) )
     {
-        ec = VMAE_MEM;
-        goto error;
+        return seterr( VMAE_CONTEXT );
     }
     
     /*
-    || Remember the file name
+    || Ensure an active subfile
     */
-    vma->vname = strdup( name );
-    if( vma->vname == NULL )
+    psf = vma->active;
+    if( psf == NULL )
     {
-        ec = VMAE_MEM;
-        goto error;
+        return seterr( VMAE_INACT );
     }
     
     /*
-    || Set default conversion table
+    || Verify the record format
     */
-    vma_setconv( vma, NULL, NULL );
+    if( recfm != VMAR_FIXED && recfm != VMAR_VARIABLE )
+    {
+        return seterr( VMAE_BADRECFM );
+    }
     
     /*
-    || Get the system type
-    */
-    systype( vma );
-
-    /*
-    || Open the VMARC file
+    || Can only set recfm on new subfiles, not existing ones.
     */
-    vma->vfile = fopen( name, "rb" );
-    if( vma->vfile == NULL )
+    if( psf->locked )
     {
-        /*
-        || Just assume they're going to create a new file
-        */
-        *( (VMA **) vvma ) = vma;
-        
-        return seterr( VMAE_NOERR );
+        return seterr( VMAE_NOTMOD );
     }
     
-    /*
-    || Set active input file
-    */
-    vma->in = vma->vfile;
+    psf->sf.recfm = recfm;
     
-    /*
-    || Turn off extraction
-    */
-    vma->f_extract = FALSE;
+    mark_dirty( vma, psf );
     
-    /*
-    || Build list of subfiles
-    */
-    lpsf = NULL;
-    while( locate_file( vma ) )
-    {
-        /*
-        || Allocate a new subfile
-        */
-        if( vma_new( vma, NULL ) != VMAE_NOERR )
-        {
-            ec = VMAE_MEM;
-            goto error;
-        }
-        
-        /*
-        || Get the newly allocated subfile
-        */
-        psf = vma->active;
-        
-        /*
-        || Copy header to subfile
-        */
-        psf->sf.ver     = vma->head[ H_VER ];
-        psf->sf.rel     = vma->head[ H_REL ];
-        
-        sprintf( (char *) psf->sf.meth,
-                "%s",
-                ( vma->head[ H_FLAGS ] & HF_ASIS ? "ASIS" :
-                 ( vma->head[ H_FLAGS ] & HF_S2 ? "S2" :
-                  "LZW" ) ) );
-        for( i = 0; i < 8 && vma->head[ H_FN + i ] != ' '; i++ )
-        {
-            psf->sf.fn[ i ] = vma->head[ H_FN + i ];
-        }
-        psf->sf.fn[ i ] = '\0';
-        
-        for( i = 0; i < 8 && vma->head[ H_FT + i ] != ' '; i++ )
-        {
-            psf->sf.ft[ i ] = vma->head[ H_FT + i ];
-        }
-        psf->sf.ft[ i ] = '\0';
-        
-        for( i = 0; i < 2 && vma->head[ H_FM + i ] != ' '; i++ )
-        {
-            psf->sf.fm[ i ] = vma->head[ H_FM + i ];
-        }
-        psf->sf.fm[ i ] = '\0';
-        
-        psf->sf.year = vma->head[ H_YEAR ] + 1900 +
-        ( ( vma->head[ H_FLAGS ] & HF_Y2K ) ? 100 : 0 );
-        psf->sf.month   = vma->head[ H_MONTH ];
-        psf->sf.day     = vma->head[ H_DAY ];
-        psf->sf.hour    = vma->head[ H_HOUR ];
-        psf->sf.minute  = vma->head[ H_MINUTE ];
-        psf->sf.second  = vma->head[ H_SECOND ];
-        psf->sf.recfm   = vma->head[ H_RECFM ];
-        psf->flags      = vma->head[ H_FLAGS ] & ( HF_S2 | HF_ASIS );
-        
-        /*
-        || Hack for non-Y2K compliant files.  Yes, they ARE still being
-        || created!  Come on folks, upgrade your VMARC to at least
-        || V1R2P021.  :-)
-        */
-        if( psf->sf.year < 1960 )
-        {
-            psf->sf.year += 100;
-        }
-        
-        /*
-        || Construct the LRECL
-        */
-        if( vma->head[ H_FLAGS ] & HF_EXTH )
-        {
-            psf->sf.lrecl = ( vma->head[ H_XRECL + 0 ] << 24 ) |
-            ( vma->head[ H_XRECL + 1 ] << 16 ) |
-            ( vma->head[ H_XRECL + 2 ] << 8  ) |
-            ( vma->head[ H_XRECL + 3 ]       );
-        }
-        else
-        {
-            psf->sf.lrecl = ( vma->head[ H_LRECL + 0 ] << 8  ) |
-            ( vma->head[ H_LRECL + 1 ]       );
-        }
-        
-        /*
-        || Remember where the data starts
-        */
-        psf->dataoff = mytell( vma );
+    return seterr( VMAE_NOERR );
+}
 
-        /*
-        || Retrieve the sizes
-        */
-        set_active( vma, psf );
-        if( !extract( vma ) )
-        {
-            ec = vma->lasterr;
-            goto error;
-        }
-        set_active( vma, NULL );
-        
-        /*
-        || Prevent modification of certain header fields
-        */
-        psf->locked = TRUE;
+/* ====================================================================
+||
+*/
+int
+vma_setlrecl( void *vvma, int lrecl )
+{
+    VMA *vma = (VMA *) vvma;
+    PSUBFILE *psf;
+    
+    /*
+    || Verify VMA
+    */
+    if( vma == NULL )
+    {
+        return VMAE_BADARG;
     }
     
     /*
-    || Locate file doesn't check for errors, just EOF
+    || Decode contexts rely on the archive staying as it is
     */
-    if( ferror( vma->vfile ) )
+    if( in_context( vma ) )
     {
-        ec = VMAE_RERR;
-        goto error;
+        return seterr( VMAE_CONTEXT );
     }
     
     /*
-    || See if any errors are outstanding
+    || Ensure an active subfile
     */
-    if( vma->lasterr )
+    psf = vma->active;
+    if( psf == NULL )
     {
-        ec = vma->lasterr;
-        goto error;
+        return seterr( VMAE_INACT );
     }
     
     /*
-    || Store the VMA ptr
+    || Verify the record format (yes I know, VMARCs support longer)
     */
-    *( (VMA **) vvma ) = vma;
+    if( lrecl < 1 || lrecl > 65535 )
+    {
+        return seterr( VMAE_BADLRECL );
+    }
     
     /*
-    || Success
+    || Can only set lrecl on new subfiles, not existing ones.
     */
-    return seterr( VMAE_NOERR );
+    /*
+    || Can only set recfm on new subfiles, not existing ones.
+    */
+    if( psf->locked )
+    {
+        return seterr( VMAE_NOTMOD );
+    }
     
-error:
+    psf->sf.lrecl = lrecl;
+    
+    mark_dirty( vma, psf );
+    
+    return seterr( VMAE_NOERR );
+}
+
+/* --------------------------------------------------------------------
+|| Sets a subfile's storage method and the header bits that go with it
+*/
+static void
+set_method( PSUBFILE *psf, const char *method )
+{
+    strcpy( psf->sf.meth, method );
+    psf->sf.why = VMAW_GIVEN;
     
     /*
-    || Use vma_close() to cleanup
+    || Set subfile flags
     */
-    vma_close( vma );
-    
-    return ec;
+    psf->sf.rel = 0;
+    psf->flags = 0;
+    if( strcmp( method, VMAM_ASIS ) == 0 )
+    {
+        psf->flags = HF_ASIS;
+        psf->sf.rel = 1;
+    }
+    else if( strcmp( method, VMAM_S2 ) == 0 )
+    {
+        psf->flags = HF_S2;
+    }
 }
 
 /* ====================================================================
 ||
 */
 int
-vma_new( void *vvma, SUBFILE **sfp )
+vma_setmethod( void *vvma, const char *method )
 {
     VMA *vma = (VMA *) vvma;
     PSUBFILE *psf;
@@ -4076,237 +10572,467 @@ vma_new( void *vvma, SUBFILE **sfp )
     }
     
     /*
-    || Allocate a new subfile
+    || Decode contexts rely on the archive staying as it is
     */
-    psf = (PSUBFILE *) calloc( 1, sizeof( PSUBFILE ) );
-    if( psf == NULL )
+    if( in_context( vma ) )
     {
-        return seterr( VMAE_MEM );
+        return seterr( VMAE_CONTEXT );
     }
     
     /*
-    || Link it in
+    || Ensure an active subfile
     */
-    if( vma->sflast == NULL )
-    {
-        vma->subfiles = psf;
-    }
-    else
+    psf = vma->active;
+    if( psf == NULL )
     {
-        vma->sflast->next = psf;
+        return seterr( VMAE_INACT );
     }
-    vma->sflast = psf;
     
     /*
-    || Make this subfile the active one
+    || Verify method
     */
-    set_active( vma, psf );
+    if( strcmp( method, VMAM_ASIS ) != 0 &&
+       strcmp( method, VMAM_LZW ) != 0 &&
+       strcmp( method, VMAM_S2 ) != 0 &&
+       strcmp( method, VMAM_AUTO ) != 0 )
+    {
+        return seterr( VMAE_BADARG );
+    }
     
     /*
-    || Set defaults
+    || Can only set recfm on new subfiles, not existing ones.
     */
-    psf->sf.ver = 1;
-    psf->sf.rel = 0;
-    strcpy( (char *) psf->sf.meth, VMAM_ASIS );
-    strcpy( (char *) psf->sf.fn, "TEMPNAME" );
-    strcpy( (char *) psf->sf.ft, "$DEFAULT" );
-    strcpy( (char *) psf->sf.fm, "A1" );
-    psf->sf.lrecl = 65535;
-    psf->sf.year = 1900;
-    psf->sf.month = 1;
-    psf->sf.day = 1;
-    psf->sf.hour = 0;
-    psf->sf.minute = 0;
-    psf->sf.second = 0;
-    psf->sf.recfm = VMAR_VARIABLE;
-    psf->sf.compressed = 0;
-    psf->sf.uncompressed = 0;
-    psf->sf.dtype = VMAD_UNKNOWN;
-    
     /*
-    || Store subfile ptr
+    || Can only set recfm on new subfiles, not existing ones.
     */
-    if( sfp != NULL )
+    if( psf->locked )
     {
-        *sfp = &vma->active->sf;
+        return seterr( VMAE_NOTMOD );
+    }
+    
+    set_method( psf, method );
+    
+    mark_dirty( vma, psf );
+    
+    return seterr( VMAE_NOERR );
+}
+
+/* --------------------------------------------------------------------
+|| Copies "len" bytes at "off" in "from" to the end of the temp file
+*/
+static int
+copy_temp( VMA *vma, FILE *from, long off, size_t len )
+{
+    size_t cnt;
+    
+    if( fseek( from, off, SEEK_SET ) != 0 )
+    {
+        return seterr( VMAE_SEEK );
+    }
+    
+    while( len > 0 )
+    {
+        cnt = ( len < BUFLEN ? len : BUFLEN );
+        
+        if( fread( vma->cd->ibuf, 1, cnt, from ) != cnt )
+        {
+            return seterr( VMAE_RERR );
+        }
+        
+        if( fwrite( vma->cd->ibuf, 1, cnt, vma->tfile ) != cnt )
+        {
+            return seterr( VMAE_WERR );
+        }
+        
+        len -= cnt;
+    }
+    
+    return seterr( VMAE_NOERR );
+}
+
+/* --------------------------------------------------------------------
+|| Opens the file to be added and, in VMAX_AUTO mode, decides whether
+|| it's text or binary
+*/
+static int
+add_open( VMA *vma, const char *name, FILE **fp, int *modep )
+{
+    FILE *f;
+    int mode = vma->mode;
+    
+    f = fopen( name, "rb" );
+    if( f == NULL )
+    {
+        return seterr( VMAE_IOPEN );
     }
     
     /*
-    || Success
+    || Try to determine the file type
     */
+    if( mode == VMAX_AUTO )
+    {
+        char buf[ 1024 ];
+        size_t actual = fread( buf, 1, 1024, f );
+        size_t i;
+        
+        if( ferror( f ) )
+        {
+            fclose( f );
+            return seterr( VMAE_RERR );
+        }
+        
+        mode = VMAX_TEXT;
+        for( i = 0; i < actual; i++ )
+        {
+            if( buf[ i ] < 0x20 )
+            {
+                if( buf[ i ] != '\t' && buf[ i ] != '\r' && buf[ i ] != '\n' )
+                {
+                    mode = VMAX_BINARY;
+                }
+            }
+        }
+        
+        rewind( f );
+    }
+    
+    *fp = f;
+    *modep = mode;
+    
     return seterr( VMAE_NOERR );
 }
 
-/* ====================================================================
-||
+/* --------------------------------------------------------------------
+|| Readies the handle to store a file as "psf"'s data
 */
-int
-vma_setname( void *vvma, const char *fn, const char *ft, const char *fm )
+static void
+add_reset( VMA *vma, PSUBFILE *psf, int mode )
 {
-    VMA *vma = (VMA *) vvma;
-    PSUBFILE *psf;
-    
     /*
-    || Verify VMA
+    || Convert to ASCII?
     */
-    if( vma == NULL )
+    vma->f_text = FALSE;
+    if( mode == VMAX_TEXT )
     {
-        return VMAE_BADARG;
+        vma->f_text = TRUE;
     }
     
     /*
-    || Ensure an active subfile
+    || Cache RECFM and LRECL
     */
-    psf = vma->active;
-    if( psf == NULL )
+    vma->recfm = psf->sf.recfm;
+    vma->lrecl = psf->sf.lrecl;
+    
+    /*
+    || Reset various counters and I/O controls
+    */
+    vma->imap = FALSE;
+    vma->ibase = &vma->cd->ibuf[ UNREAD ];
+    vma->iptr = vma->ibase;
+    vma->icnt = 0;
+    vma->bytesin = 0;
+    vma->bytesout = 0;
+    vma->residual = UINT_MAX;
+    vma->recbytes = 0;
+    vma->eor = 0;
+    vma->omax = 0;
+}
+
+/* --------------------------------------------------------------------
+|| VMAM_AUTO
+||
+|| Each method is tried on a scratch copy of the handle that reads its
+|| own copy of the sample and writes to a file of its own, so all three
+|| can run at once.  They're listed fastest first.
+*/
+#define AUTOMETHS   3
+
+static const char *auto_meths[ AUTOMETHS ] =
+{
+    VMAM_ASIS,
+    VMAM_LZW,
+    VMAM_S2
+};
+
+typedef struct trial
+{
+    VMA *vma;                           /* scratch handle            */
+    FILE *in;                           /* copy of the sample        */
+    int meth;                           /* index into auto_meths     */
+    int mode;                           /* add mode                  */
+} TRIAL;
+
+/*
+|| Stores the sample with one method
+*/
+static void *
+try_method( void *arg )
+{
+    TRIAL *t = (TRIAL *) arg;
+    
+    switch( t->meth )
     {
-        return seterr( VMAE_INACT );
+        case 0:
+            add_asis( t->vma, t->in, t->mode );
+            break;
+            
+        case 1:
+            add_lzw( t->vma, t->in, t->mode );
+            break;
+            
+        default:
+            add_s2( t->vma, t->in, t->mode );
+            break;
     }
     
+    return NULL;
+}
+
+/*
+|| Picks the method for "psf" by trying them all.  If the whole file was
+|| tried, the winning result is copied to the temp file and "kept" set.
+*/
+static int
+add_auto( VMA *vma, PSUBFILE *psf, FILE *f, int mode, int *kept )
+{
+    TRIAL trials[ AUTOMETHS ];
+    void *args[ AUTOMETHS ];
+    unsigned char *buf;
+    size_t best;
+    size_t len;
+    int whole;
+    int win;
+    int i;
+    
+    *kept = FALSE;
+    
     /*
-    || Verify the file name
+    || Read the sample and find out if it's the whole file
     */
-    if( fn != NULL && !validate_name( fn ) )
+    buf = (unsigned char *) malloc( AUTOSAMPLE );
+    if( buf == NULL )
+    {
+        return seterr( VMAE_MEM );
+    }
+    
+    len = fread( buf, 1, AUTOSAMPLE, f );
+    whole = ( len < AUTOSAMPLE || getc( f ) == EOF );
+    if( ferror( f ) )
     {
-        return seterr( VMAE_BADNAME );
+        free( buf );
+        return seterr( VMAE_RERR );
     }
+    rewind( f );
     
     /*
-    || Verify the file type
+    || Only try whole lines of text
     */
-    if( ft != NULL && !validate_name( ft ) )
+    if( !whole && mode == VMAX_TEXT )
     {
-        return seterr( VMAE_BADTYPE );
+        while( len > 1 && buf[ len - 1 ] != '\n' )
+        {
+            len--;
+        }
     }
     
     /*
-    || Verify the file mode
+    || Give each method a scratch handle, a copy of the sample and an
+    || output file
     */
-    if( fm != NULL )
+    memset( trials, 0, sizeof( trials ) );
+    
+    seterr( VMAE_NOERR );
+    for( i = 0; i < AUTOMETHS; i++ )
     {
-        size_t len = strlen( fm );
+        TRIAL *t = &trials[ i ];
         
-        if( len != 2 )
+        t->meth = i;
+        t->mode = mode;
+        t->vma = (VMA *) malloc( sizeof( VMA ) );
+        if( t->vma == NULL )
         {
-            return seterr( VMAE_BADMODE );
+            seterr( VMAE_MEM );
+            break;
         }
+        memcpy( t->vma, vma, sizeof( VMA ) );
+        t->vma->cd = (CODER *) malloc( sizeof( CODER ) );
+        if( t->vma->cd == NULL )
+        {
+            seterr( VMAE_MEM );
+            break;
+        }
+        t->vma->tfile = tmpfile();
+        t->in = tmpfile();
         
-        switch( fm[ 0 ] )
+        if( t->vma->tfile == NULL || t->in == NULL )
         {
-            case 'A': case 'B': case 'C': case 'D': case 'E': case 'F':
-            case 'G': case 'H': case 'I': case 'J': case 'K': case 'L':
-            case 'M': case 'N': case 'O': case 'P': case 'Q': case 'R':
-            case 'S': case 'T': case 'U': case 'V': case 'W': case 'Y':
-            case 'Z':
-                if( isdigit( fm[ 1 ] ) )
-                {
-                    break;
-                }
-                /* fall through*/
-                
-            default:
-                return seterr( VMAE_BADMODE );
-                break;
+            seterr( VMAE_TOPEN );
+            break;
+        }
+        
+        if( fwrite( buf, 1, len, t->in ) != len || fseek( t->in, 0, SEEK_SET ) != 0 )
+        {
+            seterr( VMAE_WERR );
+            break;
         }
+        
+        add_reset( t->vma, psf, mode );
+        args[ i ] = t;
     }
     
     /*
-    || Set the file name
+    || Run them, on threads of their own unless a pool already has the
+    || processors
     */
-    if( fn != NULL )
+    if( vma->lasterr == VMAE_NOERR )
     {
-        strcpy( (char *) psf->sf.fn, fn );
-        mark_dirty( vma, psf );
+#if defined( HAVE_THREADS )
+        if( vma->parent == NULL && cpus() > 1 )
+        {
+            run_threads( try_method, args, AUTOMETHS );
+        }
+        else
+#endif
+        {
+            for( i = 0; i < AUTOMETHS; i++ )
+            {
+                try_method( args[ i ] );
+            }
+        }
+        
+        for( i = 0; i < AUTOMETHS; i++ )
+        {
+            if( trials[ i ].vma->lasterr != VMAE_NOERR )
+            {
+                seterr( trials[ i ].vma->lasterr );
+                break;
+            }
+        }
     }
     
     /*
-    || Set the file type
+    || Take the fastest that's within the slack of the smallest
     */
-    if( ft != NULL )
+    if( vma->lasterr == VMAE_NOERR )
     {
-        strcpy( (char *) psf->sf.ft, ft );
-        mark_dirty( vma, psf );
+        best = trials[ 0 ].vma->bytesout;
+        for( i = 1; i < AUTOMETHS; i++ )
+        {
+            if( trials[ i ].vma->bytesout < best )
+            {
+                best = trials[ i ].vma->bytesout;
+            }
+        }
+        
+        for( win = 0; win < AUTOMETHS - 1; win++ )
+        {
+            if( trials[ win ].vma->bytesout * 100 <= best * ( 100 + vma->slack ) )
+            {
+                break;
+            }
+        }
+        
+        set_method( psf, auto_meths[ win ] );
+        psf->sf.why = ( trials[ win ].vma->bytesout == best ? VMAW_SMALLEST : VMAW_FASTER );
+        
+        /*
+        || Keep what the whole file came to
+        */
+        if( whole &&
+            copy_temp( vma, trials[ win ].vma->tfile, 0, trials[ win ].vma->bytesout ) == VMAE_NOERR )
+        {
+            vma->bytesin = trials[ win ].vma->bytesin;
+            vma->bytesout = trials[ win ].vma->bytesout;
+            vma->omax = trials[ win ].vma->omax;
+            *kept = TRUE;
+        }
     }
     
-    /*
-    || Set the file mode
-    */
-    if( fm != NULL )
+    for( i = 0; i < AUTOMETHS; i++ )
     {
-        strcpy( (char *) psf->sf.fm, fm );
-        mark_dirty( vma, psf );
+        if( trials[ i ].in != NULL )
+        {
+            fclose( trials[ i ].in );
+        }
+        
+        if( trials[ i ].vma != NULL )
+        {
+            if( trials[ i ].vma->tfile != NULL )
+            {
+                fclose( trials[ i ].vma->tfile );
+            }
+            if( trials[ i ].vma->cd != NULL )
+            {
+                free( trials[ i ].vma->cd );
+            }
+            free( trials[ i ].vma );
+        }
     }
+    free( buf );
     
-    return seterr( VMAE_NOERR );
+    return vma->lasterr;
 }
 
-/* ====================================================================
-||
+/* --------------------------------------------------------------------
+|| Stores "f" as the data of "psf" at the end of vma->tfile and fills
+|| in the fields that depend on it
 */
-int
-vma_setdate( void *vvma, int year, int month, int day )
+static int
+add_data( VMA *vma, PSUBFILE *psf, FILE *f, int mode )
 {
-    VMA *vma = (VMA *) vvma;
-    PSUBFILE *psf;
-    
-    /*
-    || Verify VMA
-    */
-    if( vma == NULL )
-    {
-        return VMAE_BADARG;
-    }
+    int kept = FALSE;
     
-    /*
-    || Ensure an active subfile
-    */
-    psf = vma->active;
-    if( psf == NULL )
-    {
-        return seterr( VMAE_INACT );
-    }
+    add_reset( vma, psf, mode );
     
     /*
-    || Verify the year
+    || Settle the method first if it's up to us
     */
-    if( year < 1900 )
+    seterr( VMAE_NOERR );
+    if( strcmp( psf->sf.meth, VMAM_AUTO ) == 0 )
     {
-        return seterr( VMAE_BADYEAR );
+        add_auto( vma, psf, f, mode, &kept );
     }
     
     /*
-    || Verify the month
+    || Store based on type
     */
-    if( month < 1 || month > 12 )
+    if( vma->lasterr == VMAE_NOERR && !kept )
     {
-        return seterr( VMAE_BADMONTH );
+        if( strcmp( psf->sf.meth, VMAM_ASIS ) == 0 )
+        {
+            add_asis( vma, f, mode );
+        }
+        else if( strcmp( psf->sf.meth, VMAM_LZW ) == 0 )
+        {
+            add_lzw( vma, f, mode );
+        }
+        else if( strcmp( psf->sf.meth, VMAM_S2 ) == 0 )
+        {
+            add_s2( vma, f, mode );
+        }
     }
-    
+
     /*
-    || Verify the day (I know, I know...lazy)
+    || Finalize subfile fields
     */
-    if( day < 1 || day > 31 )
-    {
-        return seterr( VMAE_BADDAY );
-    }
-    
-    psf->sf.year = year;
-    psf->sf.month = month;
-    psf->sf.day = day;
-    
-    mark_dirty( vma, psf );
+    psf->sf.dtype = mode;
+    psf->sf.lrecl = (int) ( vma->recfm == VMAR_FIXED ? vma->lrecl : vma->omax );
+    psf->sf.compressed = vma->bytesout;
+    psf->sf.uncompressed = vma->bytesin;
     
-    return seterr( VMAE_NOERR );
+    return vma->lasterr;
 }
 
 /* ====================================================================
 ||
 */
 int
-vma_settime( void *vvma, int hour, int minute, int second )
+vma_add( void *vvma, const char *name )
 {
     VMA *vma = (VMA *) vvma;
     PSUBFILE *psf;
+    FILE *f;
+    int mode;
     
     /*
     || Verify VMA
@@ -4316,6 +11042,14 @@ vma_settime( void *vvma, int hour, int minute, int second )
         return VMAE_BADARG;
     }
     
+    /*
+    || Decode contexts rely on the archive staying as it is
+    */
+    if( in_context( vma ) )
+    {
+        return seterr( VMAE_CONTEXT );
+    }
+    
     /*
     || Ensure an active subfile
     */
@@ -4326,217 +11060,247 @@ vma_settime( void *vvma, int hour, int minute, int second )
     }
     
     /*
-    || Verify the hour
+    || The decoder belongs to the stream while one is open
     */
-    if( hour < 0 || hour > 23 )
+    if( vma->f_stream )
     {
-        return seterr( VMAE_BADHOUR );
+        return seterr( VMAE_STREAM );
     }
     
     /*
-    || Verify the minute
+    || Ensure the subfile is fresh (maybe remove to do subfile replaces)
     */
-    if( minute < 0 || minute > 59 )
+    if( psf->dataoff != 0 )
     {
-        return seterr( VMAE_BADMINS );
+        return seterr( VMAE_BADARG );
     }
     
     /*
-    || Verify the second
+    || Verify name
     */
-    if( second < 0 || second > 59 )
+    if( name == NULL )
     {
-        return seterr( VMAE_BADSECS );
+        return seterr( VMAE_BADFILE );
     }
     
-    psf->sf.hour = hour;
-    psf->sf.minute = minute;
-    psf->sf.second = second;
-    
-    mark_dirty( vma, psf );
-    
-    return seterr( VMAE_NOERR );
-}
-
-/* ====================================================================
-||
-*/
-int
-vma_setrecfm( void *vvma, char recfm )
-{
-    VMA *vma = (VMA *) vvma;
-    PSUBFILE *psf;
-    
     /*
-    || Verify VMA
+    || Open input file
     */
-    if( vma == NULL )
+    if( add_open( vma, name, &f, &mode ) != VMAE_NOERR )
     {
-        return VMAE_BADARG;
+        return vma->lasterr;
     }
     
     /*
-    || Ensure an active subfile
+    || Make sure the temp file is open and positioned properly
     */
-    psf = vma->active;
-    if( psf == NULL )
+    if( open_temp( vma ) != VMAE_NOERR )
     {
-        return seterr( VMAE_INACT );
+        fclose( f );
+        return vma->lasterr;
     }
     
     /*
-    || Verify the record format
+    || Remember data offset
     */
-    if( recfm != VMAR_FIXED && recfm != VMAR_VARIABLE )
-    {
-        return seterr( VMAE_BADRECFM );
-    }
+    psf->dataoff = ftell( vma->tfile );
     
     /*
-    || Can only set recfm on new subfiles, not existing ones.
+    || Store based on type
     */
-    if( psf->locked )
-    {
-        return seterr( VMAE_NOTMOD );
-    }
-    
-    psf->sf.recfm = recfm;
+    add_data( vma, psf, f, mode );
+    fclose( f );
     
-    mark_dirty( vma, psf );
+    psf->temp = TRUE;
     
-    return seterr( VMAE_NOERR );
+    return vma->lasterr;
 }
 
-/* ====================================================================
+/* --------------------------------------------------------------------
+|| Add all
 ||
+|| Adds one job's file to the end of vma->tfile, which for a context is
+|| the segment file that thread is filling.  Returns FALSE on failure.
 */
-int
-vma_setlrecl( void *vvma, int lrecl )
+static int
+add_job( VMA *vma, XJOB *job )
 {
-    VMA *vma = (VMA *) vvma;
-    PSUBFILE *psf;
-    
-    /*
-    || Verify VMA
-    */
-    if( vma == NULL )
-    {
-        return VMAE_BADARG;
-    }
-    
-    /*
-    || Ensure an active subfile
-    */
-    psf = vma->active;
-    if( psf == NULL )
-    {
-        return seterr( VMAE_INACT );
-    }
+    FILE *f;
+    int mode;
     
-    /*
-    || Verify the record format (yes I know, VMARCs support longer)
-    */
-    if( lrecl < 1 || lrecl > 65535 )
+    job->run = TRUE;
+    job->seg = vma->tfile;
+    job->segoff = ftell( vma->tfile );
+    
+    if( add_open( vma, job->name, &f, &mode ) == VMAE_NOERR )
     {
-        return seterr( VMAE_BADLRECL );
+        add_data( vma, job->psf, f, mode );
+        fclose( f );
     }
     
-    /*
-    || Can only set lrecl on new subfiles, not existing ones.
-    */
-    /*
-    || Can only set recfm on new subfiles, not existing ones.
-    */
-    if( psf->locked )
+    job->rc = vma->lasterr;
+    
+    return ( job->rc == VMAE_NOERR );
+}
+
+#if defined( HAVE_THREADS )
+/*
+|| Copies a job's data from its segment to the end of the temp file
+*/
+static int
+splice_job( VMA *vma, XJOB *job )
+{
+    long off = ftell( vma->tfile );
+    
+    if( copy_temp( vma, job->seg, job->segoff, job->psf->sf.compressed ) != VMAE_NOERR )
     {
-        return seterr( VMAE_NOTMOD );
+        return vma->lasterr;
     }
     
-    psf->sf.lrecl = lrecl;
-    
-    mark_dirty( vma, psf );
+    job->psf->dataoff = off;
+    job->psf->temp = TRUE;
     
     return seterr( VMAE_NOERR );
 }
 
-/* ====================================================================
-||
+/*
+|| Adds files until there aren't any left or one of them fails
 */
-int
-vma_setmethod( void *vvma, const char *method )
+static void *
+add_jobs( void *arg )
 {
-    VMA *vma = (VMA *) vvma;
-    PSUBFILE *psf;
+    XWORKER *w = (XWORKER *) arg;
+    XPOOL *pool = w->pool;
+    XJOB *job;
     
-    /*
-    || Verify VMA
-    */
-    if( vma == NULL )
+    while( ( job = next_job( pool ) ) != NULL )
     {
-        return VMAE_BADARG;
+        if( !add_job( w->ctx, job ) )
+        {
+            stop_pool( pool );
+        }
     }
     
-    /*
-    || Ensure an active subfile
-    */
-    psf = vma->active;
-    if( psf == NULL )
+    return NULL;
+}
+
+/*
+|| Compresses the jobs on up to "nthr" contexts, each into a segment
+|| file of its own, then splices them into the temp file in the order
+|| they were asked for, up to the first failure.  Returns FALSE (with
+|| the error set) if not even one context could be opened.
+*/
+static int
+add_parallel( VMA *vma, XJOB *jobs, size_t njob, int nthr )
+{
+    XWORKER work[ MAXTHREADS ];
+    FILE *tfile[ MAXTHREADS ];
+    void *args[ MAXTHREADS ];
+    XPOOL pool;
+    XJOB *job;
+    size_t i;
+    int opened;
+    int cnt;
+    int ec;
+    
+    if( !init_pool( vma, &pool, jobs, njob ) )
     {
-        return seterr( VMAE_INACT );
+        return FALSE;
     }
     
     /*
-    || Verify method
+    || Contexts have to come from this thread.  They're only used for
+    || their compression tables, and write to their segment instead of
+    || the temp file.
     */
-    if( strcmp( method, VMAM_ASIS ) != 0 &&
-       strcmp( method, VMAM_LZW ) != 0 &&
-       strcmp( method, VMAM_S2 ) != 0 )
+    ec = VMAE_NOERR;
+    for( cnt = 0; cnt < nthr; cnt++ )
     {
-        return seterr( VMAE_BADARG );
+        ec = vma_open_context( vma, (void **) &work[ cnt ].ctx );
+        if( ec != VMAE_NOERR )
+        {
+            break;
+        }
+        
+        tfile[ cnt ] = work[ cnt ].ctx->tfile;
+        work[ cnt ].ctx->tfile = tmpfile();
+        if( work[ cnt ].ctx->tfile == NULL )
+        {
+            work[ cnt ].ctx->tfile = tfile[ cnt ];
+            vma_close( work[ cnt ].ctx );
+            ec = VMAE_TOPEN;
+            break;
+        }
+        
+        work[ cnt ].pool = &pool;
+        args[ cnt ] = &work[ cnt ];
     }
     
-    /*
-    || Can only set recfm on new subfiles, not existing ones.
-    */
-    /*
-    || Can only set recfm on new subfiles, not existing ones.
-    */
-    if( psf->locked )
+    opened = cnt;
+    if( opened > 0 )
     {
-        return seterr( VMAE_NOTMOD );
+        run_threads( add_jobs, args, opened );
+        
+        for( i = 0; i < njob; i++ )
+        {
+            job = &jobs[ i ];
+            if( !job->run || job->rc != VMAE_NOERR )
+            {
+                break;
+            }
+            
+            if( splice_job( vma, job ) != VMAE_NOERR )
+            {
+                job->rc = vma->lasterr;
+                break;
+            }
+        }
     }
     
-    strcpy( psf->sf.meth, method );
-    
-    /*
-    || Set subfile flags
-    */
-    psf->sf.rel = 0;
-    if( strcmp( method, VMAM_ASIS ) == 0 )
+    while( cnt > 0 )
     {
-        psf->flags = HF_ASIS;
-        psf->sf.rel = 1;
+        cnt--;
+        fclose( work[ cnt ].ctx->tfile );
+        work[ cnt ].ctx->tfile = tfile[ cnt ];
+        vma_close( work[ cnt ].ctx );
     }
-    else if( strcmp( method, VMAM_S2 ) == 0 )
+    
+    pthread_mutex_destroy( &pool.lock );
+    free( pool.order );
+    
+    if( opened == 0 )
     {
-        psf->flags = HF_S2;
+        seterr( ec );
+        return FALSE;
     }
     
-    mark_dirty( vma, psf );
-    
-    return seterr( VMAE_NOERR );
+    return TRUE;
 }
+#endif
 
 /* ====================================================================
-||
+|| Adds the file "name" gives for each new subfile (made by vma_new()
+|| but not yet added), using up to "threads" threads (0 means one per
+|| processor).  Then "done" (if given) is told how each one went, in
+|| archive order.
 */
 int
-vma_add( void *vvma, const char *name )
+vma_add_all( void *vvma,
+             int threads,
+             int ( *name )( void *ctx, SUBFILE *sf, char *buf, size_t len ),
+             int ( *done )( void *ctx, SUBFILE *sf, int rc ),
+             void *ctx )
 {
     VMA *vma = (VMA *) vvma;
     PSUBFILE *psf;
-    FILE *f;
-    int mode = vma->mode;
+    XJOB *jobs;
+    XJOB *job;
+    char fname[ FILENAME_MAX ];
+    struct stat st;
+    size_t njob;
+    size_t cnt;
+    size_t i;
+    int rc;
     
     /*
     || Verify VMA
@@ -4547,136 +11311,172 @@ vma_add( void *vvma, const char *name )
     }
     
     /*
-    || Ensure an active subfile
+    || Verify args
     */
-    psf = vma->active;
-    if( psf == NULL )
+    if( name == NULL || threads < 0 )
     {
-        return seterr( VMAE_INACT );
+        return seterr( VMAE_BADARG );
     }
     
     /*
-    || Ensure the subfile is fresh (maybe remove to do subfile replaces)
+    || Reset error
     */
-    if( psf->dataoff != 0 )
-    {
-        return seterr( VMAE_BADARG );
-    }
+    seterr( VMAE_NOERR );
     
     /*
-    || Verify name
+    || Decode contexts rely on the archive staying as it is
     */
-    if( name == NULL )
+    if( in_context( vma ) )
     {
-        return seterr( VMAE_BADFILE );
+        return seterr( VMAE_CONTEXT );
     }
     
     /*
-    || Open input file
+    || The encoder tables belong to the stream while one is open
     */
-    f = fopen( name, "rb" );
-    if( f == NULL )
+    if( vma->f_stream )
     {
-        return seterr( VMAE_IOPEN );
+        return seterr( VMAE_STREAM );
     }
     
     /*
-    || Try to determine the file type
+    || Collect the names, in archive order, right here
     */
-    if( mode == VMAX_AUTO )
+    cnt = 0;
+    for( psf = vma->subfiles; psf != NULL; psf = psf->next )
     {
-        char buf[ 1024 ];
-        size_t actual = fread( buf, 1, 1024, f );
-        size_t i;
-        
-        if( ferror( f ) )
+        cnt++;
+    }
+    
+    jobs = (XJOB *) calloc( cnt ? cnt : 1, sizeof( XJOB ) );
+    if( jobs == NULL )
+    {
+        return seterr( VMAE_MEM );
+    }
+    
+    njob = 0;
+    for( psf = vma->subfiles, i = 0; psf != NULL; psf = psf->next, i++ )
+    {
+        if( psf->dataoff != 0 || psf->temp )
         {
-            return seterr( VMAE_RERR );
+            continue;
         }
         
-        mode = VMAX_TEXT;
-        for( i = 0; i < actual; i++ )
+        fname[ 0 ] = '\0';
+        if( name( ctx, &psf->sf, fname, sizeof( fname ) ) != 0 )
         {
-            if( buf[ i ] < 0x20 )
-            {
-                if( buf[ i ] != '\t' && buf[ i ] != '\r' && buf[ i ] != '\n' )
-                {
-                    mode = VMAX_BINARY;
-                }
-            }
+            continue;
         }
+        fname[ sizeof( fname ) - 1 ] = '\0';
         
-        rewind( f );
+        job = &jobs[ njob ];
+        job->name = strdup( fname );
+        if( job->name == NULL )
+        {
+            seterr( VMAE_MEM );
+            break;
+        }
+        job->psf = psf;
+        job->ndx = i;
+        job->weight = ( stat( fname, &st ) == 0 ? (size_t) st.st_size : 0 );
+        job->rc = VMAE_NOERR;
+        job->run = FALSE;
+        njob++;
     }
     
     /*
-    || Convert to ASCII?
+    || Make sure the temp file is open
     */
-    vma->f_text = FALSE;
-    if( mode == VMAX_TEXT )
+    if( vma->lasterr == VMAE_NOERR && njob > 0 )
     {
-        vma->f_text = TRUE;
+        open_temp( vma );
     }
     
     /*
-    || Cache RECFM and LRECL
-    */
-    vma->recfm = psf->sf.recfm;
-    vma->lrecl = psf->sf.lrecl;
-    
-    /*
-    || Reset various counters and I/O controls
-    */
-    vma->ibufp = 0;
-    vma->icnt = 0;
-    vma->bytesin = 0;
-    vma->bytesout = 0;
-    vma->residual = UINT_MAX;
-    vma->recbytes = 0;
-    vma->eor = 0;
-    vma->omax = 0;
-    
-    /*
-    || Make sure the temp file is open and positioned properly
+    || Add them
     */
-    if( open_temp( vma ) != VMAE_NOERR )
+    rc = vma->lasterr;
+    if( rc == VMAE_NOERR )
     {
-        return vma->lasterr;
+#if defined( HAVE_THREADS )
+        if( threads == 0 )
+        {
+            threads = cpus();
+        }
+        
+        if( threads > MAXTHREADS )
+        {
+            threads = MAXTHREADS;
+        }
+        
+        if( (size_t) threads > njob )
+        {
+            threads = (int) njob;
+        }
+        
+        if( threads > 1 )
+        {
+            if( !add_parallel( vma, jobs, njob, threads ) )
+            {
+                rc = vma->lasterr;
+            }
+        }
+        else
+#endif
+        {
+            for( i = 0; i < njob; i++ )
+            {
+                job = &jobs[ i ];
+                if( !add_job( vma, job ) )
+                {
+                    break;
+                }
+                
+                job->psf->dataoff = job->segoff;
+                job->psf->temp = TRUE;
+            }
+        }
     }
     
     /*
-    || Remember data offset
-    */
-    psf->dataoff = ftell( vma->tfile );
-    
-    /*
-    || Store based on type
+    || Report in archive order up to the first failure, just as far as
+    || adding them one at a time would have gotten
     */
-    if( strcmp( psf->sf.meth, VMAM_ASIS ) == 0 )
-    {
-        add_asis( vma, f, mode );
-    }
-    else if( strcmp( psf->sf.meth, VMAM_LZW ) == 0 )
+    for( i = 0; i < njob && rc == VMAE_NOERR; i++ )
     {
-        add_lzw( vma, f, mode );
+        job = &jobs[ i ];
+        if( !job->run )
+        {
+            /*
+            || Never started because a later one failed
+            */
+            while( ++i < njob && rc == VMAE_NOERR )
+            {
+                if( jobs[ i ].run && jobs[ i ].rc != VMAE_NOERR )
+                {
+                    rc = jobs[ i ].rc;
+                }
+            }
+            break;
+        }
+        
+        if( job->rc != VMAE_NOERR )
+        {
+            rc = job->rc;
+        }
+        else if( done != NULL )
+        {
+            rc = done( ctx, &job->psf->sf, job->rc );
+        }
     }
-    else if( strcmp( psf->sf.meth, VMAM_S2 ) == 0 )
+    
+    for( i = 0; i < njob; i++ )
     {
-        /* force lzw until s2 is added */
-        strcpy( psf->sf.meth, VMAM_LZW );
-        add_lzw( vma, f, mode );
+        free( jobs[ i ].name );
     }
-
-    /*
-    || Finalize subfile fields
-    */
-    psf->sf.dtype = mode;
-    psf->sf.lrecl = (int) ( vma->recfm == VMAR_FIXED ? vma->lrecl : vma->omax );
-    psf->sf.compressed = vma->bytesout;
-    psf->sf.uncompressed = vma->bytesin;
-    psf->temp = TRUE;
+    free( jobs );
     
-    return VMAE_NOERR;
+    return seterr( rc );
 }
 
 /* ====================================================================
@@ -4697,6 +11497,14 @@ vma_delete( void *vvma )
         return VMAE_BADARG;
     }
     
+    /*
+    || Decode contexts rely on the archive staying as it is
+    */
+    if( in_context( vma ) )
+    {
+        return seterr( VMAE_CONTEXT );
+    }
+    
     /*
     || Ensure an active subfile
     */
@@ -4705,6 +11513,14 @@ vma_delete( void *vvma )
         return seterr( VMAE_INACT );
     }
     
+    /*
+    || Can't pull the subfile out from under its stream
+    */
+    if( vma->f_stream && vma->active == vma->spsf )
+    {
+        return seterr( VMAE_STREAM );
+    }
+    
     /*
     || Find the subfile preceeding the active one
     */
@@ -4744,6 +11560,7 @@ vma_delete( void *vvma )
     /*
     || Free the memory
     */
+    name_unlink( vma, psf );
     free( psf );
     
     /*
@@ -4771,6 +11588,14 @@ vma_retain( void *vvma )
         return VMAE_BADARG;
     }
     
+    /*
+    || Decode contexts rely on the archive staying as it is
+    */
+    if( in_context( vma ) )
+    {
+        return seterr( VMAE_CONTEXT );
+    }
+    
     /*
     || Make sure something is not already retained
     */
@@ -4791,7 +11616,7 @@ vma_retain( void *vvma )
     /*
     || Retain the active subfile
     */
-    memcpy( &vma->sfsave, psf, sizeof( vma->sfsave ) );
+    memcpy( &vma->sfsave, &psf->sf, sizeof( vma->sfsave ) );
     
     /*
     || Remember which subfile was retained
@@ -4823,6 +11648,14 @@ vma_release( void *vvma, int discard )
         return VMAE_BADARG;
     }
     
+    /*
+    || Decode contexts rely on the archive staying as it is
+    */
+    if( in_context( vma ) )
+    {
+        return seterr( VMAE_CONTEXT );
+    }
+    
     /*
     || Ensure an active subfile
     */
@@ -4845,7 +11678,9 @@ vma_release( void *vvma, int discard )
     */
     if( discard )
     {
-        memcpy( psf, &vma->sfsave, sizeof( *psf ) );
+        name_unlink( vma, psf );
+        memcpy( &psf->sf, &vma->sfsave, sizeof( psf->sf ) );
+        name_link( vma, psf );
         vma->f_dirty = vma->f_retdirty;
     }
     
@@ -40,6 +40,7 @@ typedef struct subfile
     size_t compressed;
     size_t uncompressed;
     char   dtype;                           /* data type TRUE = text */
+    char   why;                          /* why VMAM_AUTO chose meth */
 } SUBFILE;
 
 /* --------------------------------------------------------------------
@@ -48,6 +49,24 @@ typedef struct subfile
 #define VMAM_ASIS       "ASIS"
 #define VMAM_LZW        "LZW"
 #define VMAM_S2         "S2"
+#define VMAM_AUTO       "AUTO"
+
+/* --------------------------------------------------------------------
+|| VMAM_AUTO tries ASIS, LZW and S2 on each file as it's added, on the
+|| whole file if it's small and on a sample of its start if not, and
+|| stores it with whichever does best.  That's the smallest, unless a
+|| faster one (ASIS, then LZW, then S2) comes within the percentage set
+|| by vma_setslack() of it.  SUBFILE::meth then holds the method used
+|| and SUBFILE::why says why it won:
+||
+||  VMAW_GIVEN      the method was set some other way (this is also
+||                  what subfiles read from an archive have)
+||  VMAW_SMALLEST   it made the smallest subfile
+||  VMAW_FASTER     it's faster than the smallest and within the slack
+*/
+#define VMAW_GIVEN      0                   /* method was given      */
+#define VMAW_SMALLEST   1                   /* it was smallest       */
+#define VMAW_FASTER     2                   /* faster and near it    */
 
 /* --------------------------------------------------------------------
 || SUBFILE::recfm
@@ -72,6 +91,96 @@ typedef struct subfile
 #define VMAX_BINARY     2                   /* no conversion         */
 #define VMAX_TRANS      3                   /* translate             */
 
+/* --------------------------------------------------------------------
+|| Open flags
+||
+|| VMAO_LAZY doesn't decode the subfiles when the archive is opened.
+|| It still has to find where each one's data ends, so ASIS records are
+|| stepped over and compressed data is run through its string table
+|| without being expanded.  SUBFILE::compressed, ::uncompressed and
+|| ::dtype are then filled in by vma_getactive(), vma_stat() or by
+|| extracting the subfile.
+||
+|| VMAO_INDEX reuses (and maintains) a "<archive>.vmaidx" sidecar file
+|| holding the subfile list, so reopening an unchanged archive doesn't
+|| have to scan or decode it at all.
+||
+|| Where supported, the archive is memory mapped and read in place.
+|| VMAO_NOMAP forces plain stdio reads instead.
+||
+|| VMAO_PARALLEL searches a mapped archive for headers and sizes the
+|| subfiles using one thread per processor.
+||
+|| VMAO_PIPELINE extracts large subfiles to a file or descriptor with
+|| the reading, decoding and writing each done on its own thread.
+||
+|| VMAO_PARDECODE spreads the decoding of large LZW subfiles across
+|| one thread per processor.
+*/
+#define VMAO_LAZY       0x0001              /* defer subfile sizing  */
+#define VMAO_INDEX      0x0002              /* use sidecar index     */
+#define VMAO_NOMAP      0x0004              /* don't map the archive */
+#define VMAO_PARALLEL   0x0008              /* open using threads    */
+#define VMAO_PIPELINE   0x0010              /* extract using threads */
+#define VMAO_PARDECODE  0x0020              /* decode using threads  */
+
+/* --------------------------------------------------------------------
+|| Extraction targets
+||
+|| Besides a named file, the active subfile can be extracted to an open
+|| file descriptor (vma_extract_fd), to a malloc()ed buffer the caller
+|| frees (vma_extract_mem) or through a callback that gets each record
+|| as it's decoded (vma_extract_cb).  None of these touch file times.
+||
+|| vma_extract_all() extracts every subfile at once using a pool of
+|| decode contexts.  The "name" callback is called for each subfile, in
+|| archive order and on the calling thread, to fill in an output file
+|| name; returning nonzero skips the subfile.  Once they're all done,
+|| "done" gets each result in archive order.  The files are the same
+|| as extracting one at a time, and as with that, the first failure
+|| (other than VMAE_LRECL) ends the reporting and is returned.  Small
+|| subfiles are decoded into memory and their files made in batches,
+|| through io_uring when they're going to a network file system.
+*/
+
+/* --------------------------------------------------------------------
+|| Adding
+||
+|| vma_add_all() adds the data of every subfile made by vma_new() but
+|| not yet added, compressing several at once.  The "name" callback is
+|| called for each of them, in archive order and on the calling thread,
+|| to fill in the input file name; returning nonzero leaves it alone.
+|| Each file is compressed with its own tables into a segment file of
+|| its thread's, and the segments are copied into the temp file in
+|| archive order, so the archive comes out just as adding them one at
+|| a time would make it.  As with vma_extract_all(), "done" then gets
+|| each result in order and the first failure is returned.
+*/
+
+/* --------------------------------------------------------------------
+|| Streams
+||
+|| vma_open_stream() readies the active subfile to be read with
+|| vma_read() in the current extraction mode.  Only as much is decoded
+|| as each read needs.  There can be one stream per archive, and while
+|| it's open anything else that would need to decode or rewrite the
+|| archive fails with VMAE_STREAM.
+*/
+
+/* --------------------------------------------------------------------
+|| Decode contexts
+||
+|| vma_open_context() creates a handle that decodes from an already
+|| opened archive without disturbing it or any other context, so each
+|| thread can extract from the one archive at once.  Contexts are
+|| opened by the thread using the archive, then handed out.  They have
+|| their own active subfile, mode, conversion tables and last error and
+|| support the lookup, stat, extract and stream calls.  They're closed
+|| with vma_close(), which must happen before the archive is closed.
+|| While any are open, calls that would change the archive (from the
+|| archive or a context) fail with VMAE_CONTEXT.
+*/
+
 /* --------------------------------------------------------------------
 || Errors
 */
@@ -114,6 +223,8 @@ enum
     VMAE_RETAINED,                          /* already retained      */
     VMAE_NOTRET,                            /* not retained          */
     VMAE_RENAME,                            /* rename failed         */
+    VMAE_STREAM,                            /* stream is open        */
+    VMAE_CONTEXT,                           /* contexts are open     */
     VMAE_NUMERRORS                          /* number of errors      */
 };
 
@@ -121,17 +232,30 @@ enum
 || Public functions
 */
 extern int vma_open( const char *name, void **vvma );
+extern int vma_open_ex( const char *name, int flags, void **vvma );
 extern void vma_close( void *vvma );
+extern int vma_open_context( void *vvma, void **vctx );
 
 extern int vma_setmode( void *vvma, int mode );
+extern int vma_setslack( void *vvma, int percent );
 
 extern int vma_first( void *vvma, SUBFILE **sfp );
 extern int vma_next( void *vvma, SUBFILE **sfp );
 
 extern int vma_getactive( void *vvma, SUBFILE **sfp );
 extern int vma_setactive( void *vvma, SUBFILE *sf );
+extern int vma_find( void *vvma, const char *fn, const char *ft, const char *fm, SUBFILE **sfp );
+extern int vma_find_next( void *vvma, const char *fn, const char *ft, const char *fm, SUBFILE **sfp );
+extern int vma_stat( void *vvma, SUBFILE *sf );
 
 extern int vma_extract( void *vvma, const char *name );
+extern int vma_extract_fd( void *vvma, int fd );
+extern int vma_extract_mem( void *vvma, void **buf, size_t *len );
+extern int vma_extract_cb( void *vvma, int ( *cb )( void *ctx, const void *buf, size_t len ), void *ctx );
+extern int vma_extract_all( void *vvma, int threads, int ( *name )( void *ctx, SUBFILE *sf, char *buf, size_t len ), int ( *done )( void *ctx, SUBFILE *sf, int rc ), void *ctx );
+extern int vma_open_stream( void *vvma );
+extern int vma_read( void *vvma, void *buf, size_t len, size_t *nread );
+extern int vma_close_stream( void *vvma );
 extern int vma_setconv( void *vvma, const char *fucm, const char *tucm );
 
 extern const char *vma_strerror( int ec );
@@ -145,6 +269,7 @@ extern int vma_setlrecl( void *vvma, int lrecl );
 extern int vma_setmethod( void *vvma, const char *method );
 
 extern int vma_add( void *vvma, const char *name );
+extern int vma_add_all( void *vvma, int threads, int ( *name )( void *ctx, SUBFILE *sf, char *buf, size_t len ), int ( *done )( void *ctx, SUBFILE *sf, int rc ), void *ctx );
 extern int vma_delete( void *vvma );
 
 extern int vma_isdirty( void *vvma, int *dirty );
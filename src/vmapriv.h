@@ -39,57 +39,110 @@ typedef unsigned char uchar;
 #define kodebcd 1               /* Origin of EBCDIC character codes  */
 #define kodmax  kodebcd + 255   /* Last predefined compaction code   */
 
-/* --------------------------------------------------------------------
-|| LZW stuff
+/*
+|| The decoders lay their output end to end in a history buffer and
+|| remember where each table entry's string last appeared, so most
+|| strings can simply be copied instead of rebuilt.
+*/
+#define NOPOS   UINT_MAX        /* String not in history             */
+#define HISTLEN 65536           /* Length of history buffer          */
+#define CODEBUF 1024            /* Codes unpacked at a time          */
+
+/*
+|| Returned by a decoder that stopped early so a stream reader could
+|| catch up.  It picks up where it left off the next time it's called.
 */
-#define CHAINEND ( (struct lzwdsect *) -1 )
+#define PAUSED  ( -1 )          /* Decoder stopped for the reader    */
 
 /* --------------------------------------------------------------------
 || String table
+||
+|| The encoder's entries refer to each other by table index so the whole
+|| dictionary fits in the cache.  The reference counts are a separate
+|| array since the search for a free entry runs along them.
 */
 #define TABSIZE 4096
+#define LZWNONE 0xffff                  /* no entry                  */
 
 typedef struct lzwdsect
 {
-    struct lzwdsect *right;
-    struct lzwdsect *left;
-    struct lzwdsect *pred;
-    unsigned short  refcnt;
-    unsigned short  schar;
+    unsigned short pred;                /* prefix entry or LZWNONE   */
+    unsigned short schar;               /* last character            */
 } LZWSTRING;
 
-#define ENDCHAIN ( (LZWSTRING *) -1 )
-
 /* --------------------------------------------------------------------
-|| Hash table
+|| Decoder table
 ||
-|| Each entry in the hash table contains pointers to the first and
-|| last entries in the chain of doubly-linked string table entries.
+|| The decoder keeps each code's string as its prefix code and last
+|| character, plus the string's first character and length, so strings
+|| can be rebuilt back to front without touching the prefix chain.  The
+|| reference counts are a separate array since the search for a free
+|| entry runs along them.
 */
-#define HASHSIZE 5003
+#define LZWROOT     0xffff              /* no prefix                 */
+#define LZWUNDEF    0xfffe              /* code not yet defined      */
 
-typedef struct lzwhash
+typedef struct lzwcode
 {
-    LZWSTRING *head;
-    LZWSTRING *tail;
-} LZWHASH;
+    unsigned short pred;                /* prefix code               */
+    unsigned short schar;               /* last character            */
+    unsigned short first;               /* first character           */
+    unsigned short len;                 /* length of string          */
+    unsigned int   pos;                 /* offset in history buffer  */
+} LZWCODE;
+
+/* --------------------------------------------------------------------
+|| Hash tables
+||
+|| The LZW encoder finds an entry by its prefix and character in a flat
+|| table of ( prefix << 9 | character ) keys, linearly probed and never
+|| more than half full.  Single characters aren't in it since they're
+|| always their own entries.
+||
+|| The S2 encoder's buckets hold the index of the first entry in a chain,
+|| or S2NONE.
+*/
+#define LZWHBITS    13                  /* log2 of LZW hash slots    */
+#define LZWHSIZE    ( 1 << LZWHBITS )   /* LZW hash slots            */
+#define LZWHFREE    UINT_MAX            /* unused LZW hash slot      */
+#define HASHSIZE    5003                /* S2 hash buckets           */
+
+/* --------------------------------------------------------------------
+|| VMAM_AUTO trials
+||
+|| Files up to AUTOSAMPLE bytes are tried whole and the winning trial
+|| kept as is.  Bigger ones are tried on their first AUTOSAMPLE bytes
+|| and then stored again with the winner.
+*/
+#define AUTOSAMPLE  262144              /* bytes tried per method    */
+#define AUTOSLACK   3                   /* default size slack (%)    */
 
 /* --------------------------------------------------------------------
 || S2 stuff
+||
+|| Entries are table indices as well (S2NONE for none).  Expanding a
+|| string only needs STRDSECT; the counts and the offspring lists that
+|| s2addnew() maintains are in STRLINKS.  A single character's entry is
+|| its own code (unused entries act as kodendr), so it isn't stored.
 */
+#define S2NONE  0xffff                  /* no entry                  */
+
 typedef struct strdsect
 {
-    struct strdsect *strleft;
-    struct strdsect *strright;
-    struct strdsect *strsiblg;
-    struct strdsect *stroffsp;
-    unsigned short strlen;
-    unsigned short strcount;
-    unsigned short strchar;
-    uchar visited;
-    uchar align[ 9 ];
+    unsigned short strleft;             /* left half or S2NONE       */
+    unsigned short strright;            /* right half                */
+    unsigned short strnchar;            /* characters in string      */
+    unsigned short strlen;              /* VMARC's string length     */
+    unsigned int strpos;                /* offset in history buffer  */
 } STRDSECT;
 
+typedef struct strlinks
+{
+    unsigned short strsiblg;            /* next with same left half  */
+    unsigned short stroffsp;            /* first with this left half */
+    unsigned short strcount;            /* uses as a half (+1 root)  */
+} STRLINKS;
+
 /* --------------------------------------------------------------------
 || File header stuff
 */
@@ -126,9 +179,53 @@ typedef struct psubfile
     unsigned char   dirty;              /* subfile has been changed  */
     unsigned char   temp;               /* subfile lives in tempfile */
     unsigned char   locked;             /* can't change some fields  */
+    unsigned char   sized;              /* sizes and dtype are known */
+    unsigned char   exact;              /* and from a binary decode  */
+    struct psubfile *hnext;             /* next in name hash chain   */
+    unsigned long   seq;                /* order of creation         */
     SUBFILE         sf;                 /* SUBFILE info              */
 } PSUBFILE;
 
+/* --------------------------------------------------------------------
+|| Coder state
+||
+|| The buffers and tables one extraction or addition works in.  They're
+|| kept apart from the handle so a decode context or a scratch handle
+|| only has to allocate these instead of copying the whole archive's.
+*/
+typedef struct coder
+{
+    unsigned char ibuf[ BUFLEN + UNREAD ];  /* input buffer          */
+    unsigned short codes[ CODEBUF ];        /* codes unpacked        */
+    unsigned short hist[ HISTLEN ];         /* decoded history       */
+
+    /* ----------------------------------------------------------------
+    || LZW stuff
+    */
+    unsigned int lzwhkey[ LZWHSIZE ];       /* lzw hash keys         */
+    unsigned short lzwhent[ LZWHSIZE ];     /* and their entries     */
+    LZWSTRING lzwstrtab[ TABSIZE + 1 ];     /* lzw string table      */
+    unsigned short lzwrefcnt[ TABSIZE + 1 ]; /* and reference counts */
+    LZWCODE lzwcodes[ TABSIZE + 1 ];        /* lzw decoder table     */
+    unsigned short lzwrefs[ TABSIZE + 1 ];  /* and reference counts  */
+
+    /* ----------------------------------------------------------------
+    || S2 stuff
+    */
+    unsigned short s2buf[ 2048 ];           /* s2 input buffer       */
+    STRDSECT s2strtab[ TABSIZE + 1 ];       /* s2 string table       */
+    STRLINKS s2links[ TABSIZE + 1 ];        /* and its bookkeeping   */
+    unsigned short s2hashtab[ HASHSIZE ];   /* encoder hash heads    */
+    unsigned short s2hnext[ TABSIZE + 1 ];  /* next in hash chain    */
+    unsigned short s2hbkt[ TABSIZE + 1 ];   /* chain entry is on     */
+    unsigned short s2first[ TABSIZE + 1 ];  /* first character       */
+
+    /* ----------------------------------------------------------------
+    || End finding stuff
+    */
+    unsigned char eors[ TABSIZE + 1 ];      /* EOR runs of entries   */
+} CODER;
+
 typedef struct vma
 {
     /* ----------------------------------------------------------------
@@ -138,6 +235,7 @@ typedef struct vma
     uchar e2a_map[ 256 ];               /* ebcdic->ascii table       */
     int lasterr;                        /* last error code           */
     int mode;                           /* extract/add mode          */
+    int flags;                          /* open flags                */
     char f_zos;                         /* system is z/OS            */
     char f_zvm;                         /* system is z/VM            */
     char f_debug;                       /* turn on debugging         */
@@ -145,7 +243,23 @@ typedef struct vma
     char f_size;                        /* retrieve subfile sizes    */
     char f_extract;                     /* extract subfiles          */
     char f_scanning;                    /* scanning for data type    */
+    char f_stream;                      /* stream is open            */
+    char f_pause;                       /* decoder should stop       */
     char f_dirty;                       /* archive has been changed  */
+    unsigned long idxsized;             /* sized subfiles in index   */
+
+    /* ----------------------------------------------------------------
+    || Decode context stuff
+    ||
+    || A context is a copy of the archive's handle with its own decoder
+    || state.  It shares the archive's subfile list, map and files.
+    */
+    struct vma *parent;                 /* archive (for a context)   */
+    int nctx;                           /* contexts open (archive)   */
+    char f_shared;                      /* lock is in use (archive)  */
+#if defined( HAVE_THREADS )
+    pthread_mutex_t lock;               /* guards shared sizes       */
+#endif
 
     /* ----------------------------------------------------------------
     || General I/O stuff
@@ -156,13 +270,23 @@ typedef struct vma
     FILE *tfile;                        /* temp file handle          */
 
     FILE *in;                           /* input file handle         */
-    unsigned char ibuf[ BUFLEN + UNREAD ]; /* input buffer           */
-    size_t ibufp;                       /* index to next byte in buf */
-    size_t ipos;                        /* file pos at last read     */
-    size_t icnt;                        /* bytes left in buffer      */
+    const unsigned char *ibase;         /* start of input window     */
+    const unsigned char *iptr;          /* next byte in window       */
+    size_t ipos;                        /* file pos of window start  */
+    size_t icnt;                        /* bytes left in window      */
+    char f_pread;                       /* read with pread() at ioff */
+    size_t ioff;                        /* file pos of next pread()  */
+    char imap;                          /* window is the mapping     */
+    unsigned char *vmap;                /* mapped VMA file           */
+    size_t vmaplen;                     /* length of mapping         */
     size_t bytesin;                     /* num subfile bytes read    */
+    struct vpipe *pipe;                 /* pipelined extraction      */
 
     FILE *out;                          /* output file handle        */
+    int ( *owrite )( struct vma *, const uchar *, size_t ); /* writer */
+    int ofd;                            /* output descriptor         */
+    int ( *ocb )( void *, const void *, size_t ); /* output callback */
+    void *octx;                         /* callback context          */
     unsigned char *obuf;                /* output buffer             */
     size_t opos;                        /* index into output buffer  */
     size_t omax;                        /* max size of output record */
@@ -171,41 +295,61 @@ typedef struct vma
     /* ----------------------------------------------------------------
     || Shared compression stuff
     */
+    CODER *cd;                  /* Buffers and tables in use         */
     char recfm;                 /* RECFM of current subfile          */
     int lrecl;                  /* LRECL of current subfile          */
     size_t recbytes;            /* Bytes in current record (RECFM=F) */
     int eor;                    /* Number of times EOR seen          */
     unsigned int residual;      /* Bits waiting to be written        */
+    unsigned int codecnt;       /* Number of unpacked codes          */
+    unsigned int codepos;       /* Next unpacked code to use         */
+    unsigned int hpos;          /* Next free history position        */
+    unsigned short pend;        /* Pending LZW entry                 */
+    unsigned short last;        /* Last LZW entry or previous S2 code*/
+    char started;               /* First S2 code has been seen       */
+    int ( *decode )( struct vma * ); /* Decoder for the subfile      */
+    int slack;                  /* VMAM_AUTO size slack (percent)    */
 
     /* ----------------------------------------------------------------
     || LZW stuff
     */
-    LZWHASH lzwhashtab[ HASHSIZE ];         /* lzw hash table        */
-    LZWSTRING lzwstrtab[ TABSIZE + 1 ];     /* lzw string table      */
-    LZWSTRING *lzwtabs;                     /* First reusable entry  */
-    LZWSTRING *lzwtabp;                     /* Last entry of table   */
-    LZWSTRING *lzwtabl;                     /* End of string table   */
+    unsigned short lzwtabs;                 /* First reusable entry  */
+    unsigned short lzwtabp;                 /* Last entry of table   */
+    unsigned short lzwtabl;                 /* End of string table   */
 
     /* ----------------------------------------------------------------
     || S2 stuff
     */
-    unsigned short s2buf[ 2048 ];           /* s2 input buffer       */
-    STRDSECT s2strtab[ TABSIZE ];           /* s2 string table       */
-    STRDSECT *s2tabs;                       /* First reusable entry  */
-    STRDSECT *s2tabp;                       /* Last entry of table   */
-    STRDSECT *s2tabl;                       /* End of string table   */
+    unsigned short s2tabs;                  /* First reusable entry  */
+    unsigned short s2tabp;                  /* Last entry of table   */
+    unsigned short s2tabl;                  /* End of string table   */
 
     /* ----------------------------------------------------------------
     || Subfile stuff
     */
     PSUBFILE *subfiles;                     /* subfile list          */
     PSUBFILE *sflast;                       /* last subfile          */
+    PSUBFILE **names;                       /* name hash table       */
+    size_t namesize;                        /* name hash slots       */
+    size_t namecnt;                         /* subfiles in name hash */
+    unsigned long seq;                      /* next subfile sequence */
     PSUBFILE *active;                       /* active subfile        */
     unsigned char head[ H_XDLEN ];          /* header buffer         */
     unsigned char dtype;                    /* apparent data type    */
     SUBFILE sfsave;                         /* retained subfile      */
     PSUBFILE *sfretained;                   /* which was retained    */
     char f_retdirty;                        /* retained dirty flag   */
+
+    /* ----------------------------------------------------------------
+    || Stream and memory output stuff
+    */
+    PSUBFILE *spsf;                         /* subfile being read    */
+    uchar *sbuf;                            /* output kept in memory */
+    size_t slen;                            /* bytes in sbuf         */
+    size_t spos;                            /* bytes already read    */
+    size_t smax;                            /* size of sbuf          */
+    int serr;                               /* how the decode ended  */
+    char sdone;                             /* decoder has finished  */
 } VMA;
 
 /* --------------------------------------------------------------------
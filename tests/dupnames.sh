@@ -0,0 +1,78 @@
+#!/bin/sh
+#
+# Subfiles that extract to the same file must leave it holding the last
+# of them, however many threads are used.
+#
+# Usage: dupnames.sh path/to/vma
+#
+
+VMA=${1:-src/vma}
+case "$VMA" in
+    /*) ;;
+    *)  VMA=`pwd`/$VMA ;;
+esac
+
+DIR=`mktemp -d ${TMPDIR:-/tmp}/vmadup.XXXXXX` || exit 1
+trap 'rm -rf "$DIR"' 0
+
+cd "$DIR" || exit 1
+
+#
+# Small and large text files, all different.  The large ones are
+# past the size that's decoded into memory and batched.
+#
+lines()
+{
+    awk -v n=$1 -v t="$2" 'BEGIN { srand( 1 ); for( i = 1; i <= n; i++ ) printf "%s %d %d\n", t, i, rand() * 1000000000 }'
+}
+
+lines 5 "small first" > s1
+lines 20000 "large second" > l2
+lines 20000 "large first" > l1
+lines 5 "small second" > s2
+lines 3000 "filler" > f
+
+#
+# DUP goes small then large, REV large then small
+#
+"$VMA" -a -t dup.vma \
+    s1,DUP.TXT.A1 \
+    f,FILL1.TXT.A1 \
+    l2,DUP.TXT.A1 \
+    l1,REV.TXT.A1 \
+    f,FILL2.TXT.A1 \
+    s2,REV.TXT.A1 \
+    f,FILL3.TXT.A1 > /dev/null || exit 1
+
+rc=0
+for j in 1 4
+do
+    rm -rf out && mkdir out && cd out || exit 1
+
+    if ! "$VMA" -x -t -q -j $j ../dup.vma > /dev/null
+    then
+        echo "FAIL: -j $j extraction failed"
+        rc=1
+    fi
+
+    if ! cmp -s DUP.TXT.A1 ../l2
+    then
+        echo "FAIL: -j $j DUP.TXT.A1 isn't the last DUP subfile"
+        rc=1
+    fi
+
+    if ! cmp -s REV.TXT.A1 ../s2
+    then
+        echo "FAIL: -j $j REV.TXT.A1 isn't the last REV subfile"
+        rc=1
+    fi
+
+    cd ..
+done
+
+if [ $rc -eq 0 ]
+then
+    echo "dupnames: OK"
+fi
+
+exit $rc